@@ -0,0 +1,59 @@
+dnl * Compiler support for per-function SIMD target attributes. The code using
+dnl * them chooses the implementation at runtime based on cpu_features_have().
+AC_DEFUN([DOVECOT_CPU_SIMD], [
+  AC_CACHE_CHECK([whether compiler supports x86 SIMD target attributes],i_cv_have_x86_simd_target,[
+    AC_TRY_COMPILE([
+      #include <immintrin.h>
+      #include <cpuid.h>
+
+      __attribute__((target("sse4.1,pclmul")))
+      static int f_pclmul(void)
+      {
+        __m128i x = _mm_setzero_si128();
+        x = _mm_clmulepi64_si128(x, x, 0x00);
+        return _mm_extract_epi32(x, 1);
+      }
+      __attribute__((target("avx2")))
+      static int f_avx2(void)
+      {
+        __m256i y = _mm256_setzero_si256();
+        y = _mm256_shuffle_epi8(y, y);
+        return _mm256_movemask_epi8(y);
+      }
+    ], [
+      unsigned int a, b, c, d;
+      __cpuid_count(7, 0, a, b, c, d);
+      return f_pclmul() + f_avx2() + (int)(a + b + c + d);
+    ], [
+      i_cv_have_x86_simd_target=yes
+    ], [
+      i_cv_have_x86_simd_target=no
+    ])
+  ])
+  if test $i_cv_have_x86_simd_target = yes; then
+    AC_DEFINE(HAVE_X86_SIMD_TARGET,, [Define if compiler supports x86 SIMD function target attributes])
+  fi
+
+  AC_CACHE_CHECK([whether compiler supports ARMv8 CRC32 target attribute],i_cv_have_arm_crc32_target,[
+    AC_TRY_COMPILE([
+      #include <arm_acle.h>
+      #include <sys/auxv.h>
+      #include <asm/hwcap.h>
+
+      __attribute__((target("+crc")))
+      static unsigned int f_crc(unsigned int crc)
+      {
+        return __crc32d(crc, 0);
+      }
+    ], [
+      return f_crc(0) + (getauxval(AT_HWCAP) & HWCAP_CRC32);
+    ], [
+      i_cv_have_arm_crc32_target=yes
+    ], [
+      i_cv_have_arm_crc32_target=no
+    ])
+  ])
+  if test $i_cv_have_arm_crc32_target = yes; then
+    AC_DEFINE(HAVE_ARM_CRC32_TARGET,, [Define if compiler supports ARMv8 CRC32 function target attribute])
+  fi
+])
@@ -1,6 +1,41 @@
 dnl * I/O loop function
 AC_DEFUN([DOVECOT_IOLOOP], [
   have_ioloop=no
+
+  if test "$ioloop" = "uring"; then
+    dnl * io_uring isn't picked automatically, since it requires
+    dnl * a recent kernel at runtime (v5.11+)
+    AC_CACHE_CHECK([whether we can use io_uring],i_cv_io_uring_works,[
+      AC_TRY_RUN([
+        #include <string.h>
+        #include <unistd.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+
+        int main()
+        {
+  	struct io_uring_params params;
+
+  	memset(&params, 0, sizeof(params));
+  #ifndef IORING_ENTER_EXT_ARG
+  	return 1;
+  #else
+  	return syscall(__NR_io_uring_setup, 4, &params) < 0;
+  #endif
+        }
+      ], [
+        i_cv_io_uring_works=yes
+      ], [
+        i_cv_io_uring_works=no
+      ])
+    ])
+    if test $i_cv_io_uring_works = yes; then
+      AC_DEFINE(IOLOOP_URING,, [Implement I/O loop with Linux io_uring])
+      have_ioloop=yes
+    else
+      AC_MSG_ERROR([io_uring ioloop requested but io_uring_setup() is not available])
+    fi
+  fi
   
   if test "$ioloop" = "best" || test "$ioloop" = "epoll"; then
     AC_CACHE_CHECK([whether we can use epoll],i_cv_epoll_works,[
@@ -0,0 +1,5 @@
+AC_DEFUN([DOVECOT_SHM_OPEN], [
+  AC_SEARCH_LIBS(shm_open, rt, [
+    AC_DEFINE(HAVE_SHM_OPEN,, [Define if you have the shm_open function])
+  ])
+])
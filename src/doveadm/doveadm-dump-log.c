@@ -438,6 +438,8 @@ static void log_record_print(const struct mail_transaction_header *hdr,
 		const struct mail_transaction_boundary *rec = data;
 
 		printf(" - size=%u\n", rec->size);
+		if (size >= sizeof(*rec))
+			printf(" - crc32=%08x\n", rec->crc32);
 		break;
 	}
 	case MAIL_TRANSACTION_ATTRIBUTE_UPDATE: {
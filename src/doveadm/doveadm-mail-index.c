@@ -93,6 +93,49 @@ static int cmd_index_box_precache(struct mailbox *box)
 	return ret;
 }
 
+static int cmd_index_box_compress_cache(struct mailbox *box)
+{
+	struct mailbox_metadata metadata;
+	unsigned int prev_copied = UINT_MAX;
+	bool printed = FALSE;
+	int ret = 0;
+
+	/* incremental cache compression progresses on each sync. keep
+	   syncing as long as it's making progress. */
+	for (;;) {
+		if (mailbox_get_metadata(box, MAILBOX_METADATA_CACHE_COMPRESS,
+					 &metadata) < 0) {
+			i_error("Mailbox %s: Cache compression status lookup failed: %s",
+				mailbox_get_vname(box),
+				mailbox_get_last_error(box, NULL));
+			ret = -1;
+			break;
+		}
+		if (metadata.cache_compress_total == 0 ||
+		    metadata.cache_compress_copied == prev_copied)
+			break;
+		prev_copied = metadata.cache_compress_copied;
+
+		if (doveadm_verbose) {
+			printf("\rCompressing cache %u/%u",
+			       metadata.cache_compress_copied,
+			       metadata.cache_compress_total);
+			fflush(stdout);
+			printed = TRUE;
+		}
+		if (mailbox_sync(box, 0) < 0) {
+			i_error("Syncing mailbox %s failed: %s",
+				mailbox_get_vname(box),
+				mailbox_get_last_error(box, NULL));
+			ret = -1;
+			break;
+		}
+	}
+	if (printed)
+		printf("\n");
+	return ret;
+}
+
 static int
 cmd_index_box(struct index_cmd_context *ctx, const struct mailbox_info *info)
 {
@@ -127,7 +170,8 @@ cmd_index_box(struct index_cmd_context *ctx, const struct mailbox_info *info)
 		doveadm_mail_failed_mailbox(&ctx->ctx, box);
 		ret = -1;
 	} else {
-		if (cmd_index_box_precache(box) < 0) {
+		if (cmd_index_box_precache(box) < 0 ||
+		    cmd_index_box_compress_cache(box) < 0) {
 			doveadm_mail_failed_mailbox(&ctx->ctx, box);
 			ret = -1;
 		}
@@ -99,6 +99,8 @@ int dsync_mail_fill_nonminimal(struct mail *mail, struct dsync_mail *dmail_r,
 		*error_field_r = "body";
 		return -1;
 	}
+	/* the whole mail is exported */
+	i_stream_set_access_pattern(dmail_r->input, I_STREAM_ACCESS_SEQUENTIAL);
 
 	if (mail_get_special(mail, MAIL_FETCH_UIDL_BACKEND, &dmail_r->pop3_uidl) < 0) {
 		*error_field_r = "pop3-uidl";
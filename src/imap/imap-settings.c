@@ -64,6 +64,7 @@ static const struct setting_define imap_setting_defines[] = {
 	DEF(SET_BOOL, verbose_proctitle),
 
 	DEF(SET_SIZE, imap_max_line_length),
+	DEF(SET_SIZE, imap_data_stack_max_unused_size),
 	DEF(SET_TIME, imap_idle_notify_interval),
 	DEF(SET_STR, imap_capability),
 	DEF(SET_STR, imap_client_workarounds),
@@ -87,6 +88,7 @@ static const struct imap_settings imap_default_settings = {
 	   break large message sets to multiple commands, so we're pretty
 	   liberal by default. */
 	.imap_max_line_length = 64*1024,
+	.imap_data_stack_max_unused_size = 1024*1024,
 	.imap_idle_notify_interval = 2*60,
 	.imap_capability = "",
 	.imap_client_workarounds = "",
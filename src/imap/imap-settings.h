@@ -18,6 +18,7 @@ struct imap_settings {
 
 	/* imap: */
 	uoff_t imap_max_line_length;
+	uoff_t imap_data_stack_max_unused_size;
 	unsigned int imap_idle_notify_interval;
 	const char *imap_capability;
 	const char *imap_client_workarounds;
@@ -249,6 +249,10 @@ int client_create_from_input(const struct mail_storage_service_input *input,
 	imap_set = mail_storage_service_user_get_set(user)[1];
 	if (imap_set->verbose_proctitle)
 		verbose_proctitle = TRUE;
+	if (imap_set->imap_data_stack_max_unused_size != 0) {
+		data_stack_set_max_unused_size(
+			imap_set->imap_data_stack_max_unused_size);
+	}
 	lda_set = mail_storage_service_user_get_set(user)[2];
 
 	settings_var_expand(&imap_setting_parser_info, imap_set,
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "crc32.h"
 #include "istream.h"
 #include "write-full.h"
 #include "strescape.h"
@@ -12,6 +13,7 @@
 #include "mail-storage-private.h"
 #include "mail-storage-service.h"
 #include "mail-search-build.h"
+#include "mail-cache.h"
 #include "master-connection.h"
 
 #include <unistd.h>
@@ -50,21 +52,130 @@ indexer_worker_refresh_proctitle(const char *username, const char *mailbox,
 	}
 }
 
+/* Commit the cached fields after this many messages, so other sessions can
+   use them while the rest of the mailbox is still being indexed. */
+#define INDEXER_PRECACHE_BATCH_COUNT 1000
+#define INDEXER_PRECACHE_EXT_NAME "indexer-precache"
+
+struct indexer_precache_header {
+	/* XOR of the crc32s of the cache field names that had "yes" caching
+	   decision when the messages were precached */
+	uint32_t fields_crc32;
+	/* The first UID that hasn't yet been precached with these fields.
+	   0 if all the messages have been precached. */
+	uint32_t next_uid;
+};
+
+struct indexer_precache_context {
+	struct master_connection *conn;
+	struct mailbox *box;
+	const char *username, *box_vname;
+	enum mail_fetch_field fields;
+	uint32_t ext_id;
+	struct indexer_precache_header hdr;
+
+	unsigned int counter, max, percentage_sent;
+};
+
+static uint32_t index_mailbox_precache_fields_crc32(struct mailbox *box)
+{
+	const struct mail_cache_field *fields;
+	unsigned int i, count;
+	uint32_t crc = 0;
+
+	fields = mail_cache_register_get_list(box->cache,
+					      pool_datastack_create(), &count);
+	for (i = 0; i < count; i++) {
+		if ((fields[i].decision & ~MAIL_CACHE_DECISION_FORCED) ==
+		    MAIL_CACHE_DECISION_YES)
+			crc ^= crc32_str(fields[i].name);
+	}
+	return crc;
+}
+
+static void
+index_mailbox_precache_progress(struct indexer_precache_context *ctx)
+{
+	char percentage_str[2+1+1];
+	unsigned int percentage;
+
+	percentage = ctx->counter*100 / ctx->max;
+	if (percentage != ctx->percentage_sent && percentage < 100) {
+		ctx->percentage_sent = percentage;
+		if (i_snprintf(percentage_str, sizeof(percentage_str), "%u\n",
+			       percentage) < 0)
+			i_unreached();
+		(void)write_full(ctx->conn->fd, percentage_str,
+				 strlen(percentage_str));
+	}
+	indexer_worker_refresh_proctitle(ctx->username, ctx->box_vname,
+					 ctx->counter, ctx->max);
+}
+
 static int
-index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
+index_mailbox_precache_batch(struct indexer_precache_context *ctx,
+			     uint32_t seq1, uint32_t seq2, bool last)
 {
-	struct mail_storage *storage = mailbox_get_storage(box);
-	const char *username = mail_storage_get_user(storage)->username;
-	const char *box_vname = mailbox_get_vname(box);
-	struct mailbox_status status;
+	struct mailbox *box = ctx->box;
 	struct mailbox_transaction_context *trans;
 	struct mail_search_args *search_args;
-	struct mail_search_context *ctx;
+	struct mail_search_context *search_ctx;
 	struct mail *mail;
+	struct indexer_precache_header new_hdr;
+	uint32_t uid;
+	int ret = 0;
+
+	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
+	search_args = mail_search_build_init();
+	mail_search_build_add_seqset(search_args, seq1, seq2);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 ctx->fields, NULL);
+	mail_search_args_unref(&search_args);
+
+	while (mailbox_search_next(search_ctx, &mail)) {
+		mail_precache(mail);
+		if (++ctx->counter % 100 == 0)
+			index_mailbox_precache_progress(ctx);
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0) {
+		i_error("Mailbox %s: Mail search failed: %s",
+			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
+		ret = -1;
+	}
+
+	/* remember how far the precaching got */
+	new_hdr = ctx->hdr;
+	if (last)
+		new_hdr.next_uid = 0;
+	else {
+		mail_index_lookup_uid(box->view, seq2, &uid);
+		new_hdr.next_uid = uid + 1;
+	}
+	if (ret == 0 && memcmp(&new_hdr, &ctx->hdr, sizeof(new_hdr)) != 0) {
+		mail_index_update_header_ext(trans->itrans, ctx->ext_id, 0,
+					     &new_hdr, sizeof(new_hdr));
+	}
+
+	if (mailbox_transaction_commit(&trans) < 0) {
+		i_error("Mailbox %s: Transaction commit failed: %s",
+			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
+		ret = -1;
+	}
+	if (ret == 0)
+		ctx->hdr = new_hdr;
+	return ret;
+}
+
+static int
+index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
+{
+	struct mail_storage *storage = mailbox_get_storage(box);
+	struct indexer_precache_context ctx;
+	struct mailbox_status status;
 	struct mailbox_metadata metadata;
-	uint32_t seq;
-	char percentage_str[2+1+1];
-	unsigned int counter = 0, max, percentage, percentage_sent = 0;
+	const void *data;
+	size_t size;
+	uint32_t seq, seq1, seq2, fields_crc32;
 	int ret = 0;
 
 	if (mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS,
@@ -79,46 +190,48 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
 		return -1;
 	}
-	seq = status.last_cached_seq + 1;
-
-	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
-	search_args = mail_search_build_init();
-	mail_search_build_add_seqset(search_args, seq, status.messages);
-	ctx = mailbox_search_init(trans, search_args, NULL,
-				  metadata.precache_fields, NULL);
-	mail_search_args_unref(&search_args);
 
-	max = status.messages - seq + 1;
-	while (mailbox_search_next(ctx, &mail)) {
-		mail_precache(mail);
-		if (++counter % 100 == 0) {
-			percentage = counter*100 / max;
-			if (percentage != percentage_sent && percentage < 100) {
-				percentage_sent = percentage;
-				if (i_snprintf(percentage_str,
-					       sizeof(percentage_str), "%u\n",
-					       percentage) < 0)
-					i_unreached();
-				(void)write_full(conn->fd, percentage_str,
-						 strlen(percentage_str));
-			}
-			indexer_worker_refresh_proctitle(username, box_vname,
-							 counter, max);
-		}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.conn = conn;
+	ctx.box = box;
+	ctx.username = mail_storage_get_user(storage)->username;
+	ctx.box_vname = mailbox_get_vname(box);
+	ctx.fields = metadata.precache_fields;
+	ctx.ext_id = mail_index_ext_register(box->index,
+					     INDEXER_PRECACHE_EXT_NAME,
+					     sizeof(ctx.hdr), 0, 0);
+	mail_index_get_header_ext(box->view, ctx.ext_id, &data, &size);
+	if (size >= sizeof(ctx.hdr))
+		memcpy(&ctx.hdr, data, sizeof(ctx.hdr));
+
+	/* Normally only the messages after the last cached one need to be
+	   precached. But when a field gets "yes" caching decision, it's
+	   missing from the older messages. Fill it to them too, so that
+	   clients don't need to parse all the messages on their first
+	   access. */
+	seq = status.last_cached_seq + 1;
+	fields_crc32 = index_mailbox_precache_fields_crc32(box);
+	if (ctx.hdr.fields_crc32 != fields_crc32) {
+		ctx.hdr.fields_crc32 = fields_crc32;
+		ctx.hdr.next_uid = fields_crc32 == 0 ? 0 : 1;
 	}
-	if (mailbox_search_deinit(&ctx) < 0) {
-		i_error("Mailbox %s: Mail search failed: %s",
-			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
-		ret = -1;
+	if (ctx.hdr.next_uid != 0) {
+		mailbox_get_seq_range(box, ctx.hdr.next_uid, (uint32_t)-1,
+				      &seq1, &seq2);
+		if (seq1 != 0 && seq1 < seq)
+			seq = seq1;
 	}
-	if (mailbox_transaction_commit(&trans) < 0) {
-		i_error("Mailbox %s: Transaction commit failed: %s",
-			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
-		ret = -1;
+
+	ctx.max = status.messages < seq ? 0 : status.messages - seq + 1;
+	for (; seq <= status.messages && ret == 0; seq = seq2 + 1) {
+		seq2 = I_MIN(status.messages,
+			     seq + INDEXER_PRECACHE_BATCH_COUNT - 1);
+		ret = index_mailbox_precache_batch(&ctx, seq, seq2,
+						   seq2 == status.messages);
 	}
 	if (ret == 0) {
 		i_info("Indexed %u messages in %s",
-		       counter, mailbox_get_vname(box));
+		       ctx.counter, mailbox_get_vname(box));
 	}
 	return ret;
 }
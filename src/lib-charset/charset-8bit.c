@@ -0,0 +1,287 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "cpu-features.h"
+#include "charset-utf8.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
+
+/* Input is converted in chunks of this many bytes into a stack buffer. */
+#define CHARSET_8BIT_CHUNK_SIZE 1024
+
+struct charset_8bit {
+	const char *const *names;
+	const uint16_t *table;
+};
+
+/* Unicode code points for bytes 0x80..0xff. 0 means the byte is invalid. */
+static const uint16_t latin1_table[128] = {
+	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+	0x0088, 0x0089, 0x008a, 0x008b, 0x008c, 0x008d, 0x008e, 0x008f,
+	0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+	0x0098, 0x0099, 0x009a, 0x009b, 0x009c, 0x009d, 0x009e, 0x009f,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7,
+	0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7,
+	0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff
+};
+static const uint16_t latin9_table[128] = {
+	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+	0x0088, 0x0089, 0x008a, 0x008b, 0x008c, 0x008d, 0x008e, 0x008f,
+	0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+	0x0098, 0x0099, 0x009a, 0x009b, 0x009c, 0x009d, 0x009e, 0x009f,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x20ac, 0x00a5, 0x0160, 0x00a7,
+	0x0161, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x017d, 0x00b5, 0x00b6, 0x00b7,
+	0x017e, 0x00b9, 0x00ba, 0x00bb, 0x0152, 0x0153, 0x0178, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff
+};
+static const uint16_t cp1252_table[128] = {
+	0x20ac, 0x0000, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017d, 0x0000,
+	0x0000, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x0000, 0x017e, 0x0178,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7,
+	0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7,
+	0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff
+};
+
+static const char *const latin1_names[] = {
+	"ISO-8859-1", "ISO8859-1", "ISO_8859-1", "LATIN1", "L1", NULL
+};
+static const char *const latin9_names[] = {
+	"ISO-8859-15", "ISO8859-15", "ISO_8859-15", "LATIN-9", "LATIN9", NULL
+};
+static const char *const cp1252_names[] = {
+	"WINDOWS-1252", "CP1252", NULL
+};
+
+static const struct charset_8bit charsets_8bit[] = {
+	{ latin1_names, latin1_table },
+	{ latin9_names, latin9_table },
+	{ cp1252_names, cp1252_table }
+};
+
+const uint16_t *charset_8bit_find(const char *charset)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < N_ELEMENTS(charsets_8bit); i++) {
+		for (j = 0; charsets_8bit[i].names[j] != NULL; j++) {
+			if (strcasecmp(charsets_8bit[i].names[j], charset) == 0)
+				return charsets_8bit[i].table;
+		}
+	}
+	return NULL;
+}
+
+typedef size_t charset_ascii_prefix_len_t(const unsigned char *src,
+					   size_t size);
+
+static charset_ascii_prefix_len_t charset_ascii_prefix_len_init;
+static charset_ascii_prefix_len_t *charset_ascii_prefix_len_func =
+	charset_ascii_prefix_len_init;
+
+static size_t
+charset_ascii_prefix_len_swar(const unsigned char *src, size_t size)
+{
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, src + i, sizeof(word));
+		if ((word & 0x8080808080808080ULL) != 0)
+			break;
+	}
+	for (; i < size && src[i] < 0x80; i++) ;
+	return i;
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* The SIMD versions check 16 or 32 bytes at a time. The high bits of the
+   bytes are exactly what movemask collects. */
+__attribute__((target("sse2")))
+static size_t
+charset_ascii_prefix_len_sse2(const unsigned char *src, size_t size)
+{
+	unsigned int high_bits;
+	size_t i = 0;
+
+	for (; size - i >= 16; i += 16) {
+		high_bits = _mm_movemask_epi8(
+			_mm_loadu_si128((const void *)(src + i)));
+		if (high_bits != 0)
+			return i + __builtin_ctz(high_bits);
+	}
+	return i + charset_ascii_prefix_len_swar(src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+charset_ascii_prefix_len_avx2(const unsigned char *src, size_t size)
+{
+	unsigned int high_bits;
+	size_t i = 0;
+
+	for (; size - i >= 32; i += 32) {
+		high_bits = _mm256_movemask_epi8(
+			_mm256_loadu_si256((const void *)(src + i)));
+		if (high_bits != 0) {
+			_mm256_zeroupper();
+			return i + __builtin_ctz(high_bits);
+		}
+	}
+	/* avoid AVX-SSE transition penalties in the non-AVX code */
+	_mm256_zeroupper();
+	return i + charset_ascii_prefix_len_sse2(src + i, size - i);
+}
+#endif
+
+bool charset_ascii_scan_set_impl(enum charset_ascii_scan_impl impl)
+{
+	switch (impl) {
+	case CHARSET_ASCII_SCAN_IMPL_SWAR:
+		charset_ascii_prefix_len_func = charset_ascii_prefix_len_swar;
+		return TRUE;
+	case CHARSET_ASCII_SCAN_IMPL_SSE2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2)) {
+			charset_ascii_prefix_len_func =
+				charset_ascii_prefix_len_sse2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	case CHARSET_ASCII_SCAN_IMPL_AVX2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2)) {
+			charset_ascii_prefix_len_func =
+				charset_ascii_prefix_len_avx2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void charset_ascii_scan_set_best_impl(void)
+{
+	if (charset_ascii_scan_set_impl(CHARSET_ASCII_SCAN_IMPL_AVX2) ||
+	    charset_ascii_scan_set_impl(CHARSET_ASCII_SCAN_IMPL_SSE2))
+		return;
+	(void)charset_ascii_scan_set_impl(CHARSET_ASCII_SCAN_IMPL_SWAR);
+}
+
+static size_t
+charset_ascii_prefix_len_init(const unsigned char *src, size_t size)
+{
+	charset_ascii_scan_set_best_impl();
+	return charset_ascii_prefix_len_func(src, size);
+}
+
+size_t charset_ascii_prefix_len(const unsigned char *src, size_t size)
+{
+	return charset_ascii_prefix_len_func(src, size);
+}
+
+static size_t
+charset_8bit_chunk_to_utf8(const uint16_t *table, const unsigned char *src,
+			   size_t size, unsigned char *out, bool *prev_invalid,
+			   enum charset_result *result)
+{
+	size_t pos, n, out_used = 0;
+	uint16_t chr;
+
+	for (pos = 0; pos < size; ) {
+		n = charset_ascii_prefix_len(src + pos, size - pos);
+		if (n > 0) {
+			memcpy(out + out_used, src + pos, n);
+			out_used += n;
+			pos += n;
+			*prev_invalid = FALSE;
+		}
+		for (; pos < size && src[pos] >= 0x80; pos++) {
+			chr = table[src[pos] - 0x80];
+			if (chr == 0) {
+				/* like with iconv, add only a single replacement
+				   char for a sequence of invalid input */
+				if (!*prev_invalid) {
+					n = strlen(UNICODE_REPLACEMENT_CHAR_UTF8);
+					memcpy(out + out_used,
+					       UNICODE_REPLACEMENT_CHAR_UTF8, n);
+					out_used += n;
+				}
+				*prev_invalid = TRUE;
+				*result = CHARSET_RET_INVALID_INPUT;
+			} else if (chr < 0x800) {
+				out[out_used++] = 0xc0 | (chr >> 6);
+				out[out_used++] = 0x80 | (chr & 0x3f);
+				*prev_invalid = FALSE;
+			} else {
+				out[out_used++] = 0xe0 | (chr >> 12);
+				out[out_used++] = 0x80 | ((chr >> 6) & 0x3f);
+				out[out_used++] = 0x80 | (chr & 0x3f);
+				*prev_invalid = FALSE;
+			}
+		}
+	}
+	return out_used;
+}
+
+enum charset_result
+charset_8bit_to_utf8(const uint16_t *table, normalizer_func_t *normalizer,
+		     const unsigned char *src, size_t *src_size,
+		     buffer_t *dest)
+{
+	/* each input byte becomes at most 3 bytes of UTF-8 */
+	unsigned char out[CHARSET_8BIT_CHUNK_SIZE * 3];
+	enum charset_result result = CHARSET_RET_OK;
+	size_t pos, size, out_used;
+	bool prev_invalid = FALSE;
+
+	if (normalizer == NULL &&
+	    charset_ascii_prefix_len(src, *src_size) == *src_size) {
+		buffer_append(dest, src, *src_size);
+		return CHARSET_RET_OK;
+	}
+
+	for (pos = 0; pos < *src_size; pos += size) {
+		size = I_MIN(*src_size - pos, CHARSET_8BIT_CHUNK_SIZE);
+		out_used = charset_8bit_chunk_to_utf8(table, src + pos, size,
+						      out, &prev_invalid,
+						      &result);
+		if (normalizer == NULL)
+			buffer_append(dest, out, out_used);
+		else if (normalizer(out, out_used, dest) < 0)
+			return CHARSET_RET_INVALID_INPUT;
+	}
+	return result;
+}
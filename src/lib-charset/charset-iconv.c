@@ -10,29 +10,111 @@
 #include <iconv.h>
 #include <ctype.h>
 
+/* Number of released iconv handles kept open for reuse */
+#define CHARSET_ICONV_CACHE_SIZE 8
+
 struct charset_translation {
 	iconv_t cd;
+	char *charset;
+	const uint16_t *table_8bit;
 	normalizer_func_t *normalizer;
 };
 
+struct charset_iconv_cache_entry {
+	char *charset;
+	iconv_t cd;
+};
+
+/* Headers' encoded-words and message parts begin and end a translation for
+   each string, so keep the most recently used handles instead of opening
+   them again for each one. */
+static struct charset_iconv_cache_entry iconv_cache[CHARSET_ICONV_CACHE_SIZE];
+static unsigned int iconv_cache_next_idx;
+static bool iconv_cache_atexit_registered;
+
+static void charset_iconv_cache_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(iconv_cache); i++) {
+		if (iconv_cache[i].charset != NULL) {
+			iconv_close(iconv_cache[i].cd);
+			i_free_and_null(iconv_cache[i].charset);
+		}
+	}
+}
+
+static iconv_t charset_iconv_cache_take(const char *charset)
+{
+	unsigned int i;
+	iconv_t cd;
+
+	for (i = 0; i < N_ELEMENTS(iconv_cache); i++) {
+		if (iconv_cache[i].charset != NULL &&
+		    strcasecmp(iconv_cache[i].charset, charset) == 0) {
+			cd = iconv_cache[i].cd;
+			i_free_and_null(iconv_cache[i].charset);
+			return cd;
+		}
+	}
+	return (iconv_t)-1;
+}
+
+static void charset_iconv_cache_put(const char *charset, iconv_t cd)
+{
+	struct charset_iconv_cache_entry *entry;
+	unsigned int i;
+
+	if (!iconv_cache_atexit_registered) {
+		lib_atexit(charset_iconv_cache_deinit);
+		iconv_cache_atexit_registered = TRUE;
+	}
+
+	/* drop the shift state, so the next user starts from scratch */
+	(void)iconv(cd, NULL, NULL, NULL, NULL);
+
+	for (i = 0; i < N_ELEMENTS(iconv_cache); i++) {
+		if (iconv_cache[i].charset == NULL)
+			break;
+	}
+	if (i == N_ELEMENTS(iconv_cache)) {
+		/* full - replace the entries in round-robin order */
+		i = iconv_cache_next_idx;
+		iconv_cache_next_idx = (i + 1) % N_ELEMENTS(iconv_cache);
+		iconv_close(iconv_cache[i].cd);
+		i_free(iconv_cache[i].charset);
+	}
+	entry = &iconv_cache[i];
+	entry->charset = i_strdup(charset);
+	entry->cd = cd;
+}
+
 int charset_to_utf8_begin(const char *charset, normalizer_func_t *normalizer,
 			  struct charset_translation **t_r)
 {
 	struct charset_translation *t;
-	iconv_t cd;
+	const uint16_t *table_8bit = NULL;
+	iconv_t cd = (iconv_t)-1;
 
-	if (charset_is_utf8(charset))
-		cd = (iconv_t)-1;
-	else {
+	/* UTF-8 and the common single byte charsets are translated without
+	   iconv */
+	if (!charset_is_utf8(charset) &&
+	    (table_8bit = charset_8bit_find(charset)) == NULL) {
 		if (strcmp(charset, "UTF-8//TEST") == 0)
 			charset = "UTF-8";
-		cd = iconv_open("UTF-8", charset);
-		if (cd == (iconv_t)-1)
-			return -1;
+		cd = charset_iconv_cache_take(charset);
+		if (cd == (iconv_t)-1) {
+			cd = iconv_open("UTF-8", charset);
+			if (cd == (iconv_t)-1)
+				return -1;
+		}
 	}
 
 	t = i_new(struct charset_translation, 1);
 	t->cd = cd;
+	if (cd != (iconv_t)-1)
+		t->charset = i_strdup(charset);
+	t->table_8bit = table_8bit;
 	t->normalizer = normalizer;
 	*t_r = t;
 	return 0;
@@ -45,7 +127,8 @@ void charset_to_utf8_end(struct charset_translation **_t)
 	*_t = NULL;
 
 	if (t->cd != (iconv_t)-1)
-		iconv_close(t->cd);
+		charset_iconv_cache_put(t->charset, t->cd);
+	i_free(t->charset);
 	i_free(t);
 }
 
@@ -65,6 +148,11 @@ charset_to_utf8_try(struct charset_translation *t,
 	size_t srcleft, destleft, tmpbuf_used;
 	bool ret = TRUE;
 
+	if (t->table_8bit != NULL) {
+		*result = charset_8bit_to_utf8(t->table_8bit, t->normalizer,
+					       src, src_size, dest);
+		return TRUE;
+	}
 	if (t->cd == (iconv_t)-1) {
 		/* input is already supposed to be UTF-8 */
 		*result = charset_utf8_to_utf8(t->normalizer, src, src_size, dest);
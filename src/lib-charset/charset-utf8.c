@@ -46,20 +46,24 @@ charset_utf8_to_utf8_begin(normalizer_func_t *normalizer)
 
 struct charset_translation {
 	normalizer_func_t *normalizer;
+	const uint16_t *table_8bit;
 };
 
 int charset_to_utf8_begin(const char *charset, normalizer_func_t *normalizer,
 			  struct charset_translation **t_r)
 {
 	struct charset_translation *t;
+	const uint16_t *table_8bit = NULL;
 
-	if (!charset_is_utf8(charset)) {
+	if (!charset_is_utf8(charset) &&
+	    (table_8bit = charset_8bit_find(charset)) == NULL) {
 		/* no support for charsets that need translation */
 		return -1;
 	}
 
 	t = i_new(struct charset_translation, 1);
 	t->normalizer = normalizer;
+	t->table_8bit = table_8bit;
 	*t_r = t;
 	return 0;
 }
@@ -80,6 +84,10 @@ enum charset_result
 charset_to_utf8(struct charset_translation *t,
 		const unsigned char *src, size_t *src_size, buffer_t *dest)
 {
+	if (t->table_8bit != NULL) {
+		return charset_8bit_to_utf8(t->table_8bit, t->normalizer,
+					    src, src_size, dest);
+	}
 	return charset_utf8_to_utf8(t->normalizer, src, src_size, dest);
 }
 
@@ -90,9 +98,13 @@ charset_utf8_to_utf8(normalizer_func_t *normalizer,
 		     const unsigned char *src, size_t *src_size, buffer_t *dest)
 {
 	enum charset_result res = CHARSET_RET_OK;
-	size_t pos;
+	size_t pos, ascii_len;
 
-	uni_utf8_partial_strlen_n(src, *src_size, &pos);
+	/* the ASCII prefix is valid and complete, so only the rest needs to
+	   be scanned */
+	ascii_len = charset_ascii_prefix_len(src, *src_size);
+	uni_utf8_partial_strlen_n(src + ascii_len, *src_size - ascii_len, &pos);
+	pos += ascii_len;
 	if (pos < *src_size) {
 		i_assert(*src_size - pos <= CHARSET_MAX_PENDING_BUF_SIZE);
 		*src_size = pos;
@@ -102,10 +114,12 @@ charset_utf8_to_utf8(normalizer_func_t *normalizer,
 	if (normalizer != NULL) {
 		if (normalizer(src, *src_size, dest) < 0)
 			return CHARSET_RET_INVALID_INPUT;
-	} else if (!uni_utf8_get_valid_data(src, *src_size, dest)) {
-		return CHARSET_RET_INVALID_INPUT;
 	} else {
-		buffer_append(dest, src, *src_size);
+		buffer_append(dest, src, ascii_len);
+		if (!uni_utf8_get_valid_data(src + ascii_len,
+					     *src_size - ascii_len, dest))
+			return CHARSET_RET_INVALID_INPUT;
+		buffer_append(dest, src + ascii_len, *src_size - ascii_len);
 	}
 	return res;
 }
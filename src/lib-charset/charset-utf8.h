@@ -49,5 +49,26 @@ int charset_to_utf8_str(const char *charset, normalizer_func_t *normalizer,
 enum charset_result
 charset_utf8_to_utf8(normalizer_func_t *normalizer,
 		     const unsigned char *src, size_t *src_size, buffer_t *dest);
+/* Returns the conversion table for a single byte charset that is translated
+   without iconv, or NULL if there is none. */
+const uint16_t *charset_8bit_find(const char *charset);
+enum charset_result
+charset_8bit_to_utf8(const uint16_t *table, normalizer_func_t *normalizer,
+		     const unsigned char *src, size_t *src_size,
+		     buffer_t *dest);
+/* Returns the number of bytes at the beginning of src that are 7bit ASCII. */
+size_t charset_ascii_prefix_len(const unsigned char *src, size_t size);
+
+enum charset_ascii_scan_impl {
+	CHARSET_ASCII_SCAN_IMPL_SWAR,
+	CHARSET_ASCII_SCAN_IMPL_SSE2,
+	CHARSET_ASCII_SCAN_IMPL_AVX2
+};
+/* The ASCII scanning uses the fastest implementation supported by the CPU.
+   For unit tests and benchmarks: Force using the given implementation.
+   Returns FALSE if it's not supported by the CPU or the build. */
+bool charset_ascii_scan_set_impl(enum charset_ascii_scan_impl impl);
+/* Switch back to the fastest supported implementation. */
+void charset_ascii_scan_set_best_impl(void);
 
 #endif
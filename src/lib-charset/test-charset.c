@@ -5,6 +5,10 @@
 #include "test-common.h"
 #include "charset-utf8.h"
 
+#ifdef HAVE_ICONV
+#  include <iconv.h>
+#endif
+
 static void test_charset_is_utf8(void)
 {
 	test_begin("charset_is_utf8");
@@ -57,7 +61,127 @@ static void test_charset_utf8(void)
 	test_end();
 }
 
+static void test_charset_8bit(void)
+{
+	struct {
+		const char *charset;
+		const char *input;
+		const char *output;
+		enum charset_result result;
+	} tests[] = {
+		{ "ISO-8859-1", "p\xE4\xE4", "p\xC3\xA4\xC3\xA4", CHARSET_RET_OK },
+		{ "latin1", "\x80\xA4\xFF", "\xC2\x80\xC2\xA4\xC3\xBF", CHARSET_RET_OK },
+		{ "ISO-8859-15", "\xA4\xBD", "\xE2\x82\xAC\xC5\x93", CHARSET_RET_OK },
+		{ "windows-1252", "\x80 \x93x\x94", "\xE2\x82\xAC \xE2\x80\x9Cx\xE2\x80\x9D", CHARSET_RET_OK },
+		{ "CP1252", "a\x81\x8D""b\x90", "a"UNICODE_REPLACEMENT_CHAR_UTF8"b"UNICODE_REPLACEMENT_CHAR_UTF8, CHARSET_RET_INVALID_INPUT }
+	};
+	string_t *src, *expected, *str = t_str_new(256);
+	enum charset_result result;
+	unsigned int i;
+
+	test_begin("charset 8bit");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		str_truncate(str, 0);
+		test_assert_idx(charset_to_utf8_str(tests[i].charset, NULL,
+						    tests[i].input, str, &result) == 0, i);
+		test_assert_idx(strcmp(tests[i].output, str_c(str)) == 0, i);
+		test_assert_idx(result == tests[i].result, i);
+	}
+
+	/* input that is converted in multiple chunks */
+	src = t_str_new(8192);
+	expected = t_str_new(8192);
+	for (i = 0; i < 4000; i++) {
+		str_append(src, i % 3 == 0 ? "\xE4" : "abcdefghij");
+		str_append(expected, i % 3 == 0 ? "\xC3\xA4" : "abcdefghij");
+	}
+	str_truncate(str, 0);
+	test_assert(charset_to_utf8_str("ISO-8859-1", NULL, str_c(src),
+					str, &result) == 0);
+	test_assert(result == CHARSET_RET_OK);
+	test_assert(strcmp(str_c(str), str_c(expected)) == 0);
+	test_end();
+}
+
+static void test_charset_ascii_prefix_len_impl(const char *name)
+{
+	unsigned char buf[100];
+	size_t i, size, expected;
+	unsigned int n;
+
+	test_begin(t_strdup_printf("charset ascii prefix len (%s)", name));
+	for (n = 0; n < 10000; n++) {
+		size = rand() % sizeof(buf);
+		for (i = 0; i < size; i++)
+			buf[i] = rand() % 64 == 0 ? 0x80 + rand() % 128 : 'a';
+		for (expected = 0; expected < size; expected++) {
+			if (buf[expected] >= 0x80)
+				break;
+		}
+		test_assert_idx(charset_ascii_prefix_len(buf, size) == expected, n);
+	}
+	test_end();
+}
+
+static void test_charset_ascii_prefix_len(void)
+{
+	static const struct {
+		enum charset_ascii_scan_impl impl;
+		const char *name;
+	} impls[] = {
+		{ CHARSET_ASCII_SCAN_IMPL_SWAR, "swar" },
+		{ CHARSET_ASCII_SCAN_IMPL_SSE2, "sse2" },
+		{ CHARSET_ASCII_SCAN_IMPL_AVX2, "avx2" },
+	};
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(impls); i++) {
+		if (charset_ascii_scan_set_impl(impls[i].impl))
+			test_charset_ascii_prefix_len_impl(impls[i].name);
+	}
+	charset_ascii_scan_set_best_impl();
+}
+
 #ifdef HAVE_ICONV
+static void test_charset_8bit_iconv(void)
+{
+	const char *charsets[] = { "ISO-8859-1", "ISO-8859-15", "WINDOWS-1252" };
+	string_t *str = t_str_new(16);
+	enum charset_result result;
+	unsigned int i, c;
+	char input[2], output[16], *ic_destbuf;
+	ICONV_CONST char *ic_srcbuf;
+	size_t srcleft, destleft;
+	iconv_t cd;
+
+	test_begin("charset 8bit matches iconv");
+	for (i = 0; i < N_ELEMENTS(charsets); i++) {
+		cd = iconv_open("UTF-8", charsets[i]);
+		test_assert(cd != (iconv_t)-1);
+		if (cd == (iconv_t)-1)
+			continue;
+		for (c = 0x80; c <= 0xff; c++) {
+			input[0] = c; input[1] = '\0';
+			ic_srcbuf = input; srcleft = 1;
+			ic_destbuf = output; destleft = sizeof(output);
+			str_truncate(str, 0);
+			test_assert(charset_to_utf8_str(charsets[i], NULL,
+							input, str, &result) == 0);
+			if (iconv(cd, &ic_srcbuf, &srcleft,
+				  &ic_destbuf, &destleft) == (size_t)-1) {
+				test_assert_idx(result == CHARSET_RET_INVALID_INPUT, c);
+				(void)iconv(cd, NULL, NULL, NULL, NULL);
+			} else {
+				test_assert_idx(result == CHARSET_RET_OK, c);
+				test_assert_idx(str_len(str) == sizeof(output) - destleft &&
+						memcmp(str_data(str), output, str_len(str)) == 0, c);
+			}
+		}
+		iconv_close(cd);
+	}
+	test_end();
+}
+
 static void test_charset_iconv(void)
 {
 	struct {
@@ -152,6 +276,33 @@ static void test_charset_iconv_utf7_state(void)
 	charset_to_utf8_end(&trans);
 	test_end();
 }
+
+static void test_charset_iconv_reuse(void)
+{
+	struct charset_translation *trans;
+	string_t *str = t_str_new(32);
+	size_t size;
+	unsigned int i;
+
+	test_begin("charset iconv handle reuse");
+	for (i = 0; i < 3; i++) {
+		/* leave the previous translation in the middle of a
+		   shift sequence */
+		str_truncate(str, 0);
+		test_assert(charset_to_utf8_begin("UTF-7", NULL, &trans) == 0);
+		size = 5;
+		test_assert_idx(charset_to_utf8(trans, (const void *)"a+AOQ", &size, str) != CHARSET_RET_INVALID_INPUT, i);
+		charset_to_utf8_end(&trans);
+
+		str_truncate(str, 0);
+		test_assert(charset_to_utf8_begin("utf-7", NULL, &trans) == 0);
+		size = 3;
+		test_assert_idx(charset_to_utf8(trans, (const void *)"AOQ", &size, str) == CHARSET_RET_OK, i);
+		test_assert_idx(strcmp(str_c(str), "AOQ") == 0, i);
+		charset_to_utf8_end(&trans);
+	}
+	test_end();
+}
 #endif
 
 int main(void)
@@ -159,10 +310,14 @@ int main(void)
 	static void (*test_functions[])(void) = {
 		test_charset_is_utf8,
 		test_charset_utf8,
+		test_charset_8bit,
+		test_charset_ascii_prefix_len,
 #ifdef HAVE_ICONV
+		test_charset_8bit_iconv,
 		test_charset_iconv,
 		test_charset_iconv_crashes,
 		test_charset_iconv_utf7_state,
+		test_charset_iconv_reuse,
 #endif
 		NULL
 	};
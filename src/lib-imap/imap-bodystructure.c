@@ -4,7 +4,9 @@
 #include "buffer.h"
 #include "istream.h"
 #include "str.h"
+#include "numpack.h"
 #include "message-parser.h"
+#include "message-part-serialize.h"
 #include "rfc822-parser.h"
 #include "rfc2231-parser.h"
 #include "imap-parser.h"
@@ -1006,3 +1008,190 @@ int imap_body_parse_from_bodystructure(const char *bodystructure,
 	i_stream_destroy(&input);
 	return ret;
 }
+
+/*
+   serialized message_part size
+   serialized message_part (message_part_serialize())
+   part (in the same order as in the serialized message_part: root first,
+         then its children, then its next siblings)
+     for each body_data_string_offsets[]:
+       string length + 1, or 0 if NULL
+       string
+
+   The numbers are packed with numpack.
+*/
+static const size_t body_data_string_offsets[] = {
+	offsetof(struct message_part_body_data, content_type),
+	offsetof(struct message_part_body_data, content_subtype),
+	offsetof(struct message_part_body_data, content_type_params),
+	offsetof(struct message_part_body_data, content_transfer_encoding),
+	offsetof(struct message_part_body_data, content_id),
+	offsetof(struct message_part_body_data, content_description),
+	offsetof(struct message_part_body_data, content_disposition),
+	offsetof(struct message_part_body_data, content_disposition_params),
+	offsetof(struct message_part_body_data, content_md5),
+	offsetof(struct message_part_body_data, content_language),
+	offsetof(struct message_part_body_data, content_location),
+	/* the parsed envelope is serialized as envelope_str */
+	offsetof(struct message_part_body_data, envelope_str)
+};
+
+static void
+imap_bodystructure_serialize_string(const char *value, buffer_t *dest)
+{
+	size_t len;
+
+	if (value == NULL)
+		numpack_encode(dest, 0);
+	else {
+		len = strlen(value);
+		numpack_encode(dest, len + 1);
+		buffer_append(dest, value, len);
+	}
+}
+
+static void
+imap_bodystructure_serialize_parts(const struct message_part *part,
+				   buffer_t *dest)
+{
+	const struct message_part_body_data *data;
+	const char *value;
+	string_t *str;
+	unsigned int i;
+
+	for (; part != NULL; part = part->next) {
+		data = part->context;
+		for (i = 0; i < N_ELEMENTS(body_data_string_offsets); i++) {
+			value = data == NULL ? NULL :
+				*(const char *const *)CONST_PTR_OFFSET(data,
+					body_data_string_offsets[i]);
+			if (value == NULL && data != NULL &&
+			    body_data_string_offsets[i] ==
+			    offsetof(struct message_part_body_data, envelope_str) &&
+			    data->envelope != NULL) {
+				str = t_str_new(256);
+				imap_envelope_write_part_data(data->envelope, str);
+				value = str_c(str);
+			}
+			imap_bodystructure_serialize_string(value, dest);
+		}
+		if (part->children != NULL)
+			imap_bodystructure_serialize_parts(part->children, dest);
+	}
+}
+
+void imap_bodystructure_serialize(struct message_part *part, buffer_t *dest)
+{
+	buffer_t *parts_buf;
+
+	parts_buf = buffer_create_dynamic(pool_datastack_create(), 128);
+	message_part_serialize(part, parts_buf);
+	numpack_encode(dest, parts_buf->used);
+	buffer_append_buf(dest, parts_buf, 0, (size_t)-1);
+	imap_bodystructure_serialize_parts(part, dest);
+}
+
+static int
+imap_bodystructure_deserialize_parts(pool_t pool, struct message_part *part,
+				     const uint8_t **p, const uint8_t *end,
+				     const char **error_r)
+{
+	struct message_part_body_data *data;
+	uint64_t len;
+	unsigned int i;
+
+	for (; part != NULL; part = part->next) {
+		data = p_new(pool, struct message_part_body_data, 1);
+		data->pool = pool;
+		for (i = 0; i < N_ELEMENTS(body_data_string_offsets); i++) {
+			if (numpack_decode(p, end, &len) < 0 ||
+			    len > (uint64_t)(end - *p) + 1) {
+				*error_r = "Truncated body data";
+				return -1;
+			}
+			if (len == 0)
+				continue;
+			*(const char **)PTR_OFFSET(data,
+				body_data_string_offsets[i]) =
+				p_strndup(pool, *p, len - 1);
+			*p += len - 1;
+		}
+		part->context = data;
+
+		if (part->children != NULL) {
+			if (imap_bodystructure_deserialize_parts(pool,
+					part->children, p, end, error_r) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static bool
+imap_bodystructure_parts_match(const struct message_part *dest,
+			       const struct message_part *src)
+{
+	for (; src != NULL; src = src->next, dest = dest->next) {
+		if (dest == NULL || src->flags != dest->flags ||
+		    src->body_size.physical_size != dest->body_size.physical_size ||
+		    src->body_size.virtual_size != dest->body_size.virtual_size)
+			return FALSE;
+		if ((src->children == NULL) != (dest->children == NULL))
+			return FALSE;
+		if (src->children != NULL &&
+		    !imap_bodystructure_parts_match(dest->children,
+						    src->children))
+			return FALSE;
+	}
+	return dest == NULL;
+}
+
+static void
+imap_bodystructure_move_contexts(struct message_part *dest,
+				 const struct message_part *src)
+{
+	for (; src != NULL; src = src->next, dest = dest->next) {
+		dest->context = src->context;
+		if (src->children != NULL) {
+			imap_bodystructure_move_contexts(dest->children,
+							 src->children);
+		}
+	}
+}
+
+int imap_bodystructure_deserialize(pool_t pool, const void *data, size_t size,
+				   struct message_part **parts,
+				   const char **error_r)
+{
+	const uint8_t *p = data, *end = p + size;
+	struct message_part *new_parts;
+	uint64_t parts_size;
+
+	if (numpack_decode(&p, end, &parts_size) < 0 ||
+	    parts_size > (uint64_t)(end - p)) {
+		*error_r = "Truncated message_part";
+		return -1;
+	}
+	new_parts = message_part_deserialize(pool, p, parts_size, error_r);
+	if (new_parts == NULL)
+		return -1;
+	p += parts_size;
+
+	if (imap_bodystructure_deserialize_parts(pool, new_parts,
+						 &p, end, error_r) < 0)
+		return -1;
+	if (p != end) {
+		*error_r = "Trailing garbage after body data";
+		return -1;
+	}
+
+	if (*parts == NULL)
+		*parts = new_parts;
+	else if (imap_bodystructure_parts_match(*parts, new_parts))
+		imap_bodystructure_move_contexts(*parts, new_parts);
+	else {
+		*error_r = "message_part doesn't match the serialized one";
+		return -1;
+	}
+	return 0;
+}
@@ -44,6 +44,19 @@ void imap_bodystructure_write(const struct message_part *part,
 int imap_bodystructure_parse(const char *bodystructure, pool_t pool,
 			     struct message_part *parts, const char **error_r);
 
+/* Serialize the message_part and its body data into a compact binary form,
+   from which both BODY and BODYSTRUCTURE can be written without parsing
+   them. The message_part->contexts must contain struct
+   message_part_body_data. */
+void imap_bodystructure_serialize(struct message_part *part, buffer_t *dest);
+/* Deserialize the data written by imap_bodystructure_serialize(). If *parts
+   is NULL, it's set to the deserialized message_part. Otherwise the body data
+   is set to the existing *parts->contexts, which must match the serialized
+   message_part. Returns 0 if ok, -1 if the data was invalid. */
+int imap_bodystructure_deserialize(pool_t pool, const void *data, size_t size,
+				   struct message_part **parts,
+				   const char **error_r);
+
 /* Get BODY part from BODYSTRUCTURE and write it to dest.
    Returns 0 if ok, -1 if bodystructure wasn't valid. */
 int imap_body_parse_from_bodystructure(const char *bodystructure,
@@ -1,6 +1,7 @@
 /* Copyright (c) 2013-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "istream.h"
 #include "str.h"
 #include "message-parser.h"
@@ -131,11 +132,60 @@ static void test_imap_bodystructure_parse(void)
 	test_end();
 }
 
+static void test_imap_bodystructure_serialize(void)
+{
+	struct message_part *parts, *parts2;
+	const char *error;
+	string_t *str = t_str_new(128);
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 512);
+	pool_t pool = pool_alloconly_create("imap bodystructure serialize", 1024);
+	size_t size;
+
+	test_begin("imap bodystructure serialize");
+	parts = msg_parse(pool, TRUE);
+	imap_bodystructure_serialize(parts, buf);
+
+	/* deserialize everything */
+	parts2 = NULL;
+	test_assert(imap_bodystructure_deserialize(pool, buf->data, buf->used,
+						   &parts2, &error) == 0);
+	imap_bodystructure_write(parts2, str, TRUE);
+	test_assert(strcmp(str_c(str), testmsg_bodystructure) == 0);
+	str_truncate(str, 0);
+	imap_bodystructure_write(parts2, str, FALSE);
+	test_assert(strcmp(str_c(str), testmsg_body) == 0);
+
+	/* add the body data to existing message_parts */
+	parts2 = msg_parse(pool, FALSE);
+	test_assert(imap_bodystructure_deserialize(pool, buf->data, buf->used,
+						   &parts2, &error) == 0);
+	str_truncate(str, 0);
+	imap_bodystructure_write(parts2, str, TRUE);
+	test_assert(strcmp(str_c(str), testmsg_bodystructure) == 0);
+
+	/* message_parts don't match */
+	parts2 = msg_parse(pool, FALSE);
+	parts2->children->next->body_size.virtual_size++;
+	test_assert(imap_bodystructure_deserialize(pool, buf->data, buf->used,
+						   &parts2, &error) < 0);
+	test_assert(parts2->children->context == NULL);
+
+	/* truncated data */
+	for (size = 0; size < buf->used; size++) {
+		parts2 = NULL;
+		test_assert_idx(imap_bodystructure_deserialize(pool, buf->data,
+				size, &parts2, &error) < 0, size);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_imap_bodystructure_write,
 		test_imap_bodystructure_parse,
+		test_imap_bodystructure_serialize,
 		NULL
 	};
 	return test_run(test_functions);
@@ -0,0 +1,143 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_DIR ".bench-mail-index-commit"
+#define BENCH_MESSAGE_COUNT 1000
+#define BENCH_DEFAULT_COMMITS 200
+
+static void bench_index_init(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	(void)unlink_directory(BENCH_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(BENCH_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", BENCH_DIR);
+
+	index = mail_index_alloc(BENCH_DIR, "bench.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= BENCH_MESSAGE_COUNT; seq++)
+		mail_index_append(trans, seq, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static void bench_child(unsigned int child_idx, unsigned int commits,
+			unsigned int group_size)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	unsigned int i;
+	uint32_t seq;
+
+	index = mail_index_alloc(BENCH_DIR, "bench.index");
+	mail_index_set_fsync_mode(index, FSYNC_MODE_ALWAYS, 0);
+	if (mail_index_open(index, 0) <= 0)
+		i_fatal("mail_index_open() failed");
+	view = mail_index_view_open(index);
+
+	for (i = 0; i < commits; i++) {
+		if (group_size > 1 && i % group_size == 0) {
+			if (mail_index_group_commit_begin(index) < 0)
+				i_fatal("mail_index_group_commit_begin() failed");
+		}
+		seq = (child_idx * commits + i) % BENCH_MESSAGE_COUNT + 1;
+		trans = mail_index_transaction_begin(view, 0);
+		mail_index_update_flags(trans, seq, i % 2 == 0 ?
+					MODIFY_ADD : MODIFY_REMOVE, MAIL_SEEN);
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("mail_index_transaction_commit() failed");
+		if (group_size > 1 &&
+		    (i % group_size == group_size-1 || i+1 == commits)) {
+			if (mail_index_group_commit_end(index) < 0)
+				i_fatal("mail_index_group_commit_end() failed");
+		}
+	}
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static void
+bench_commits(unsigned int processes, unsigned int commits,
+	      unsigned int group_size)
+{
+	struct timeval start, end;
+	unsigned int i;
+	long long usecs;
+	pid_t pid;
+	int status;
+
+	bench_index_init();
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < processes; i++) {
+		if ((pid = fork()) < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			bench_child(i, commits, group_size);
+			exit(0);
+		}
+	}
+	for (i = 0; i < processes; i++) {
+		if (wait(&status) < 0)
+			i_fatal("wait() failed: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			i_fatal("benchmark process failed");
+	}
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&end, &start);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%2u processes, group %-3u %10.0f commits/s\n",
+	       processes, group_size,
+	       processes * commits * 1000000.0 / usecs);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int process_counts[] = { 1, 4, 16 };
+	static const unsigned int group_sizes[] = { 1, 8, 32 };
+	unsigned int i, j, commits = BENCH_DEFAULT_COMMITS;
+
+	lib_init();
+	ioloop_time = time(NULL);
+	if (argc > 1 && str_to_uint(argv[1], &commits) < 0)
+		i_fatal("Usage: %s [<commits per process>]", argv[0]);
+
+	printf("fsync_mode=always, %u commits per process\n", commits);
+	fflush(stdout);
+	for (i = 0; i < N_ELEMENTS(process_counts); i++) {
+		for (j = 0; j < N_ELEMENTS(group_sizes); j++)
+			bench_commits(process_counts[i], commits, group_sizes[j]);
+	}
+	(void)unlink_directory(BENCH_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	lib_deinit();
+	return 0;
+}
@@ -2,9 +2,12 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hostpid.h"
+#include "ioloop.h"
 #include "ostream.h"
 #include "nfs-workarounds.h"
 #include "read-full.h"
+#include "write-full.h"
 #include "file-dotlock.h"
 #include "file-cache.h"
 #include "file-set-size.h"
@@ -13,13 +16,33 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+struct mail_cache_copy_column {
+	unsigned int field_idx;
+	uint32_t file_field;
+	buffer_t *bitmap, *values;
+	bool have_values;
+};
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
+	pool_t pool;
 
 	buffer_t *buffer, *field_seen;
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
 
+	/* field_idx -> index in columns, UINT_MAX if not a column */
+	unsigned int *field_column_map;
+	ARRAY(struct mail_cache_copy_column) columns;
+	buffer_t *column_uids;
+	uint32_t column_pos;
+	/* struct mail_cache_header_columns follows the header when
+	   column_uids != NULL */
+	struct mail_cache_header_columns hdr_columns;
+
+	unsigned int fields_count, used_fields_count;
+	unsigned int record_count;
+
 	uint8_t field_seen_value;
 	bool new_msg;
 };
@@ -28,6 +51,42 @@ struct mail_cache_compress_lock {
 	struct dotlock *dotlock;
 };
 
+struct mail_cache_compress_msg {
+	uint32_t uid;
+	/* record offset in the old file when the message was copied */
+	uint32_t old_offset;
+	/* record offset in the new file, 0 if nothing was copied */
+	uint32_t new_offset;
+};
+
+/* Incremental compression in progress. The messages are copied in batches
+   to the temp file without locking the cache. The compression dotlock is
+   held only while copying a batch or finishing, so a stalled process can't
+   block others from compressing the file. */
+struct mail_cache_compress_state {
+	pool_t pool;
+	struct mail_cache_copy_context ctx;
+	struct dotlock *dotlock;
+
+	int fd;
+	char *temp_path;
+	uoff_t output_offset;
+	/* when the compression was started or a batch was last copied */
+	time_t last_progress;
+
+	/* file_seq of the file being compressed */
+	uint32_t file_seq;
+	/* next UID to copy */
+	uint32_t next_uid;
+	unsigned int messages_count;
+	/* all the messages have been copied once. the rest is done when
+	   finishing. */
+	bool copy_finished;
+	/* copied messages in UID order. With columns the array index is also
+	   the message's position in the columns. */
+	ARRAY(struct mail_cache_compress_msg) msgs;
+};
+
 static void
 mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 			 const struct mail_cache_iterate_field *field)
@@ -80,6 +139,24 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			return;
 	}
 
+	if (ctx->field_column_map != NULL &&
+	    ctx->field_column_map[field->field_idx] != UINT_MAX) {
+		struct mail_cache_copy_column *column =
+			array_idx_modifiable(&ctx->columns,
+				ctx->field_column_map[field->field_idx]);
+		uint8_t *bits;
+
+		i_assert(field->size == cache_field->field_size);
+		bits = buffer_get_space_unsafe(column->bitmap,
+					       ctx->column_pos / 8, 1);
+		*bits |= 1 << (ctx->column_pos % 8);
+		buffer_write(column->values,
+			     ctx->column_pos * field->size,
+			     field->data, field->size);
+		column->have_values = TRUE;
+		return;
+	}
+
 	buffer_append(ctx->buffer, &file_field_idx, sizeof(file_field_idx));
 
 	if (cache_field->field_size == UINT_MAX) {
@@ -98,6 +175,116 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 		buffer_append_zero(ctx->buffer, 4 - (field->size & 3));
 }
 
+static void
+mail_cache_compress_init_columns(struct mail_cache_copy_context *ctx,
+				 uint32_t message_count)
+{
+	struct mail_cache *cache = ctx->cache;
+	struct mail_cache_copy_column *column;
+	const struct mail_cache_field *field;
+	unsigned int i;
+
+	ctx->field_column_map = p_new(ctx->pool, unsigned int,
+				      cache->fields_count);
+	p_array_init(&ctx->columns, ctx->pool, 8);
+	for (i = 0; i < cache->fields_count; i++) {
+		field = &cache->fields[i].field;
+		ctx->field_column_map[i] = UINT_MAX;
+
+		/* only fields that are wanted for all messages are worth
+		   having in columns */
+		if (ctx->field_file_map[i] == (uint32_t)-1 ||
+		    field->type != MAIL_CACHE_FIELD_FIXED_SIZE ||
+		    field->field_size == 0 ||
+		    (field->decision & ~MAIL_CACHE_DECISION_FORCED) !=
+		    MAIL_CACHE_DECISION_YES)
+			continue;
+
+		ctx->field_column_map[i] = array_count(&ctx->columns);
+		column = array_append_space(&ctx->columns);
+		column->field_idx = i;
+		column->file_field = ctx->field_file_map[i];
+		column->bitmap = buffer_create_dynamic(default_pool,
+			MAIL_CACHE_COLUMN_BITMAP_SIZE(message_count));
+		column->values = buffer_create_dynamic(default_pool,
+			message_count * field->field_size);
+	}
+	ctx->column_uids = buffer_create_dynamic(default_pool,
+			message_count * sizeof(uint32_t));
+}
+
+static void
+mail_cache_compress_write_columns(struct mail_cache_copy_context *ctx,
+				  struct ostream *output,
+				  struct mail_cache_header *hdr)
+{
+	struct mail_cache_column_header col_hdr;
+	struct mail_cache_column col;
+	struct mail_cache_copy_column *columns;
+	unsigned int i, count, bitmap_size, values_size;
+	uint32_t offset;
+
+	memset(&col_hdr, 0, sizeof(col_hdr));
+	col_hdr.uids_count = ctx->column_pos;
+	columns = array_get_modifiable(&ctx->columns, &count);
+	for (i = 0; i < count; i++) {
+		if (columns[i].have_values)
+			col_hdr.columns_count++;
+	}
+	if (col_hdr.columns_count == 0)
+		return;
+
+	bitmap_size = MAIL_CACHE_COLUMN_BITMAP_SIZE(col_hdr.uids_count);
+	hdr->minor_version = MAIL_CACHE_MINOR_VERSION_COLUMNS;
+	ctx->hdr_columns.column_header_offset = output->offset;
+	o_stream_nsend(output, &col_hdr, sizeof(col_hdr));
+	o_stream_nsend(output, ctx->column_uids->data,
+		       ctx->column_uids->used);
+
+	offset = output->offset + col_hdr.columns_count * sizeof(col);
+	for (i = 0; i < count; i++) {
+		if (!columns[i].have_values)
+			continue;
+		memset(&col, 0, sizeof(col));
+		col.file_field = columns[i].file_field;
+		col.field_size =
+			ctx->cache->fields[columns[i].field_idx].field.field_size;
+		col.offset = offset;
+		o_stream_nsend(output, &col, sizeof(col));
+
+		/* fill the messages at the end that didn't have the field.
+		   the bitmap is already 32bit aligned, make the values too. */
+		values_size = (col_hdr.uids_count * col.field_size + 3) & ~3U;
+		buffer_append_zero(columns[i].bitmap,
+				   bitmap_size - columns[i].bitmap->used);
+		buffer_append_zero(columns[i].values,
+				   values_size - columns[i].values->used);
+		offset += columns[i].bitmap->used + columns[i].values->used;
+	}
+	for (i = 0; i < count; i++) {
+		if (!columns[i].have_values)
+			continue;
+		o_stream_nsend(output, columns[i].bitmap->data,
+			       columns[i].bitmap->used);
+		o_stream_nsend(output, columns[i].values->data,
+			       columns[i].values->used);
+	}
+	i_assert(offset == output->offset);
+}
+
+static void mail_cache_compress_free_columns(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache_copy_column *column;
+
+	if (ctx->column_uids == NULL)
+		return;
+	array_foreach_modifiable(&ctx->columns, column) {
+		buffer_free(&column->bitmap);
+		buffer_free(&column->values);
+	}
+	buffer_free(&ctx->column_uids);
+}
+
 static uint32_t get_next_file_seq(struct mail_cache *cache)
 {
 	const struct mail_index_ext *ext;
@@ -159,47 +346,37 @@ mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
 	mail_cache_header_fields_get(cache, ctx->buffer);
 }
 
-static int
-mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
-		int fd, uint32_t *file_seq_r,
-		ARRAY_TYPE(uint32_t) *ext_offsets)
+static void
+mail_cache_copy_init(struct mail_cache_copy_context *ctx,
+		     struct mail_cache *cache, pool_t pool)
 {
-        struct mail_cache_copy_context ctx;
-	struct mail_cache_lookup_iterate_ctx iter;
-	struct mail_cache_iterate_field field;
-	struct mail_index_view *view;
-	struct mail_cache_view *cache_view;
-	const struct mail_index_header *idx_hdr;
-	struct mail_cache_header hdr;
-	struct mail_cache_record cache_rec;
-	struct ostream *output;
-	uint32_t message_count, seq, first_new_seq, ext_offset;
-	unsigned int i, used_fields_count, orig_fields_count, record_count;
-	time_t max_drop_time;
-
-	/* get the latest info on fields */
-	if (mail_cache_header_fields_read(cache) < 0)
-		return -1;
-
-	view = mail_index_transaction_get_view(trans);
-	cache_view = mail_cache_view_open(cache, view);
-	output = o_stream_create_fd_file(fd, 0, FALSE);
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->cache = cache;
+	ctx->pool = pool;
+	ctx->buffer = buffer_create_dynamic(default_pool, 4096);
+	ctx->field_seen = buffer_create_dynamic(default_pool, 64);
+	ctx->field_seen_value = 0;
+	ctx->fields_count = cache->fields_count;
+	ctx->field_file_map = p_new(pool, uint32_t, cache->fields_count + 1);
+	p_array_init(&ctx->bitmask_pos, pool, 32);
+}
 
-	memset(&hdr, 0, sizeof(hdr));
-	hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
-	hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
-	hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
-	hdr.indexid = cache->index->indexid;
-	hdr.file_seq = get_next_file_seq(cache);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
+static void mail_cache_copy_deinit(struct mail_cache_copy_context *ctx)
+{
+	mail_cache_compress_free_columns(ctx);
+	buffer_free(&ctx->buffer);
+	buffer_free(&ctx->field_seen);
+}
 
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.cache = cache;
-	ctx.buffer = buffer_create_dynamic(default_pool, 4096);
-	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
-	ctx.field_seen_value = 0;
-	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
-	t_array_init(&ctx.bitmask_pos, 32);
+static unsigned int
+mail_cache_copy_map_fields(struct mail_cache *cache,
+			   struct mail_index_view *view, bool update_fields,
+			   uint32_t *field_file_map)
+{
+	const struct mail_index_header *idx_hdr;
+	unsigned int i, used_fields_count;
+	time_t max_drop_time;
+	bool used;
 
 	/* @UNSAFE: drop unused fields and create a field mapping for
 	   used fields */
@@ -207,155 +384,303 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	max_drop_time = idx_hdr->day_stamp == 0 ? 0 :
 		idx_hdr->day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
 
-	orig_fields_count = cache->fields_count;
 	if (cache->file_fields_count == 0) {
 		/* creating the initial cache file. add all fields. */
-		for (i = 0; i < orig_fields_count; i++)
-			ctx.field_file_map[i] = i;
-		used_fields_count = i;
-	} else {
-		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
-			struct mail_cache_field_private *priv =
-				&cache->fields[i];
-			enum mail_cache_decision_type dec =
-				priv->field.decision;
-
-			/* if the decision isn't forced and this field hasn't
-			   been accessed for a while, drop it */
-			if ((dec & MAIL_CACHE_DECISION_FORCED) == 0 &&
-			    priv->field.last_used < max_drop_time &&
-			    !priv->adding) {
-				dec = MAIL_CACHE_DECISION_NO;
+		for (i = 0; i < cache->fields_count; i++)
+			field_file_map[i] = i;
+		return i;
+	}
+
+	for (i = used_fields_count = 0; i < cache->fields_count; i++) {
+		struct mail_cache_field_private *priv = &cache->fields[i];
+		enum mail_cache_decision_type dec = priv->field.decision;
+
+		/* if the decision isn't forced and this field hasn't
+		   been accessed for a while, drop it */
+		used = priv->used;
+		if ((dec & MAIL_CACHE_DECISION_FORCED) == 0 &&
+		    priv->field.last_used < max_drop_time &&
+		    !priv->adding) {
+			dec = MAIL_CACHE_DECISION_NO;
+			if (update_fields)
 				priv->field.decision = dec;
-			}
+		}
 
-			/* drop all fields we don't want */
-			if ((dec & ~MAIL_CACHE_DECISION_FORCED) ==
-			    MAIL_CACHE_DECISION_NO && !priv->adding) {
+		/* drop all fields we don't want */
+		if ((dec & ~MAIL_CACHE_DECISION_FORCED) ==
+		    MAIL_CACHE_DECISION_NO && !priv->adding) {
+			used = FALSE;
+			if (update_fields) {
 				priv->used = FALSE;
 				priv->field.last_used = 0;
 			}
-
-			ctx.field_file_map[i] = !priv->used ?
-				(uint32_t)-1 : used_fields_count++;
 		}
-	}
 
-	/* get sequence of first message which doesn't need its temp fields
-	   removed. */
-	first_new_seq = mail_cache_get_first_new_seq(view);
-	message_count = mail_index_view_get_messages_count(view);
+		field_file_map[i] = !used ? (uint32_t)-1 : used_fields_count++;
+	}
+	return used_fields_count;
+}
 
-	i_array_init(ext_offsets, message_count); record_count = 0;
-	for (seq = 1; seq <= message_count; seq++) {
-		if (mail_index_transaction_is_expunged(trans, seq)) {
-			array_append_zero(ext_offsets);
-			continue;
-		}
+/* Give file field indexes to the fields that are used now, but didn't have
+   one yet. They were either registered after copying was started or weren't
+   used back then. The existing indexes are kept, so the already copied
+   records stay valid. */
+static void
+mail_cache_copy_remap_fields(struct mail_cache_copy_context *ctx,
+			     struct mail_index_view *view, bool update_fields)
+{
+	struct mail_cache *cache = ctx->cache;
+	uint32_t *field_file_map;
+	unsigned int *field_column_map;
+	unsigned int i;
 
-		ctx.new_msg = seq >= first_new_seq;
-		buffer_set_used_size(ctx.buffer, 0);
+	field_file_map = p_new(ctx->pool, uint32_t, cache->fields_count + 1);
+	(void)mail_cache_copy_map_fields(cache, view, update_fields,
+					 field_file_map);
+	for (i = 0; i < cache->fields_count; i++) {
+		if (i < ctx->fields_count &&
+		    ctx->field_file_map[i] != (uint32_t)-1)
+			field_file_map[i] = ctx->field_file_map[i];
+		else if (field_file_map[i] != (uint32_t)-1)
+			field_file_map[i] = ctx->used_fields_count++;
+	}
+	ctx->field_file_map = field_file_map;
+
+	if (ctx->field_column_map != NULL &&
+	    cache->fields_count > ctx->fields_count) {
+		/* new fields aren't written to columns */
+		field_column_map = p_new(ctx->pool, unsigned int,
+					 cache->fields_count);
+		memcpy(field_column_map, ctx->field_column_map,
+		       sizeof(*field_column_map) * ctx->fields_count);
+		for (i = ctx->fields_count; i < cache->fields_count; i++)
+			field_column_map[i] = UINT_MAX;
+		ctx->field_column_map = field_column_map;
+	}
+	ctx->fields_count = cache->fields_count;
+}
 
-		if (++ctx.field_seen_value == 0) {
-			memset(buffer_get_modifiable_data(ctx.field_seen, NULL),
-			       0, buffer_get_size(ctx.field_seen));
-			ctx.field_seen_value++;
-		}
+static uint32_t
+mail_cache_copy_msg(struct mail_cache_copy_context *ctx,
+		    struct mail_cache_view *cache_view, uint32_t seq,
+		    struct ostream *output)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_record cache_rec;
+	uint32_t ext_offset;
 
-		memset(&cache_rec, 0, sizeof(cache_rec));
-		buffer_append(ctx.buffer, &cache_rec, sizeof(cache_rec));
+	buffer_set_used_size(ctx->buffer, 0);
 
-		mail_cache_lookup_iter_init(cache_view, seq, &iter);
-		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_compress_field(&ctx, &field);
+	if (++ctx->field_seen_value == 0) {
+		memset(buffer_get_modifiable_data(ctx->field_seen, NULL),
+		       0, buffer_get_size(ctx->field_seen));
+		ctx->field_seen_value++;
+	}
 
-		if (ctx.buffer->used == sizeof(cache_rec) ||
-		    ctx.buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
-			/* nothing cached */
-			ext_offset = 0;
-		} else {
-			cache_rec.size = ctx.buffer->used;
-			ext_offset = output->offset;
-			buffer_write(ctx.buffer, 0, &cache_rec,
-				     sizeof(cache_rec));
-			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
-			record_count++;
+	memset(&cache_rec, 0, sizeof(cache_rec));
+	buffer_append(ctx->buffer, &cache_rec, sizeof(cache_rec));
+
+	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0) {
+		if (field.field_idx >= ctx->fields_count) {
+			/* the cache isn't locked while compressing
+			   incrementally, so the field was just added to the
+			   file by another process */
+			mail_cache_copy_remap_fields(ctx, cache_view->view,
+						     FALSE);
 		}
+		mail_cache_compress_field(ctx, &field);
+	}
 
-		array_append(ext_offsets, &ext_offset, 1);
+	if (ctx->buffer->used == sizeof(cache_rec) ||
+	    ctx->buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
+		/* nothing cached */
+		return 0;
+	}
+
+	cache_rec.size = ctx->buffer->used;
+	ext_offset = output->offset;
+	buffer_write(ctx->buffer, 0, &cache_rec, sizeof(cache_rec));
+	o_stream_nsend(output, ctx->buffer->data, cache_rec.size);
+	ctx->record_count++;
+	return ext_offset;
+}
+
+static void
+mail_cache_copy_add_column_uid(struct mail_cache_copy_context *ctx,
+			       uint32_t uid)
+{
+	if (ctx->column_uids != NULL) {
+		buffer_append(ctx->column_uids, &uid, sizeof(uid));
+		ctx->column_pos++;
 	}
-	i_assert(orig_fields_count == cache->fields_count);
+}
+
+static void
+mail_cache_copy_finish(struct mail_cache_copy_context *ctx,
+		       struct ostream *output, struct mail_cache_header *hdr)
+{
+	if (ctx->column_uids != NULL)
+		mail_cache_compress_write_columns(ctx, output, hdr);
 
-	hdr.record_count = record_count;
-	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
-	mail_cache_compress_get_fields(&ctx, used_fields_count);
-	o_stream_nsend(output, ctx.buffer->data, ctx.buffer->used);
+	hdr->record_count = ctx->record_count;
+	hdr->field_header_offset = mail_index_uint32_to_offset(output->offset);
+	mail_cache_compress_get_fields(ctx, ctx->used_fields_count);
+	o_stream_nsend(output, ctx->buffer->data, ctx->buffer->used);
 
-	hdr.backwards_compat_used_file_size = output->offset;
-	buffer_free(&ctx.buffer);
-	buffer_free(&ctx.field_seen);
+	hdr->backwards_compat_used_file_size = output->offset;
 
 	(void)o_stream_seek(output, 0);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, hdr, sizeof(*hdr));
+	if (ctx->column_uids != NULL) {
+		o_stream_nsend(output, &ctx->hdr_columns,
+			       sizeof(ctx->hdr_columns));
+	}
+}
 
-	mail_cache_view_close(&cache_view);
+static void
+mail_cache_copy_init_header(struct mail_cache *cache,
+			    struct mail_cache_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->major_version = MAIL_CACHE_MAJOR_VERSION;
+	hdr->minor_version = MAIL_CACHE_MINOR_VERSION;
+	hdr->compat_sizeof_uoff_t = sizeof(uoff_t);
+	hdr->indexid = cache->index->indexid;
+	hdr->file_seq = get_next_file_seq(cache);
+}
+
+static int
+mail_cache_copy_flush(struct mail_cache *cache, struct ostream **_output)
+{
+	struct ostream *output = *_output;
+	int ret = 0;
 
 	if (o_stream_nfinish(output) < 0) {
 		mail_cache_set_syscall_error(cache, "write()");
-		o_stream_destroy(&output);
-		array_free(ext_offsets);
-		return -1;
+		ret = -1;
 	}
-	o_stream_destroy(&output);
+	o_stream_destroy(_output);
+	return ret;
+}
 
+static int mail_cache_copy_fsync(struct mail_cache *cache, int fd)
+{
 	if (cache->index->fsync_mode == FSYNC_MODE_ALWAYS) {
 		if (fdatasync(fd) < 0) {
 			mail_cache_set_syscall_error(cache, "fdatasync()");
-			array_free(ext_offsets);
 			return -1;
 		}
 	}
+	return 0;
+}
+
+static int
+mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
+		int fd, uint32_t *file_seq_r,
+		ARRAY_TYPE(uint32_t) *ext_offsets)
+{
+	struct mail_cache_copy_context ctx;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_header hdr;
+	struct mail_cache_header_columns hdr_columns;
+	struct ostream *output;
+	uint32_t message_count, seq, first_new_seq, ext_offset, uid;
+	int ret;
+
+	/* get the latest info on fields */
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+
+	view = mail_index_transaction_get_view(trans);
+	cache_view = mail_cache_view_open(cache, view);
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+
+	mail_cache_copy_init_header(cache, &hdr);
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	if (cache->write_columns) {
+		/* written again when finishing */
+		memset(&hdr_columns, 0, sizeof(hdr_columns));
+		o_stream_nsend(output, &hdr_columns, sizeof(hdr_columns));
+	}
+
+	mail_cache_copy_init(&ctx, cache, pool_datastack_create());
+	ctx.used_fields_count =
+		mail_cache_copy_map_fields(cache, view, TRUE,
+					   ctx.field_file_map);
+
+	/* get sequence of first message which doesn't need its temp fields
+	   removed. */
+	first_new_seq = mail_cache_get_first_new_seq(view);
+	message_count = mail_index_view_get_messages_count(view);
+
+	if (cache->write_columns)
+		mail_cache_compress_init_columns(&ctx, message_count);
+
+	i_array_init(ext_offsets, message_count);
+	for (seq = 1; seq <= message_count; seq++) {
+		if (mail_index_transaction_is_expunged(trans, seq)) {
+			array_append_zero(ext_offsets);
+			continue;
+		}
+
+		ctx.new_msg = seq >= first_new_seq;
+		ext_offset = mail_cache_copy_msg(&ctx, cache_view, seq, output);
+		array_append(ext_offsets, &ext_offset, 1);
+
+		mail_index_lookup_uid(view, seq, &uid);
+		mail_cache_copy_add_column_uid(&ctx, uid);
+	}
+	i_assert(ctx.fields_count == cache->fields_count);
+
+	mail_cache_copy_finish(&ctx, output, &hdr);
+	mail_cache_copy_deinit(&ctx);
+	mail_cache_view_close(&cache_view);
+
+	ret = mail_cache_copy_flush(cache, &output);
+	if (ret == 0)
+		ret = mail_cache_copy_fsync(cache, fd);
+	if (ret < 0) {
+		array_free(ext_offsets);
+		return -1;
+	}
 
 	*file_seq_r = hdr.file_seq;
 	return 0;
 }
 
 static int
-mail_cache_compress_write(struct mail_cache *cache,
-			  struct mail_index_transaction *trans,
-			  int fd, const char *temp_path, bool *unlock)
+mail_cache_compress_replace(struct mail_cache *cache,
+			    struct mail_index_transaction *trans,
+			    int fd, const char *temp_path, uint32_t file_seq,
+			    ARRAY_TYPE(uint32_t) *ext_offsets, bool *unlock)
 {
 	struct stat st;
-	uint32_t file_seq, old_offset;
-	ARRAY_TYPE(uint32_t) ext_offsets;
+	uint32_t old_offset;
 	const uint32_t *offsets;
 	unsigned int i, count;
 
-	if (mail_cache_copy(cache, trans, fd, &file_seq, &ext_offsets) < 0)
-		return -1;
-
 	if (fstat(fd, &st) < 0) {
 		mail_cache_set_syscall_error(cache, "fstat()");
-		array_free(&ext_offsets);
 		return -1;
 	}
 	if (rename(temp_path, cache->filepath) < 0) {
 		mail_cache_set_syscall_error(cache, "rename()");
-		array_free(&ext_offsets);
 		return -1;
 	}
 
 	/* once we're sure that the compression was successful,
 	   update the offsets */
 	mail_index_ext_reset(trans, cache->ext_id, file_seq, TRUE);
-	offsets = array_get(&ext_offsets, &count);
+	offsets = array_get(ext_offsets, &count);
 	for (i = 0; i < count; i++) {
 		if (offsets[i] != 0) {
 			mail_index_update_ext(trans, i + 1, cache->ext_id,
 					      &offsets[i], &old_offset);
 		}
 	}
-	array_free(&ext_offsets);
 
 	if (*unlock) {
 		(void)mail_cache_unlock(cache);
@@ -371,7 +696,25 @@ mail_cache_compress_write(struct mail_cache *cache,
 	return 0;
 }
 
-static int mail_cache_compress_has_file_changed(struct mail_cache *cache)
+static int
+mail_cache_compress_write(struct mail_cache *cache,
+			  struct mail_index_transaction *trans,
+			  int fd, const char *temp_path, bool *unlock)
+{
+	uint32_t file_seq;
+	ARRAY_TYPE(uint32_t) ext_offsets;
+	int ret;
+
+	if (mail_cache_copy(cache, trans, fd, &file_seq, &ext_offsets) < 0)
+		return -1;
+	ret = mail_cache_compress_replace(cache, trans, fd, temp_path,
+					  file_seq, &ext_offsets, unlock);
+	array_free(&ext_offsets);
+	return ret;
+}
+
+static int mail_cache_compress_has_file_changed(struct mail_cache *cache,
+						uint32_t file_seq)
 {
 	struct mail_cache_header hdr;
 	unsigned int i;
@@ -393,12 +736,12 @@ static int mail_cache_compress_has_file_changed(struct mail_cache *cache)
 		if (ret >= 0) {
 			if (ret == 0)
 				return 0;
-			if (cache->need_compress_file_seq == 0) {
+			if (file_seq == 0) {
 				/* previously it didn't exist or it
 				   was unusable and was just unlinked */
 				return 1;
 			}
-			return hdr.file_seq != cache->need_compress_file_seq;
+			return hdr.file_seq != file_seq;
 		} else if (errno != ESTALE || i >= NFS_ESTALE_RETRY_COUNT) {
 			mail_cache_set_syscall_error(cache, "read()");
 			return -1;
@@ -411,11 +754,12 @@ static int mail_cache_compress_dotlock(struct mail_cache *cache,
 {
 	if (file_dotlock_create(&cache->dotlock_settings, cache->filepath,
 				DOTLOCK_CREATE_FLAG_NONBLOCK, dotlock_r) <= 0) {
-		if (errno != EAGAIN)
-			mail_cache_set_syscall_error(cache, "file_dotlock_open()");
+		if (errno == EAGAIN)
+			return 0;
+		mail_cache_set_syscall_error(cache, "file_dotlock_open()");
 		return -1;
 	}
-	return 0;
+	return 1;
 }
 
 static int mail_cache_compress_locked(struct mail_cache *cache,
@@ -433,11 +777,13 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 	   separate dotlock to guard against two processes compressing the
 	   cache at the same time. */
 
-	if (mail_cache_compress_dotlock(cache, dotlock_r) < 0)
+	if (mail_cache_compress_dotlock(cache, dotlock_r) <= 0)
 		return -1;
 	/* we've locked the cache compression now. if somebody else had just
 	   recreated the cache, reopen the cache and return success. */
-	if ((ret = mail_cache_compress_has_file_changed(cache)) != 0) {
+	ret = mail_cache_compress_has_file_changed(cache,
+			cache->need_compress_file_seq);
+	if (ret != 0) {
 		if (ret < 0)
 			return -1;
 
@@ -491,6 +837,9 @@ int mail_cache_compress(struct mail_cache *cache,
 
 	*lock_r = NULL;
 
+	/* we'd be overriding our own dotlock */
+	mail_cache_compress_abort(cache);
+
 	if (MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly) {
 		*lock_r = i_new(struct mail_cache_compress_lock, 1);
 		return 0;
@@ -558,6 +907,445 @@ void mail_cache_compress_unlock(struct mail_cache_compress_lock **_lock)
 	i_free(lock);
 }
 
+static void
+mail_cache_compress_state_free(struct mail_cache_compress_state **_state)
+{
+	struct mail_cache_compress_state *state = *_state;
+
+	*_state = NULL;
+	mail_cache_copy_deinit(&state->ctx);
+	if (state->fd != -1) {
+		i_close_fd(&state->fd);
+		i_unlink(state->temp_path);
+	}
+	if (state->dotlock != NULL)
+		file_dotlock_delete(&state->dotlock);
+	array_free(&state->msgs);
+	i_free(state->temp_path);
+	pool_unref(&state->pool);
+	i_free(state);
+}
+
+void mail_cache_compress_abort(struct mail_cache *cache)
+{
+	if (cache->compress_state != NULL)
+		mail_cache_compress_state_free(&cache->compress_state);
+}
+
+static int mail_cache_compress_incr_lock(struct mail_cache *cache)
+{
+	struct mail_cache_compress_state *state = cache->compress_state;
+	int ret;
+
+	i_assert(state->dotlock == NULL);
+
+	if (ioloop_time - state->last_progress >=
+	    MAIL_CACHE_COMPRESS_INCR_TIMEOUT_SECS) {
+		/* someone else has kept the file locked for a long time.
+		   don't keep the temp file around forever. */
+		return -1;
+	}
+	if ((ret = mail_cache_compress_dotlock(cache, &state->dotlock)) <= 0)
+		return ret;
+
+	/* the file may have been compressed by someone else while it was
+	   unlocked */
+	ret = mail_cache_compress_has_file_changed(cache, state->file_seq);
+	if (ret != 0) {
+		file_dotlock_delete(&state->dotlock);
+		return -1;
+	}
+	return 1;
+}
+
+static int
+mail_cache_compress_incr_init(struct mail_cache *cache,
+			      struct mail_index_transaction *trans)
+{
+	struct mail_cache_compress_state *state;
+	struct mail_index_view *view;
+	struct dotlock *dotlock;
+	struct mail_cache_header hdr;
+	struct mail_cache_header_columns hdr_columns;
+	const char *temp_path;
+	const void *data;
+	pool_t pool;
+	int fd, ret;
+
+	if (mail_cache_compress_dotlock(cache, &dotlock) <= 0)
+		return -1;
+	ret = mail_cache_compress_has_file_changed(cache,
+			cache->need_compress_file_seq);
+	if (ret != 0) {
+		file_dotlock_delete(&dotlock);
+		if (ret < 0)
+			return -1;
+		/* was just compressed, forget this */
+		cache->need_compress_file_seq = 0;
+		return mail_cache_reopen(cache) < 0 ? -1 : 0;
+	}
+	if (mail_cache_map(cache, 0, 0, &data) < 0 ||
+	    mail_cache_header_fields_read(cache) < 0) {
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+
+	/* the dotlock isn't kept between the batches, so the temp file
+	   needs a name that another process compressing the file won't use */
+	fd = mail_index_create_tmp_file(cache->index,
+		t_strdup_printf("%s.%s.%s", cache->filepath,
+				my_hostname, my_pid), &temp_path);
+	if (fd == -1) {
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+	/* the headers are written when finishing */
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&hdr_columns, 0, sizeof(hdr_columns));
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    (cache->write_columns &&
+	     write_full(fd, &hdr_columns, sizeof(hdr_columns)) < 0)) {
+		mail_cache_set_syscall_error(cache, "write()");
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		file_dotlock_delete(&dotlock);
+		return -1;
+	}
+
+	/* the batches are copied to our own temp file, so the dotlock is
+	   needed again only when copying and finishing */
+	file_dotlock_delete(&dotlock);
+
+	view = mail_index_transaction_get_view(trans);
+	pool = pool_alloconly_create("mail cache compress", 1024);
+	state = i_new(struct mail_cache_compress_state, 1);
+	state->pool = pool;
+	state->fd = fd;
+	state->temp_path = i_strdup(temp_path);
+	state->output_offset = sizeof(hdr) +
+		(cache->write_columns ? sizeof(hdr_columns) : 0);
+	state->file_seq = cache->hdr->file_seq;
+	state->last_progress = ioloop_time;
+	state->next_uid = 1;
+	state->messages_count = mail_index_view_get_messages_count(view);
+	i_array_init(&state->msgs, state->messages_count + 16);
+
+	/* the fields aren't modified until finishing, because other
+	   processes may still add them to the old file */
+	mail_cache_copy_init(&state->ctx, cache, pool);
+	state->ctx.used_fields_count =
+		mail_cache_copy_map_fields(cache, view, FALSE,
+					   state->ctx.field_file_map);
+	if (cache->write_columns) {
+		mail_cache_compress_init_columns(&state->ctx,
+						 state->messages_count);
+	}
+	cache->compress_state = state;
+	return 1;
+}
+
+static int
+mail_cache_compress_incr_copy(struct mail_cache *cache,
+			      struct mail_index_view *view)
+{
+	struct mail_cache_compress_state *state = cache->compress_state;
+	struct mail_cache_compress_msg *msg;
+	struct mail_cache_view *cache_view;
+	struct ostream *output;
+	uint32_t seq, seq2, first_new_seq, reset_id;
+	unsigned int count = 0;
+
+	if (state->ctx.fields_count != cache->fields_count)
+		mail_cache_copy_remap_fields(&state->ctx, view, FALSE);
+
+	state->messages_count = mail_index_view_get_messages_count(view);
+	if (!mail_index_lookup_seq_range(view, state->next_uid, (uint32_t)-1,
+					 &seq, &seq2))
+		return 1;
+
+	first_new_seq = mail_cache_get_first_new_seq(view);
+	cache_view = mail_cache_view_open(cache, view);
+	output = o_stream_create_fd_file(state->fd, state->output_offset,
+					 FALSE);
+	for (; seq <= seq2 && count < cache->compress_batch_size; seq++) {
+		msg = array_append_space(&state->msgs);
+		mail_index_lookup_uid(view, seq, &msg->uid);
+		msg->old_offset = mail_cache_lookup_cur_offset(view, seq,
+							       &reset_id);
+		state->ctx.new_msg = seq >= first_new_seq;
+		msg->new_offset = mail_cache_copy_msg(&state->ctx, cache_view,
+						      seq, output);
+		mail_cache_copy_add_column_uid(&state->ctx, msg->uid);
+		state->next_uid = msg->uid + 1;
+		count++;
+	}
+	mail_cache_view_close(&cache_view);
+	state->output_offset = output->offset;
+	if (mail_cache_copy_flush(cache, &output) < 0)
+		return -1;
+	return seq > seq2 ? 1 : 0;
+}
+
+static int
+mail_cache_compress_incr_finish_locked(struct mail_cache *cache,
+				       struct mail_index_transaction *trans,
+				       bool *unlock, struct dotlock **dotlock_r)
+{
+	struct mail_cache_compress_state *state = cache->compress_state;
+	struct mail_cache_copy_context *ctx = &state->ctx;
+	const struct mail_cache_compress_msg *msgs;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_header hdr;
+	struct ostream *output;
+	ARRAY_TYPE(uint32_t) ext_offsets;
+	uint32_t seq, message_count, first_new_seq, uid, reset_id;
+	uint32_t ext_offset, column_pos;
+	unsigned int i, msgs_count;
+	const void *data;
+	int ret;
+
+	ret = mail_cache_compress_has_file_changed(cache,
+			cache->need_compress_file_seq);
+	if (ret != 0) {
+		mail_cache_compress_abort(cache);
+		if (ret < 0)
+			return -1;
+		/* was just compressed, forget this */
+		cache->need_compress_file_seq = 0;
+		if (*unlock) {
+			(void)mail_cache_unlock(cache);
+			*unlock = FALSE;
+		}
+		return mail_cache_reopen(cache) < 0 ? -1 : 0;
+	}
+	if (mail_cache_map(cache, 0, 0, &data) < 0 ||
+	    mail_cache_header_fields_read(cache) < 0)
+		return -1;
+
+	view = mail_index_transaction_get_view(trans);
+	mail_cache_copy_remap_fields(ctx, view, TRUE);
+
+	/* copy the messages that were added or had fields cached since
+	   they were copied */
+	first_new_seq = mail_cache_get_first_new_seq(view);
+	message_count = mail_index_view_get_messages_count(view);
+	cache_view = mail_cache_view_open(cache, view);
+	output = o_stream_create_fd_file(state->fd, state->output_offset,
+					 FALSE);
+	mail_cache_copy_init_header(cache, &hdr);
+
+	msgs = array_get(&state->msgs, &msgs_count);
+	i_array_init(&ext_offsets, message_count);
+	for (seq = 1, i = 0; seq <= message_count; seq++) {
+		if (mail_index_transaction_is_expunged(trans, seq)) {
+			array_append_zero(&ext_offsets);
+			continue;
+		}
+		mail_index_lookup_uid(view, seq, &uid);
+		while (i < msgs_count && msgs[i].uid < uid)
+			i++;
+
+		ctx->new_msg = seq >= first_new_seq;
+		if (uid >= state->next_uid) {
+			/* added after copying was started */
+			ext_offset = mail_cache_copy_msg(ctx, cache_view,
+							 seq, output);
+			mail_cache_copy_add_column_uid(ctx, uid);
+		} else if (i == msgs_count || msgs[i].uid != uid) {
+			/* it was being expunged while it was copied, but
+			   the expunge hasn't happened. just drop its cache,
+			   the columns need to stay in UID order. */
+			ext_offset = 0;
+		} else if (msgs[i].old_offset ==
+			   mail_cache_lookup_cur_offset(view, seq, &reset_id)) {
+			ext_offset = msgs[i].new_offset;
+		} else {
+			/* the old copy is left unused in the new file */
+			if (msgs[i].new_offset != 0) {
+				hdr.deleted_record_count++;
+				ctx->record_count--;
+			}
+			column_pos = ctx->column_pos;
+			ctx->column_pos = i;
+			ext_offset = mail_cache_copy_msg(ctx, cache_view,
+							 seq, output);
+			ctx->column_pos = column_pos;
+		}
+		array_append(&ext_offsets, &ext_offset, 1);
+	}
+	mail_cache_copy_finish(ctx, output, &hdr);
+	mail_cache_view_close(&cache_view);
+
+	ret = mail_cache_copy_flush(cache, &output);
+	if (ret == 0)
+		ret = mail_cache_copy_fsync(cache, state->fd);
+	if (ret == 0) {
+		ret = mail_cache_compress_replace(cache, trans, state->fd,
+						  state->temp_path,
+						  hdr.file_seq, &ext_offsets,
+						  unlock);
+	}
+	array_free(&ext_offsets);
+	if (ret < 0)
+		return -1;
+
+	/* the file is now owned by the cache */
+	state->fd = -1;
+	*dotlock_r = state->dotlock;
+	state->dotlock = NULL;
+	mail_cache_compress_abort(cache);
+
+	if (cache->file_cache != NULL)
+		file_cache_set_fd(cache->file_cache, cache->fd);
+	if (mail_cache_map(cache, 0, 0, &data) < 0)
+		return -1;
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+	cache->need_compress_file_seq = 0;
+	return 0;
+}
+
+static int
+mail_cache_compress_incr_finish(struct mail_cache *cache,
+				struct mail_index_transaction *trans,
+				struct mail_cache_compress_lock **lock_r)
+{
+	struct dotlock *dotlock = NULL;
+	bool unlock = FALSE;
+	int ret;
+
+	switch (mail_cache_try_lock(cache)) {
+	case -1:
+		/* already locked. try again later. */
+		return 0;
+	case 0:
+		/* cache is broken or was just deleted */
+		mail_cache_compress_abort(cache);
+		return -1;
+	default:
+		unlock = TRUE;
+	}
+	if ((ret = mail_cache_compress_incr_lock(cache)) <= 0) {
+		/* give up or try again later. if the file was already
+		   compressed, the next call notices it. */
+		if (ret < 0)
+			mail_cache_compress_abort(cache);
+		(void)mail_cache_unlock(cache);
+		return 0;
+	}
+
+	cache->compressing = TRUE;
+	T_BEGIN {
+		ret = mail_cache_compress_incr_finish_locked(cache, trans,
+							     &unlock, &dotlock);
+	} T_END;
+	cache->compressing = FALSE;
+	if (unlock) {
+		if (mail_cache_unlock(cache) < 0)
+			ret = -1;
+	}
+	if (ret < 0) {
+		if (dotlock != NULL)
+			file_dotlock_delete(&dotlock);
+		mail_cache_compress_abort(cache);
+		(void)mail_cache_header_fields_read(cache);
+		return -1;
+	}
+	*lock_r = i_new(struct mail_cache_compress_lock, 1);
+	(*lock_r)->dotlock = dotlock;
+	return 1;
+}
+
+int mail_cache_compress_incremental(struct mail_cache *cache,
+				    struct mail_index_transaction *trans,
+				    struct mail_cache_compress_lock **lock_r)
+{
+	int ret;
+
+	*lock_r = NULL;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (cache->compress_batch_size == 0 ||
+	    MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly ||
+	    cache->index->lock_method == FILE_LOCK_METHOD_DOTLOCK ||
+	    MAIL_CACHE_IS_UNUSABLE(cache) || cache->map_with_read) {
+		/* the cache lock would be held the whole time with dotlocks,
+		   and an unusable cache has nothing worth copying */
+		return mail_cache_compress(cache, trans, lock_r) < 0 ? -1 : 1;
+	}
+
+	if (cache->compress_state != NULL &&
+	    cache->compress_state->file_seq != cache->hdr->file_seq) {
+		/* someone else replaced the file */
+		mail_cache_compress_abort(cache);
+	}
+	if (cache->compress_state == NULL) {
+		if ((ret = mail_cache_compress_incr_init(cache, trans)) <= 0) {
+			if (ret == 0)
+				*lock_r = i_new(struct mail_cache_compress_lock, 1);
+			return ret < 0 ? -1 : 1;
+		}
+		/* the messages are copied by
+		   mail_cache_compress_incremental_copy() */
+		return 0;
+	}
+	if (!cache->compress_state->copy_finished)
+		return 0;
+	return mail_cache_compress_incr_finish(cache, trans, lock_r);
+}
+
+void mail_cache_compress_incremental_copy(struct mail_cache *cache)
+{
+	struct mail_cache_compress_state *state = cache->compress_state;
+	struct mail_index_view *view;
+	int ret;
+
+	if (state == NULL || state->copy_finished)
+		return;
+	if (MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    cache->hdr->file_seq != state->file_seq) {
+		/* someone else replaced the file */
+		mail_cache_compress_abort(cache);
+		return;
+	}
+
+	if ((ret = mail_cache_compress_incr_lock(cache)) <= 0) {
+		if (ret < 0)
+			mail_cache_compress_abort(cache);
+		return;
+	}
+
+	view = mail_index_view_open(cache->index);
+	T_BEGIN {
+		ret = mail_cache_compress_incr_copy(cache, view);
+	} T_END;
+	mail_index_view_close(&view);
+	file_dotlock_delete(&state->dotlock);
+
+	if (ret < 0)
+		mail_cache_compress_abort(cache);
+	else {
+		state->last_progress = ioloop_time;
+		if (ret > 0)
+			state->copy_finished = TRUE;
+	}
+}
+
+bool mail_cache_compress_get_progress(struct mail_cache *cache,
+				      unsigned int *copied_r,
+				      unsigned int *total_r)
+{
+	const struct mail_cache_compress_state *state = cache->compress_state;
+
+	if (state == NULL)
+		return FALSE;
+	*copied_r = array_count(&state->msgs);
+	*total_r = I_MAX(state->messages_count, *copied_r);
+	return TRUE;
+}
+
 bool mail_cache_need_compress(struct mail_cache *cache)
 {
 	return cache->need_compress_file_seq != 0 &&
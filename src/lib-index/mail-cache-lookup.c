@@ -4,9 +4,11 @@
 #include "array.h"
 #include "buffer.h"
 #include "str.h"
+#include "sort.h"
+#include "bsearch-insert-pos.h"
+#include "mail-index-latency.h"
 #include "mail-cache-private.h"
 
-
 #define CACHE_PREFETCH IO_BLOCK_SIZE
 
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
@@ -54,40 +56,146 @@ int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 	return 0;
 }
 
-uint32_t mail_cache_lookup_cur_offset(struct mail_index_view *view,
-				      uint32_t seq, uint32_t *reset_id_r)
+static int
+mail_cache_columns_read_bitmaps(struct mail_cache *cache, uint32_t uids_count)
 {
-	struct mail_cache *cache = mail_index_view_get_index(view)->cache;
-	struct mail_index_map *map;
+	struct mail_cache_column_info *info;
+	unsigned int bitmap_size = MAIL_CACHE_COLUMN_BITMAP_SIZE(uids_count);
 	const void *data;
 	uint32_t offset;
 
-	mail_index_lookup_ext_full(view, seq, cache->ext_id, &map, &data, NULL);
-	if (data == NULL) {
-		/* no cache offsets */
+	array_foreach_modifiable(&cache->columns, info) {
+		offset = info->values_offset - bitmap_size;
+		if (mail_cache_map(cache, offset, bitmap_size, &data) < 0)
+			return -1;
+		if (offset + bitmap_size > cache->mmap_length) {
+			mail_cache_set_corrupted(cache,
+				"column field %s points outside file",
+				cache->fields[info->field_idx].field.name);
+			return -1;
+		}
+		info->bitmap_pos = cache->column_bitmaps->used;
+		buffer_append(cache->column_bitmaps, data, bitmap_size);
+	}
+	return 0;
+}
+
+static int mail_cache_columns_read(struct mail_cache *cache)
+{
+	const struct mail_cache_header_columns *hdr_columns;
+	const struct mail_cache_column_header *col_hdr;
+	const struct mail_cache_column *cols;
+	struct mail_cache_column_info *info;
+	const void *data;
+	uint32_t offset, uids_count, columns_count;
+	uoff_t size;
+	unsigned int i, field_idx;
+
+	if (cache->columns_file_seq == cache->hdr->file_seq)
+		return 0;
+
+	array_clear(&cache->columns);
+	array_clear(&cache->column_uids);
+	buffer_set_used_size(cache->column_bitmaps, 0);
+	if (cache->hdr->minor_version < MAIL_CACHE_MINOR_VERSION_COLUMNS) {
+		cache->columns_file_seq = cache->hdr->file_seq;
 		return 0;
 	}
-	offset = *((const uint32_t *)data);
-	if (offset == 0)
+
+	offset = sizeof(struct mail_cache_header);
+	if (mail_cache_map(cache, offset, sizeof(*hdr_columns), &data) < 0)
+		return -1;
+	if (offset + sizeof(*hdr_columns) > cache->mmap_length) {
+		mail_cache_set_corrupted(cache, "columns header missing");
+		return -1;
+	}
+	hdr_columns = data;
+	offset = hdr_columns->column_header_offset;
+	if (offset == 0) {
+		cache->columns_file_seq = cache->hdr->file_seq;
 		return 0;
+	}
 
-	if (!mail_index_ext_get_reset_id(view, map, cache->ext_id, reset_id_r))
-		i_unreached();
-	return offset;
+	if (offset % sizeof(uint32_t) != 0) {
+		mail_cache_set_corrupted(cache, "invalid column header offset");
+		return -1;
+	}
+	if (mail_cache_map(cache, offset, sizeof(*col_hdr), &data) < 0)
+		return -1;
+	if (offset + sizeof(*col_hdr) > cache->mmap_length) {
+		mail_cache_set_corrupted(cache,
+			"column header points outside file");
+		return -1;
+	}
+	col_hdr = data;
+	uids_count = col_hdr->uids_count;
+	columns_count = col_hdr->columns_count;
+	if (uids_count == 0) {
+		cache->columns_file_seq = cache->hdr->file_seq;
+		return 0;
+	}
+
+	offset += sizeof(*col_hdr);
+	size = (uoff_t)uids_count * sizeof(uint32_t) +
+		(uoff_t)columns_count * sizeof(*cols);
+	if (offset + size > (uint32_t)-1) {
+		mail_cache_set_corrupted(cache, "columns point outside file");
+		return -1;
+	}
+	if (mail_cache_map(cache, offset, size, &data) < 0)
+		return -1;
+	if (offset + size > cache->mmap_length) {
+		mail_cache_set_corrupted(cache, "columns point outside file");
+		return -1;
+	}
+	array_append(&cache->column_uids, (const uint32_t *)data, uids_count);
+	cols = CONST_PTR_OFFSET(data, uids_count * sizeof(uint32_t));
+
+	for (i = 0; i < columns_count; i++) {
+		if (cols[i].file_field >= cache->file_fields_count) {
+			mail_cache_set_corrupted(cache,
+				"column field index too large (%u >= %u)",
+				cols[i].file_field, cache->file_fields_count);
+			return -1;
+		}
+		field_idx = cache->file_field_map[cols[i].file_field];
+		if (cols[i].field_size == 0 ||
+		    cols[i].field_size != cache->fields[field_idx].field.field_size) {
+			mail_cache_set_corrupted(cache,
+				"column field %s has invalid size %u",
+				cache->fields[field_idx].field.name,
+				cols[i].field_size);
+			return -1;
+		}
+		if (cols[i].offset % sizeof(uint32_t) != 0 ||
+		    (uoff_t)cols[i].offset +
+		    MAIL_CACHE_COLUMN_BITMAP_SIZE(uids_count) +
+		    (uoff_t)uids_count * cols[i].field_size > (uint32_t)-1) {
+			mail_cache_set_corrupted(cache,
+				"column field %s has invalid offset %u",
+				cache->fields[field_idx].field.name,
+				cols[i].offset);
+			return -1;
+		}
+		info = array_append_space(&cache->columns);
+		info->field_idx = field_idx;
+		info->field_size = cols[i].field_size;
+		info->values_offset = cols[i].offset +
+			MAIL_CACHE_COLUMN_BITMAP_SIZE(uids_count);
+	}
+	/* cols may point to a read buffer that the mapping replaces */
+	if (mail_cache_columns_read_bitmaps(cache, uids_count) < 0)
+		return -1;
+	cache->columns_file_seq = cache->hdr->file_seq;
+	return 0;
 }
 
 static int
-mail_cache_lookup_offset(struct mail_cache *cache, struct mail_index_view *view,
-			 uint32_t seq, uint32_t *offset_r)
+mail_cache_verify_reset_id(struct mail_cache *cache, uint32_t reset_id)
 {
-	uint32_t offset, reset_id;
 	int i, ret;
 
-	offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
-	if (offset == 0)
-		return 0;
-
-	/* reset_id must match file_seq or the offset is for a different cache
+	/* reset_id must match file_seq or the data is for a different cache
 	   file. if this happens, try if reopening the cache helps. if not,
 	   it was probably for an old cache file that's already lost by now. */
 	i = 0;
@@ -105,7 +213,171 @@ mail_cache_lookup_offset(struct mail_cache *cache, struct mail_index_view *view,
 			return ret;
 		}
 	}
+	return 1;
+}
+
+int mail_cache_column_lookup_pos(struct mail_cache_view *view, uint32_t seq,
+				 uint32_t *pos_r)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_index_map *map;
+	const uint32_t *uids;
+	const void *data;
+	uint32_t uid, reset_id;
+	unsigned int idx, count;
+	int ret;
+
+	if (MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    seq > mail_index_view_get_messages_count(view->view))
+		return 0;
+
+	/* The columns are matched by UID, so they can be used only if the
+	   index still refers to this cache file. After a cache reset or an
+	   index rebuild the UIDs may belong to different messages. */
+	mail_index_lookup_ext_full(view->view, seq, cache->ext_id,
+				   &map, &data, NULL);
+	if (!mail_index_ext_get_reset_id(view->view, map, cache->ext_id,
+					 &reset_id))
+		return 0;
+	if ((ret = mail_cache_verify_reset_id(cache, reset_id)) <= 0)
+		return ret;
+
+	if (mail_cache_columns_read(cache) < 0)
+		return -1;
+	if (array_count(&cache->columns) == 0)
+		return 0;
+
+	mail_index_lookup_uid(view->view, seq, &uid);
+	uids = array_get(&cache->column_uids, &count);
+
+	/* the same message's fields are usually looked up one after another,
+	   and messages in ascending order */
+	for (idx = view->column_last_pos;
+	     idx < count && idx <= view->column_last_pos + 1; idx++) {
+		if (uids[idx] == uid) {
+			*pos_r = view->column_last_pos = idx;
+			return 1;
+		}
+	}
+	if (!bsearch_insert_pos(&uid, uids, count, sizeof(uint32_t),
+				uint32_cmp, &idx))
+		return 0;
+	*pos_r = view->column_last_pos = idx;
+	return 1;
+}
+
+static const struct mail_cache_column_info *
+mail_cache_column_find(struct mail_cache *cache, unsigned int field_idx)
+{
+	const struct mail_cache_column_info *col;
+
+	array_foreach(&cache->columns, col) {
+		if (col->field_idx == field_idx)
+			return col;
+	}
+	return NULL;
+}
+
+static bool
+mail_cache_column_is_set(struct mail_cache *cache,
+			 const struct mail_cache_column_info *col, uint32_t pos)
+{
+	const unsigned char *bitmap =
+		CONST_PTR_OFFSET(cache->column_bitmaps->data, col->bitmap_pos);
+
+	return (bitmap[pos / 8] & (1 << (pos % 8))) != 0;
+}
+
+static int
+mail_cache_column_get_value(struct mail_cache *cache,
+			    const struct mail_cache_column_info *col,
+			    uint32_t pos, const void **data_r, uoff_t *offset_r)
+{
+	uoff_t offset;
+
+	/* the following messages' values are likely looked up next */
+	offset = col->values_offset + (uoff_t)pos * col->field_size;
+	if (mail_cache_map(cache, offset, col->field_size + CACHE_PREFETCH,
+			   data_r) < 0)
+		return -1;
+	if (offset + col->field_size > cache->mmap_length) {
+		mail_cache_set_corrupted(cache, "column points outside file");
+		return -1;
+	}
+	*offset_r = offset;
+	return 0;
+}
+
+/* Look up the field directly from the columns without going through all the
+   fields cached for the message. Returns 1 if found, 0 if the field isn't
+   in the columns for the message, -1 if error. data_r and size_r may be
+   NULL when only checking if the field exists. */
+static int
+mail_cache_column_lookup_field(struct mail_cache_view *view, uint32_t seq,
+			       unsigned int field_idx, const void **data_r,
+			       unsigned int *size_r)
+{
+	struct mail_cache *cache = view->cache;
+	const struct mail_cache_column_info *col;
+	uoff_t offset;
+	uint32_t pos;
+	int ret;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	/* this may reopen the cache file, so look up the column only after
+	   it */
+	if ((ret = mail_cache_column_lookup_pos(view, seq, &pos)) <= 0)
+		return ret;
+	if ((col = mail_cache_column_find(cache, field_idx)) == NULL)
+		return 0;
+	if (!mail_cache_column_is_set(cache, col, pos))
+		return 0;
+
+	if (data_r != NULL) {
+		if (mail_cache_column_get_value(cache, col, pos,
+						data_r, &offset) < 0)
+			return -1;
+		*size_r = col->field_size;
+	}
+	return 1;
+}
+
+uint32_t mail_cache_lookup_cur_offset(struct mail_index_view *view,
+				      uint32_t seq, uint32_t *reset_id_r)
+{
+	struct mail_cache *cache = mail_index_view_get_index(view)->cache;
+	struct mail_index_map *map;
+	const void *data;
+	uint32_t offset;
+
+	mail_index_lookup_ext_full(view, seq, cache->ext_id, &map, &data, NULL);
+	if (data == NULL) {
+		/* no cache offsets */
+		return 0;
+	}
+	offset = *((const uint32_t *)data);
+	if (offset == 0)
+		return 0;
+
+	if (!mail_index_ext_get_reset_id(view, map, cache->ext_id, reset_id_r))
+		i_unreached();
+	return offset;
+}
+
+static int
+mail_cache_lookup_offset(struct mail_cache *cache, struct mail_index_view *view,
+			 uint32_t seq, uint32_t *offset_r)
+{
+	uint32_t offset, reset_id;
+	int ret;
+
+	offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
+	if (offset == 0)
+		return 0;
 
+	if ((ret = mail_cache_verify_reset_id(cache, reset_id)) <= 0)
+		return ret;
 	*offset_r = offset;
 	return 1;
 }
@@ -157,6 +429,13 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 			ctx->failed = ret < 0;
 		}
 	}
+	if (!ctx->failed) {
+		ret = mail_cache_column_lookup_pos(view, seq, &ctx->column_pos);
+		if (ret < 0)
+			ctx->failed = TRUE;
+		else if (ret > 0)
+			ctx->column_count = array_count(&view->cache->columns);
+	}
 	ctx->remap_counter = view->cache->remap_counter;
 
 	memset(&view->loop_track, 0, sizeof(view->loop_track));
@@ -232,6 +511,33 @@ mail_cache_lookup_iter_next_record(struct mail_cache_lookup_iterate_ctx *ctx)
 	return 1;
 }
 
+static int
+mail_cache_lookup_iter_next_column(struct mail_cache_lookup_iterate_ctx *ctx,
+				   struct mail_cache_iterate_field *field_r)
+{
+	struct mail_cache *cache = ctx->view->cache;
+	const struct mail_cache_column_info *col;
+
+	for (; ctx->column_idx < ctx->column_count; ctx->column_idx++) {
+		col = array_idx(&cache->columns, ctx->column_idx);
+		if (!mail_cache_column_is_set(cache, col, ctx->column_pos))
+			continue;
+
+		if (mail_cache_column_get_value(cache, col, ctx->column_pos,
+						&field_r->data,
+						&field_r->offset) < 0)
+			return -1;
+		ctx->remap_counter = cache->remap_counter;
+
+		field_r->field_idx = col->field_idx;
+		field_r->size = col->field_size;
+		ctx->column_idx++;
+		return 1;
+	}
+	ctx->remap_counter = cache->remap_counter;
+	return 0;
+}
+
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r)
 {
@@ -241,6 +547,10 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 	uint32_t file_field;
 	int ret;
 
+	if (ctx->column_idx < ctx->column_count) {
+		if ((ret = mail_cache_lookup_iter_next_column(ctx, field_r)) != 0)
+			return ret;
+	}
 	i_assert(ctx->remap_counter == cache->remap_counter);
 
 	if (ctx->pos + sizeof(uint32_t) > ctx->rec_size) {
@@ -337,6 +647,7 @@ int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 			    unsigned int field)
 {
 	const uint8_t *data;
+	int ret;
 
 	i_assert(seq > 0);
 
@@ -346,6 +657,12 @@ int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 	if (!mail_cache_file_has_field(view->cache, field))
 		return 0;
 
+	/* fields in columns can be checked without going through all the
+	   fields cached for the message */
+	if ((ret = mail_cache_column_lookup_field(view, seq, field,
+						  NULL, NULL)) != 0)
+		return ret;
+
 	/* FIXME: we should discard the cache if view has been synced */
 	if (view->cached_exists_seq != seq) {
 		if (mail_cache_seq(view, seq) < 0)
@@ -359,9 +676,11 @@ int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 
 bool mail_cache_field_exists_any(struct mail_cache_view *view, uint32_t seq)
 {
-	uint32_t reset_id;
+	uint32_t reset_id, pos;
 
-	return mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0;
+	if (mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0)
+		return TRUE;
+	return mail_cache_column_lookup_pos(view, seq, &pos) > 0;
 }
 
 enum mail_cache_decision_type
@@ -401,15 +720,26 @@ mail_cache_lookup_bitmask(struct mail_cache_lookup_iterate_ctx *iter,
 	return ret < 0 ? -1 : (found ? 1 : 0);
 }
 
-int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
-			    uint32_t seq, unsigned int field_idx)
+static int
+mail_cache_lookup_field_real(struct mail_cache_view *view, buffer_t *dest_buf,
+			     uint32_t seq, unsigned int field_idx)
 {
 	const struct mail_cache_field *field_def;
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
+	const void *data;
+	unsigned int size;
 	int ret;
 
-	ret = mail_cache_field_exists(view, seq, field_idx);
+	ret = mail_cache_column_lookup_field(view, seq, field_idx,
+					     &data, &size);
+	if (ret > 0) {
+		buffer_append(dest_buf, data, size);
+		mail_cache_decision_state_update(view, seq, field_idx);
+		return 1;
+	}
+	if (ret == 0)
+		ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
 	if (ret <= 0)
 		return ret;
@@ -434,6 +764,18 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	return ret;
 }
 
+int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
+			    uint32_t seq, unsigned int field_idx)
+{
+	struct timeval start;
+	int ret;
+
+	mail_index_latency_start(&start);
+	ret = mail_cache_lookup_field_real(view, dest_buf, seq, field_idx);
+	mail_index_latency_end(MAIL_INDEX_LATENCY_CACHE_LOOKUP, &start);
+	return ret;
+}
+
 struct header_lookup_data {
 	uint32_t data_size;
 	const unsigned char *data;
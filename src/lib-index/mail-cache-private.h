@@ -7,6 +7,11 @@
 
 #define MAIL_CACHE_MAJOR_VERSION 1
 #define MAIL_CACHE_MINOR_VERSION 1
+/* Files with this minor version may contain fixed size fields stored in
+   per-field columns instead of the records. Older versions simply ignore
+   the columns. Variable size fields (headers) are still stored in the
+   records uncompressed, see TODO. */
+#define MAIL_CACHE_MINOR_VERSION_COLUMNS 2
 
 /* Drop fields that haven't been accessed for n seconds */
 #define MAIL_CACHE_FIELD_DROP_SECS (3600*24*30)
@@ -14,6 +19,10 @@
 /* Never compress the file if it's smaller than this */
 #define MAIL_CACHE_COMPRESS_MIN_SIZE (1024*32)
 
+/* Give up incremental compression if no batch could be copied for this
+   many seconds */
+#define MAIL_CACHE_COMPRESS_INCR_TIMEOUT_SECS (60*5)
+
 /* Compress the file when n% of records are deleted */
 #define MAIL_CACHE_COMPRESS_DELETE_PERCENTAGE 20
 
@@ -56,6 +65,40 @@ struct mail_cache_header {
 	uint32_t field_header_offset;
 };
 
+/* Written right after struct mail_cache_header when the file is compressed
+   with columns enabled. It's used only when minor_version >=
+   MAIL_CACHE_MINOR_VERSION_COLUMNS. It's not part of mail_cache_header,
+   because the header is written back with its old size by versions that
+   don't know about it. It's never modified after compression. */
+struct mail_cache_header_columns {
+	/* offset to struct mail_cache_column_header, 0 if none */
+	uint32_t column_header_offset;
+};
+
+struct mail_cache_column_header {
+	uint32_t uids_count;
+	uint32_t columns_count;
+#if 0
+	/* UIDs of the messages that existed when the columns were written,
+	   in ascending order. A message's position in the columns is its
+	   index in this array. */
+	uint32_t uids[uids_count];
+	struct mail_cache_column columns[columns_count];
+#endif
+};
+
+struct mail_cache_column {
+	uint32_t file_field;
+	uint32_t field_size;
+	/* Offset to a bitmap of uids_count bits telling which messages have
+	   the field cached. It's followed by 32bit aligned
+	   uids_count * field_size bytes of values. */
+	uint32_t offset;
+};
+
+#define MAIL_CACHE_COLUMN_BITMAP_SIZE(uids_count) \
+	((((uids_count) + 7) / 8 + 3) & ~3U)
+
 struct mail_cache_header_fields {
 	uint32_t next_offset;
 	uint32_t size;
@@ -93,6 +136,14 @@ struct mail_cache_record {
 	/* array of { uint32_t field; [ uint32_t size; ] { .. } } */
 };
 
+struct mail_cache_column_info {
+	unsigned int field_idx;
+	unsigned int field_size;
+	/* offset to the presence bitmap in cache->column_bitmaps */
+	unsigned int bitmap_pos;
+	uint32_t values_offset;
+};
+
 struct mail_cache_field_private {
 	struct mail_cache_field field;
 
@@ -152,6 +203,21 @@ struct mail_cache {
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
 
+	/* copy at most this many messages per incremental compression step,
+	   0 = compress everything at once */
+	unsigned int compress_batch_size;
+	struct mail_cache_compress_state *compress_state;
+
+	/* Columns of the currently open file. They're read lazily, so
+	   columns_file_seq tells for which file they were read (0 = none).
+	   They don't change after the file is written, so the UIDs and the
+	   presence bitmaps are kept in memory. Only the values are read from
+	   the file. */
+	uint32_t columns_file_seq;
+	ARRAY_TYPE(uint32_t) column_uids;
+	buffer_t *column_bitmaps;
+	ARRAY(struct mail_cache_column_info) columns;
+
 	unsigned int opened:1;
 	unsigned int locked:1;
 	unsigned int last_lock_failed:1;
@@ -159,6 +225,8 @@ struct mail_cache {
 	unsigned int field_header_write_pending:1;
 	unsigned int compressing:1;
 	unsigned int map_with_read:1;
+	/* write fixed size fields to columns when compressing */
+	unsigned int write_columns:1;
 };
 
 struct mail_cache_loop_track {
@@ -182,6 +250,8 @@ struct mail_cache_view {
 	buffer_t *cached_exists_buf;
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
+	/* position in columns that was last looked up */
+	uint32_t column_last_pos;
 
 	unsigned int no_decision_updates:1;
 };
@@ -203,6 +273,9 @@ struct mail_cache_lookup_iterate_ctx {
 	uint32_t offset;
 
 	unsigned int trans_next_idx;
+	/* columns are returned before the records */
+	uint32_t column_pos;
+	unsigned int column_idx, column_count;
 
 	unsigned int stop:1;
 	unsigned int failed:1;
@@ -232,6 +305,10 @@ uint32_t mail_cache_lookup_cur_offset(struct mail_index_view *view,
 				      uint32_t seq, uint32_t *reset_id_r);
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r);
+/* Look up the message's position in the cache file's columns. Returns 1 if
+   found, 0 if the message isn't in the columns, -1 if error. */
+int mail_cache_column_lookup_pos(struct mail_cache_view *view, uint32_t seq,
+				 uint32_t *pos_r);
 uint32_t mail_cache_get_first_new_seq(struct mail_index_view *view);
 
 /* Returns TRUE if offset..size area has been tracked before.
@@ -255,6 +332,8 @@ int mail_cache_map(struct mail_cache *cache, size_t offset, size_t size,
 		   const void **data_r);
 void mail_cache_file_close(struct mail_cache *cache);
 int mail_cache_reopen(struct mail_cache *cache);
+/* Stop an incremental compression and delete its temp file. */
+void mail_cache_compress_abort(struct mail_cache *cache);
 
 /* Notify the decision handling code that field was looked up for seq.
    This should be called even for fields that aren't currently in cache file */
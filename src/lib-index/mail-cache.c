@@ -67,6 +67,7 @@ void mail_cache_file_close(struct mail_cache *cache)
 	cache->hdr = NULL;
 	cache->mmap_length = 0;
 	cache->last_field_header_offset = 0;
+	cache->columns_file_seq = 0;
 
 	if (cache->file_lock != NULL)
 		file_lock_free(&cache->file_lock);
@@ -518,6 +519,9 @@ static struct mail_cache *mail_cache_alloc(struct mail_index *index)
 	cache->field_pool = pool_alloconly_create("Cache fields", 2048);
 	hash_table_create(&cache->field_name_hash, cache->field_pool, 0,
 			  strcase_hash, strcasecmp);
+	i_array_init(&cache->columns, 8);
+	i_array_init(&cache->column_uids, 64);
+	cache->column_bitmaps = buffer_create_dynamic(default_pool, 64);
 
 	cache->dotlock_settings.use_excl_lock =
 		(index->flags & MAIL_INDEX_OPEN_FLAG_DOTLOCK_USE_EXCL) != 0;
@@ -557,12 +561,16 @@ void mail_cache_free(struct mail_cache **_cache)
 	if (cache->file_cache != NULL)
 		file_cache_free(&cache->file_cache);
 
+	mail_cache_compress_abort(cache);
 	mail_index_unregister_expunge_handler(cache->index, cache->ext_id);
 	mail_cache_file_close(cache);
 
 	if (cache->read_buf != NULL)
 		buffer_free(&cache->read_buf);
 	hash_table_destroy(&cache->field_name_hash);
+	array_free(&cache->columns);
+	array_free(&cache->column_uids);
+	buffer_free(&cache->column_bitmaps);
 	pool_unref(&cache->field_pool);
 	i_free(cache->field_file_map);
 	i_free(cache->file_field_map);
@@ -571,6 +579,17 @@ void mail_cache_free(struct mail_cache **_cache)
 	i_free(cache);
 }
 
+void mail_cache_set_columns(struct mail_cache *cache, bool set)
+{
+	cache->write_columns = set;
+}
+
+void mail_cache_set_compress_batch_size(struct mail_cache *cache,
+					unsigned int count)
+{
+	cache->compress_batch_size = count;
+}
+
 static int mail_cache_lock_file(struct mail_cache *cache, bool nonblock)
 {
 	unsigned int timeout_secs;
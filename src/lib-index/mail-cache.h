@@ -63,6 +63,14 @@ const struct mail_cache_field *
 mail_cache_register_get_list(struct mail_cache *cache, pool_t pool,
 			     unsigned int *count_r);
 
+/* Write fixed size fields to per-field columns when the cache is compressed.
+   This makes looking up the same field for many messages faster. */
+void mail_cache_set_columns(struct mail_cache *cache, bool set);
+/* Compress the cache in batches of this many messages during index syncs
+   instead of locking the cache for the whole compression. 0 disables. */
+void mail_cache_set_compress_batch_size(struct mail_cache *cache,
+					unsigned int count);
+
 /* Returns TRUE if cache should be compressed. */
 bool mail_cache_need_compress(struct mail_cache *cache);
 /* Compress cache file. Offsets are updated to given transaction. The cache
@@ -74,6 +82,29 @@ int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans,
 			struct mail_cache_compress_lock **lock_r);
 void mail_cache_compress_unlock(struct mail_cache_compress_lock **lock);
+/* Compress the cache file in steps. The first call starts the compression,
+   after which mail_cache_compress_incremental_copy() copies the messages in
+   batches to a temporary file. The call after all messages are copied locks
+   the cache, copies again the messages that were added or changed in the
+   meantime and replaces the file. Returns 1 when the compression is finished
+   and lock_r is set the same way as with mail_cache_compress(), 0 if more
+   calls are needed, -1 on error. Without a batch size this is the same as
+   mail_cache_compress(). If the compression can't continue for
+   MAIL_CACHE_COMPRESS_INCR_TIMEOUT_SECS because someone else keeps it
+   locked, it's given up. */
+int mail_cache_compress_incremental(struct mail_cache *cache,
+				    struct mail_index_transaction *trans,
+				    struct mail_cache_compress_lock **lock_r);
+/* Copy the next batch of messages for an incremental compression. This
+   neither locks the cache nor needs the index to be locked, so it should be
+   called after the index sync is finished to avoid making other processes
+   wait for it. */
+void mail_cache_compress_incremental_copy(struct mail_cache *cache);
+/* Returns TRUE and the number of copied messages if incremental compression
+   is in progress. */
+bool mail_cache_compress_get_progress(struct mail_cache *cache,
+				      unsigned int *copied_r,
+				      unsigned int *total_r);
 /* Returns TRUE if there is at least something in the cache. */
 bool mail_cache_exists(struct mail_cache *cache);
 /* Open and read cache header. Returns 0 if ok, -1 if error/corrupted. */
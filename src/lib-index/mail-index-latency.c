@@ -0,0 +1,45 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "time-util.h"
+#include "mail-index-latency.h"
+
+struct mail_index_latency_histogram
+mail_index_latencies[MAIL_INDEX_LATENCY_TYPE_COUNT];
+
+unsigned int mail_index_latency_bucket(uint64_t usecs)
+{
+	unsigned int bucket;
+
+	if (usecs == 0)
+		return 0;
+	/* 4^n <= usecs < 4^(n+1) */
+	bucket = (bits_required64(usecs) - 1) / 2;
+	return I_MIN(bucket, MAIL_INDEX_LATENCY_BUCKET_COUNT - 1);
+}
+
+void mail_index_latency_add(enum mail_index_latency_type type,
+			    uint64_t usecs)
+{
+	struct mail_index_latency_histogram *hist;
+
+	i_assert(type < MAIL_INDEX_LATENCY_TYPE_COUNT);
+
+	hist = &mail_index_latencies[type];
+	hist->count++;
+	hist->usecs += usecs;
+	hist->buckets[mail_index_latency_bucket(usecs)]++;
+}
+
+void mail_index_latency_end(enum mail_index_latency_type type,
+			    const struct timeval *start)
+{
+	struct timeval now;
+	long long usecs;
+
+	(void)gettimeofday(&now, NULL);
+	usecs = timeval_diff_usecs(&now, start);
+	/* the clock may have been moved backwards */
+	mail_index_latency_add(type, usecs < 0 ? 0 : usecs);
+}
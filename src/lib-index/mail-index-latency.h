@@ -0,0 +1,56 @@
+#ifndef MAIL_INDEX_LATENCY_H
+#define MAIL_INDEX_LATENCY_H
+
+#include <sys/time.h>
+
+enum mail_index_latency_type {
+	/* mail_index_sync_begin*() */
+	MAIL_INDEX_LATENCY_INDEX_SYNC = 0,
+	/* mail_index_view_sync_begin() */
+	MAIL_INDEX_LATENCY_VIEW_SYNC,
+	/* mail_cache_lookup_field() */
+	MAIL_INDEX_LATENCY_CACHE_LOOKUP,
+	/* mail_transaction_log_append_commit() */
+	MAIL_INDEX_LATENCY_LOG_APPEND,
+	/* Waiting for the transaction log lock. This time is also included
+	   in the index sync and log append latencies, so subtracting it from
+	   them leaves the time spent on I/O and CPU. */
+	MAIL_INDEX_LATENCY_LOG_LOCK,
+
+	MAIL_INDEX_LATENCY_TYPE_COUNT
+};
+
+/* Bucket n contains the operations that took less than 4^(n+1) usecs and
+   weren't counted in earlier buckets. The last bucket contains all the
+   rest (>= 262 ms). The stats plugin exports each bucket as a separate
+   field, so update its field names when changing this. */
+#define MAIL_INDEX_LATENCY_BUCKET_COUNT 10
+
+struct mail_index_latency_histogram {
+	uint32_t count;
+	uint64_t usecs;
+	uint32_t buckets[MAIL_INDEX_LATENCY_BUCKET_COUNT];
+};
+
+/* Latencies of all the indexes accessed by this process since it
+   started. They aren't tracked per user, so in processes that serve
+   multiple users (e.g. lmtp, indexer-worker) the difference between two
+   snapshots includes the latencies of all the users that were served
+   in between. */
+extern struct mail_index_latency_histogram
+mail_index_latencies[MAIL_INDEX_LATENCY_TYPE_COUNT];
+
+static inline void mail_index_latency_start(struct timeval *start_r)
+{
+	(void)gettimeofday(start_r, NULL);
+}
+/* Add the time elapsed since mail_index_latency_start() to the histogram. */
+void mail_index_latency_end(enum mail_index_latency_type type,
+			    const struct timeval *start);
+void mail_index_latency_add(enum mail_index_latency_type type,
+			    uint64_t usecs);
+
+/* Returns the histogram bucket for the given latency. */
+unsigned int mail_index_latency_bucket(uint64_t usecs);
+
+#endif
@@ -1,20 +1,18 @@
 /* Copyright (c) 2003-2016 Dovecot authors, see the included COPYING file */
 
 /*
-   Locking should never fail or timeout. Exclusive locks must be kept as short
-   time as possible. Shared locks can be long living, so if we can't get
-   exclusive lock directly, we'll recreate the index. That means the shared
-   lock holders can keep using the old file.
-
-   lock_id is used to figure out if acquired lock is still valid. When index
-   file is reopened, the lock_id can become invalid. It doesn't matter however,
-   as no-one's going to modify the old file anymore.
-
-   lock_id also tells us if we're referring to a shared or an exclusive lock.
-   This allows us to drop back to shared locking once all exclusive locks
-   are dropped. Shared locks have even numbers, exclusive locks have odd numbers.
-   The number is increased by two every time the lock is dropped or index file
-   is reopened.
+   The main index file is never locked. It's never modified after it has been
+   written either: writers create a new file and rename() it over the old one
+   (see mail_index_recreate()). So a reader always sees a consistent snapshot
+   through its fd, and it notices a newer file by comparing the path's inode
+   to its fd's. Readers therefore never wait for writers, and they don't need
+   a generation counter or a seqlock to detect torn reads. The only retries
+   are for ESTALE errors on NFS, where an old file's data may vanish under
+   an open fd.
+
+   Writers are serialized by the transaction log's lock. The cache file is
+   locked separately while it's being written to. Both go through
+   mail_index_lock_fd().
 */
 
 #include "lib.h"
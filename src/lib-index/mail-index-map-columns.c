@@ -0,0 +1,322 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "cpu-features.h"
+#include "mail-index-private.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
+
+/* Without SIMD the flags column is scanned 8 bytes at a time. */
+#define FLAGS_WORD_SIZE sizeof(uint64_t)
+#define FLAGS_WORD_REPEAT(c) ((uint64_t)(c) * 0x0101010101010101ULL)
+
+/* Returns the first index in [i, end) where (column[idx] & flags_mask) ==
+   flags, or end if there are none. */
+typedef unsigned int
+mail_index_flags_find_t(const uint8_t *column, unsigned int i,
+			unsigned int end, uint8_t flags, uint8_t flags_mask);
+/* Returns the number of such indexes in [i, end). */
+typedef unsigned int
+mail_index_flags_count_t(const uint8_t *column, unsigned int i,
+			 unsigned int end, uint8_t flags, uint8_t flags_mask);
+
+static mail_index_flags_find_t mail_index_flags_find_init;
+static mail_index_flags_count_t mail_index_flags_count_init;
+static mail_index_flags_find_t *mail_index_flags_find =
+	mail_index_flags_find_init;
+static mail_index_flags_count_t *mail_index_flags_count =
+	mail_index_flags_count_init;
+
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map)
+{
+	i_free_and_null(rec_map->column_uids);
+	i_free_and_null(rec_map->column_flags);
+	rec_map->columns_count = 0;
+	rec_map->columns_alloc_count = 0;
+}
+
+void mail_index_map_columns_invalidate(struct mail_index_map *map,
+				       uint32_t seq)
+{
+	i_assert(seq > 0);
+
+	if (map->rec_map->columns_count >= seq)
+		map->rec_map->columns_count = seq - 1;
+}
+
+static void mail_index_map_columns_update(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	const struct mail_index_record *rec;
+	unsigned int i, count = map->hdr.messages_count;
+
+	i_assert(count <= rec_map->records_count);
+
+	if (rec_map->columns_count >= count)
+		return;
+
+	if (count > rec_map->columns_alloc_count) {
+		unsigned int old_count = rec_map->columns_alloc_count;
+		unsigned int new_count = nearest_power(count);
+
+		rec_map->column_uids =
+			i_realloc(rec_map->column_uids,
+				  old_count * sizeof(uint32_t),
+				  new_count * sizeof(uint32_t));
+		rec_map->column_flags =
+			i_realloc(rec_map->column_flags, old_count, new_count);
+		rec_map->columns_alloc_count = new_count;
+	}
+
+	for (i = rec_map->columns_count; i < count; i++) {
+		rec = MAIL_INDEX_MAP_IDX(map, i);
+		rec_map->column_uids[i] = rec->uid;
+		rec_map->column_flags[i] = rec->flags;
+	}
+	rec_map->columns_count = count;
+}
+
+void mail_index_map_get_columns(struct mail_index_map *map,
+				const uint32_t **uids_r,
+				const uint8_t **flags_r)
+{
+	mail_index_map_columns_update(map);
+	*uids_r = map->rec_map->column_uids;
+	*flags_r = map->rec_map->column_flags;
+}
+
+static inline uint64_t
+flags_word_match(const uint8_t *data, uint8_t flags, uint8_t flags_mask)
+{
+	const uint64_t low7 = FLAGS_WORD_REPEAT(0x7f);
+	uint64_t word, diff;
+
+	memcpy(&word, data, sizeof(word));
+	/* diff has a zero byte for each matching message */
+	diff = (word & FLAGS_WORD_REPEAT(flags_mask)) ^ FLAGS_WORD_REPEAT(flags);
+	/* set the high bit of each zero byte and clear all the other bits */
+	return ~(((diff & low7) + low7) | diff | low7);
+}
+
+static unsigned int
+mail_index_flags_find_swar(const uint8_t *column, unsigned int i,
+			   unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	unsigned int j;
+
+	while (i < end) {
+		if (i % FLAGS_WORD_SIZE != 0 || end - i < FLAGS_WORD_SIZE) {
+			if ((column[i] & flags_mask) == flags)
+				return i;
+			i++;
+		} else if (flags_word_match(column + i, flags,
+					    flags_mask) == 0) {
+			i += FLAGS_WORD_SIZE;
+		} else {
+			for (j = i; (column[j] & flags_mask) != flags; j++) ;
+			return j;
+		}
+	}
+	return end;
+}
+
+static unsigned int
+mail_index_flags_count_swar(const uint8_t *column, unsigned int i,
+			    unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	unsigned int count = 0;
+	uint64_t matches;
+
+	while (i < end) {
+		if (i % FLAGS_WORD_SIZE != 0 || end - i < FLAGS_WORD_SIZE) {
+			if ((column[i] & flags_mask) == flags)
+				count++;
+			i++;
+		} else {
+			matches = flags_word_match(column + i, flags,
+						   flags_mask) >> 7;
+			/* sum the 0/1 bytes into the highest byte */
+			count += (matches * FLAGS_WORD_REPEAT(1)) >> 56;
+			i += FLAGS_WORD_SIZE;
+		}
+	}
+	return count;
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* The SIMD versions compare 16 or 32 flags at a time. The byte compare
+   results are collected into a bitmask of the matching messages. */
+__attribute__((target("sse2")))
+static unsigned int
+mail_index_flags_find_sse2(const uint8_t *column, unsigned int i,
+			   unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	const __m128i mask = _mm_set1_epi8((char)flags_mask);
+	const __m128i want = _mm_set1_epi8((char)flags);
+	unsigned int matches;
+
+	for (; end - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const void *)(column + i));
+
+		matches = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_and_si128(in, mask), want));
+		if (matches != 0)
+			return i + __builtin_ctz(matches);
+	}
+	return mail_index_flags_find_swar(column, i, end, flags, flags_mask);
+}
+
+__attribute__((target("sse2")))
+static unsigned int
+mail_index_flags_count_sse2(const uint8_t *column, unsigned int i,
+			    unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	const __m128i mask = _mm_set1_epi8((char)flags_mask);
+	const __m128i want = _mm_set1_epi8((char)flags);
+	unsigned int count = 0;
+
+	for (; end - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const void *)(column + i));
+
+		count += __builtin_popcount(_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_and_si128(in, mask), want)));
+	}
+	return count + mail_index_flags_count_swar(column, i, end,
+						   flags, flags_mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+mail_index_flags_find_avx2(const uint8_t *column, unsigned int i,
+			   unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	const __m256i mask = _mm256_set1_epi8((char)flags_mask);
+	const __m256i want = _mm256_set1_epi8((char)flags);
+	unsigned int matches;
+
+	for (; end - i >= 32; i += 32) {
+		__m256i in = _mm256_loadu_si256((const void *)(column + i));
+
+		matches = _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(in, mask), want));
+		if (matches != 0) {
+			_mm256_zeroupper();
+			return i + __builtin_ctz(matches);
+		}
+	}
+	/* avoid AVX-SSE transition penalties in the non-AVX code */
+	_mm256_zeroupper();
+	return mail_index_flags_find_sse2(column, i, end, flags, flags_mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+mail_index_flags_count_avx2(const uint8_t *column, unsigned int i,
+			    unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	const __m256i mask = _mm256_set1_epi8((char)flags_mask);
+	const __m256i want = _mm256_set1_epi8((char)flags);
+	unsigned int count = 0;
+
+	for (; end - i >= 32; i += 32) {
+		__m256i in = _mm256_loadu_si256((const void *)(column + i));
+
+		count += __builtin_popcount(_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(in, mask), want)));
+	}
+	_mm256_zeroupper();
+	return count + mail_index_flags_count_sse2(column, i, end,
+						   flags, flags_mask);
+}
+#endif
+
+bool mail_index_flags_scan_set_impl(enum mail_index_flags_scan_impl impl)
+{
+	switch (impl) {
+	case MAIL_INDEX_FLAGS_SCAN_IMPL_SWAR:
+		mail_index_flags_find = mail_index_flags_find_swar;
+		mail_index_flags_count = mail_index_flags_count_swar;
+		return TRUE;
+	case MAIL_INDEX_FLAGS_SCAN_IMPL_SSE2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2)) {
+			mail_index_flags_find = mail_index_flags_find_sse2;
+			mail_index_flags_count = mail_index_flags_count_sse2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	case MAIL_INDEX_FLAGS_SCAN_IMPL_AVX2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2)) {
+			mail_index_flags_find = mail_index_flags_find_avx2;
+			mail_index_flags_count = mail_index_flags_count_avx2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void mail_index_flags_scan_set_best_impl(void)
+{
+	if (mail_index_flags_scan_set_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_AVX2) ||
+	    mail_index_flags_scan_set_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_SSE2))
+		return;
+	(void)mail_index_flags_scan_set_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_SWAR);
+}
+
+static unsigned int
+mail_index_flags_find_init(const uint8_t *column, unsigned int i,
+			   unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	mail_index_flags_scan_set_best_impl();
+	return mail_index_flags_find(column, i, end, flags, flags_mask);
+}
+
+static unsigned int
+mail_index_flags_count_init(const uint8_t *column, unsigned int i,
+			    unsigned int end, uint8_t flags, uint8_t flags_mask)
+{
+	mail_index_flags_scan_set_best_impl();
+	return mail_index_flags_count(column, i, end, flags, flags_mask);
+}
+
+uint32_t mail_index_map_find_flags(struct mail_index_map *map,
+				   uint32_t first_seq, uint32_t last_seq,
+				   uint8_t flags, uint8_t flags_mask)
+{
+	unsigned int idx;
+
+	i_assert(first_seq > 0);
+
+	if (last_seq > map->hdr.messages_count)
+		last_seq = map->hdr.messages_count;
+	if (first_seq > last_seq)
+		return 0;
+
+	mail_index_map_columns_update(map);
+	idx = mail_index_flags_find(map->rec_map->column_flags, first_seq - 1,
+				    last_seq, flags, flags_mask);
+	return idx == last_seq ? 0 : idx + 1;
+}
+
+unsigned int mail_index_map_count_flags(struct mail_index_map *map,
+					uint32_t first_seq, uint32_t last_seq,
+					uint8_t flags, uint8_t flags_mask)
+{
+	i_assert(first_seq > 0);
+
+	if (last_seq > map->hdr.messages_count)
+		last_seq = map->hdr.messages_count;
+	if (first_seq > last_seq)
+		return 0;
+
+	mail_index_map_columns_update(map);
+	return mail_index_flags_count(map->rec_map->column_flags,
+				      first_seq - 1, last_seq,
+				      flags, flags_mask);
+}
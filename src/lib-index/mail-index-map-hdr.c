@@ -229,6 +229,7 @@ static void mail_index_map_clear_recent_flags(struct mail_index_map *map)
 		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
 		rec->flags &= ~MAIL_RECENT;
 	}
+	mail_index_map_columns_invalidate(map, 1);
 }
 
 int mail_index_map_check_header(struct mail_index_map *map,
@@ -26,7 +26,8 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	map->hdr.unused_old_recent_messages_count = 0;
 }
 
-static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
+static int
+mail_index_mmap(struct mail_index_map *map, int fd, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
 	struct mail_index_record_map *rec_map = map->rec_map;
@@ -44,7 +45,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	}
 
 	rec_map->mmap_base = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE, index->fd, 0);
+				  MAP_PRIVATE, fd, 0);
 	if (rec_map->mmap_base == MAP_FAILED) {
 		rec_map->mmap_base = NULL;
 		mail_index_set_syscall_error(index, "mmap()");
@@ -95,6 +96,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 
 	map->hdr_base = rec_map->mmap_base;
 	rec_map->records = PTR_OFFSET(rec_map->mmap_base, map->hdr.header_size);
+	mail_index_map_columns_invalidate(map, 1);
 	return 1;
 }
 
@@ -235,25 +237,42 @@ mail_index_try_read_map(struct mail_index_map *map,
 	map->rec_map->records =
 		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
+	mail_index_map_columns_invalidate(map, 1);
 
 	mail_index_map_copy_hdr(map, hdr);
 	map->hdr_base = map->hdr_copy_buf->data;
 	return 1;
 }
 
+/* The index file isn't modified after it's written, so this doesn't need
+   to verify that the header and the records came from the same write.
+   Retrying is only needed when NFS returns ESTALE for a replaced file. */
 static int mail_index_read_map(struct mail_index_map *map, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
 	mail_index_sync_lost_handler_t *const *handlerp;
 	struct stat st;
+	uoff_t shared_size;
 	unsigned int i;
-	int ret;
+	int ret, fd;
 	bool try_retry, retry;
 
 	/* notify all "sync lost" handlers */
 	array_foreach(&index->sync_lost_handlers, handlerp)
 		(**handlerp)(index);
 
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_SHARED_MAPS) != 0) {
+		/* another process has already read this index file. the
+		   mapping is private, so pages get copied only when they're
+		   written to. */
+		fd = mail_index_shared_map_open(index, &shared_size);
+		if (fd != -1) {
+			ret = mail_index_mmap(map, fd, shared_size);
+			i_close_fd(&fd);
+			return ret;
+		}
+	}
+
 	for (i = 0;; i++) {
 		try_retry = i < MAIL_INDEX_ESTALE_RETRY_COUNT;
 		if (file_size == (uoff_t)-1) {
@@ -290,6 +309,8 @@ static int mail_index_read_map(struct mail_index_map *map, uoff_t file_size)
 			file_size = (uoff_t)-1;
 		}
 	}
+	if (ret > 0 && (index->flags & MAIL_INDEX_OPEN_FLAG_SHARED_MAPS) != 0)
+		mail_index_shared_map_publish(map);
 	return ret;
 }
 
@@ -335,7 +356,7 @@ static int mail_index_map_latest_file(struct mail_index *index)
 
 	new_map = mail_index_map_alloc(index);
 	if (use_mmap) {
-		ret = mail_index_mmap(new_map, file_size);
+		ret = mail_index_mmap(new_map, index->fd, file_size);
 	} else {
 		ret = mail_index_read_map(new_map, file_size);
 	}
@@ -0,0 +1,370 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hex-binary.h"
+#include "sha1.h"
+#include "write-full.h"
+#include "mail-index-private.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MAIL_INDEX_SHARED_MAP_MAGIC 0x4d494458
+#define MAIL_INDEX_SHARED_MAP_PREFIX "dovecot.index."
+/* Where shm_open() objects are visible in the filesystem. If it doesn't
+   exist, stale maps can't be cleaned up. */
+#define MAIL_INDEX_SHARED_MAP_DIR "/dev/shm"
+/* Publishing cleans up the maps that haven't been republished in this
+   many seconds. They're republished by the next process reading the index
+   if they're still needed. */
+#define MAIL_INDEX_SHARED_MAP_MAX_AGE_SECS (60*60)
+/* Limits for the maps published by one uid. Publishing removes the least
+   recently published maps to stay within them. */
+#define MAIL_INDEX_SHARED_MAP_MAX_COUNT 1000
+#define MAIL_INDEX_SHARED_MAP_MAX_TOTAL_SIZE (256*1024*1024)
+
+/* Written after the index file image. The index file is only replaced by
+   renaming a new file over it, so the file's identity also identifies its
+   contents, including the log offsets in its header. */
+struct mail_index_shared_map_trailer {
+	uint32_t magic;
+	uint32_t mtime_nsec;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t ctime;
+	/* size of the index file image before this trailer */
+	uint64_t content_size;
+};
+
+#ifdef HAVE_SHM_OPEN
+
+struct mail_index_shared_map_file {
+	const char *name;
+	time_t mtime;
+	unsigned int mtime_nsec;
+	uoff_t size;
+};
+
+static const char *
+mail_index_shared_map_get_name(struct mail_index *index, uid_t uid)
+{
+	unsigned char digest[SHA1_RESULTLEN];
+
+	/* the maps are published only by the index file's owner, so the uid
+	   keeps different users' maps apart */
+	sha1_get_digest(index->filepath, strlen(index->filepath), digest);
+	return t_strdup_printf("/"MAIL_INDEX_SHARED_MAP_PREFIX"%s.%s",
+			       dec2str(uid),
+			       binary_to_hex(digest, sizeof(digest)));
+}
+
+static void
+mail_index_shared_map_trailer_init(struct mail_index_shared_map_trailer *trailer,
+				   const struct stat *st, uoff_t content_size)
+{
+	memset(trailer, 0, sizeof(*trailer));
+	trailer->magic = MAIL_INDEX_SHARED_MAP_MAGIC;
+	trailer->dev = st->st_dev;
+	trailer->ino = st->st_ino;
+	trailer->size = st->st_size;
+	trailer->mtime = st->st_mtime;
+	trailer->mtime_nsec = ST_MTIME_NSEC(*st);
+	trailer->ctime = st->st_ctime;
+	trailer->content_size = content_size;
+}
+
+int mail_index_shared_map_open(struct mail_index *index, uoff_t *size_r)
+{
+	struct mail_index_shared_map_trailer trailer, shm_trailer;
+	struct stat st, shm_st;
+	uoff_t content_size;
+	int fd;
+
+	if (index->fd == -1 || fstat(index->fd, &st) < 0)
+		return -1;
+
+	T_BEGIN {
+		fd = shm_open(mail_index_shared_map_get_name(index, st.st_uid),
+			      O_RDONLY, 0);
+	} T_END;
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &shm_st) < 0 ||
+	    shm_st.st_size < (off_t)sizeof(shm_trailer)) {
+		i_close_fd(&fd);
+		return -1;
+	}
+	/* only trust maps that were published by the index file's owner,
+	   and that can't be modified anymore. */
+	if (shm_st.st_uid != st.st_uid || (shm_st.st_mode & 0222) != 0) {
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	content_size = shm_st.st_size - sizeof(shm_trailer);
+	mail_index_shared_map_trailer_init(&trailer, &st, content_size);
+	if (pread(fd, &shm_trailer, sizeof(shm_trailer),
+		  content_size) != sizeof(shm_trailer) ||
+	    memcmp(&trailer, &shm_trailer, sizeof(trailer)) != 0) {
+		/* published from another version of the index file */
+		i_close_fd(&fd);
+		return -1;
+	}
+	*size_r = content_size;
+	return fd;
+}
+
+static int
+mail_index_shared_map_write(struct mail_index_map *map, int fd,
+			    const struct stat *st)
+{
+	struct mail_index_shared_map_trailer trailer;
+	size_t records_size;
+
+	records_size = (size_t)map->rec_map->records_count *
+		map->hdr.record_size;
+	mail_index_shared_map_trailer_init(&trailer, st,
+		map->hdr_copy_buf->used + records_size);
+
+	/* the trailer is written last, so a partially written map is never
+	   attached */
+	if (write_full(fd, map->hdr_copy_buf->data,
+		       map->hdr_copy_buf->used) < 0 ||
+	    write_full(fd, map->rec_map->records, records_size) < 0 ||
+	    write_full(fd, &trailer, sizeof(trailer)) < 0)
+		return -1;
+	return 0;
+}
+
+static void mail_index_shared_map_publish_fd(struct mail_index_map *map,
+					     const char *name, int fd,
+					     const struct stat *index_st)
+{
+	struct mail_index *index = map->index;
+	struct stat st;
+
+	mail_index_fchown(index, fd, name);
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(index, name, "fstat()");
+		return;
+	}
+	/* nobody may modify the published map */
+	if ((st.st_mode & 0222) != 0 && fchmod(fd, st.st_mode & 0444) < 0) {
+		mail_index_file_set_syscall_error(index, name, "fchmod()");
+		return;
+	}
+
+	if (mail_index_shared_map_write(map, fd, index_st) < 0) {
+		mail_index_file_set_syscall_error(index, name, "write()");
+		if (shm_unlink(name) < 0 && errno != ENOENT)
+			mail_index_file_set_syscall_error(index, name,
+							  "shm_unlink()");
+	}
+}
+
+static void
+mail_index_shared_map_publish_name(struct mail_index_map *map,
+				   const struct stat *index_st, uoff_t size,
+				   const char *name)
+{
+	struct mail_index *index = map->index;
+	int fd;
+
+	/* replace the map of the older index file */
+	if (shm_unlink(name) < 0 && errno != ENOENT)
+		mail_index_file_set_syscall_error(index, name, "shm_unlink()");
+	if (size > MAIL_INDEX_SHARED_MAP_MAX_TOTAL_SIZE)
+		return;
+
+	/* make room for the new map */
+	mail_index_shared_maps_cleanup(ioloop_time -
+				       MAIL_INDEX_SHARED_MAP_MAX_AGE_SECS,
+				       MAIL_INDEX_SHARED_MAP_MAX_COUNT - 1,
+				       MAIL_INDEX_SHARED_MAP_MAX_TOTAL_SIZE - size);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, index->mode & 0444);
+	if (fd != -1) {
+		mail_index_shared_map_publish_fd(map, name, fd, index_st);
+		i_close_fd(&fd);
+	} else if (errno != EEXIST) {
+		/* EEXIST = another process just published it */
+		mail_index_file_set_syscall_error(index, name, "shm_open()");
+	}
+}
+
+void mail_index_shared_map_publish(struct mail_index_map *map)
+{
+	struct mail_index *index = map->index;
+	struct stat st;
+	uoff_t size;
+
+	i_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(map));
+
+	if (index->fd == -1 ||
+	    map->rec_map->records_count != map->hdr.messages_count ||
+	    map->hdr_copy_buf->used != map->hdr.header_size) {
+		/* only publish images of complete index files */
+		return;
+	}
+	if (fstat(index->fd, &st) < 0) {
+		mail_index_set_syscall_error(index, "fstat()");
+		return;
+	}
+	if (st.st_uid != geteuid()) {
+		/* only the index file's owner publishes its maps */
+		return;
+	}
+
+	size = map->hdr_copy_buf->used +
+		(uoff_t)map->rec_map->records_count * map->hdr.record_size +
+		sizeof(struct mail_index_shared_map_trailer);
+
+	T_BEGIN {
+		mail_index_shared_map_publish_name(map, &st, size,
+			mail_index_shared_map_get_name(index, st.st_uid));
+	} T_END;
+}
+
+void mail_index_shared_map_unlink(struct mail_index *index)
+{
+	const char *name;
+
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_SHARED_MAPS) == 0 ||
+	    MAIL_INDEX_IS_IN_MEMORY(index))
+		return;
+
+	T_BEGIN {
+		name = mail_index_shared_map_get_name(index, geteuid());
+		if (shm_unlink(name) < 0 && errno != ENOENT)
+			mail_index_file_set_syscall_error(index, name,
+							  "shm_unlink()");
+	} T_END;
+}
+
+static int
+mail_index_shared_map_file_cmp(const struct mail_index_shared_map_file *f1,
+			       const struct mail_index_shared_map_file *f2)
+{
+	if (f1->mtime != f2->mtime)
+		return f1->mtime < f2->mtime ? -1 : 1;
+	if (f1->mtime_nsec != f2->mtime_nsec)
+		return f1->mtime_nsec < f2->mtime_nsec ? -1 : 1;
+	return 0;
+}
+
+static void mail_index_shared_map_file_unlink(const char *name)
+{
+	const char *path = t_strconcat("/", name, NULL);
+
+	if (shm_unlink(path) < 0 && errno != ENOENT)
+		i_error("shm_unlink(%s) failed: %m", path);
+}
+
+static void
+mail_index_shared_maps_cleanup_real(time_t min_mtime, unsigned int max_count,
+				    uoff_t max_size)
+{
+	ARRAY(struct mail_index_shared_map_file) files;
+	struct mail_index_shared_map_file *file;
+	DIR *dir;
+	struct dirent *d;
+	struct stat st;
+	const char *prefix, *path;
+	size_t prefix_len;
+	uoff_t total_size = 0;
+	unsigned int i, count;
+	uid_t uid = geteuid();
+
+	dir = opendir(MAIL_INDEX_SHARED_MAP_DIR);
+	if (dir == NULL) {
+		if (errno != ENOENT) {
+			i_error("opendir(%s) failed: %m",
+				MAIL_INDEX_SHARED_MAP_DIR);
+		}
+		return;
+	}
+	prefix = t_strdup_printf(MAIL_INDEX_SHARED_MAP_PREFIX"%s.",
+				 dec2str(uid));
+	prefix_len = strlen(prefix);
+
+	t_array_init(&files, 32);
+	errno = 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, prefix, prefix_len) != 0)
+			continue;
+
+		path = t_strconcat(MAIL_INDEX_SHARED_MAP_DIR"/",
+				   d->d_name, NULL);
+		if (lstat(path, &st) < 0) {
+			if (errno != ENOENT)
+				i_error("lstat(%s) failed: %m", path);
+		} else if (st.st_uid != uid) {
+			/* not ours */
+		} else if (st.st_mtime < min_mtime) {
+			mail_index_shared_map_file_unlink(d->d_name);
+		} else {
+			file = array_append_space(&files);
+			file->name = t_strdup(d->d_name);
+			file->mtime = st.st_mtime;
+			file->mtime_nsec = ST_MTIME_NSEC(st);
+			file->size = st.st_size;
+			total_size += st.st_size;
+		}
+		errno = 0;
+	}
+	if (errno != 0)
+		i_error("readdir(%s) failed: %m", MAIL_INDEX_SHARED_MAP_DIR);
+	if (closedir(dir) < 0)
+		i_error("closedir(%s) failed: %m", MAIL_INDEX_SHARED_MAP_DIR);
+
+	/* drop the least recently published maps until the rest fit */
+	array_sort(&files, mail_index_shared_map_file_cmp);
+	file = array_get_modifiable(&files, &count);
+	for (i = 0; i < count; i++) {
+		if (count - i <= max_count && total_size <= max_size)
+			break;
+		mail_index_shared_map_file_unlink(file[i].name);
+		total_size -= file[i].size;
+	}
+}
+
+void mail_index_shared_maps_cleanup(time_t min_mtime, unsigned int max_count,
+				    uoff_t max_size)
+{
+	T_BEGIN {
+		mail_index_shared_maps_cleanup_real(min_mtime, max_count,
+						    max_size);
+	} T_END;
+}
+
+#else
+
+int mail_index_shared_map_open(struct mail_index *index ATTR_UNUSED,
+			       uoff_t *size_r ATTR_UNUSED)
+{
+	return -1;
+}
+
+void mail_index_shared_map_publish(struct mail_index_map *map ATTR_UNUSED)
+{
+}
+
+void mail_index_shared_map_unlink(struct mail_index *index ATTR_UNUSED)
+{
+}
+
+void mail_index_shared_maps_cleanup(time_t min_mtime ATTR_UNUSED,
+				    unsigned int max_count ATTR_UNUSED,
+				    uoff_t max_size ATTR_UNUSED)
+{
+}
+
+#endif
@@ -278,6 +278,7 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 	array_free(&rec_map->maps);
 	if (rec_map->modseq != NULL)
 		mail_index_map_modseq_free(&rec_map->modseq);
+	mail_index_record_map_columns_free(rec_map);
 	i_free(rec_map);
 }
 
@@ -443,6 +444,8 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 
 	if (new_map->records_count != map->hdr.messages_count) {
 		new_map->records_count = map->hdr.messages_count;
+		mail_index_map_columns_invalidate(map,
+						  new_map->records_count + 1);
 		if (new_map->records_count == 0)
 			new_map->last_appended_uid = 0;
 		else {
@@ -130,6 +130,13 @@ struct mail_index_record_map {
 
 	struct mail_index_map_modseq *modseq;
 	uint32_t last_appended_uid;
+
+	/* Copies of the records' uid and flags fields as separate arrays
+	   for fast scanning. They're built lazily, and the first
+	   columns_count records have valid values. */
+	uint32_t *column_uids;
+	uint8_t *column_flags;
+	unsigned int columns_count, columns_alloc_count;
 };
 
 struct mail_index_map {
@@ -304,6 +311,47 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 				     uint32_t *first_seq_r,
 				     uint32_t *last_seq_r);
 
+/* Returns the uid and flags columns of the map's records, indexed by seq-1. */
+void mail_index_map_get_columns(struct mail_index_map *map,
+				const uint32_t **uids_r,
+				const uint8_t **flags_r);
+/* Records starting from seq were changed. */
+void mail_index_map_columns_invalidate(struct mail_index_map *map,
+				       uint32_t seq);
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map);
+/* Returns the first seq in the given range where
+   (flags & flags_mask) == flags, or 0 if there are none. */
+uint32_t mail_index_map_find_flags(struct mail_index_map *map,
+				   uint32_t first_seq, uint32_t last_seq,
+				   uint8_t flags, uint8_t flags_mask);
+/* Returns the number of messages in the given range where
+   (flags & flags_mask) == flags. */
+unsigned int mail_index_map_count_flags(struct mail_index_map *map,
+					uint32_t first_seq, uint32_t last_seq,
+					uint8_t flags, uint8_t flags_mask);
+
+enum mail_index_flags_scan_impl {
+	MAIL_INDEX_FLAGS_SCAN_IMPL_SWAR,
+	MAIL_INDEX_FLAGS_SCAN_IMPL_SSE2,
+	MAIL_INDEX_FLAGS_SCAN_IMPL_AVX2
+};
+/* The flags scanning uses the fastest implementation supported by the CPU.
+   For unit tests and benchmarks: Force using the given implementation.
+   Returns FALSE if it's not supported by the CPU or the build. */
+bool mail_index_flags_scan_set_impl(enum mail_index_flags_scan_impl impl);
+/* Switch back to the fastest supported implementation. */
+void mail_index_flags_scan_set_best_impl(void);
+
+/* Open the map published for the current index file. Returns fd and the size
+   of the index file image in it, or -1 if there's no usable map. */
+int mail_index_shared_map_open(struct mail_index *index, uoff_t *size_r);
+/* Publish a map that was just read from the index file for other processes
+   to attach. */
+void mail_index_shared_map_publish(struct mail_index_map *map);
+/* Remove the map published for this index. This is done whenever the index
+   file is recreated, unlinked or the index is deleted. */
+void mail_index_shared_map_unlink(struct mail_index *index);
+
 /* Returns 1 on success, 0 on non-critical errors we want to silently fix,
    -1 if map isn't usable. The caller is responsible for logging the errors
    if -1 is returned. */
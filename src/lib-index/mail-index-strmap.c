@@ -32,7 +32,12 @@ struct mail_index_strmap_view {
 
 	ARRAY_TYPE(mail_index_strmap_rec) recs;
 	ARRAY(uint32_t) recs_crc32;
-	struct hash2_table *hash;
+	/* Open addressed hash of the records with non-zero crc32, keyed by
+	   the crc32. Each slot has the record's index in recs + 1, or 0 if
+	   the slot is empty. It's rebuilt in memory for each view, the file
+	   doesn't contain it (see TODO). */
+	uint32_t *hash_slots;
+	unsigned int hash_size, hash_count;
 
 	mail_index_strmap_key_cmp_t *key_compare;
 	mail_index_strmap_rec_cmp_t *rec_compare;
@@ -72,11 +77,6 @@ struct mail_index_strmap_view_sync {
 	struct mail_index_strmap_view *view;
 };
 
-struct mail_index_strmap_hash_key {
-	const char *str;
-	uint32_t crc32;
-};
-
 /* number of bytes required to store one string idx */
 #define STRMAP_FILE_STRIDX_SIZE (sizeof(uint32_t)*2)
 
@@ -89,6 +89,10 @@ struct mail_index_strmap_hash_key {
 
 #define MAIL_INDEX_STRMAP_TIMEOUT_SECS 10
 
+/* hash_size is always a power of two, and the hash is kept at most half
+   full */
+#define STRMAP_HASH_MIN_SIZE 256
+
 static const struct dotlock_settings default_dotlock_settings = {
 	.timeout = MAIL_INDEX_STRMAP_TIMEOUT_SECS,
 	.stale_timeout = 30
@@ -162,21 +166,99 @@ void mail_index_strmap_deinit(struct mail_index_strmap **_strmap)
 	i_free(strmap);
 }
 
-static unsigned int mail_index_strmap_hash_key(const void *_key)
+static void strmap_hash_clear(struct mail_index_strmap_view *view)
+{
+	i_free_and_null(view->hash_slots);
+	view->hash_size = 0;
+	view->hash_count = 0;
+}
+
+static void
+strmap_hash_insert_slot(struct mail_index_strmap_view *view,
+			uint32_t crc32, unsigned int rec_idx)
 {
-	const struct mail_index_strmap_hash_key *key = _key;
+	unsigned int mask = view->hash_size - 1;
+	unsigned int i = crc32 & mask;
 
-	return key->crc32;
+	while (view->hash_slots[i] != 0)
+		i = (i + 1) & mask;
+	view->hash_slots[i] = rec_idx + 1;
 }
 
-static bool
-mail_index_strmap_hash_cmp(const void *_key, const void *_value, void *context)
+static void strmap_hash_grow(struct mail_index_strmap_view *view)
+{
+	const uint32_t *crc32s;
+	uint32_t *old_slots = view->hash_slots;
+	unsigned int i, old_size = view->hash_size;
+
+	view->hash_size = old_size == 0 ? STRMAP_HASH_MIN_SIZE : old_size * 2;
+	view->hash_slots = i_new(uint32_t, view->hash_size);
+
+	crc32s = array_idx(&view->recs_crc32, 0);
+	for (i = 0; i < old_size; i++) {
+		if (old_slots[i] != 0) {
+			strmap_hash_insert_slot(view, crc32s[old_slots[i]-1],
+						old_slots[i]-1);
+		}
+	}
+	i_free(old_slots);
+}
+
+static void
+strmap_hash_insert(struct mail_index_strmap_view *view, unsigned int rec_idx)
 {
-	const struct mail_index_strmap_hash_key *key = _key;
-	const struct mail_index_strmap_rec *rec = _value;
-	struct mail_index_strmap_view *view = context;
+	uint32_t crc32 = *array_idx(&view->recs_crc32, rec_idx);
+
+	i_assert(crc32 != 0);
 
-	return view->key_compare(key->str, rec, view->cb_context);
+	if ((view->hash_count + 1) * 2 > view->hash_size)
+		strmap_hash_grow(view);
+	strmap_hash_insert_slot(view, crc32, rec_idx);
+	view->hash_count++;
+}
+
+static void
+strmap_hash_remove_slot(struct mail_index_strmap_view *view, unsigned int i)
+{
+	const uint32_t *crc32s = array_idx(&view->recs_crc32, 0);
+	unsigned int j, home, mask = view->hash_size - 1;
+
+	i_assert(view->hash_slots[i] != 0);
+
+	/* move back the following records that would no longer be found
+	   after the hole */
+	for (j = (i + 1) & mask; view->hash_slots[j] != 0; j = (j + 1) & mask) {
+		home = crc32s[view->hash_slots[j]-1] & mask;
+		if (i <= j ? (home <= i || home > j) :
+		    (home <= i && home > j)) {
+			view->hash_slots[i] = view->hash_slots[j];
+			i = j;
+		}
+	}
+	view->hash_slots[i] = 0;
+	view->hash_count--;
+}
+
+static const struct mail_index_strmap_rec *
+strmap_hash_lookup(struct mail_index_strmap_view *view,
+		   uint32_t crc32, const char *key)
+{
+	const struct mail_index_strmap_rec *recs;
+	const uint32_t *crc32s;
+	unsigned int i, idx, mask = view->hash_size - 1;
+
+	if (view->hash_count == 0)
+		return NULL;
+
+	recs = array_idx(&view->recs, 0);
+	crc32s = array_idx(&view->recs_crc32, 0);
+	for (i = crc32 & mask; view->hash_slots[i] != 0; i = (i + 1) & mask) {
+		idx = view->hash_slots[i] - 1;
+		if (crc32s[idx] == crc32 &&
+		    view->key_compare(key, &recs[idx], view->cb_context))
+			return &recs[idx];
+	}
+	return NULL;
 }
 
 struct mail_index_strmap_view *
@@ -186,8 +268,7 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 			    mail_index_strmap_rec_cmp_t *rec_compare_cb,
 			    mail_index_strmap_remap_t *remap_cb,
 			    void *context,
-			    const ARRAY_TYPE(mail_index_strmap_rec) **recs_r,
-			    const struct hash2_table **hash_r)
+			    const ARRAY_TYPE(mail_index_strmap_rec) **recs_r)
 {
 	struct mail_index_strmap_view *view;
 
@@ -202,11 +283,7 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 
 	i_array_init(&view->recs, 64);
 	i_array_init(&view->recs_crc32, 64);
-	view->hash = hash2_create(0, sizeof(struct mail_index_strmap_rec),
-				  mail_index_strmap_hash_key,
-				  mail_index_strmap_hash_cmp, view);
 	*recs_r = &view->recs;
-	*hash_r = view->hash;
 	return view;
 }
 
@@ -217,7 +294,7 @@ void mail_index_strmap_view_close(struct mail_index_strmap_view **_view)
 	*_view = NULL;
 	array_free(&view->recs);
 	array_free(&view->recs_crc32);
-	hash2_destroy(&view->hash);
+	strmap_hash_clear(view);
 	i_free(view);
 }
 
@@ -231,7 +308,7 @@ static void mail_index_strmap_view_reset(struct mail_index_strmap_view *view)
 	view->remap_cb(NULL, 0, 0, view->cb_context);
 	array_clear(&view->recs);
 	array_clear(&view->recs_crc32);
-	hash2_clear(view->hash);
+	strmap_hash_clear(view);
 
 	view->last_added_uid = 0;
 	view->lost_expunged_uid = 0;
@@ -612,14 +689,17 @@ strmap_read_block_deinit(struct mail_index_strmap_read_context *ctx, int ret,
 static bool
 strmap_view_sync_handle_conflict(struct mail_index_strmap_read_context *ctx,
 				 const struct mail_index_strmap_rec *hash_rec,
-				 struct hash2_iter *iter)
+				 unsigned int slot, bool *removed_r)
 {
 	uint32_t seq;
 
+	*removed_r = FALSE;
+
 	/* hopefully it's a message that has since been expunged */
 	if (!mail_index_lookup_seq(ctx->view->view, hash_rec->uid, &seq)) {
 		/* message is no longer in our view. remove it completely. */
-		hash2_remove_iter(ctx->view->hash, iter);
+		strmap_hash_remove_slot(ctx->view, slot);
+		*removed_r = TRUE;
 		return TRUE;
 	}
 	if (mail_index_is_expunged(ctx->view->view, seq)) {
@@ -638,10 +718,13 @@ static int
 strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ctx,
 				       uint32_t crc32)
 {
-	struct mail_index_strmap_rec *hash_rec;
-	struct hash2_iter iter;
+	struct mail_index_strmap_view *view = ctx->view;
+	const struct mail_index_strmap_rec *hash_rec;
+	const uint32_t *crc32s;
+	unsigned int i, idx, mask = view->hash_size - 1;
+	bool removed;
 
-	if (crc32 == 0) {
+	if (crc32 == 0 || view->hash_count == 0) {
 		/* unique string - there are no conflicts */
 		return 0;
 	}
@@ -656,15 +739,27 @@ strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ct
 
 	if we detect such a conflict, we can't continue using the
 	strmap index until X has been expunged. */
-	memset(&iter, 0, sizeof(iter));
-	while ((hash_rec = hash2_iterate(ctx->view->hash,
-					 crc32, &iter)) != NULL &&
-	       hash_rec->str_idx != ctx->rec.str_idx) {
+	crc32s = array_idx(&view->recs_crc32, 0);
+	i = crc32 & mask;
+	while (view->hash_slots[i] != 0) {
+		idx = view->hash_slots[i] - 1;
+		hash_rec = array_idx(&view->recs, idx);
+		if (crc32s[idx] != crc32) {
+			i = (i + 1) & mask;
+			continue;
+		}
+		if (hash_rec->str_idx == ctx->rec.str_idx)
+			break;
+
 		/* CRC32 matches, but string index doesn't */
-		if (!strmap_view_sync_handle_conflict(ctx, hash_rec, &iter)) {
+		if (!strmap_view_sync_handle_conflict(ctx, hash_rec, i,
+						      &removed)) {
 			ctx->lost_expunged_uid = hash_rec->uid;
 			return -1;
 		}
+		/* a removed slot was filled by the following records */
+		if (!removed)
+			i = (i + 1) & mask;
 	}
 	return 0;
 }
@@ -672,7 +767,6 @@ strmap_view_sync_block_check_conflicts(struct mail_index_strmap_read_context *ct
 static int
 mail_index_strmap_view_sync_block(struct mail_index_strmap_read_context *ctx)
 {
-	struct mail_index_strmap_rec *hash_rec;
 	uint32_t crc32, prev_uid = 0;
 	int ret;
 
@@ -692,13 +786,13 @@ mail_index_strmap_view_sync_block(struct mail_index_strmap_read_context *ctx)
 		}
 		ctx->view->last_added_uid = ctx->rec.uid;
 
-		/* add the record to records array */
+		/* add the record to records array and its index to hash */
 		array_append(&ctx->view->recs, &ctx->rec, 1);
 		array_append(&ctx->view->recs_crc32, &crc32, 1);
-
-		/* add a separate copy of the record to hash */
-		hash_rec = hash2_insert_hash(ctx->view->hash, crc32);
-		memcpy(hash_rec, &ctx->rec, sizeof(*hash_rec));
+		if (crc32 != 0) {
+			strmap_hash_insert(ctx->view,
+					   array_count(&ctx->view->recs) - 1);
+		}
 	}
 	return strmap_read_block_deinit(ctx, ret, TRUE);
 }
@@ -756,18 +850,16 @@ void mail_index_strmap_view_sync_add(struct mail_index_strmap_view_sync *sync,
 				     const char *key)
 {
 	struct mail_index_strmap_view *view = sync->view;
-	struct mail_index_strmap_rec *rec, *old_rec;
-	struct mail_index_strmap_hash_key hash_key;
-	uint32_t str_idx;
+	const struct mail_index_strmap_rec *old_rec;
+	struct mail_index_strmap_rec rec;
+	uint32_t str_idx, crc32;
 
 	i_assert(uid > view->last_added_uid ||
 		 (uid == view->last_added_uid &&
 		  ref_index > view->last_ref_index));
 
-	hash_key.str = key;
-	hash_key.crc32 = crc32_str_nonzero(key);
-
-	old_rec = hash2_lookup(view->hash, &hash_key);
+	crc32 = crc32_str_nonzero(key);
+	old_rec = strmap_hash_lookup(view, crc32, key);
 	if (old_rec != NULL) {
 		/* The string already exists, use the same unique idx */
 		str_idx = old_rec->str_idx;
@@ -777,12 +869,13 @@ void mail_index_strmap_view_sync_add(struct mail_index_strmap_view_sync *sync,
 	}
 	i_assert(str_idx != 0);
 
-	rec = hash2_insert(view->hash, &hash_key);
-	rec->uid = uid;
-	rec->ref_index = ref_index;
-	rec->str_idx = str_idx;
-	array_append(&view->recs, rec, 1);
-	array_append(&view->recs_crc32, &hash_key.crc32, 1);
+	memset(&rec, 0, sizeof(rec));
+	rec.uid = uid;
+	rec.ref_index = ref_index;
+	rec.str_idx = str_idx;
+	array_append(&view->recs, &rec, 1);
+	array_append(&view->recs_crc32, &crc32, 1);
+	strmap_hash_insert(view, array_count(&view->recs) - 1);
 
 	view->last_added_uid = uid;
 	view->last_ref_index = ref_index;
@@ -820,7 +913,7 @@ mail_index_strmap_zero_terminate(struct mail_index_strmap_view *view)
 static void mail_index_strmap_view_renumber(struct mail_index_strmap_view *view)
 {
 	struct mail_index_strmap_read_context ctx;
-	struct mail_index_strmap_rec *recs, *hash_rec;
+	struct mail_index_strmap_rec *recs;
 	uint32_t prev_uid, str_idx, *recs_crc32, *renumber_map;
 	unsigned int i, dest, count, count2;
 	int ret;
@@ -873,11 +966,11 @@ static void mail_index_strmap_view_renumber(struct mail_index_strmap_view *view)
 
 	/* renumber the indexes in-place and recreate the hash */
 	recs = array_get_modifiable(&view->recs, &count);
-	hash2_clear(view->hash);
+	strmap_hash_clear(view);
 	for (i = 0; i < count; i++) {
 		recs[i].str_idx = renumber_map[recs[i].str_idx];
-		hash_rec = hash2_insert_hash(view->hash, recs_crc32[i]);
-		memcpy(hash_rec, &recs[i], sizeof(*hash_rec));
+		if (recs_crc32[i] != 0)
+			strmap_hash_insert(view, i);
 	}
 
 	/* update the new next_str_idx only after remapping */
@@ -1187,7 +1280,7 @@ static int mail_index_strmap_write(struct mail_index_strmap_view *view)
 	/* FIXME: this renumbering doesn't work well when running for a long
 	   time since records aren't removed from hash often enough */
 	if (STRIDX_MUST_RENUMBER(view->next_str_idx - 1,
-				 hash2_count(view->hash))) {
+				 array_count(&view->recs))) {
 		mail_index_strmap_view_renumber(view);
 		if (!MAIL_INDEX_IS_IN_MEMORY(view->strmap->index)) {
 			if (mail_index_strmap_recreate(view) < 0) {
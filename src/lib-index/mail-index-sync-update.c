@@ -260,6 +260,7 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 	prev_seq2 = 0;
 	dest_seq1 = 1;
 	orig_rec_count = map->rec_map->records_count;
+	mail_index_map_columns_invalidate(map, range[0].seq1);
 	for (i = 0; i < count; i++) {
 		uint32_t seq1 = range[i].seq1;
 		uint32_t seq2 = range[i].seq2;
@@ -408,6 +409,8 @@ static int sync_append(const struct mail_index_record *rec,
 		/* don't rely on buffer->used being at the correct position.
 		   at least expunges can move it */
 		dest = sync_append_record(map);
+		mail_index_map_columns_invalidate(map,
+			map->rec_map->records_count + 1);
 		memcpy(dest, rec, sizeof(*rec));
 		memset(PTR_OFFSET(dest, sizeof(*rec)), 0,
 		       map->hdr.record_size - sizeof(*rec));
@@ -451,6 +454,7 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 		view->map->hdr.flags |= MAIL_INDEX_HDR_FLAG_HAVE_DIRTY;
 
         flag_mask = ~u->remove_flags;
+	mail_index_map_columns_invalidate(view->map, seq1);
 
 	if (((u->add_flags | u->remove_flags) &
 	     (MAIL_SEEN | MAIL_DELETED)) == 0) {
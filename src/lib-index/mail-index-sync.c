@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "mail-index-latency.h"
 #include "mail-index-view-private.h"
 #include "mail-index-sync-private.h"
 #include "mail-index-transaction-private.h"
@@ -26,6 +27,7 @@ struct mail_index_sync_ctx {
 
 	unsigned int no_warning:1;
 	unsigned int seen_nonexternal_transactions:1;
+	unsigned int group_commit:1;
 };
 
 static void mail_index_sync_add_expunge(struct mail_index_sync_ctx *ctx)
@@ -480,6 +482,12 @@ mail_index_sync_begin_to2(struct mail_index *index,
 		(flags & (MAIL_INDEX_SYNC_FLAG_DELETING_INDEX |
 			  MAIL_INDEX_SYNC_FLAG_TRY_DELETING_INDEX)) != 0;
 
+	/* the transactions committed while we're syncing are fdatasync()ed
+	   together when the sync is finished */
+	if (!index->log->group_commit &&
+	    mail_transaction_log_group_commit_begin(index->log) == 0)
+		ctx->group_commit = TRUE;
+
 	*ctx_r = ctx;
 	*view_r = ctx->view;
 	*trans_r = ctx->ext_trans;
@@ -493,11 +501,13 @@ int mail_index_sync_begin_to(struct mail_index *index,
 			     uint32_t log_file_seq, uoff_t log_file_offset,
 			     enum mail_index_sync_flags flags)
 {
+	struct timeval start;
 	bool retry;
 	int ret;
 
 	i_assert(index->open_count > 0);
 
+	mail_index_latency_start(&start);
 	ret = mail_index_sync_begin_to2(index, ctx_r, view_r, trans_r,
 					log_file_seq, log_file_offset,
 					flags, &retry);
@@ -506,6 +516,7 @@ int mail_index_sync_begin_to(struct mail_index *index,
 						log_file_seq, log_file_offset,
 						flags, &retry);
 	}
+	mail_index_latency_end(MAIL_INDEX_LATENCY_INDEX_SYNC, &start);
 	return ret;
 }
 
@@ -740,6 +751,14 @@ void mail_index_sync_set_reason(struct mail_index_sync_ctx *ctx,
 	ctx->reason = i_strdup(reason);
 }
 
+static int mail_index_sync_group_commit_end(struct mail_index_sync_ctx *ctx)
+{
+	if (!ctx->group_commit)
+		return 0;
+	ctx->group_commit = FALSE;
+	return mail_transaction_log_group_commit_end(ctx->index->log);
+}
+
 static void mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
 {
         struct mail_index_sync_ctx *ctx = *_ctx;
@@ -756,6 +775,7 @@ static void mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
 		lock_reason = ctx->reason;
 	else
 		lock_reason = "Mailbox was synchronized";
+	(void)mail_index_sync_group_commit_end(ctx);
 	mail_transaction_log_sync_unlock(ctx->index->log, lock_reason);
 
 	mail_index_view_close(&ctx->view);
@@ -850,8 +870,9 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		/* if cache compression fails, we don't really care.
 		   the cache offsets are updated only if the compression was
 		   successful. */
-		(void)mail_cache_compress(index->cache, ctx->ext_trans,
-					  &cache_lock);
+		(void)mail_cache_compress_incremental(index->cache,
+						      ctx->ext_trans,
+						      &cache_lock);
 	}
 
 	if ((ctx->flags & MAIL_INDEX_SYNC_FLAG_DROP_RECENT) != 0) {
@@ -865,6 +886,9 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 	}
 
 	ret2 = mail_index_transaction_commit(&ctx->ext_trans);
+	/* the index file must not point to log data that isn't on disk */
+	if (mail_index_sync_group_commit_end(ctx) < 0)
+		ret2 = -1;
 	if (cache_lock != NULL)
 		mail_cache_compress_unlock(&cache_lock);
 	if (ret2 < 0) {
@@ -895,6 +919,10 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		mail_index_write(index, want_rotate);
 	}
 	mail_index_sync_end(_ctx);
+
+	/* the index is unlocked now, so the cache compression's copying
+	   doesn't make other processes wait */
+	mail_cache_compress_incremental_copy(index->cache);
 	return ret;
 }
 
@@ -277,6 +277,16 @@ void mail_index_transaction_rollback(struct mail_index_transaction **_t)
 	t->v.rollback(t);
 }
 
+int mail_index_group_commit_begin(struct mail_index *index)
+{
+	return mail_transaction_log_group_commit_begin(index->log);
+}
+
+int mail_index_group_commit_end(struct mail_index *index)
+{
+	return mail_transaction_log_group_commit_end(index->log);
+}
+
 static struct mail_index_transaction_vfuncs trans_vfuncs = {
 	mail_index_transaction_reset_v,
 	mail_index_transaction_commit_v,
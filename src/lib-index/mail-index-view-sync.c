@@ -6,6 +6,7 @@
 #include "mail-index-view-private.h"
 #include "mail-index-sync-private.h"
 #include "mail-index-modseq.h"
+#include "mail-index-latency.h"
 #include "mail-transaction-log.h"
 
 
@@ -516,9 +517,9 @@ static int mail_index_view_sync_init_fix(struct mail_index_view_sync_ctx *ctx)
 	return 0;
 }
 
-struct mail_index_view_sync_ctx *
-mail_index_view_sync_begin(struct mail_index_view *view,
-			   enum mail_index_view_sync_flags flags)
+static struct mail_index_view_sync_ctx *
+mail_index_view_sync_begin_real(struct mail_index_view *view,
+				enum mail_index_view_sync_flags flags)
 {
 	struct mail_index_view_sync_ctx *ctx;
 	struct mail_index_map *tmp_map;
@@ -642,6 +643,19 @@ mail_index_view_sync_begin(struct mail_index_view *view,
 	return ctx;
 }
 
+struct mail_index_view_sync_ctx *
+mail_index_view_sync_begin(struct mail_index_view *view,
+			   enum mail_index_view_sync_flags flags)
+{
+	struct mail_index_view_sync_ctx *ctx;
+	struct timeval start;
+
+	mail_index_latency_start(&start);
+	ctx = mail_index_view_sync_begin_real(view, flags);
+	mail_index_latency_end(MAIL_INDEX_LATENCY_VIEW_SYNC, &start);
+	return ctx;
+}
+
 static bool
 view_sync_is_hidden(struct mail_index_view *view, uint32_t seq, uoff_t offset)
 {
@@ -260,7 +260,6 @@ static void view_lookup_first(struct mail_index_view *view,
 #define LOW_UPDATE(x) \
 	STMT_START { if ((x) > low_uid) low_uid = x; } STMT_END
 	const struct mail_index_header *hdr = &view->map->hdr;
-	const struct mail_index_record *rec;
 	uint32_t seq, seq2, low_uid = 1;
 
 	*seq_r = 0;
@@ -279,13 +278,8 @@ static void view_lookup_first(struct mail_index_view *view,
 	}
 
 	i_assert(hdr->messages_count <= view->map->rec_map->records_count);
-	for (; seq <= hdr->messages_count; seq++) {
-		rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
-		if ((rec->flags & flags_mask) == (uint8_t)flags) {
-			*seq_r = seq;
-			break;
-		}
-	}
+	*seq_r = mail_index_map_find_flags(view->map, seq, hdr->messages_count,
+					   flags, flags_mask);
 }
 
 static void
@@ -529,6 +523,22 @@ void mail_index_lookup_first(struct mail_index_view *view,
 	view->v.lookup_first(view, flags, flags_mask, seq_r);
 }
 
+void mail_index_view_get_columns(struct mail_index_view *view,
+				 const uint32_t **uids_r,
+				 const uint8_t **flags_r)
+{
+	mail_index_map_get_columns(view->map, uids_r, flags_r);
+}
+
+unsigned int mail_index_view_count_flags(struct mail_index_view *view,
+					 enum mail_flags flags,
+					 uint8_t flags_mask)
+{
+	return mail_index_map_count_flags(view->map, 1,
+					  view->map->hdr.messages_count,
+					  flags, flags_mask);
+}
+
 void mail_index_lookup_ext(struct mail_index_view *view, uint32_t seq,
 			   uint32_t ext_id, const void **data_r,
 			   bool *expunged_r)
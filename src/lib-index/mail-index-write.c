@@ -112,6 +112,10 @@ static int mail_index_recreate(struct mail_index *index)
 
 	if (ret < 0)
 		i_unlink(path);
+	else {
+		/* the published map is stale now */
+		mail_index_shared_map_unlink(index);
+	}
 	return ret;
 }
 
@@ -124,6 +128,15 @@ void mail_index_write(struct mail_index *index, bool want_rotate)
 
 	if (index->readonly)
 		return;
+	/* the index must not point to log data that isn't on disk yet */
+	if (mail_transaction_log_group_fsync(index->log) < 0) {
+		mail_index_set_error(index, "%s not written: "
+			"Transaction log couldn't be fsynced",
+			index->filepath);
+		/* try again on the next sync */
+		index->need_recreate = TRUE;
+		return;
+	}
 
 	/* rotate the .log before writing index, so the index will point to
 	   the latest log. */
@@ -632,6 +632,8 @@ static void mail_index_close_nonopened(struct mail_index *index)
 	i_assert(!index->syncing);
 	i_assert(index->views == NULL);
 
+	if (index->index_deleted)
+		mail_index_shared_map_unlink(index);
 	if (index->map != NULL)
 		mail_index_unmap(&index->map);
 
@@ -662,6 +664,7 @@ int mail_index_unlink(struct mail_index *index)
 	if (MAIL_INDEX_IS_IN_MEMORY(index) || index->readonly)
 		return 0;
 
+	mail_index_shared_map_unlink(index);
 	/* main index */
 	if (unlink(index->filepath) < 0 && errno != ENOENT)
 		last_errno = errno;
@@ -815,6 +818,7 @@ void mail_index_mark_corrupted(struct mail_index *index)
 		    errno != ENOENT && errno != ESTALE)
 			mail_index_set_syscall_error(index, "unlink()");
 		(void)mail_transaction_log_unlink(index->log);
+		mail_index_shared_map_unlink(index);
 	}
 }
 
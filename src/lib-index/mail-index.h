@@ -34,7 +34,11 @@ enum mail_index_open_flags {
 	MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY	= 0x200,
 	/* We're only going to save new messages to the index.
 	   Avoid unnecessary reads. */
-	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400
+	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400,
+	/* When mmap is disabled, publish index file maps in shared memory
+	   and attach to the maps published by other processes instead of
+	   reading the file. */
+	MAIL_INDEX_OPEN_FLAG_SHARED_MAPS	= 0x800
 };
 
 enum mail_index_header_compat_flags {
@@ -257,6 +261,13 @@ int mail_index_open_or_create(struct mail_index *index,
 void mail_index_close(struct mail_index *index);
 /* unlink() all the index files. */
 int mail_index_unlink(struct mail_index *index);
+/* Remove this user's index maps published in shared memory that haven't been
+   republished since min_mtime. If there are still more than max_count maps
+   or their total size is larger than max_size, remove the least recently
+   published ones until they fit. This is also done automatically when
+   publishing maps. */
+void mail_index_shared_maps_cleanup(time_t min_mtime, unsigned int max_count,
+				    uoff_t max_size);
 
 /* Returns TRUE if index is currently in memory. */
 bool mail_index_is_in_memory(struct mail_index *index);
@@ -298,6 +309,13 @@ int mail_index_transaction_commit(struct mail_index_transaction **t);
 int mail_index_transaction_commit_full(struct mail_index_transaction **t,
 				       struct mail_index_transaction_commit_result *result_r);
 void mail_index_transaction_rollback(struct mail_index_transaction **t);
+/* Commit the following transactions as a group: The transaction log is kept
+   locked between the commits, and it's fdatasync()ed only once in
+   mail_index_group_commit_end() instead of after each commit. */
+int mail_index_group_commit_begin(struct mail_index *index);
+/* Returns -1 if the fdatasync() failed, in which case the transactions
+   committed in the group may not be on disk. */
+int mail_index_group_commit_end(struct mail_index *index);
 /* Discard all changes in the transaction. */
 void mail_index_transaction_reset(struct mail_index_transaction *t);
 /* When committing transaction, drop flag/keyword updates for messages whose
@@ -460,6 +478,17 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Returns the UIDs and flags of all the messages in the view as arrays
+   indexed by seq-1. Uncommitted changes in transaction views aren't included.
+   The arrays are valid until the index is modified. */
+void mail_index_view_get_columns(struct mail_index_view *view,
+				 const uint32_t **uids_r,
+				 const uint8_t **flags_r);
+/* Returns the number of mails with (mail->flags & flags_mask) == flags.
+   Uncommitted changes in transaction views aren't included. */
+unsigned int mail_index_view_count_flags(struct mail_index_view *view,
+					 enum mail_flags flags,
+					 uint8_t flags_mask);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
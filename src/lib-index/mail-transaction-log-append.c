@@ -2,8 +2,10 @@
 
 #include "lib.h"
 #include "array.h"
+#include "crc32.h"
 #include "write-full.h"
 #include "mail-index-private.h"
+#include "mail-index-latency.h"
 #include "mail-transaction-log-private.h"
 
 void mail_transaction_log_append_add(struct mail_transaction_log_append_ctx *ctx,
@@ -90,7 +92,9 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 	if ((ctx->want_fsync &&
 	     file->log->index->fsync_mode != FSYNC_MODE_NEVER) ||
 	    file->log->index->fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(file->fd) < 0) {
+		if (file->log->group_commit)
+			file->log->group_fsync_pending = TRUE;
+		else if (fdatasync(file->fd) < 0) {
 			mail_index_file_set_syscall_error(ctx->log->index,
 							  file->filepath,
 							  "fdatasync()");
@@ -191,12 +195,6 @@ mail_transaction_log_append_locked(struct mail_transaction_log_append_ctx *ctx)
 		}
 	}
 
-	/* don't include log_file_tail_offset update in the transaction */
-	boundary = buffer_get_space_unsafe(ctx->output,
-				sizeof(struct mail_transaction_header),
-				sizeof(*boundary));
-	boundary->size = ctx->output->used;
-
 	if (ctx->transaction_count <= 2) {
 		/* 0-1 changes. don't bother with the boundary */
 		unsigned int boundary_size =
@@ -204,6 +202,16 @@ mail_transaction_log_append_locked(struct mail_transaction_log_append_ctx *ctx)
 			sizeof(*boundary);
 
 		buffer_delete(ctx->output, 0, boundary_size);
+	} else {
+		/* don't include log_file_tail_offset update in the
+		   transaction */
+		boundary = buffer_get_space_unsafe(ctx->output,
+					sizeof(struct mail_transaction_header),
+					sizeof(*boundary));
+		boundary->size = ctx->output->used;
+		boundary->crc32 = crc32_data(boundary + 1, ctx->output->used -
+				sizeof(struct mail_transaction_header) -
+				sizeof(*boundary));
 	}
 
 	log_append_sync_offset_if_needed(ctx);
@@ -220,7 +228,7 @@ int mail_transaction_log_append_begin(struct mail_index *index,
 	struct mail_transaction_log_append_ctx *ctx;
 	struct mail_transaction_boundary boundary;
 
-	if (!index->log_sync_locked) {
+	if (!index->log_sync_locked && !index->log->group_commit) {
 		if (mail_transaction_log_lock_head(index->log, "appending") < 0)
 			return -1;
 	}
@@ -241,15 +249,71 @@ int mail_transaction_log_append_commit(struct mail_transaction_log_append_ctx **
 {
 	struct mail_transaction_log_append_ctx *ctx = *_ctx;
 	struct mail_index *index = ctx->log->index;
+	struct timeval start;
 	int ret = 0;
 
 	*_ctx = NULL;
 
+	mail_index_latency_start(&start);
 	ret = mail_transaction_log_append_locked(ctx);
-	if (!index->log_sync_locked)
+	if (!index->log_sync_locked && !index->log->group_commit)
 		mail_transaction_log_file_unlock(index->log->head, "appending");
+	mail_index_latency_end(MAIL_INDEX_LATENCY_LOG_APPEND, &start);
 
 	buffer_free(&ctx->output);
 	i_free(ctx);
 	return ret;
 }
+
+int mail_transaction_log_group_fsync(struct mail_transaction_log *log)
+{
+	struct mail_transaction_log_file *file = log->head;
+
+	if (!log->group_fsync_pending)
+		return 0;
+
+	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file)) {
+		log->group_fsync_pending = FALSE;
+		return 0;
+	}
+	if (fdatasync(file->fd) < 0) {
+		/* keep it pending, so the index isn't written to point to
+		   the unsynced data by the next sync either */
+		mail_index_file_set_syscall_error(log->index, file->filepath,
+						  "fdatasync()");
+		return -1;
+	}
+	log->group_fsync_pending = FALSE;
+	return 0;
+}
+
+int mail_transaction_log_group_commit_begin(struct mail_transaction_log *log)
+{
+	i_assert(!log->group_commit);
+
+	if (!log->index->log_sync_locked) {
+		if (mail_transaction_log_lock_head(log, "group commit") < 0)
+			return -1;
+		log->group_locked = TRUE;
+	}
+	log->group_commit = TRUE;
+	return 0;
+}
+
+int mail_transaction_log_group_commit_end(struct mail_transaction_log *log)
+{
+	int ret;
+
+	i_assert(log->group_commit);
+
+	ret = mail_transaction_log_group_fsync(log);
+	log->group_commit = FALSE;
+	if (log->group_locked) {
+		log->group_locked = FALSE;
+		if (!log->index->log_sync_locked) {
+			mail_transaction_log_file_unlock(log->head,
+							 "group commit");
+		}
+	}
+	return ret;
+}
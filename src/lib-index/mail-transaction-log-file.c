@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "ioloop.h"
+#include "crc32.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "read-full.h"
@@ -10,7 +11,8 @@
 #include "mmap-util.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
-#include "mail-transaction-log-private.h"
+#include "mail-index-latency.h"
+#include "mail-transaction-log-view-private.h"
 
 #define LOG_PREFETCH IO_BLOCK_SIZE
 #define MEMORY_LOG_NAME "(in-memory transaction log file)"
@@ -346,19 +348,12 @@ mail_transaction_log_file_undotlock(struct mail_transaction_log_file *file)
 	return 0;
 }
 
-int mail_transaction_log_file_lock(struct mail_transaction_log_file *file)
+static int
+mail_transaction_log_file_lock_real(struct mail_transaction_log_file *file)
 {
 	unsigned int lock_timeout_secs;
 	int ret;
 
-	if (file->locked)
-		return 0;
-
-	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file)) {
-		file->locked = TRUE;
-		return 0;
-	}
-
 	if (file->log->index->lock_method == FILE_LOCK_METHOD_DOTLOCK)
 		return mail_transaction_log_file_dotlock(file);
 
@@ -394,6 +389,25 @@ int mail_transaction_log_file_lock(struct mail_transaction_log_file *file)
 	return -1;
 }
 
+int mail_transaction_log_file_lock(struct mail_transaction_log_file *file)
+{
+	struct timeval start;
+	int ret;
+
+	if (file->locked)
+		return 0;
+
+	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file)) {
+		file->locked = TRUE;
+		return 0;
+	}
+
+	mail_index_latency_start(&start);
+	ret = mail_transaction_log_file_lock_real(file);
+	mail_index_latency_end(MAIL_INDEX_LATENCY_LOG_LOCK, &start);
+	return ret;
+}
+
 void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file,
 				      const char *lock_reason)
 {
@@ -1060,15 +1074,16 @@ modseq_cache_get_offset(struct mail_transaction_log_file *file, uoff_t offset)
 			continue;
 
 		if (file->modseq_cache[i].offset == 0)
-			return NULL;
+			break;
 
 		if (offset == file->modseq_cache[i].offset) {
 			/* exact cache hit */
 			return modseq_cache_hit(file, i);
 		}
 
+		/* use the closest offset to avoid scanning the file */
 		if (best == UINT_MAX ||
-		    file->modseq_cache[i].offset <
+		    file->modseq_cache[i].offset >
 		    file->modseq_cache[best].offset)
 			best = i;
 	}
@@ -1077,6 +1092,18 @@ modseq_cache_get_offset(struct mail_transaction_log_file *file, uoff_t offset)
 	return &file->modseq_cache[best];
 }
 
+static void
+modseq_cache_add(struct mail_transaction_log_file *file, uoff_t offset,
+		 uint64_t highest_modseq)
+{
+	/* @UNSAFE: cache the value */
+	memmove(file->modseq_cache + 1, file->modseq_cache,
+		sizeof(*file->modseq_cache) *
+		(N_ELEMENTS(file->modseq_cache) - 1));
+	file->modseq_cache[0].offset = offset;
+	file->modseq_cache[0].highest_modseq = highest_modseq;
+}
+
 static struct modseq_cache *
 modseq_cache_get_modseq(struct mail_transaction_log_file *file, uint64_t modseq)
 {
@@ -1087,7 +1114,7 @@ modseq_cache_get_modseq(struct mail_transaction_log_file *file, uint64_t modseq)
 			continue;
 
 		if (file->modseq_cache[i].offset == 0)
-			return NULL;
+			break;
 
 		if (modseq == file->modseq_cache[i].highest_modseq) {
 			/* exact cache hit */
@@ -1095,7 +1122,7 @@ modseq_cache_get_modseq(struct mail_transaction_log_file *file, uint64_t modseq)
 		}
 
 		if (best == UINT_MAX ||
-		    file->modseq_cache[i].highest_modseq <
+		    file->modseq_cache[i].highest_modseq >
 		    file->modseq_cache[best].highest_modseq)
 			best = i;
 	}
@@ -1180,13 +1207,7 @@ int mail_transaction_log_file_get_highest_modseq_at(
 		mail_transaction_update_modseq(hdr, hdr + 1, &cur_modseq);
 	}
 
-	/* @UNSAFE: cache the value */
-	memmove(file->modseq_cache + 1, file->modseq_cache,
-		sizeof(*file->modseq_cache) *
-		(N_ELEMENTS(file->modseq_cache) - 1));
-	file->modseq_cache[0].offset = cur_offset;
-	file->modseq_cache[0].highest_modseq = cur_modseq;
-
+	modseq_cache_add(file, cur_offset, cur_modseq);
 	*highest_modseq_r = cur_modseq;
 	return 0;
 }
@@ -1253,17 +1274,44 @@ int mail_transaction_log_file_get_modseq_next_offset(
 		return -1;
 	}
 
-	/* @UNSAFE: cache the value */
-	memmove(file->modseq_cache + 1, file->modseq_cache,
-		sizeof(*file->modseq_cache) *
-		(N_ELEMENTS(file->modseq_cache) - 1));
-	file->modseq_cache[0].offset = cur_offset;
-	file->modseq_cache[0].highest_modseq = cur_modseq;
-
+	modseq_cache_add(file, cur_offset, cur_modseq);
 	*next_offset_r = cur_offset;
 	return 0;
 }
 
+static int
+log_file_verify_boundary(struct mail_transaction_log_file *file,
+			 const struct mail_transaction_header *hdr,
+			 const struct mail_transaction_boundary *boundary)
+{
+	uint32_t trans_size = mail_index_offset_to_uint32(hdr->size);
+	uint32_t crc;
+
+	if (boundary->size < trans_size) {
+		mail_transaction_log_file_set_corrupted(file,
+			"boundary size too small (%u < %u)",
+			boundary->size, trans_size);
+		return -1;
+	}
+
+	/* only the new data needs to be verified, so a partially read or
+	   mapped file doesn't need to be read again from the beginning. */
+	crc = crc32_data(CONST_PTR_OFFSET(hdr, trans_size),
+			 boundary->size - trans_size);
+	if (crc == boundary->crc32)
+		return 1;
+
+	if (!file->locked) {
+		/* the transaction may still be in the middle of being
+		   written, or we're seeing stale cached data. */
+		return 0;
+	}
+	mail_transaction_log_file_set_corrupted(file,
+		"transaction checksum mismatch at offset %"PRIuUOFF_T
+		" (%x != %x)", file->sync_offset, crc, boundary->crc32);
+	return -1;
+}
+
 static int
 log_file_track_sync(struct mail_transaction_log_file *file,
 		    const struct mail_transaction_header *hdr,
@@ -1311,6 +1359,11 @@ log_file_track_sync(struct mail_transaction_log_file *file,
 			/* the full transaction hasn't been written yet */
 			return 0;
 		}
+		if (trans_size >= sizeof(*hdr) + sizeof(*boundary)) {
+			if ((ret = log_file_verify_boundary(file, hdr,
+							    boundary)) <= 0)
+				return ret;
+		}
 		break;
 	}
 	}
@@ -1331,6 +1384,8 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 	const void *data;
 	struct stat st;
 	size_t size, avail;
+	uoff_t prev_sync_offset = file->sync_offset;
+	uint64_t prev_sync_highest_modseq = file->sync_highest_modseq;
 	uint32_t trans_size = 0;
 	int ret;
 
@@ -1369,6 +1424,14 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 
 		file->sync_offset += trans_size;
 	}
+	if (file->sync_offset != prev_sync_offset &&
+	    prev_sync_offset > file->hdr.hdr_size) {
+		/* views are usually set to start from the previous sync
+		   offset. remember its modseq so it's not necessary to scan
+		   the file from the beginning to find it. */
+		modseq_cache_add(file, prev_sync_offset,
+				 prev_sync_highest_modseq);
+	}
 
 	if (file->mmap_base != NULL && !file->locked) {
 		/* Now that all the mmaped pages have page faulted, check if
@@ -1507,6 +1570,53 @@ mail_transaction_log_file_need_nfs_flush(struct mail_transaction_log_file *file)
 	return FALSE;
 }
 
+static uoff_t
+log_file_get_window_offset(struct mail_transaction_log_file *file,
+			   uoff_t start_offset)
+{
+	struct mail_transaction_log_view *view;
+	uoff_t offset = start_offset;
+
+	/* find the lowest offset that any of the views may still read */
+	for (view = file->log->views; view != NULL; view = view->next) {
+		if (view->mark_file == file && view->mark_offset < offset)
+			offset = view->mark_offset;
+		if (view->cur == NULL)
+			continue;
+
+		if (view->cur == file) {
+			if (view->cur_offset < offset)
+				offset = view->cur_offset;
+		} else if (view->cur->hdr.file_seq < file->hdr.file_seq &&
+			   view->head->hdr.file_seq >= file->hdr.file_seq) {
+			/* the view hasn't reached this file yet */
+			offset = file->hdr.hdr_size;
+		}
+	}
+	return offset;
+}
+
+static void
+log_file_buffer_drop_old(struct mail_transaction_log_file *file,
+			 uoff_t start_offset)
+{
+	uoff_t offset;
+
+	offset = log_file_get_window_offset(file, start_offset);
+	offset = I_MIN(offset, file->buffer_offset + file->buffer->used);
+
+	if (offset <= file->buffer_offset ||
+	    offset - file->buffer_offset < LOG_PREFETCH) {
+		/* not worth the memmove() */
+		return;
+	}
+	/* none of the views can access the beginning of the buffer anymore.
+	   drop it, so the buffer grows only with the data that may still be
+	   read. */
+	buffer_delete(file->buffer, 0, offset - file->buffer_offset);
+	file->buffer_offset = offset;
+}
+
 static int
 mail_transaction_log_file_read(struct mail_transaction_log_file *file,
 			       uoff_t start_offset, bool nfs_flush)
@@ -1580,15 +1690,23 @@ log_file_map_check_offsets(struct mail_transaction_log_file *file,
 }
 
 static int
-mail_transaction_log_file_mmap(struct mail_transaction_log_file *file)
+mail_transaction_log_file_mmap(struct mail_transaction_log_file *file,
+			       uoff_t start_offset)
 {
+	uoff_t map_offset;
+
 	if (file->buffer != NULL) {
 		/* in case we just switched to mmaping */
 		buffer_free(&file->buffer);
 	}
-	file->mmap_size = file->last_size;
+	/* map only the window from the oldest offset that the views can
+	   still read up to EOF. */
+	map_offset = log_file_get_window_offset(file, start_offset);
+	map_offset -= map_offset % mmap_get_page_size();
+
+	file->mmap_size = file->last_size - map_offset;
 	file->mmap_base = mmap(NULL, file->mmap_size, PROT_READ, MAP_SHARED,
-			       file->fd, 0);
+			       file->fd, map_offset);
 	if (file->mmap_base == MAP_FAILED) {
 		file->mmap_base = NULL;
 		file->mmap_size = 0;
@@ -1605,7 +1723,7 @@ mail_transaction_log_file_mmap(struct mail_transaction_log_file *file)
 	buffer_create_from_const_data(&file->mmap_buffer,
 				      file->mmap_base, file->mmap_size);
 	file->buffer = &file->mmap_buffer;
-	file->buffer_offset = 0;
+	file->buffer_offset = map_offset;
 	return 0;
 }
 
@@ -1632,7 +1750,6 @@ mail_transaction_log_file_map_mmap(struct mail_transaction_log_file *file,
 
 	/* we are going to mmap() this file, but it's not necessarily
 	   mmaped currently. */
-	i_assert(file->buffer_offset == 0 || file->mmap_base == NULL);
 	i_assert(file->mmap_size == 0 || file->mmap_base != NULL);
 
 	if (fstat(file->fd, &st) < 0) {
@@ -1668,7 +1785,7 @@ mail_transaction_log_file_map_mmap(struct mail_transaction_log_file *file,
 							      FALSE);
 		}
 
-		if (mail_transaction_log_file_mmap(file) < 0)
+		if (mail_transaction_log_file_mmap(file, start_offset) < 0)
 			return -1;
 		if ((ret = mail_transaction_log_file_sync(file)) < 0)
 			return 0;
@@ -1705,6 +1822,12 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 		end_offset = file->sync_offset;
 	}
 
+	if (file->buffer != NULL && file->mmap_base == NULL &&
+	    !MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file)) {
+		log_file_buffer_drop_old(file,
+					 I_MIN(start_offset, file->sync_offset));
+	}
+
 	if (file->buffer != NULL && file->buffer_offset <= start_offset) {
 		/* see if we already have it */
 		size = file->buffer->used;
@@ -1766,8 +1889,6 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 
 	if (file->mmap_base != NULL) {
 		/* just copy to memory */
-		i_assert(file->buffer_offset == 0);
-
 		buf = buffer_create_dynamic(default_pool, file->mmap_size);
 		buffer_append(buf, file->mmap_base, file->mmap_size);
 		buffer_free(&file->buffer);
@@ -1777,7 +1898,8 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 		if (munmap(file->mmap_base, file->mmap_size) < 0)
 			log_file_set_syscall_error(file, "munmap()");
 		file->mmap_base = NULL;
-	} else if (file->buffer_offset != 0) {
+	}
+	if (file->buffer_offset != 0) {
 		/* we don't have the full log in the memory. read it. */
 		(void)mail_transaction_log_file_read(file, 0, FALSE);
 	}
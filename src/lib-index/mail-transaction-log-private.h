@@ -99,6 +99,12 @@ struct mail_transaction_log {
 
 	unsigned int nfs_flush:1;
 	unsigned int log_2_unlink_checked:1;
+	/* Group commit is open: the appends don't unlock the head file and
+	   their fdatasync()s are delayed until the group is finished. */
+	unsigned int group_commit:1;
+	/* the head was locked for the group commit */
+	unsigned int group_locked:1;
+	unsigned int group_fsync_pending:1;
 };
 
 void
@@ -120,6 +126,8 @@ int mail_transaction_log_file_open(struct mail_transaction_log_file *file);
 int mail_transaction_log_file_create(struct mail_transaction_log_file *file,
 				     bool reset);
 int mail_transaction_log_file_lock(struct mail_transaction_log_file *file);
+/* fdatasync() the head file if a group commit has delayed it. */
+int mail_transaction_log_group_fsync(struct mail_transaction_log *log);
 
 int mail_transaction_log_find_file(struct mail_transaction_log *log,
 				   uint32_t file_seq, bool nfs_flush,
@@ -233,6 +233,10 @@ int mail_transaction_log_rotate(struct mail_transaction_log *log, bool reset)
 
 	i_assert(log->head->locked);
 
+	/* the old file must be on disk before the new one refers to it */
+	if (mail_transaction_log_group_fsync(log) < 0)
+		return -1;
+
 	if (MAIL_INDEX_IS_IN_MEMORY(log->index)) {
 		file = mail_transaction_log_file_alloc_in_memory(log);
 		if (reset) {
@@ -516,7 +520,14 @@ void mail_transaction_log_sync_unlock(struct mail_transaction_log *log,
 	i_assert(log->index->log_sync_locked);
 
 	log->index->log_sync_locked = FALSE;
-	mail_transaction_log_file_unlock(log->head, lock_reason);
+	if (log->group_commit && !log->group_locked) {
+		/* group commit was started while syncing. it keeps the lock
+		   now. */
+		log->group_locked = TRUE;
+		return;
+	}
+	if (!log->group_locked)
+		mail_transaction_log_file_unlock(log->head, lock_reason);
 }
 
 void mail_transaction_log_get_head(struct mail_transaction_log *log,
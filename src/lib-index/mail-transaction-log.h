@@ -165,6 +165,10 @@ struct mail_transaction_ext_atomic_inc {
 
 struct mail_transaction_boundary {
 	uint32_t size;
+	/* crc32 of the rest of the transaction after this record. Older
+	   versions wrote only the size, so this exists only if the record is
+	   large enough. */
+	uint32_t crc32;
 };
 
 struct mail_transaction_log_append_ctx {
@@ -275,6 +279,13 @@ void mail_transaction_log_append_add(struct mail_transaction_log_append_ctx *ctx
 				     const void *data, size_t size);
 int mail_transaction_log_append_commit(struct mail_transaction_log_append_ctx **ctx);
 
+/* Start a group commit: Until mail_transaction_log_group_commit_end() the head
+   file is kept locked between appends, and instead of fdatasync()ing each
+   append it's done once at the end. Returns -1 if locking failed. */
+int mail_transaction_log_group_commit_begin(struct mail_transaction_log *log);
+/* Returns -1 if the delayed fdatasync() failed. */
+int mail_transaction_log_group_commit_end(struct mail_transaction_log *log);
+
 /* Lock transaction log for index synchronization. Log cannot be read or
    written to while it's locked. Returns end offset. */
 int mail_transaction_log_sync_lock(struct mail_transaction_log *log,
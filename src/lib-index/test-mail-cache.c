@@ -0,0 +1,477 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-cache-private.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-cache"
+#define TEST_MESSAGE_COUNT 100
+
+static struct mail_cache_field test_cache_fields[] = {
+	{ .name = "test.fixed", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "test.string", .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static void test_mail_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	int ret;
+
+	ret = mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0);
+	test_assert(ret >= 0);
+	if (ret > 0)
+		test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void
+test_mail_cache_fill(struct mail_index *index, uint32_t first_seq,
+		     uint32_t last_seq)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const char *str;
+	uint32_t seq, value, uid_validity = 1;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = first_seq; seq <= last_seq; seq++)
+		mail_index_append(trans, seq, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_sync(index);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_view = mail_cache_view_open(index->cache, view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = first_seq; seq <= last_seq; seq++) {
+		/* leave some holes into the columns */
+		if (seq % 3 != 0) {
+			value = seq * 1000;
+			mail_cache_add(cache_trans, seq,
+				       test_cache_fields[0].idx,
+				       &value, sizeof(value));
+		}
+		str = t_strdup_printf("string %u", seq);
+		mail_cache_add(cache_trans, seq, test_cache_fields[1].idx,
+			       str, strlen(str)+1);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void
+test_mail_cache_add_field(struct mail_index *index, uint32_t seq,
+			  unsigned int field_idx)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t value = seq * 1000;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_view = mail_cache_view_open(index->cache, view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, seq, field_idx, &value, sizeof(value));
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void
+test_mail_cache_verify_field(struct mail_index *index, uint32_t seq,
+			     unsigned int field_idx)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	uint32_t value;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	buf = buffer_create_dynamic(default_pool, 16);
+	test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+						field_idx) == 1, seq);
+	test_assert_idx(buf->used == sizeof(value), seq);
+	if (buf->used == sizeof(value)) {
+		memcpy(&value, buf->data, sizeof(value));
+		test_assert_idx(value == seq * 1000, seq);
+	}
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_cache_compress(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+
+	/* compression is skipped if the file doesn't look like it needs it */
+	index->cache->need_compress_file_seq = index->cache->hdr->file_seq;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	test_assert(mail_cache_compress(index->cache, trans, &lock) == 0);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_compress_unlock(&lock);
+	mail_index_view_close(&view);
+}
+
+static void
+test_mail_cache_verify(struct mail_index *index, uint32_t message_count,
+		       uint32_t extra_fixed_seq)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	uint32_t seq, value;
+	const char *str;
+	int ret;
+
+	test_mail_index_sync(index);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	buf = buffer_create_dynamic(default_pool, 64);
+	test_assert(mail_index_view_get_messages_count(view) == message_count);
+	for (seq = 1; seq <= message_count; seq++) {
+		buffer_set_used_size(buf, 0);
+		ret = mail_cache_lookup_field(cache_view, buf, seq,
+					      test_cache_fields[0].idx);
+		if (seq % 3 == 0 && seq != extra_fixed_seq)
+			test_assert_idx(ret == 0, seq);
+		else {
+			test_assert_idx(ret == 1 && buf->used == sizeof(value), seq);
+			memcpy(&value, buf->data, sizeof(value));
+			test_assert_idx(value == seq * 1000, seq);
+		}
+
+		buffer_set_used_size(buf, 0);
+		ret = mail_cache_lookup_field(cache_view, buf, seq,
+					      test_cache_fields[1].idx);
+		str = t_strdup_printf("string %u", seq);
+		test_assert_idx(ret == 1 && buf->used == strlen(str)+1 &&
+				memcmp(buf->data, str, buf->used) == 0, seq);
+		test_assert_idx(mail_cache_field_exists_any(cache_view, seq), seq);
+	}
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_cache_verify_read(void)
+{
+	struct mail_index *index;
+
+	/* columns are looked up also when the file isn't mmap()ed */
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open(index, MAIL_INDEX_OPEN_FLAG_SAVEONLY) == 1);
+	mail_cache_register_fields(index->cache, test_cache_fields,
+				   N_ELEMENTS(test_cache_fields));
+	test_assert(index->cache->map_with_read);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+	test_assert(array_count(&index->cache->columns) == 1);
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static void test_mail_cache_columns_reset(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	uint32_t seq;
+
+	/* the index no longer refers to this cache file, e.g. after the
+	   cache was reset */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_ext_reset(trans, index->cache->ext_id,
+			     index->cache->hdr->file_seq + 1, TRUE);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_sync(index);
+
+	/* so the columns' UIDs may belong to different messages */
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	buf = buffer_create_dynamic(default_pool, 16);
+	for (seq = 1; seq <= TEST_MESSAGE_COUNT; seq++) {
+		test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+					test_cache_fields[0].idx) == 0, seq);
+		test_assert_idx(mail_cache_field_exists(cache_view, seq,
+					test_cache_fields[0].idx) == 0, seq);
+		test_assert_idx(!mail_cache_field_exists_any(cache_view, seq), seq);
+	}
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_cache_columns(void)
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+
+	test_begin("mail cache columns");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	cache = index->cache;
+	mail_cache_register_fields(cache, test_cache_fields,
+				   N_ELEMENTS(test_cache_fields));
+	mail_cache_set_columns(cache, TRUE);
+
+	test_mail_cache_fill(index, 1, TEST_MESSAGE_COUNT);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+
+	/* the fixed size field is moved to columns */
+	test_mail_cache_compress(index);
+	test_assert(cache->hdr->minor_version == MAIL_CACHE_MINOR_VERSION_COLUMNS);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+	test_assert(array_count(&cache->columns) == 1);
+	test_assert(array_count(&cache->column_uids) == TEST_MESSAGE_COUNT);
+	test_mail_cache_verify_read();
+
+	/* compressing keeps the columns */
+	test_mail_cache_compress(index);
+	test_assert(cache->hdr->minor_version == MAIL_CACHE_MINOR_VERSION_COLUMNS);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+
+	/* and the values are moved back to records when columns are
+	   disabled */
+	mail_cache_set_columns(cache, FALSE);
+	test_mail_cache_compress(index);
+	test_assert(cache->hdr->minor_version == MAIL_CACHE_MINOR_VERSION);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+	test_assert(array_count(&cache->columns) == 0);
+
+	/* columns are used only while the index refers to their file */
+	mail_cache_set_columns(cache, TRUE);
+	test_mail_cache_compress(index);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT, 0);
+	test_assert(array_count(&cache->columns) == 1);
+	test_mail_cache_columns_reset(index);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+static void test_mail_cache_header_fields_chain(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+	uint32_t seq = 1, uid_validity = 1;
+
+	test_begin("mail cache header fields chain");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	mail_cache_register_fields(index->cache, test_cache_fields,
+				   N_ELEMENTS(test_cache_fields));
+
+	/* a file without records has the fields header right after the
+	   cache header. older versions write back 32 bytes of the header
+	   when unlocking, so it must not grow or the following fields
+	   header gets overwritten. */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	mail_index_append(trans, 1, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_sync(index);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	test_assert(mail_cache_compress(index->cache, trans, &lock) == 0);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_compress_unlock(&lock);
+	mail_index_view_close(&view);
+	test_assert(sizeof(struct mail_cache_header) == 32);
+	test_assert(index->cache->hdr->field_header_offset ==
+		    mail_index_uint32_to_offset(32));
+
+	/* adding a new field links a new fields header to it while the
+	   cache is locked. unlocking must not overwrite the link. */
+	test_mail_cache_add_field(index, 1, test_cache_fields[0].idx);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open(index, 0) == 1);
+	mail_cache_register_fields(index->cache, test_cache_fields,
+				   N_ELEMENTS(test_cache_fields));
+	test_mail_index_sync(index);
+	test_mail_cache_verify_field(index, 1, test_cache_fields[0].idx);
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+static void test_mail_cache_compress_incremental(void)
+{
+	struct mail_cache_field new_field = {
+		.name = "test.new", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+		.field_size = sizeof(uint32_t),
+		.decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED
+	};
+	struct mail_index *index;
+	struct mail_cache *cache;
+	struct dotlock *dotlock;
+	struct stat st;
+	const char *lock_path, *temp_path;
+	unsigned int copied, total;
+	uint32_t file_seq;
+
+	test_begin("mail cache compress incremental");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	cache = index->cache;
+	mail_cache_register_fields(cache, test_cache_fields,
+				   N_ELEMENTS(test_cache_fields));
+	mail_cache_set_columns(cache, TRUE);
+	mail_cache_set_compress_batch_size(cache, 40);
+	test_mail_cache_fill(index, 1, TEST_MESSAGE_COUNT);
+	test_mail_index_sync(index);
+
+	file_seq = cache->hdr->file_seq;
+	cache->need_compress_file_seq = file_seq;
+	test_assert(!mail_cache_compress_get_progress(cache, &copied, &total));
+
+	/* each index sync copies one batch without touching the cache file */
+	test_mail_index_sync(index);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(copied == 40 && total == TEST_MESSAGE_COUNT);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	/* registering a new field keeps the progress. the new field is
+	   added to an already copied message and to one that isn't. */
+	mail_cache_register_fields(cache, &new_field, 1);
+	test_mail_cache_add_field(index, 2, new_field.idx);
+	test_mail_cache_add_field(index, 50, new_field.idx);
+
+	/* change an already copied message and add a new one. they're
+	   copied again when finishing. */
+	test_mail_cache_add_field(index, 3, test_cache_fields[0].idx);
+	test_mail_cache_fill(index, TEST_MESSAGE_COUNT + 1,
+			     TEST_MESSAGE_COUNT + 1);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(copied == 80 && total == TEST_MESSAGE_COUNT + 1);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	/* the last batch is copied, finishing is done by the next sync */
+	test_mail_index_sync(index);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(copied == TEST_MESSAGE_COUNT + 1);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	test_mail_index_sync(index);
+	test_assert(!mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(cache->hdr->file_seq != file_seq);
+	test_assert(cache->hdr->minor_version == MAIL_CACHE_MINOR_VERSION_COLUMNS);
+	test_assert(cache->need_compress_file_seq == 0);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT + 1, 3);
+	test_mail_cache_verify_field(index, 2, new_field.idx);
+	test_mail_cache_verify_field(index, 50, new_field.idx);
+
+	/* full compression replaces an unfinished incremental one */
+	file_seq = cache->hdr->file_seq;
+	cache->need_compress_file_seq = file_seq;
+	test_mail_index_sync(index);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_mail_cache_compress(index);
+	test_assert(!mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(cache->hdr->file_seq != file_seq);
+	test_mail_cache_verify(index, TEST_MESSAGE_COUNT + 1, 3);
+
+	/* the compression isn't locked between the batches */
+	file_seq = cache->hdr->file_seq;
+	cache->need_compress_file_seq = file_seq;
+	test_mail_index_sync(index);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(copied == 40);
+	lock_path = t_strconcat(cache->filepath, ".lock", NULL);
+	test_assert(stat(lock_path, &st) < 0 && errno == ENOENT);
+	temp_path = t_strdup_printf("%s.%s.%s.tmp", cache->filepath,
+				    my_hostname, my_pid);
+	test_assert(stat(temp_path, &st) == 0);
+
+	/* someone else is compressing. wait for it for a while, but then
+	   give up and remove the temp file */
+	test_assert(file_dotlock_create(&cache->dotlock_settings,
+					cache->filepath,
+					DOTLOCK_CREATE_FLAG_NONBLOCK,
+					&dotlock) > 0);
+	test_mail_index_sync(index);
+	test_assert(mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(copied == 40);
+	ioloop_time += MAIL_CACHE_COMPRESS_INCR_TIMEOUT_SECS;
+	test_mail_index_sync(index);
+	test_assert(!mail_cache_compress_get_progress(cache, &copied, &total));
+	test_assert(stat(temp_path, &st) < 0 && errno == ENOENT);
+	ioloop_time -= MAIL_CACHE_COMPRESS_INCR_TIMEOUT_SECS;
+	file_dotlock_delete(&dotlock);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_columns,
+		test_mail_cache_header_fields_chain,
+		test_mail_cache_compress_incremental,
+		NULL
+	};
+	/* indexid is taken from ioloop_time */
+	ioloop_time = time(NULL);
+	return test_run(test_functions);
+}
@@ -0,0 +1,110 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-latency.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-index-latency"
+
+static void test_mail_index_latency_bucket(void)
+{
+	static const struct {
+		uint64_t usecs;
+		unsigned int bucket;
+	} tests[] = {
+		{ 0, 0 }, { 1, 0 }, { 3, 0 },
+		{ 4, 1 }, { 15, 1 }, { 16, 2 },
+		{ 1023, 4 }, { 1024, 5 },
+		{ 262143, 8 }, { 262144, 9 },
+		{ 1000000000, 9 }
+	};
+	struct mail_index_latency_histogram *hist =
+		&mail_index_latencies[MAIL_INDEX_LATENCY_LOG_LOCK];
+	unsigned int i;
+
+	test_begin("mail index latency bucket");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(mail_index_latency_bucket(tests[i].usecs) ==
+				tests[i].bucket, i);
+	}
+
+	memset(hist, 0, sizeof(*hist));
+	mail_index_latency_add(MAIL_INDEX_LATENCY_LOG_LOCK, 5);
+	mail_index_latency_add(MAIL_INDEX_LATENCY_LOG_LOCK, 10);
+	mail_index_latency_add(MAIL_INDEX_LATENCY_LOG_LOCK, 2000);
+	test_assert(hist->count == 3 && hist->usecs == 2015);
+	test_assert(hist->buckets[1] == 2 && hist->buckets[5] == 1);
+	memset(hist, 0, sizeof(*hist));
+	test_end();
+}
+
+static void test_mail_index_latency_sync(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view, *sync_view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view_sync_ctx *view_sync_ctx;
+	struct mail_index_view_sync_rec sync_rec;
+	struct mail_index_latency_histogram old[MAIL_INDEX_LATENCY_TYPE_COUNT];
+	uint32_t seq, uid_validity = 1;
+	bool delayed_expunges;
+
+	test_begin("mail index latency sync");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	memcpy(old, mail_index_latencies, sizeof(old));
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	mail_index_append(trans, 1, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_assert(mail_index_latencies[MAIL_INDEX_LATENCY_LOG_APPEND].count ==
+		    old[MAIL_INDEX_LATENCY_LOG_APPEND].count + 1);
+	test_assert(mail_index_latencies[MAIL_INDEX_LATENCY_LOG_LOCK].count >
+		    old[MAIL_INDEX_LATENCY_LOG_LOCK].count);
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &sync_view,
+					  &trans, 0) > 0);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+	test_assert(mail_index_latencies[MAIL_INDEX_LATENCY_INDEX_SYNC].count ==
+		    old[MAIL_INDEX_LATENCY_INDEX_SYNC].count + 1);
+
+	view_sync_ctx = mail_index_view_sync_begin(view, 0);
+	while (mail_index_view_sync_next(view_sync_ctx, &sync_rec)) ;
+	test_assert(mail_index_view_sync_commit(&view_sync_ctx,
+						&delayed_expunges) == 0);
+	test_assert(mail_index_latencies[MAIL_INDEX_LATENCY_VIEW_SYNC].count ==
+		    old[MAIL_INDEX_LATENCY_VIEW_SYNC].count + 1);
+	mail_index_view_close(&view);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_latency_bucket,
+		test_mail_index_latency_sync,
+		NULL
+	};
+	/* indexid is taken from ioloop_time */
+	ioloop_time = time(NULL);
+	return test_run(test_functions);
+}
@@ -2,10 +2,20 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
 #include "test-common.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 #include "mail-index-transaction-private.h"
+#include "mail-transaction-log-private.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-index-map"
+#define TEST_SHARED_OPEN_FLAGS \
+	(MAIL_INDEX_OPEN_FLAG_CREATE | MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE | \
+	 MAIL_INDEX_OPEN_FLAG_SHARED_MAPS)
 
 static void test_mail_index_map_lookup_seq_range_count(unsigned int messages_count)
 {
@@ -47,11 +57,350 @@ static void test_mail_index_map_lookup_seq_range(void)
 	test_end();
 }
 
+static void
+test_mail_index_map_flags_verify(struct mail_index_map *map,
+				 uint8_t flags, uint8_t flags_mask)
+{
+	uint32_t seq1, seq2, seq, first_seq;
+	unsigned int count;
+
+	for (seq1 = 1; seq1 <= map->hdr.messages_count; seq1++) {
+		for (seq2 = seq1; seq2 <= map->hdr.messages_count; seq2++) {
+			first_seq = 0; count = 0;
+			for (seq = seq1; seq <= seq2; seq++) {
+				if ((MAIL_INDEX_REC_AT_SEQ(map, seq)->flags &
+				     flags_mask) == flags) {
+					if (first_seq == 0)
+						first_seq = seq;
+					count++;
+				}
+			}
+			test_assert_idx(mail_index_map_find_flags(map, seq1, seq2,
+					flags, flags_mask) == first_seq, seq1);
+			test_assert_idx(mail_index_map_count_flags(map, seq1, seq2,
+					flags, flags_mask) == count, seq1);
+		}
+	}
+}
+
+static void
+test_mail_index_map_columns_impl(enum mail_index_flags_scan_impl impl,
+				 const char *name)
+{
+	struct mail_index_record_map rec_map;
+	struct mail_index_map map;
+	const uint32_t *uids;
+	const uint8_t *flags;
+	uint32_t seq;
+
+	if (!mail_index_flags_scan_set_impl(impl))
+		return;
+
+	test_begin(t_strdup_printf("mail index map columns %s", name));
+	memset(&map, 0, sizeof(map));
+	memset(&rec_map, 0, sizeof(rec_map));
+	map.rec_map = &rec_map;
+	/* more than two AVX2 blocks */
+	map.hdr.messages_count = 75;
+	map.hdr.record_size = sizeof(struct mail_index_record);
+	rec_map.records_count = map.hdr.messages_count;
+	rec_map.records = i_new(struct mail_index_record, map.hdr.messages_count);
+
+	for (seq = 1; seq <= map.hdr.messages_count; seq++) {
+		MAIL_INDEX_REC_AT_SEQ(&map, seq)->uid = seq*2;
+		if (seq % 3 == 0)
+			MAIL_INDEX_REC_AT_SEQ(&map, seq)->flags = MAIL_SEEN;
+		if (seq % 7 == 0)
+			MAIL_INDEX_REC_AT_SEQ(&map, seq)->flags |= MAIL_DELETED;
+	}
+	mail_index_map_get_columns(&map, &uids, &flags);
+	for (seq = 1; seq <= map.hdr.messages_count; seq++) {
+		test_assert_idx(uids[seq-1] == seq*2, seq);
+		test_assert_idx(flags[seq-1] ==
+				MAIL_INDEX_REC_AT_SEQ(&map, seq)->flags, seq);
+	}
+	test_mail_index_map_flags_verify(&map, MAIL_SEEN, MAIL_SEEN);
+	test_mail_index_map_flags_verify(&map, 0, MAIL_SEEN);
+	test_mail_index_map_flags_verify(&map, MAIL_SEEN | MAIL_DELETED,
+					 MAIL_SEEN | MAIL_DELETED);
+	test_mail_index_map_flags_verify(&map, MAIL_FLAGGED, MAIL_FLAGGED);
+
+	/* changes are seen after invalidation */
+	MAIL_INDEX_REC_AT_SEQ(&map, 20)->flags = MAIL_FLAGGED;
+	mail_index_map_columns_invalidate(&map, 20);
+	test_mail_index_map_flags_verify(&map, MAIL_FLAGGED, MAIL_FLAGGED);
+	test_mail_index_map_flags_verify(&map, 0, MAIL_SEEN);
+
+	mail_index_record_map_columns_free(&rec_map);
+	i_free(rec_map.records);
+	test_end();
+}
+
+static void test_mail_index_map_columns(void)
+{
+	test_mail_index_map_columns_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_SWAR,
+					 "swar");
+	test_mail_index_map_columns_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_SSE2,
+					 "sse2");
+	test_mail_index_map_columns_impl(MAIL_INDEX_FLAGS_SCAN_IMPL_AVX2,
+					 "avx2");
+	mail_index_flags_scan_set_best_impl();
+}
+
+static void test_mail_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	int ret;
+
+	ret = mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0);
+	test_assert(ret >= 0);
+	if (ret > 0)
+		test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static struct mail_index *test_mail_index_shared_open(const char *prefix)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TEST_DIR, prefix);
+	test_assert(mail_index_open_or_create(index,
+					      TEST_SHARED_OPEN_FLAGS) == 0);
+	return index;
+}
+
+static void test_mail_index_shared_write(const char *prefix)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	/* write an index file with some messages */
+	index = test_mail_index_shared_open(prefix);
+	mail_index_shared_map_unlink(index);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= 10; seq++)
+		mail_index_append(trans, seq, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	index->need_recreate = TRUE;
+	test_mail_index_sync(index);
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static bool test_mail_index_shared_is_attached(const char *prefix)
+{
+	struct mail_index *index;
+	bool attached;
+
+	index = test_mail_index_shared_open(prefix);
+	attached = !MAIL_INDEX_MAP_IS_IN_MEMORY(index->map);
+	mail_index_close(index);
+	mail_index_free(&index);
+	return attached;
+}
+
+static void test_mail_index_map_shared(void)
+{
+	struct mail_index *index, *index2, *index3;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_record *rec;
+
+	test_begin("mail index map shared");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	test_mail_index_shared_write("test.index");
+
+	/* the first reader publishes the map */
+	index2 = test_mail_index_shared_open("test.index");
+	test_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(index2->map->hdr.messages_count == 10);
+
+	/* and the second one attaches to it */
+	index3 = test_mail_index_shared_open("test.index");
+#ifdef HAVE_SHM_OPEN
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index3->map));
+#endif
+	test_assert(index3->map->hdr.messages_count == 10);
+	test_assert(index3->map->hdr.uid_validity == 1);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(index3->map, 10)->uid == 10);
+
+	/* modifying the attached map doesn't affect the other process */
+	view = mail_index_view_open(index3);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags(trans, 1, MODIFY_ADD, MAIL_SEEN);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_sync(index3);
+	rec = MAIL_INDEX_REC_AT_SEQ(index3->map, 1);
+	test_assert(rec->flags == MAIL_SEEN);
+	rec = MAIL_INDEX_REC_AT_SEQ(index2->map, 1);
+	test_assert(rec->flags == 0);
+
+	/* until it syncs the change from the transaction log */
+	test_mail_index_sync(index2);
+	rec = MAIL_INDEX_REC_AT_SEQ(index2->map, 1);
+	test_assert(rec->flags == MAIL_SEEN);
+
+	/* recently published maps aren't cleaned up */
+	mail_index_shared_maps_cleanup(time(NULL) - 3600, UINT_MAX,
+				       (uoff_t)-1);
+#ifdef HAVE_SHM_OPEN
+	test_assert(test_mail_index_shared_is_attached("test.index"));
+#endif
+
+	/* stale maps are. the next reader publishes the map again. */
+	mail_index_shared_maps_cleanup(time(NULL) + 1, UINT_MAX, (uoff_t)-1);
+	test_assert(!test_mail_index_shared_is_attached("test.index"));
+
+	/* the least recently published maps are removed first to stay
+	   within the count and size limits */
+	test_mail_index_shared_write("test2.index");
+	test_assert(!test_mail_index_shared_is_attached("test2.index"));
+	mail_index_shared_maps_cleanup(time(NULL) - 3600, 1, (uoff_t)-1);
+#ifdef HAVE_SHM_OPEN
+	test_assert(test_mail_index_shared_is_attached("test2.index"));
+#endif
+	test_assert(!test_mail_index_shared_is_attached("test.index"));
+	mail_index_shared_maps_cleanup(time(NULL) - 3600, UINT_MAX, 0);
+	test_assert(!test_mail_index_shared_is_attached("test2.index"));
+	test_assert(!test_mail_index_shared_is_attached("test.index"));
+	index = test_mail_index_shared_open("test2.index");
+	test_assert(mail_index_unlink(index) == 0);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	/* unlinking the index removes its map */
+	test_assert(mail_index_unlink(index3) == 0);
+	index = test_mail_index_shared_open("test.index");
+	test_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(index->map));
+	test_assert(index->map->hdr.messages_count == 0);
+	test_assert(mail_index_unlink(index) == 0);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	mail_index_close(index2);
+	mail_index_free(&index2);
+	mail_index_close(index3);
+	mail_index_free(&index3);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+static void test_mail_index_map_replaced(void)
+{
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_map *old_map;
+	struct stat st;
+	uint32_t seq, uid_validity = 1;
+	ino_t old_ino;
+	int fd[2], log_fd;
+
+	test_begin("mail index map replaced");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= 10; seq++)
+		mail_index_append(trans, seq, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	index->need_recreate = TRUE;
+	test_mail_index_sync(index);
+
+	/* a reader keeps using its map without any locks */
+	index2 = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index2, 0) == 0);
+	test_assert(fstat(index2->fd, &st) == 0);
+	old_ino = st.st_ino;
+	old_map = index2->map;
+	old_map->refcount++;
+
+	/* while the writer replaces the file */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	for (seq = 11; seq <= 20; seq++)
+		mail_index_append(trans, seq, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	index->need_recreate = TRUE;
+	test_mail_index_sync(index);
+	test_assert(stat(index->filepath, &st) == 0 && st.st_ino != old_ino);
+
+	test_assert(old_map->hdr.messages_count == 10);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(old_map, 10)->uid == 10);
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(index2->map->hdr.messages_count == 20);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(index2->map, 20)->uid == 20);
+	test_assert(old_map->hdr.messages_count == 10);
+	mail_index_unmap(&old_map);
+
+	/* the index isn't replaced if the log can't be fsynced */
+	test_assert(stat(index->filepath, &st) == 0);
+	old_ino = st.st_ino;
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &trans,
+					  0) == 1);
+	/* fdatasync() fails for pipes */
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	log_fd = index->log->head->fd;
+	index->log->head->fd = fd[0];
+	index->log->group_fsync_pending = TRUE;
+	index->need_recreate = FALSE;
+	test_expect_errors(2);
+	mail_index_write(index, FALSE);
+	test_expect_no_more_errors();
+	index->log->head->fd = log_fd;
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	test_assert(index->need_recreate);
+	test_assert(index->log->group_fsync_pending);
+	test_assert(stat(index->filepath, &st) == 0 && st.st_ino == old_ino);
+	mail_index_sync_rollback(&sync_ctx);
+	/* the next sync writes it */
+	test_mail_index_sync(index);
+	test_assert(!index->log->group_fsync_pending);
+	test_assert(stat(index->filepath, &st) == 0 && st.st_ino != old_ino);
+
+	mail_index_close(index2);
+	mail_index_free(&index2);
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_mail_index_map_lookup_seq_range,
+		test_mail_index_map_columns,
+		test_mail_index_map_shared,
+		test_mail_index_map_replaced,
 		NULL
 	};
+	/* indexid is taken from ioloop_time */
+	ioloop_time = time(NULL);
 	return test_run(test_functions);
 }
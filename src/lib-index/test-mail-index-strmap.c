@@ -0,0 +1,206 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-strmap.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-index-strmap"
+#define TEST_MESSAGE_COUNT 100
+/* every n-th message has the same Message-ID */
+#define TEST_MSGID_COUNT 50
+
+static const char *test_strmap_get_str(uint32_t uid, uint32_t ref_index)
+{
+	/* ref_index=1 is In-Reply-To: to the previous message */
+	if (ref_index == 1)
+		uid--;
+	return t_strdup_printf("<%u@example.com>", uid % TEST_MSGID_COUNT);
+}
+
+static bool
+test_strmap_key_cmp(const char *key, const struct mail_index_strmap_rec *rec,
+		    void *context ATTR_UNUSED)
+{
+	return strcmp(key, test_strmap_get_str(rec->uid, rec->ref_index)) == 0;
+}
+
+static int
+test_strmap_rec_cmp(const struct mail_index_strmap_rec *rec1,
+		    const struct mail_index_strmap_rec *rec2,
+		    void *context ATTR_UNUSED)
+{
+	return strcmp(test_strmap_get_str(rec1->uid, rec1->ref_index),
+		      test_strmap_get_str(rec2->uid, rec2->ref_index)) == 0 ?
+		1 : 0;
+}
+
+static void
+test_strmap_remap(const uint32_t *idx_map ATTR_UNUSED,
+		  unsigned int old_count ATTR_UNUSED,
+		  unsigned int new_count ATTR_UNUSED,
+		  void *context ATTR_UNUSED)
+{
+}
+
+static void test_mail_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	int ret;
+
+	ret = mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0);
+	test_assert(ret >= 0);
+	if (ret > 0)
+		test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void
+test_mail_index_append(struct mail_index *index, uint32_t first_uid,
+		       uint32_t last_uid)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uid = first_uid; uid <= last_uid; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_sync(index);
+}
+
+static void
+test_strmap_add(struct mail_index_strmap_view *strmap_view,
+		uint32_t last_uid, uint32_t new_last_uid)
+{
+	struct mail_index_strmap_view_sync *sync;
+	uint32_t uid, sync_last_uid;
+
+	sync = mail_index_strmap_view_sync_init(strmap_view, &sync_last_uid);
+	test_assert(sync_last_uid == last_uid);
+	for (uid = sync_last_uid + 1; uid <= new_last_uid; uid++) T_BEGIN {
+		mail_index_strmap_view_sync_add(sync, uid, 0,
+						test_strmap_get_str(uid, 0));
+		mail_index_strmap_view_sync_add(sync, uid, 1,
+						test_strmap_get_str(uid, 1));
+	} T_END;
+	mail_index_strmap_view_sync_commit(&sync);
+}
+
+static void
+test_strmap_verify(const ARRAY_TYPE(mail_index_strmap_rec) *recs_arr,
+		   uint32_t last_uid)
+{
+	const struct mail_index_strmap_rec *recs;
+	unsigned int i, j, count;
+	bool same_str, same_idx;
+
+	recs = array_get(recs_arr, &count);
+	test_assert(count == last_uid * 2);
+	for (i = 0; i < count; i++) {
+		test_assert_idx(recs[i].uid == i/2 + 1 &&
+				recs[i].ref_index == i%2, i);
+		/* the same strings have the same string index */
+		for (j = 0; j < i; j++) T_BEGIN {
+			same_str = strcmp(test_strmap_get_str(recs[i].uid,
+							      recs[i].ref_index),
+					  test_strmap_get_str(recs[j].uid,
+							      recs[j].ref_index)) == 0;
+			same_idx = recs[i].str_idx == recs[j].str_idx;
+			test_assert_idx(same_str == same_idx, i);
+		} T_END;
+	}
+}
+
+static void test_mail_index_strmap(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_strmap *strmap;
+	struct mail_index_strmap_view *strmap_view;
+	const ARRAY_TYPE(mail_index_strmap_rec) *recs;
+	struct stat st;
+
+	test_begin("mail index strmap");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index,
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	test_mail_index_append(index, 1, TEST_MESSAGE_COUNT);
+
+	/* build the strmap file */
+	strmap = mail_index_strmap_init(index, ".strmap");
+	view = mail_index_view_open(index);
+	strmap_view = mail_index_strmap_view_open(strmap, view,
+		test_strmap_key_cmp, test_strmap_rec_cmp, test_strmap_remap,
+		NULL, &recs);
+	test_strmap_add(strmap_view, 0, TEST_MESSAGE_COUNT);
+	test_strmap_verify(recs, TEST_MESSAGE_COUNT);
+	test_assert(mail_index_strmap_view_get_highest_idx(strmap_view) ==
+		    TEST_MSGID_COUNT);
+	mail_index_strmap_view_close(&strmap_view);
+	mail_index_view_close(&view);
+	mail_index_strmap_deinit(&strmap);
+	test_assert(stat(TEST_DIR"/test.index.strmap", &st) == 0);
+
+	/* read it back and add new messages with already seen strings */
+	test_mail_index_append(index, TEST_MESSAGE_COUNT + 1,
+			       TEST_MESSAGE_COUNT * 2);
+	strmap = mail_index_strmap_init(index, ".strmap");
+	view = mail_index_view_open(index);
+	strmap_view = mail_index_strmap_view_open(strmap, view,
+		test_strmap_key_cmp, test_strmap_rec_cmp, test_strmap_remap,
+		NULL, &recs);
+	test_strmap_add(strmap_view, TEST_MESSAGE_COUNT,
+			TEST_MESSAGE_COUNT * 2);
+	test_strmap_verify(recs, TEST_MESSAGE_COUNT * 2);
+	test_assert(mail_index_strmap_view_get_highest_idx(strmap_view) ==
+		    TEST_MSGID_COUNT);
+	mail_index_strmap_view_close(&strmap_view);
+	mail_index_view_close(&view);
+	mail_index_strmap_deinit(&strmap);
+
+	/* the appended records are read from the file */
+	strmap = mail_index_strmap_init(index, ".strmap");
+	view = mail_index_view_open(index);
+	strmap_view = mail_index_strmap_view_open(strmap, view,
+		test_strmap_key_cmp, test_strmap_rec_cmp, test_strmap_remap,
+		NULL, &recs);
+	test_strmap_add(strmap_view, TEST_MESSAGE_COUNT * 2,
+			TEST_MESSAGE_COUNT * 2);
+	test_strmap_verify(recs, TEST_MESSAGE_COUNT * 2);
+	mail_index_strmap_view_close(&strmap_view);
+	mail_index_view_close(&view);
+	mail_index_strmap_deinit(&strmap);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_strmap,
+		NULL
+	};
+	/* indexid is taken from ioloop_time */
+	ioloop_time = time(NULL);
+	return test_run(test_functions);
+}
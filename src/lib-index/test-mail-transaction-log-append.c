@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "crc32.h"
 #include "test-common.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
@@ -9,6 +10,7 @@
 #include <sys/stat.h>
 
 static bool log_lock_failure = FALSE;
+static unsigned int log_lock_count, log_unlock_count;
 
 void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 				       const char *filepath ATTR_UNUSED,
@@ -19,11 +21,17 @@ void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 int mail_transaction_log_lock_head(struct mail_transaction_log *log ATTR_UNUSED,
 				   const char *lock_reason ATTR_UNUSED)
 {
-	return log_lock_failure ? -1 : 0;
+	if (log_lock_failure)
+		return -1;
+	log_lock_count++;
+	return 0;
 }
 
 void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file ATTR_UNUSED,
-				      const char *lock_reason ATTR_UNUSED) {}
+				      const char *lock_reason ATTR_UNUSED)
+{
+	log_unlock_count++;
+}
 
 void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 				    const void *data ATTR_UNUSED,
@@ -65,6 +73,8 @@ static void test_append_expunge(struct mail_transaction_log *log)
 	test_assert(mail_index_offset_to_uint32(hdr->size) == sizeof(*hdr) + sizeof(*bound));
 	bound = (const void *)(hdr + 1);
 	test_assert(bound->size == file->buffer->used);
+	test_assert(bound->crc32 == crc32_data(bound + 1, bound->size -
+					       sizeof(*hdr) - sizeof(*bound)));
 	hdr = (const void *)(bound + 1);
 
 	test_assert(hdr->type == (MAIL_TRANSACTION_APPEND |
@@ -115,6 +125,44 @@ static void test_append_sync_offset(struct mail_transaction_log *log)
 	test_end();
 }
 
+static void test_append_group_commit(struct mail_transaction_log *log)
+{
+	static unsigned int buf[] = { 0x12345678 };
+	struct mail_transaction_log_file *file = log->head;
+	struct mail_transaction_log_append_ctx *ctx;
+	unsigned int i;
+
+	test_begin("transaction log append: group commit");
+	file->log = log;
+	log->index->fsync_mode = FSYNC_MODE_ALWAYS;
+	log_lock_count = log_unlock_count = 0;
+
+	test_assert(mail_transaction_log_group_commit_begin(log) == 0);
+	for (i = 0; i < 3; i++) {
+		test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+		mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+						&buf[0], sizeof(buf[0]));
+		test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+	}
+	/* the log stays locked and the fdatasync() is delayed */
+	test_assert(log_lock_count == 1 && log_unlock_count == 0);
+	test_assert(log->group_fsync_pending);
+	test_assert(file->sync_offset == file->buffer_offset + file->buffer->used);
+
+	test_assert(mail_transaction_log_group_commit_end(log) == 0);
+	test_assert(log_lock_count == 1 && log_unlock_count == 1);
+	test_assert(!log->group_fsync_pending && !log->group_commit);
+
+	/* without group commit each append locks */
+	test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+	test_assert(log_lock_count == 2 && log_unlock_count == 2);
+	test_assert(!log->group_fsync_pending);
+
+	log->index->fsync_mode = FSYNC_MODE_OPTIMIZED;
+	test_end();
+}
+
 static void test_mail_transaction_log_append(void)
 {
 	struct mail_transaction_log *log;
@@ -155,9 +203,11 @@ static void test_mail_transaction_log_append(void)
 	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
 	if (fstat(fd, &st) < 0) i_fatal("fstat() failed: %m");
 	test_assert(st.st_size == 1);
-	file->fd = -1;
 	test_end();
 
+	test_append_group_commit(log);
+	file->fd = -1;
+
 	buffer_free(&log->head->buffer);
 	i_free(log->head);
 	i_free(log->index);
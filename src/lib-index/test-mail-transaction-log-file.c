@@ -0,0 +1,207 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "mmap-util.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-transaction-log-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-transaction-log-file"
+#define TEST_TRANSACTION_COUNT 200
+
+static struct mail_index *test_index_open(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	test_assert(mail_index_open_or_create(index, flags |
+					MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	return index;
+}
+
+static void test_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	int ret;
+
+	ret = mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0);
+	test_assert(ret >= 0);
+	if (ret > 0)
+		test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void
+test_index_append(struct mail_index *index, uint32_t first_uid,
+		  unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1;
+
+	view = mail_index_view_open(index);
+	for (uid = first_uid; uid < first_uid + count; uid++) {
+		/* two records in each transaction, so they're written with
+		   a checksummed boundary */
+		trans = mail_index_transaction_begin(view, 0);
+		mail_index_append(trans, uid, &seq);
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+		test_assert(mail_index_transaction_commit(&trans) == 0);
+	}
+	mail_index_view_close(&view);
+}
+
+static unsigned int test_index_get_messages_count(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	unsigned int count;
+
+	view = mail_index_view_open(index);
+	count = mail_index_view_get_messages_count(view);
+	mail_index_view_close(&view);
+	return count;
+}
+
+static void test_mail_transaction_log_file_mmap_window(void)
+{
+	struct mail_index *index, *index2;
+	struct mail_transaction_log_file *file;
+	uoff_t old_offset;
+
+	test_begin("transaction log file mmap window");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = test_index_open(0);
+	test_index_append(index, 1, TEST_TRANSACTION_COUNT);
+	test_index_sync(index);
+	old_offset = index->log->head->sync_offset;
+	test_assert(old_offset > (uoff_t)mmap_get_page_size());
+
+	/* another process appends more */
+	index2 = test_index_open(0);
+	test_index_append(index2, TEST_TRANSACTION_COUNT + 1,
+			  TEST_TRANSACTION_COUNT);
+	mail_index_close(index2);
+	mail_index_free(&index2);
+
+	/* only the new part of the log is mapped */
+	test_index_sync(index);
+	file = index->log->head;
+	test_assert(file->mmap_base != NULL);
+	test_assert(file->buffer_offset > 0 &&
+		    file->buffer_offset <= old_offset);
+	test_assert(file->buffer_offset % mmap_get_page_size() == 0);
+	test_assert(file->sync_offset == file->last_size);
+	test_assert(test_index_get_messages_count(index) ==
+		    TEST_TRANSACTION_COUNT*2);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+static void test_mail_transaction_log_file_read_window(void)
+{
+	struct mail_index *index;
+	struct mail_transaction_log_file *file;
+	uoff_t old_offset;
+
+	test_begin("transaction log file read window");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = test_index_open(MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE);
+	test_index_append(index, 1, TEST_TRANSACTION_COUNT);
+	test_index_sync(index);
+	old_offset = index->log->head->sync_offset;
+	test_index_append(index, TEST_TRANSACTION_COUNT + 1,
+			  TEST_TRANSACTION_COUNT);
+	test_index_sync(index);
+
+	/* the already synced beginning of the log was dropped from the
+	   read buffer */
+	file = index->log->head;
+	test_assert(file->mmap_base == NULL);
+	test_assert(file->buffer_offset > file->hdr.hdr_size &&
+		    file->buffer_offset <= old_offset);
+	test_assert(test_index_get_messages_count(index) ==
+		    TEST_TRANSACTION_COUNT*2);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+static void test_mail_transaction_log_file_checksum(void)
+{
+	struct mail_index *index;
+	uoff_t offset;
+	unsigned char c;
+	const char *path;
+	int fd;
+
+	test_begin("transaction log file checksum");
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	index = test_index_open(0);
+	test_index_append(index, 1, 2);
+	test_index_sync(index);
+	offset = index->log->head->sync_offset;
+	test_index_append(index, 3, 1);
+	path = t_strdup(index->log->head->filepath);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	/* corrupt the first record of the last transaction */
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	offset += sizeof(struct mail_transaction_header) +
+		sizeof(struct mail_transaction_boundary) +
+		sizeof(struct mail_transaction_header);
+	if (pread(fd, &c, 1, offset) != 1)
+		i_fatal("pread(%s) failed: %m", path);
+	c ^= 0xff;
+	if (pwrite(fd, &c, 1, offset) != 1)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	/* the broken transaction isn't used */
+	index = test_index_open(0);
+	test_assert(test_index_get_messages_count(index) == 2);
+	test_assert(index->log->head->sync_offset < index->log->head->last_size);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_transaction_log_file_mmap_window,
+		test_mail_transaction_log_file_read_window,
+		test_mail_transaction_log_file_checksum,
+		NULL
+	};
+	/* indexid is taken from ioloop_time */
+	ioloop_time = time(NULL);
+	return test_run(test_functions);
+}
@@ -0,0 +1,213 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "istream.h"
+#include "time-util.h"
+#include "message-parser.h"
+
+#include <stdio.h>
+
+#define BENCH_MESSAGE_COUNT 200
+#define BENCH_MIN_BYTES (256*1024*1024)
+
+ARRAY_DEFINE_TYPE(bench_message, string_t *);
+
+static void bench_append_headers(string_t *str, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		str_printfa(str, "Received: from mx%u.example.com "
+			    "(mx%u.example.com [192.0.2.%u])\r\n"
+			    "\tby mail.example.org (Postfix) with ESMTPS "
+			    "id %08X%u\r\n\tfor <user%u@example.org>; "
+			    "Mon, 17 Oct 2016 10:%02u:%02u +0300\r\n",
+			    i, i, n % 250, n * 2654435761U, i, n,
+			    n % 60, i * 7 % 60);
+	}
+	str_printfa(str,
+		"DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; "
+		"d=example.com; s=s1;\r\n\th=from:to:subject:date:message-id; "
+		"bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=;\r\n"
+		"\tb=dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZSBidXQgaXQgaXMgbG9u"
+		"ZyBlbm91Z2g=\r\n"
+		"From: \"Sender %u\" <sender%u@example.com>\r\n"
+		"To: \"User %u\" <user%u@example.org>\r\n"
+		"Subject: =?UTF-8?Q?Re=3A_message_number_%u?=\r\n"
+		"Date: Mon, 17 Oct 2016 10:%02u:00 +0300\r\n"
+		"Message-ID: <%u.%u@example.com>\r\n"
+		"MIME-Version: 1.0\r\n",
+		n, n, n, n, n, n % 60, n, n * 7);
+}
+
+static void bench_append_text(string_t *str, unsigned int lines)
+{
+	unsigned int i;
+
+	for (i = 0; i < lines; i++) {
+		str_printfa(str, "Line %u of the message body with some "
+			    "ordinary text in it, wrapped at the usual "
+			    "width=\r\n", i);
+	}
+}
+
+static void bench_append_base64(string_t *str, unsigned int lines)
+{
+	unsigned int i;
+
+	for (i = 0; i < lines; i++) {
+		str_append(str, "JVBERi0xLjQKJcfsj6IKNSAwIG9iago8PC9MZW5ndGggNiAw"
+			   "IFIvRmlsdGVyIC9GbGF0ZURlY29kZT4+CnN0\r\n");
+	}
+}
+
+static string_t *bench_message_create(unsigned int n)
+{
+	string_t *str = str_new(default_pool, 8192);
+
+	bench_append_headers(str, n);
+	switch (n % 4) {
+	case 0:
+		/* plain text */
+		str_append(str, "Content-Type: text/plain; charset=utf-8\r\n"
+			   "Content-Transfer-Encoding: quoted-printable\r\n"
+			   "\r\n");
+		bench_append_text(str, 40 + n % 100);
+		break;
+	case 1:
+	case 2:
+		/* text + html alternatives */
+		str_printfa(str, "Content-Type: multipart/alternative; "
+			    "boundary=\"alt-%u\"\r\n\r\n"
+			    "This is a multi-part message in MIME format.\r\n"
+			    "--alt-%u\r\n"
+			    "Content-Type: text/plain; charset=utf-8\r\n"
+			    "Content-Transfer-Encoding: quoted-printable\r\n"
+			    "\r\n", n, n);
+		bench_append_text(str, 30 + n % 50);
+		str_printfa(str, "--alt-%u\r\n"
+			    "Content-Type: text/html; charset=utf-8\r\n"
+			    "Content-Transfer-Encoding: quoted-printable\r\n"
+			    "\r\n", n);
+		bench_append_text(str, 60 + n % 80);
+		str_printfa(str, "--alt-%u--\r\n", n);
+		break;
+	case 3:
+		/* text with an attachment */
+		str_printfa(str, "Content-Type: multipart/mixed; "
+			    "boundary=\"mixed-%u\"\r\n\r\n"
+			    "--mixed-%u\r\n"
+			    "Content-Type: text/plain; charset=utf-8\r\n"
+			    "\r\n", n, n);
+		bench_append_text(str, 20);
+		str_printfa(str, "--mixed-%u\r\n"
+			    "Content-Type: application/pdf; name=\"doc%u.pdf\"\r\n"
+			    "Content-Disposition: attachment; "
+			    "filename=\"doc%u.pdf\"\r\n"
+			    "Content-Transfer-Encoding: base64\r\n"
+			    "\r\n", n, n, n);
+		bench_append_base64(str, 500 + n * 10);
+		str_printfa(str, "--mixed-%u--\r\n", n);
+		break;
+	}
+	return str;
+}
+
+static string_t *bench_message_read(const char *path)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str = str_new(default_pool, 8192);
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_n(str, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s", path,
+			i_stream_get_error(input));
+	}
+	i_stream_unref(&input);
+	return str;
+}
+
+static void bench_message_parse(const string_t *msg)
+{
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts;
+	struct istream *input;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("bench message parser", 1024);
+	input = i_stream_create_from_data(str_data(msg), str_len(msg));
+	parser = message_parser_init(pool, input, 0,
+				     MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0) ;
+	i_assert(ret < 0);
+	message_parser_deinit(&parser, &parts);
+	i_stream_unref(&input);
+	pool_unref(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+	ARRAY_TYPE(bench_message) messages;
+	string_t *const *msgp;
+	struct timeval start, end;
+	unsigned long long total_bytes = 0, parsed_bytes = 0;
+	long long usecs;
+	unsigned int i, rounds;
+
+	lib_init();
+	i_array_init(&messages, BENCH_MESSAGE_COUNT);
+	if (argc > 1) {
+		/* a corpus of real messages, one per file */
+		for (i = 1; i < (unsigned int)argc; i++) {
+			string_t *msg = bench_message_read(argv[i]);
+			array_append(&messages, &msg, 1);
+		}
+	} else {
+		for (i = 0; i < BENCH_MESSAGE_COUNT; i++) {
+			string_t *msg = bench_message_create(i);
+			array_append(&messages, &msg, 1);
+		}
+	}
+	array_foreach(&messages, msgp)
+		total_bytes += str_len(*msgp);
+	if (total_bytes == 0)
+		i_fatal("Empty corpus");
+	rounds = BENCH_MIN_BYTES / total_bytes + 1;
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < rounds; i++) {
+		array_foreach(&messages, msgp) {
+			bench_message_parse(*msgp);
+			parsed_bytes += str_len(*msgp);
+		}
+	}
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&end, &start);
+	if (usecs <= 0)
+		usecs = 1;
+
+	printf("%u messages, %llu bytes, %u rounds: %.1f MB/s, "
+	       "%.0f messages/s\n", array_count(&messages), total_bytes,
+	       rounds, parsed_bytes / (double)usecs,
+	       rounds * array_count(&messages) * 1000000.0 / usecs);
+
+	array_foreach(&messages, msgp) {
+		string_t *msg = *msgp;
+		str_free(&msg);
+	}
+	array_free(&messages);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "istream-qp.h"
+#include "time-util.h"
+#include "qp-decoder.h"
+
+#include <stdio.h>
+
+#define BENCH_DATA_SIZE (1024*1024)
+#define BENCH_DEFAULT_ROUNDS 100
+/* maximum encoded line length, as in MIME */
+#define BENCH_LINE_LEN 76
+
+static struct timeval bench_start_time;
+
+static void bench_start(void)
+{
+	if (gettimeofday(&bench_start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_end(const char *name, unsigned long long bytes)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, &bench_start_time);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%-24s %8.1f MB/s\n", name, bytes / (double)usecs);
+}
+
+static void bench_qp_append(string_t *dest, const char *text,
+			    unsigned int *line_len)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	char escape[4];
+	unsigned int len;
+
+	for (; *p != '\0'; p++) {
+		if (*p == '\n') {
+			str_append(dest, "\r\n");
+			*line_len = 0;
+			continue;
+		}
+		if (*p == '=' || *p >= 0x80) {
+			i_snprintf(escape, sizeof(escape), "=%02X", *p);
+			len = 3;
+		} else {
+			escape[0] = *p;
+			escape[1] = '\0';
+			len = 1;
+		}
+		if (*line_len + len >= BENCH_LINE_LEN) {
+			/* soft line break */
+			str_append(dest, "=\r\n");
+			*line_len = 0;
+		}
+		str_append(dest, escape);
+		*line_len += len;
+	}
+}
+
+/* Build a quoted-printable encoded HTML newsletter */
+static string_t *bench_qp_create(void)
+{
+	string_t *str = str_new(default_pool, BENCH_DATA_SIZE + 1024);
+	unsigned int i, line_len = 0;
+
+	bench_qp_append(str, "<html><head><meta http-equiv=\"Content-Type\" "
+			"content=\"text/html; charset=utf-8\"></head>\n"
+			"<body style=\"margin:0; padding:0\">\n", &line_len);
+	for (i = 0; str_len(str) < BENCH_DATA_SIZE; i++) {
+		bench_qp_append(str, t_strdup_printf(
+			"<table width=\"100%%\" cellpadding=\"0\" "
+			"cellspacing=\"0\" border=\"0\"><tr>"
+			"<td class=\"item-%u\" style=\"font-family: Arial, "
+			"sans-serif; font-size: 14px; color: #333333\">\n"
+			"<a href=\"https://www.example.com/offer?id=%u&amp;"
+			"utm_source=newsletter\">Tämä viikko: säästä %u %% "
+			"kaikista tuotteista – vain verkossa!</a>\n"
+			"</td></tr></table>\n", i, i, i % 70), &line_len);
+	}
+	bench_qp_append(str, "</body></html>\n", &line_len);
+	return str;
+}
+
+static void bench_istream_decode(const string_t *encoded)
+{
+	struct istream *input, *qp_input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_from_data(str_data(encoded), str_len(encoded));
+	qp_input = i_stream_create_qp_decoder(input);
+	while (i_stream_read_more(qp_input, &data, &size) > 0)
+		i_stream_skip(qp_input, size);
+	if (qp_input->stream_errno != 0) {
+		i_fatal("quoted-printable decoding failed: %s",
+			i_stream_get_error(qp_input));
+	}
+	i_stream_unref(&qp_input);
+	i_stream_unref(&input);
+}
+
+int main(int argc, char *argv[])
+{
+	struct qp_decoder *qp;
+	string_t *encoded;
+	buffer_t *decoded;
+	const char *error;
+	unsigned long long total;
+	unsigned int i, rounds = BENCH_DEFAULT_ROUNDS;
+	size_t error_pos;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &rounds) < 0)
+		i_fatal("Usage: bench-qp-decoder [<rounds>]");
+
+	encoded = bench_qp_create();
+	decoded = buffer_create_dynamic(default_pool, str_len(encoded));
+	total = (unsigned long long)rounds * str_len(encoded);
+
+	qp = qp_decoder_init(decoded);
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		if (qp_decoder_more(qp, str_data(encoded), str_len(encoded),
+				    &error_pos, &error) < 0 ||
+		    qp_decoder_finish(qp, &error) < 0)
+			i_fatal("qp_decoder_more() failed: %s", error);
+	}
+	bench_end("decode", total);
+	qp_decoder_deinit(&qp);
+
+	bench_start();
+	for (i = 0; i < rounds; i++)
+		bench_istream_decode(encoded);
+	bench_end("istream decode", total);
+
+	buffer_free(&decoded);
+	str_free(&encoded);
+	lib_deinit();
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include "istream.h"
 #include "str.h"
 #include "message-size.h"
+#include "message-scan.h"
 #include "message-header-parser.h"
 
 struct message_header_parser_ctx {
@@ -163,8 +164,10 @@ int message_parse_header_next(struct message_header_parser_ctx *ctx,
 		/* find ':' */
 		if (colon_pos == UINT_MAX) {
 			for (i = startpos; i < parse_size; i++) {
-				if (msg[i] > ':')
-					continue;
+				i += message_scan_colon_lf_nul(msg + i,
+							       parse_size - i);
+				if (i == parse_size)
+					break;
 
 				if (msg[i] == ':' && !ctx->skip_line) {
 					colon_pos = i;
@@ -186,12 +189,10 @@ int message_parse_header_next(struct message_header_parser_ctx *ctx,
 
 		/* find '\n' */
 		for (; i < parse_size; i++) {
-			if (msg[i] <= '\n') {
-				if (msg[i] == '\n')
-					break;
-				if (msg[i] == '\0')
-					ctx->has_nuls = TRUE;
-			}
+			i += message_scan_lf_nul(msg + i, parse_size - i);
+			if (i == parse_size || msg[i] == '\n')
+				break;
+			ctx->has_nuls = TRUE;
 		}
 
 		if (i < parse_size && i+1 == size && ret == -2) {
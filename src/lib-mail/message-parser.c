@@ -7,6 +7,7 @@
 #include "rfc822-parser.h"
 #include "rfc2231-parser.h"
 #include "message-parser.h"
+#include "message-scan.h"
 
 /* RFC-2046 requires boundaries are max. 70 chars + "--" prefix + "--" suffix.
    We'll add a bit more just in case. */
@@ -89,37 +90,25 @@ boundary_find(struct message_boundary *boundaries,
 static void parse_body_add_block(struct message_parser_ctx *ctx,
 				 struct message_block *block)
 {
-	unsigned int missing_cr_count = 0;
-	const unsigned char *cur, *next, *data = block->data;
+	struct message_scan_line_counts counts;
+	const unsigned char *data = block->data;
 
 	i_assert(block->size > 0);
 
 	block->hdr = NULL;
 
-	/* check if we have NULs */
-	if (memchr(data, '\0', block->size) != NULL)
+	/* count number of lines and missing CRs, and check if we have NULs */
+	memset(&counts, 0, sizeof(counts));
+	message_scan_lines(data, block->size, ctx->last_chr, &counts);
+	if (counts.has_nuls)
 		ctx->part->flags |= MESSAGE_PART_FLAG_HAS_NULS;
-
-	/* count number of lines and missing CRs */
-	if (*data == '\n') {
-		ctx->part->body_size.lines++;
-		if (ctx->last_chr != '\r')
-			missing_cr_count++;
-	}
-
-	cur = data + 1;
-	while ((next = memchr(cur, '\n', block->size - (cur - data))) != NULL) {
-		ctx->part->body_size.lines++;
-		if (next[-1] != '\r')
-			missing_cr_count++;
-
-		cur = next + 1;
-	}
+	ctx->part->body_size.lines += counts.lines;
 	ctx->last_chr = data[block->size - 1];
 	ctx->skip += block->size;
 
 	ctx->part->body_size.physical_size += block->size;
-	ctx->part->body_size.virtual_size += block->size + missing_cr_count;
+	ctx->part->body_size.virtual_size +=
+		block->size + counts.missing_cr_count;
 }
 
 static int message_parser_read_more(struct message_parser_ctx *ctx,
@@ -361,11 +350,29 @@ static int parse_part_finish(struct message_parser_ctx *ctx,
 	return ctx->parse_next_block(ctx, block_r);
 }
 
+/* Returns the next LF that may begin a boundary line, i.e. it's followed by
+   "--" or by less than two characters. last_lf_r is updated to point to the
+   last LF that was seen. */
+static const unsigned char *
+boundary_line_next(const unsigned char *data, const unsigned char *end,
+		   const unsigned char **last_lf_r)
+{
+	const unsigned char *lf;
+
+	while ((lf = memchr(data, '\n', end - data)) != NULL) {
+		*last_lf_r = lf;
+		if (end - lf < 3 || (lf[1] == '-' && lf[2] == '-'))
+			break;
+		data = lf + 1;
+	}
+	return lf;
+}
+
 static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 				       struct message_block *block_r)
 {
 	struct message_boundary *boundary = NULL;
-	const unsigned char *data, *cur, *next, *end;
+	const unsigned char *data, *cur, *next, *end, *last_lf = NULL;
 	size_t boundary_start;
 	int ret;
 	bool full;
@@ -389,9 +396,10 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	boundary_start = 0;
 
 	/* skip to beginning of the next line. the first line was
-	   handled already. */
+	   handled already. lines that can't be boundaries are skipped
+	   without looking at them further. */
 	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+	while ((next = boundary_line_next(cur, end, &last_lf)) != NULL) {
 		cur = next + 1;
 
 		boundary_start = next - data;
@@ -413,6 +421,13 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 		}
 	}
 
+	if (next == NULL && last_lf != NULL) {
+		/* the skipped lines after the last boundary candidate */
+		boundary_start = last_lf - data;
+		if (last_lf > data && last_lf[-1] == '\r')
+			boundary_start--;
+	}
+
 	if (next != NULL) {
 		/* found / need more data */
 		i_assert(ret >= 0);
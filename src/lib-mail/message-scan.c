@@ -0,0 +1,271 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "cpu-features.h"
+#include "message-scan.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
+
+/* Without SIMD the data is scanned 8 bytes at a time. */
+#define SCAN_WORD_SIZE sizeof(uint64_t)
+#define SCAN_WORD_REPEAT(c) ((uint64_t)(c) * 0x0101010101010101ULL)
+
+static inline uint64_t scan_word_load(const unsigned char *data)
+{
+	uint64_t word;
+
+	memcpy(&word, data, sizeof(word));
+	return word;
+}
+
+/* Returns a word with the high bit set in each byte that equals c, and all
+   the other bits cleared. */
+static inline uint64_t scan_word_eq(uint64_t word, unsigned char c)
+{
+	const uint64_t low7 = SCAN_WORD_REPEAT(0x7f);
+	uint64_t diff = word ^ SCAN_WORD_REPEAT(c);
+
+	return ~(((diff & low7) + low7) | diff | low7);
+}
+
+/* Returns the offset of the first matching character in data, or size if
+   there are none. */
+typedef size_t message_scan_find_t(const unsigned char *data, size_t size);
+
+static message_scan_find_t message_scan_lf_nul_init;
+static message_scan_find_t message_scan_colon_lf_nul_init;
+static message_scan_find_t *message_scan_lf_nul_func =
+	message_scan_lf_nul_init;
+static message_scan_find_t *message_scan_colon_lf_nul_func =
+	message_scan_colon_lf_nul_init;
+
+static size_t
+message_scan_lf_nul_swar(const unsigned char *data, size_t size)
+{
+	size_t i = 0;
+	uint64_t word;
+
+	for (; i + SCAN_WORD_SIZE <= size; i += SCAN_WORD_SIZE) {
+		word = scan_word_load(data + i);
+		if ((scan_word_eq(word, '\n') | scan_word_eq(word, '\0')) != 0)
+			break;
+	}
+	for (; i < size; i++) {
+		if (data[i] == '\n' || data[i] == '\0')
+			break;
+	}
+	return i;
+}
+
+static size_t
+message_scan_colon_lf_nul_swar(const unsigned char *data, size_t size)
+{
+	size_t i = 0;
+	uint64_t word;
+
+	for (; i + SCAN_WORD_SIZE <= size; i += SCAN_WORD_SIZE) {
+		word = scan_word_load(data + i);
+		if ((scan_word_eq(word, ':') | scan_word_eq(word, '\n') |
+		     scan_word_eq(word, '\0')) != 0)
+			break;
+	}
+	for (; i < size; i++) {
+		if (data[i] == ':' || data[i] == '\n' || data[i] == '\0')
+			break;
+	}
+	return i;
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* The SIMD versions compare 16 or 32 bytes at a time. The compare results
+   are collected into a bitmask of the matching bytes. The remaining tail is
+   left to the word at a time version. */
+__attribute__((target("sse2")))
+static size_t
+message_scan_lf_nul_sse2(const unsigned char *data, size_t size)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int matches;
+	size_t i = 0;
+
+	for (; size - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const void *)(data + i));
+
+		matches = _mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(in, lf),
+				     _mm_cmpeq_epi8(in, zero)));
+		if (matches != 0)
+			return i + __builtin_ctz(matches);
+	}
+	return i + message_scan_lf_nul_swar(data + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static size_t
+message_scan_colon_lf_nul_sse2(const unsigned char *data, size_t size)
+{
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int matches;
+	size_t i = 0;
+
+	for (; size - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const void *)(data + i));
+
+		matches = _mm_movemask_epi8(
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, colon),
+						  _mm_cmpeq_epi8(in, lf)),
+				     _mm_cmpeq_epi8(in, zero)));
+		if (matches != 0)
+			return i + __builtin_ctz(matches);
+	}
+	return i + message_scan_colon_lf_nul_swar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+message_scan_lf_nul_avx2(const unsigned char *data, size_t size)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int matches;
+	size_t i = 0;
+
+	for (; size - i >= 32; i += 32) {
+		__m256i in = _mm256_loadu_si256((const void *)(data + i));
+
+		matches = _mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(in, lf),
+					_mm256_cmpeq_epi8(in, zero)));
+		if (matches != 0) {
+			_mm256_zeroupper();
+			return i + __builtin_ctz(matches);
+		}
+	}
+	/* avoid AVX-SSE transition penalties in the non-AVX code */
+	_mm256_zeroupper();
+	return i + message_scan_lf_nul_sse2(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+message_scan_colon_lf_nul_avx2(const unsigned char *data, size_t size)
+{
+	const __m256i colon = _mm256_set1_epi8(':');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int matches;
+	size_t i = 0;
+
+	for (; size - i >= 32; i += 32) {
+		__m256i in = _mm256_loadu_si256((const void *)(data + i));
+
+		matches = _mm256_movemask_epi8(
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(in, colon),
+						_mm256_cmpeq_epi8(in, lf)),
+				_mm256_cmpeq_epi8(in, zero)));
+		if (matches != 0) {
+			_mm256_zeroupper();
+			return i + __builtin_ctz(matches);
+		}
+	}
+	_mm256_zeroupper();
+	return i + message_scan_colon_lf_nul_sse2(data + i, size - i);
+}
+#endif
+
+bool message_scan_set_impl(enum message_scan_impl impl)
+{
+	switch (impl) {
+	case MESSAGE_SCAN_IMPL_SWAR:
+		message_scan_lf_nul_func = message_scan_lf_nul_swar;
+		message_scan_colon_lf_nul_func = message_scan_colon_lf_nul_swar;
+		return TRUE;
+	case MESSAGE_SCAN_IMPL_SSE2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2)) {
+			message_scan_lf_nul_func = message_scan_lf_nul_sse2;
+			message_scan_colon_lf_nul_func =
+				message_scan_colon_lf_nul_sse2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	case MESSAGE_SCAN_IMPL_AVX2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2)) {
+			message_scan_lf_nul_func = message_scan_lf_nul_avx2;
+			message_scan_colon_lf_nul_func =
+				message_scan_colon_lf_nul_avx2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void message_scan_set_best_impl(void)
+{
+	if (message_scan_set_impl(MESSAGE_SCAN_IMPL_AVX2) ||
+	    message_scan_set_impl(MESSAGE_SCAN_IMPL_SSE2))
+		return;
+	(void)message_scan_set_impl(MESSAGE_SCAN_IMPL_SWAR);
+}
+
+static size_t
+message_scan_lf_nul_init(const unsigned char *data, size_t size)
+{
+	message_scan_set_best_impl();
+	return message_scan_lf_nul_func(data, size);
+}
+
+static size_t
+message_scan_colon_lf_nul_init(const unsigned char *data, size_t size)
+{
+	message_scan_set_best_impl();
+	return message_scan_colon_lf_nul_func(data, size);
+}
+
+size_t message_scan_lf_nul(const unsigned char *data, size_t size)
+{
+	return message_scan_lf_nul_func(data, size);
+}
+
+size_t message_scan_colon_lf_nul(const unsigned char *data, size_t size)
+{
+	return message_scan_colon_lf_nul_func(data, size);
+}
+
+void message_scan_lines(const unsigned char *data, size_t size,
+			unsigned char prev_chr,
+			struct message_scan_line_counts *counts)
+{
+	const unsigned char *cur, *next, *end = data + size;
+
+	if (size == 0)
+		return;
+
+	/* libc's memchr() is already vectorized, and lines are long enough
+	   that it beats looking at a word at a time here. */
+	if (memchr(data, '\0', size) != NULL)
+		counts->has_nuls = TRUE;
+
+	if (data[0] == '\n') {
+		counts->lines++;
+		if (prev_chr != '\r')
+			counts->missing_cr_count++;
+	}
+	cur = data + 1;
+	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+		counts->lines++;
+		if (next[-1] != '\r')
+			counts->missing_cr_count++;
+		cur = next + 1;
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef MESSAGE_SCAN_H
+#define MESSAGE_SCAN_H
+
+/* Scanners for the message parsers' hottest loops. Searching for multiple
+   characters uses SSE2/AVX2 when the CPU supports them, and otherwise looks
+   at a word at a time, so the data is only compared byte by byte near
+   matches. */
+
+enum message_scan_impl {
+	MESSAGE_SCAN_IMPL_SWAR,
+	MESSAGE_SCAN_IMPL_SSE2,
+	MESSAGE_SCAN_IMPL_AVX2
+};
+
+struct message_scan_line_counts {
+	unsigned int lines;
+	/* number of LFs that weren't preceded by CR */
+	unsigned int missing_cr_count;
+	bool has_nuls;
+};
+
+/* Returns the offset of the first LF or NUL in data, or size if there are
+   none. */
+size_t message_scan_lf_nul(const unsigned char *data, size_t size);
+/* Returns the offset of the first ':', LF or NUL in data, or size if there
+   are none. */
+size_t message_scan_colon_lf_nul(const unsigned char *data, size_t size);
+/* Add the LFs and NULs in data to counts. prev_chr is the character before
+   data, which is used to check whether data begins with a missing CR. */
+void message_scan_lines(const unsigned char *data, size_t size,
+			unsigned char prev_chr,
+			struct message_scan_line_counts *counts);
+
+/* The scanning uses the fastest implementation supported by the CPU.
+   For unit tests and benchmarks: Force using the given implementation.
+   Returns FALSE if it's not supported by the CPU or the build. */
+bool message_scan_set_impl(enum message_scan_impl impl);
+/* Switch back to the fastest supported implementation. */
+void message_scan_set_best_impl(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "istream.h"
 #include "message-parser.h"
 #include "message-size.h"
+#include "message-scan.h"
 
 int message_get_header_size(struct istream *input, struct message_size *hdr,
 			    bool *has_nuls_r)
@@ -68,44 +69,29 @@ int message_get_header_size(struct istream *input, struct message_size *hdr,
 int message_get_body_size(struct istream *input, struct message_size *body,
 			  bool *has_nuls_r)
 {
+	struct message_scan_line_counts counts;
 	const unsigned char *msg;
-	size_t i, size, missing_cr_count;
+	size_t size;
 	int ret;
 
 	memset(body, 0, sizeof(struct message_size));
+	memset(&counts, 0, sizeof(counts));
 	*has_nuls_r = FALSE;
 
-	missing_cr_count = 0;
 	if ((ret = i_stream_read_more(input, &msg, &size)) <= 0) {
 		i_assert(ret == -1);
 		return ret < 0 && input->stream_errno != 0 ? -1 : 0;
 	}
 
 	if (msg[0] == '\n')
-		missing_cr_count++;
+		counts.missing_cr_count++;
 
 	do {
-		for (i = 1; i < size; i++) {
-			if (msg[i] > '\n')
-				continue;
-
-			if (msg[i] == '\n') {
-				if (msg[i-1] != '\r') {
-					/* missing CR */
-					missing_cr_count++;
-				}
-
-				/* increase after making sure we didn't break
-				   at virtual \r */
-				body->lines++;
-			} else if (msg[i] == '\0') {
-				*has_nuls_r = TRUE;
-			}
-		}
+		message_scan_lines(msg + 1, size - 1, msg[0], &counts);
 
 		/* leave the last character, it may be \r */
-		i_stream_skip(input, i - 1);
-		body->physical_size += i - 1;
+		i_stream_skip(input, size - 1);
+		body->physical_size += size - 1;
 	} while ((ret = i_stream_read_bytes(input, &msg, &size, 2)) > 0);
 	i_assert(ret == -1);
 
@@ -114,7 +100,9 @@ int message_get_body_size(struct istream *input, struct message_size *body,
 	i_stream_skip(input, 1);
 	body->physical_size++;
 
-	body->virtual_size = body->physical_size + missing_cr_count;
+	body->lines = counts.lines;
+	*has_nuls_r = counts.has_nuls;
+	body->virtual_size = body->physical_size + counts.missing_cr_count;
 	i_assert(body->virtual_size >= body->physical_size);
 	return ret;
 }
@@ -18,7 +18,7 @@ enum snippet_state {
 	SNIPPET_STATE_QUOTED
 };
 
-struct snippet_context {
+struct message_snippet_context {
 	string_t *snippet;
 	unsigned int chars_left;
 	enum snippet_state state;
@@ -27,8 +27,42 @@ struct snippet_context {
 	buffer_t *plain_output;
 };
 
-static bool snippet_generate(struct snippet_context *ctx,
-			     const unsigned char *data, size_t size)
+struct message_snippet_context *
+message_snippet_init(const char *content_type, unsigned int max_snippet_chars,
+		     string_t *snippet)
+{
+	struct message_snippet_context *ctx;
+
+	ctx = i_new(struct message_snippet_context, 1);
+	ctx->snippet = snippet;
+	ctx->chars_left = max_snippet_chars;
+
+	if (content_type == NULL)
+		/* text/plain */ ;
+	else if (mail_html2text_content_type_match(content_type)) {
+		ctx->html2text = mail_html2text_init(MAIL_HTML2TEXT_FLAG_SKIP_QUOTED);
+		ctx->plain_output = buffer_create_dynamic(default_pool, 1024);
+	} else if (strncasecmp(content_type, "text/", 5) != 0) {
+		i_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void message_snippet_deinit(struct message_snippet_context **_ctx)
+{
+	struct message_snippet_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+	if (ctx->html2text != NULL)
+		mail_html2text_deinit(&ctx->html2text);
+	if (ctx->plain_output != NULL)
+		buffer_free(&ctx->plain_output);
+	i_free(ctx);
+}
+
+bool message_snippet_more(struct message_snippet_context *ctx,
+			  const unsigned char *data, size_t size)
 {
 	unsigned int i, count;
 
@@ -89,47 +123,36 @@ int message_snippet_generate(struct istream *input,
 	struct message_part *parts;
 	struct message_decoder_context *decoder;
 	struct message_block raw_block, block;
-	struct snippet_context ctx;
-	pool_t pool;
+	struct message_snippet_context *ctx = NULL;
 	int ret;
 
-	memset(&ctx, 0, sizeof(ctx));
-	pool = pool_alloconly_create("message snippet", 1024);
-	ctx.snippet = snippet;
-	ctx.chars_left = max_snippet_chars;
-
 	parser = message_parser_init(pool_datastack_create(), input, 0, 0);
 	decoder = message_decoder_init(NULL, 0);
 	while ((ret = message_parser_parse_next_block(parser, &raw_block)) > 0) {
 		if (!message_decoder_decode_next_block(decoder, &raw_block, &block))
 			continue;
-		if (block.size == 0) {
-			const char *ct;
-
-			if (block.hdr != NULL)
-				continue;
-
+		if (block.hdr != NULL)
+			continue;
+		if (raw_block.size == 0) {
 			/* end of headers - verify that we can use this
 			   Content-Type. we get here only once, because we
 			   always handle only one non-multipart MIME part. */
-			ct = message_decoder_current_content_type(decoder);
-			if (ct == NULL)
-				/* text/plain */ ;
-			else if (mail_html2text_content_type_match(ct)) {
-				ctx.html2text = mail_html2text_init(MAIL_HTML2TEXT_FLAG_SKIP_QUOTED);
-				ctx.plain_output = buffer_create_dynamic(pool, 1024);
-			} else if (strncasecmp(ct, "text/", 5) != 0)
+			ctx = message_snippet_init(
+				message_decoder_current_content_type(decoder),
+				max_snippet_chars, snippet);
+			if (ctx == NULL)
 				break;
 			continue;
 		}
-		if (!snippet_generate(&ctx, block.data, block.size))
+		if (block.size == 0)
+			continue;
+		if (!message_snippet_more(ctx, block.data, block.size))
 			break;
 	}
 	i_assert(ret != 0);
 	message_decoder_deinit(&decoder);
 	message_parser_deinit(&parser, &parts);
-	if (ctx.html2text != NULL)
-		mail_html2text_deinit(&ctx.html2text);
-	pool_unref(&pool);
+	if (ctx != NULL)
+		message_snippet_deinit(&ctx);
 	return input->stream_errno == 0 ? 0 : -1;
 }
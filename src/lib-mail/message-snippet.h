@@ -1,6 +1,8 @@
 #ifndef MESSAGE_SNIPPET_H
 #define MESSAGE_SNIPPET_H
 
+struct message_snippet_context;
+
 /* Generate UTF-8 text snippet from the beginning of the given mail input
    stream. The stream is expected to start at the MIME part's headers whose
    snippet is being generated. Returns 0 if ok, -1 if I/O error.
@@ -11,4 +13,18 @@ int message_snippet_generate(struct istream *input,
 			     unsigned int max_snippet_chars,
 			     string_t *snippet);
 
+/* Generate the snippet incrementally from the decoded UTF-8 body of a single
+   MIME part. This allows generating the snippet while the message is being
+   parsed for other reasons. content_type is the part's Content-Type as
+   returned by message_decoder_current_content_type(). Returns NULL if the
+   Content-Type isn't supported, which means the snippet is empty. */
+struct message_snippet_context *
+message_snippet_init(const char *content_type, unsigned int max_snippet_chars,
+		     string_t *snippet);
+void message_snippet_deinit(struct message_snippet_context **ctx);
+/* Add more decoded body data. Returns FALSE once the snippet is full and
+   no more data is needed. */
+bool message_snippet_more(struct message_snippet_context *ctx,
+			  const unsigned char *data, size_t size);
+
 #endif
@@ -2,7 +2,6 @@
 
 #include "lib.h"
 #include "buffer.h"
-#include "hex-binary.h"
 #include "qp-decoder.h"
 
 /* quoted-printable lines can be max 76 characters. if we've seen more than
@@ -12,6 +11,45 @@
 
 #define QP_IS_TRAILING_WHITESPACE(c) \
 	((c) == ' ' || (c) == '\t')
+/* lowercase hex isn't strictly valid, but allow */
+#define QP_IS_HEX(c) \
+	(qp_hex_values[(unsigned char)(c)] != 0xff)
+
+/* hex digit values, 0xff for non-hex characters */
+static const unsigned char qp_hex_values[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 0-7 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 8-15 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 16-23 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 24-31 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 32-39 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 40-47 */
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, /* 48-55 */
+	0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 56-63 */
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, /* 64-71 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 72-79 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 80-87 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 88-95 */
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, /* 96-103 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 104-111 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 112-119 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 120-127 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 128-135 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 136-143 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 144-151 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 152-159 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 160-167 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 168-175 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 176-183 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 184-191 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 192-199 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 200-207 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 208-215 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 216-223 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 224-231 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 232-239 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* 240-247 */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff  /* 248-255 */
+};
 
 enum qp_state {
 	STATE_TEXT = 0,
@@ -54,6 +92,10 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 {
 	size_t i, start = 0, ret = src_size;
 
+	/* Runs of text are appended with a single buffer_append(). Complete
+	   hex escapes, soft line breaks, CRLFs and whitespace that can't be
+	   trailing are handled here without going through the state
+	   machine. */
 	for (i = 0; i < src_size; i++) {
 		if (src[i] > '=') {
 			/* fast path */
@@ -61,9 +103,32 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		}
 		switch (src[i]) {
 		case '=':
+			if (i + 2 < src_size &&
+			    QP_IS_HEX(src[i+1]) && QP_IS_HEX(src[i+2])) {
+				buffer_append(qp->dest, src+start, i-start);
+				buffer_append_c(qp->dest,
+					(qp_hex_values[src[i+1]] << 4) |
+					qp_hex_values[src[i+2]]);
+				i += 2;
+				start = i+1;
+				continue;
+			}
+			if (i + 2 < src_size &&
+			    src[i+1] == '\r' && src[i+2] == '\n') {
+				/* soft line break */
+				buffer_append(qp->dest, src+start, i-start);
+				i += 2;
+				start = i+1;
+				continue;
+			}
 			qp->state = STATE_EQUALS;
 			break;
 		case '\r':
+			if (i + 1 < src_size && src[i+1] == '\n') {
+				/* CRLF is copied as-is */
+				i++;
+				continue;
+			}
 			qp->state = STATE_CR;
 			break;
 		case '\n':
@@ -74,6 +139,12 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 			continue;
 		case ' ':
 		case '\t':
+			if (i + 1 < src_size &&
+			    !QP_IS_TRAILING_WHITESPACE(src[i+1]) &&
+			    src[i+1] != '\r' && src[i+1] != '\n') {
+				/* not trailing whitespace */
+				continue;
+			}
 			i_assert(qp->whitespace->used == 0);
 			qp->state = STATE_WHITESPACE;
 			buffer_append_c(qp->whitespace, src[i]);
@@ -175,10 +246,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_EQUALS:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    /* lowercase hex isn't strictly valid, but allow */
-			    (src[i] >= 'a' && src[i] <= 'f')) {
+			if (QP_IS_HEX(src[i])) {
 				qp->hexchar = src[i];
 				qp->state = STATE_HEX2;
 			} else if (QP_IS_TRAILING_WHITESPACE(src[i])) {
@@ -200,16 +268,10 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_HEX2:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    (src[i] >= 'a' && src[i] <= 'f')) {
-				char data[3];
-
-				data[0] = qp->hexchar;
-				data[1] = src[i];
-				data[2] = '\0';
-				if (hex_to_binary(data, qp->dest) < 0)
-					i_unreached();
+			if (QP_IS_HEX(src[i])) {
+				buffer_append_c(qp->dest,
+					(qp_hex_values[(unsigned char)qp->hexchar] << 4) |
+					qp_hex_values[src[i]]);
 				qp->state = STATE_TEXT;
 			} else {
 				/* invalid input */
@@ -0,0 +1,111 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-scan.h"
+#include "test-common.h"
+
+#define TEST_SCAN_BUF_SIZE 100
+
+static void
+test_message_scan_fill(unsigned char *buf, size_t size, unsigned int sparse)
+{
+	static const unsigned char chars[] = "ab:\r\n\0-\x80\xff";
+	size_t i;
+
+	/* mostly text, with the interesting characters mixed in. The higher
+	   sparse is, the longer the runs without them are. */
+	for (i = 0; i < size; i++) {
+		if (rand() % sparse != 0)
+			buf[i] = 'x';
+		else
+			buf[i] = chars[rand() % (sizeof(chars) - 1)];
+	}
+}
+
+static void test_message_scan_find_impl(const char *name)
+{
+	unsigned char buf[TEST_SCAN_BUF_SIZE];
+	size_t i, size, lf_nul, colon_lf_nul;
+	unsigned int n;
+
+	test_begin(t_strdup_printf("message scan find (%s)", name));
+	for (n = 0; n < 10000; n++) {
+		size = rand() % sizeof(buf);
+		test_message_scan_fill(buf, size, n % 2 == 0 ? 4 : 64);
+
+		lf_nul = colon_lf_nul = size;
+		for (i = size; i > 0; i--) {
+			if (buf[i-1] == '\n' || buf[i-1] == '\0')
+				lf_nul = colon_lf_nul = i-1;
+			else if (buf[i-1] == ':')
+				colon_lf_nul = i-1;
+		}
+		test_assert_idx(message_scan_lf_nul(buf, size) == lf_nul, n);
+		test_assert_idx(message_scan_colon_lf_nul(buf, size) ==
+				colon_lf_nul, n);
+	}
+	test_end();
+}
+
+static void test_message_scan_find(void)
+{
+	static const struct {
+		enum message_scan_impl impl;
+		const char *name;
+	} impls[] = {
+		{ MESSAGE_SCAN_IMPL_SWAR, "swar" },
+		{ MESSAGE_SCAN_IMPL_SSE2, "sse2" },
+		{ MESSAGE_SCAN_IMPL_AVX2, "avx2" },
+	};
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(impls); i++) {
+		if (message_scan_set_impl(impls[i].impl))
+			test_message_scan_find_impl(impls[i].name);
+	}
+	message_scan_set_best_impl();
+}
+
+static void test_message_scan_lines(void)
+{
+	struct message_scan_line_counts counts, expected;
+	unsigned char buf[TEST_SCAN_BUF_SIZE], prev_chr;
+	size_t i, size;
+	unsigned int n;
+
+	test_begin("message scan lines");
+	for (n = 0; n < 10000; n++) {
+		size = rand() % sizeof(buf);
+		test_message_scan_fill(buf, size, 4);
+		prev_chr = n % 2 == 0 ? '\r' : 'x';
+
+		memset(&expected, 0, sizeof(expected));
+		for (i = 0; i < size; i++) {
+			if (buf[i] == '\n') {
+				expected.lines++;
+				if ((i == 0 ? prev_chr : buf[i-1]) != '\r')
+					expected.missing_cr_count++;
+			} else if (buf[i] == '\0') {
+				expected.has_nuls = TRUE;
+			}
+		}
+
+		memset(&counts, 0, sizeof(counts));
+		message_scan_lines(buf, size, prev_chr, &counts);
+		test_assert_idx(counts.lines == expected.lines, n);
+		test_assert_idx(counts.missing_cr_count ==
+				expected.missing_cr_count, n);
+		test_assert_idx(counts.has_nuls == expected.has_nuls, n);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_message_scan_find,
+		test_message_scan_lines,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -27,6 +27,9 @@ static void test_qp_decoder(void)
 		{ "foo_bar", "foo_bar", 0, 0 },
 		{ "\n\n", "\r\n\r\n", 0, 0 },
 		{ "\r\n\n\n\r\n", "\r\n\r\n\r\n\r\n", 0, 0 },
+		{ "p=C3=A4 =c3=a4 a\tb \r\nc", "p\xC3\xA4 \xC3\xA4 a\tb\r\nc", 0, 0 },
+		{ "foo=\r\nbar=3D=3d\r\n", "foobar==\r\n", 0, 0 },
+		{ "a b \t=\r\n", "a b \t", 0, 0 },
 
 		{ "foo=", "foo=", 4, -1 },
 		{ "foo= \t", "foo= \t", 6, -1 },
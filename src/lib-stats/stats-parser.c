@@ -79,6 +79,11 @@ bool stats_parser_diff(const struct stats_parser_field *fields,
 				i_unreached();
 			}
 			break;
+		case STATS_PARSER_TYPE_UINT_PEAK:
+			i_assert(fields[i].size == sizeof(uint32_t) ||
+				 fields[i].size == sizeof(uint64_t));
+			memcpy(dest, src2, fields[i].size);
+			break;
 		case STATS_PARSER_TYPE_TIMEVAL:
 			if (!stats_diff_timeval(dest, src1, src2)) {
 				const struct timeval *tv1 = src1, *tv2 = src2;
@@ -137,6 +142,28 @@ void stats_parser_add(const struct stats_parser_field *fields,
 				i_unreached();
 			}
 			break;
+		case STATS_PARSER_TYPE_UINT_PEAK:
+			switch (fields[i].size) {
+			case sizeof(uint32_t): {
+				uint32_t *n_dest = f_dest;
+				const uint32_t *n_src = f_src;
+
+				if (*n_dest < *n_src)
+					*n_dest = *n_src;
+				break;
+			}
+			case sizeof(uint64_t): {
+				uint64_t *n_dest = f_dest;
+				const uint64_t *n_src = f_src;
+
+				if (*n_dest < *n_src)
+					*n_dest = *n_src;
+				break;
+			}
+			default:
+				i_unreached();
+			}
+			break;
 		case STATS_PARSER_TYPE_TIMEVAL:
 			stats_timeval_add(f_dest, f_src);
 			break;
@@ -152,6 +179,7 @@ void stats_parser_value(string_t *str,
 
 	switch (field->type) {
 	case STATS_PARSER_TYPE_UINT:
+	case STATS_PARSER_TYPE_UINT_PEAK:
 		switch (field->size) {
 		case sizeof(uint32_t): {
 			const uint32_t *n = ptr;
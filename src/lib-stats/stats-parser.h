@@ -5,7 +5,11 @@ struct stats;
 
 enum stats_parser_type {
 	STATS_PARSER_TYPE_UINT,
-	STATS_PARSER_TYPE_TIMEVAL
+	STATS_PARSER_TYPE_TIMEVAL,
+	/* Unsigned integer containing the highest value seen (e.g. peak
+	   memory usage). The diff is the newer value, and adding takes
+	   the larger one. */
+	STATS_PARSER_TYPE_UINT_PEAK
 };
 
 struct stats_parser_field {
@@ -117,7 +117,7 @@ cydir_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED,
 		}
 		input = i_stream_create_fd_autoclose(&fd, 0);
 		i_stream_set_name(input, path);
-		index_mail_set_read_buffer_size(_mail, input);
+		index_mail_set_read_buffer_size(_mail, input, TRUE);
 		if (mail->mail.v.istream_opened != NULL) {
 			if (mail->mail.v.istream_opened(_mail, &input) < 0) {
 				i_stream_unref(&input);
@@ -122,6 +122,9 @@ struct dbox_file {
 
 	unsigned int appending:1;
 	unsigned int corrupted:1;
+	/* the file contains multiple mails (mdbox), so its input is shared
+	   by them */
+	unsigned int multiple_mails:1;
 };
 
 struct dbox_file_append_context {
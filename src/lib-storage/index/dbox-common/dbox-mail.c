@@ -297,7 +297,8 @@ int dbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED,
 			return -1;
 		}
 		data->stream = input;
-		index_mail_set_read_buffer_size(_mail, input);
+		index_mail_set_read_buffer_size(_mail, input,
+			!mail->open_file->multiple_mails);
 	}
 
 	return index_mail_init_stream(&mail->imail, hdr_size, body_size,
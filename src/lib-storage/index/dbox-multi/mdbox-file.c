@@ -162,6 +162,7 @@ mdbox_file_init_full(struct mdbox_storage *storage,
 		t_strdup_printf(MDBOX_MAIL_FILE_FORMAT, file_id);
 	mdbox_file_init_paths(file, fname, FALSE);
 	dbox_file_init(&file->file);
+	file->file.multiple_mails = TRUE;
 	if (alt_dir)
 		file->file.cur_path = file->file.alt_path;
 
@@ -520,7 +520,7 @@ void imapc_mail_init_stream(struct imapc_mail *mail)
 
 	i_stream_set_name(imail->data.stream,
 			  t_strdup_printf("imapc mail uid=%u", _mail->uid));
-	index_mail_set_read_buffer_size(_mail, imail->data.stream);
+	index_mail_set_read_buffer_size(_mail, imail->data.stream, TRUE);
 
 	if (!IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_RFC822_SIZE)) {
 		/* enable filtering only when we're not passing through
@@ -18,8 +18,6 @@
 static const enum message_header_parser_flags hdr_parser_flags =
 	MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP |
 	MESSAGE_HEADER_PARSER_FLAG_DROP_CR;
-static const enum message_parser_flags msg_parser_flags =
-	MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK;
 
 static int header_line_cmp(const struct index_mail_line *l1,
 			   const struct index_mail_line *l2)
@@ -357,6 +355,14 @@ index_mail_parse_part_header_cb(struct message_part *part,
 				struct message_header_line *hdr,
 				struct index_mail *mail)
 {
+	struct message_block block;
+
+	if (index_mail_have_parse_consumers(mail)) {
+		memset(&block, 0, sizeof(block));
+		block.part = part;
+		block.hdr = hdr;
+		index_mail_parse_consumers_block(mail, &block);
+	}
 	index_mail_parse_header(part, hdr, mail);
 }
 
@@ -367,6 +373,14 @@ index_mail_parse_header_cb(struct message_header_line *hdr,
 	index_mail_parse_header(mail->data.parts, hdr, mail);
 }
 
+static enum message_parser_flags
+index_mail_parser_flags(struct index_mail *mail)
+{
+	/* the body blocks are needed only by the parse consumers */
+	return index_mail_have_parse_consumers(mail) ? 0 :
+		MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK;
+}
+
 struct istream *
 index_mail_cache_parse_init(struct mail *_mail, struct istream *input)
 {
@@ -387,10 +401,12 @@ index_mail_cache_parse_init(struct mail *_mail, struct istream *input)
 	input2 = tee_i_stream_create_child(mail->data.tee_stream);
 
 	index_mail_parse_header_init(mail, NULL);
+	index_mail_parse_consumers_init(mail);
 	mail->data.parser_input = input;
 	mail->data.parser_ctx =
 		message_parser_init(mail->mail.data_pool, input,
-				    hdr_parser_flags, msg_parser_flags);
+				    hdr_parser_flags,
+				    index_mail_parser_flags(mail));
 	i_stream_unref(&input);
 	return input2;
 }
@@ -407,20 +423,22 @@ static void index_mail_init_parser(struct index_mail *mail)
 			index_mail_set_message_parts_corrupted(&mail->mail.mail, error);
 			data->parts = NULL;
 		}
+		index_mail_parse_consumers_finish(mail, FALSE);
 	}
 
+	index_mail_parse_consumers_init(mail);
 	if (data->parts == NULL) {
 		data->parser_input = data->stream;
 		data->parser_ctx = message_parser_init(mail->mail.data_pool,
 						       data->stream,
 						       hdr_parser_flags,
-						       msg_parser_flags);
+						       index_mail_parser_flags(mail));
 	} else {
 		data->parser_ctx =
 			message_parser_init_from_parts(data->parts,
 						       data->stream,
 						       hdr_parser_flags,
-						       msg_parser_flags);
+						       index_mail_parser_flags(mail));
 	}
 }
 
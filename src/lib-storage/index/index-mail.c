@@ -6,10 +6,12 @@
 #include "ioloop.h"
 #include "istream.h"
 #include "hex-binary.h"
+#include "hash.h"
 #include "str.h"
 #include "message-date.h"
 #include "message-part-serialize.h"
 #include "message-parser.h"
+#include "message-decoder.h"
 #include "message-snippet.h"
 #include "imap-bodystructure.h"
 #include "imap-envelope.h"
@@ -23,6 +25,34 @@
 
 #define BODY_SNIPPET_ALGO_V1 "1"
 #define BODY_SNIPPET_MAX_CHARS 100
+/* Generate snippets for at most this many text parts while parsing. The
+   part that is finally used is known only after the whole message is
+   parsed, and it's nearly always one of the first ones. */
+#define BODY_SNIPPET_MAX_PARSED_PARTS 8
+
+struct index_mail_snippet_part {
+	struct message_part *part;
+	string_t *snippet;
+};
+
+struct index_mail_snippet_consumer {
+	struct index_mail_parse_consumer consumer;
+	pool_t pool;
+
+	struct message_decoder_context *decoder;
+	struct message_snippet_context *snippet_ctx;
+	struct message_part *snippet_part;
+	ARRAY(struct index_mail_snippet_part) parts;
+	/* part => "type/subtype" for the parts with a Content-Type. This
+	   way the snippet's text part can be chosen without parsing the
+	   bodystructure. */
+	HASH_TABLE(struct message_part *, char *) content_types;
+};
+
+/* Get the part's Content-Type. If it's unknown, text/plain is returned. */
+typedef void
+index_mail_part_content_type_t(struct message_part *part, void *context,
+			       const char **type_r, const char **subtype_r);
 
 struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "flags",
@@ -61,6 +91,8 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "binary.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
 	{ .name = "body.snippet",
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	{ .name = "imap.bodystructure.packed",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
 	/* FIXME: for now need to update get_metadata_precache_fields() in
 	   index-status.c when adding more fields. those fields should probably
@@ -686,6 +718,74 @@ static void index_mail_body_parsed_cache_message_parts(struct index_mail *mail)
 	data->messageparts_saved_to_cache = TRUE;
 }
 
+static bool index_mail_bodystructure_is_cached(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+	const struct mail_cache_field *cache_fields = mail->ibox->cache_fields;
+
+	return mail_cache_field_exists(_mail->transaction->cache_view, _mail->seq,
+			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx) > 0 ||
+		mail_cache_field_exists(_mail->transaction->cache_view, _mail->seq,
+			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE_PACKED].idx) > 0;
+}
+
+static bool
+index_mail_get_cached_packed_bodystructure(struct index_mail *mail,
+					   bool extended, string_t *str)
+{
+	const unsigned int cache_field =
+		mail->ibox->cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE_PACKED].idx;
+	struct message_part *parts = mail->data.parts;
+	const char *error;
+	buffer_t *buf;
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+	if (index_mail_cache_lookup_field(mail, buf, cache_field) <= 0)
+		return FALSE;
+	if (imap_bodystructure_deserialize(mail->mail.data_pool, buf->data,
+					   buf->used, &parts, &error) < 0) {
+		mail_set_cache_corrupted_reason(&mail->mail.mail,
+			MAIL_FETCH_IMAP_BODYSTRUCTURE, t_strdup_printf(
+			"Invalid packed BODYSTRUCTURE: %s", error));
+		return FALSE;
+	}
+	/* the body data is now in the message_parts' contexts, so e.g.
+	   imap_msgpart doesn't need to parse the BODYSTRUCTURE either */
+	mail->data.parts = parts;
+	imap_bodystructure_write(parts, str, extended);
+	return TRUE;
+}
+
+static void
+index_mail_cache_bodystructure(struct index_mail *mail, const char *value)
+{
+	struct mail *_mail = &mail->mail.mail;
+	const unsigned int cache_field_bodystructure =
+		mail->ibox->cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
+	const unsigned int cache_field_packed =
+		mail->ibox->cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE_PACKED].idx;
+	enum mail_cache_decision_type dec;
+	buffer_t *buffer;
+
+	dec = mail_cache_field_get_decision(_mail->box->cache,
+					    cache_field_bodystructure);
+	if ((dec & MAIL_CACHE_DECISION_FORCED) != 0) {
+		/* explicitly configured to be cached as text */
+		index_mail_cache_add(mail, MAIL_CACHE_IMAP_BODYSTRUCTURE,
+				     value, strlen(value)+1);
+		return;
+	}
+	if (mail_cache_field_exists(_mail->transaction->cache_view,
+				    _mail->seq, cache_field_packed) > 0)
+		return;
+	T_BEGIN {
+		buffer = buffer_create_dynamic(pool_datastack_create(), 1024);
+		imap_bodystructure_serialize(mail->data.parts, buffer);
+		index_mail_cache_add(mail, MAIL_CACHE_IMAP_BODYSTRUCTURE_PACKED,
+				     buffer->data, buffer->used);
+	} T_END;
+}
+
 static void
 index_mail_body_parsed_cache_bodystructure(struct index_mail *mail,
 					   enum index_cache_field field)
@@ -737,13 +837,10 @@ index_mail_body_parsed_cache_bodystructure(struct index_mail *mail,
 		imap_bodystructure_write(data->parts, str, TRUE);
 		data->bodystructure = str_c(str);
 
-		index_mail_cache_add(mail, MAIL_CACHE_IMAP_BODYSTRUCTURE,
-				     str_c(str), str_len(str)+1);
+		index_mail_cache_bodystructure(mail, data->bodystructure);
 		bodystructure_cached = TRUE;
 	} else {
-		bodystructure_cached =
-			mail_cache_field_exists(_mail->transaction->cache_view,
-				_mail->seq, cache_field_bodystructure) > 0;
+		bodystructure_cached = index_mail_bodystructure_is_cached(mail);
 	}
 
 	/* normally don't cache both BODY and BODYSTRUCTURE, but do it
@@ -876,39 +973,60 @@ static void index_mail_cache_dates(struct index_mail *mail)
 		(void)index_mail_cache_sent_date(mail);
 }
 
-static struct message_part *
-index_mail_find_first_text_mime_part(struct message_part *parts)
+static const char *index_mail_bodystructure_unquote(const char *str)
 {
-	struct message_part_body_data *body_data = parts->context;
-	struct message_part *part;
+	size_t len = strlen(str);
+
+	if (len < 2 || str[0] != '"' || str[len-1] != '"')
+		return str;
+	return t_strndup(str + 1, len - 2);
+}
+
+static void
+index_mail_bodystructure_content_type(struct message_part *part,
+				      void *context ATTR_UNUSED,
+				      const char **type_r,
+				      const char **subtype_r)
+{
+	struct message_part_body_data *body_data = part->context;
 
 	i_assert(body_data != NULL);
 
-	if (body_data->content_type == NULL ||
-	    strcasecmp(body_data->content_type, "\"text\"") == 0) {
+	*type_r = body_data->content_type == NULL ? "text" :
+		index_mail_bodystructure_unquote(body_data->content_type);
+	*subtype_r = body_data->content_subtype == NULL ? "plain" :
+		index_mail_bodystructure_unquote(body_data->content_subtype);
+}
+
+static struct message_part *
+index_mail_find_first_text_mime_part(struct message_part *parts,
+				     index_mail_part_content_type_t *get_type,
+				     void *context)
+{
+	struct message_part *part;
+	const char *type, *subtype;
+
+	get_type(parts, context, &type, &subtype);
+	if (strcasecmp(type, "text") == 0) {
 		/* use any text/ part, even if we don't know what exactly
 		   it is. */
 		return parts;
 	}
-	if (strcasecmp(body_data->content_type, "\"multipart\"") != 0) {
+	if (strcasecmp(type, "multipart") != 0) {
 		/* for now we support only text Content-Types */
 		return NULL;
 	}
 
-	if (strcasecmp(body_data->content_subtype, "\"alternative\"") == 0) {
+	if (strcasecmp(subtype, "alternative") == 0) {
 		/* text/plain > text/html > text/ */
 		struct message_part *html_part = NULL, *text_part = NULL;
 
 		for (part = parts->children; part != NULL; part = part->next) {
-			struct message_part_body_data *sub_body_data =
-				part->context;
-
-			i_assert(sub_body_data != NULL);
-
-			if (strcasecmp(sub_body_data->content_type, "\"text\"") == 0) {
-				if (strcasecmp(sub_body_data->content_subtype, "\"plain\"") == 0)
+			get_type(part, context, &type, &subtype);
+			if (strcasecmp(type, "text") == 0) {
+				if (strcasecmp(subtype, "plain") == 0)
 					return part;
-				if (strcasecmp(sub_body_data->content_subtype, "\"html\"") == 0)
+				if (strcasecmp(subtype, "html") == 0)
 					html_part = part;
 				else
 					text_part = part;
@@ -919,7 +1037,8 @@ index_mail_find_first_text_mime_part(struct message_part *parts)
 	/* find the first usable MIME part */
 	for (part = parts->children; part != NULL; part = part->next) {
 		struct message_part *subpart =
-			index_mail_find_first_text_mime_part(part);
+			index_mail_find_first_text_mime_part(part, get_type,
+							     context);
 		if (subpart != NULL)
 			return subpart;
 	}
@@ -934,9 +1053,15 @@ static int index_mail_write_body_snippet(struct index_mail *mail)
 	string_t *str;
 	int ret;
 
-	i_assert(mail->data.parsed_bodystructure);
-
-	part = index_mail_find_first_text_mime_part(mail->data.parts);
+	part = mail->data.body_snippet_part;
+	if (part == NULL) {
+		i_assert(mail->data.parsed_bodystructure);
+		T_BEGIN {
+			part = index_mail_find_first_text_mime_part(
+				mail->data.parts,
+				index_mail_bodystructure_content_type, NULL);
+		} T_END;
+	}
 	if (part == NULL) {
 		mail->data.body_snippet = BODY_SNIPPET_ALGO_V1;
 		return 0;
@@ -962,6 +1087,184 @@ static int index_mail_write_body_snippet(struct index_mail *mail)
 	return ret;
 }
 
+void index_mail_parse_consumer_add(struct index_mail *mail,
+				   struct index_mail_parse_consumer *consumer)
+{
+	i_assert(mail->data.parser_ctx == NULL);
+
+	if (!array_is_created(&mail->data.parse_consumers))
+		p_array_init(&mail->data.parse_consumers, mail->mail.data_pool, 4);
+	array_append(&mail->data.parse_consumers, &consumer, 1);
+}
+
+bool index_mail_have_parse_consumers(struct index_mail *mail)
+{
+	return array_is_created(&mail->data.parse_consumers) &&
+		array_count(&mail->data.parse_consumers) > 0;
+}
+
+void index_mail_parse_consumers_block(struct index_mail *mail,
+				      struct message_block *block)
+{
+	struct index_mail_parse_consumer *const *consumerp;
+
+	if (!array_is_created(&mail->data.parse_consumers))
+		return;
+	array_foreach(&mail->data.parse_consumers, consumerp)
+		(*consumerp)->block(*consumerp, block);
+}
+
+void index_mail_parse_consumers_finish(struct index_mail *mail, bool success)
+{
+	struct index_mail_parse_consumer *const *consumerp;
+
+	if (!array_is_created(&mail->data.parse_consumers))
+		return;
+	array_foreach(&mail->data.parse_consumers, consumerp)
+		(*consumerp)->finish(*consumerp, mail, success);
+	array_clear(&mail->data.parse_consumers);
+}
+
+static void
+index_mail_snippet_block(struct index_mail_parse_consumer *consumer,
+			 struct message_block *block)
+{
+	struct index_mail_snippet_consumer *ctx =
+		(struct index_mail_snippet_consumer *)consumer;
+	struct index_mail_snippet_part *snippet_part;
+	struct message_block decoded;
+	const char *content_type;
+
+	if (ctx->snippet_ctx != NULL && block->part != ctx->snippet_part) {
+		/* the text part ended */
+		message_snippet_deinit(&ctx->snippet_ctx);
+	}
+
+	if (block->hdr != NULL) {
+		/* only the Content-* headers affect decoding the body */
+		if (strncasecmp(block->hdr->name, "Content-", 8) == 0) {
+			(void)message_decoder_decode_next_block(ctx->decoder,
+								block, &decoded);
+		}
+		return;
+	}
+	if (block->size == 0) {
+		/* end of headers */
+		(void)message_decoder_decode_next_block(ctx->decoder, block,
+							&decoded);
+		content_type = message_decoder_current_content_type(ctx->decoder);
+		if (content_type != NULL) {
+			hash_table_insert(ctx->content_types, block->part,
+					  p_strdup(ctx->pool, content_type));
+		}
+		if ((block->part->flags & (MESSAGE_PART_FLAG_MULTIPART |
+					   MESSAGE_PART_FLAG_MESSAGE_RFC822)) != 0 ||
+		    array_count(&ctx->parts) >= BODY_SNIPPET_MAX_PARSED_PARTS)
+			return;
+
+		snippet_part = array_append_space(&ctx->parts);
+		snippet_part->part = block->part;
+		snippet_part->snippet = str_new(ctx->pool, 128);
+		str_append(snippet_part->snippet, BODY_SNIPPET_ALGO_V1);
+		ctx->snippet_part = block->part;
+		ctx->snippet_ctx = message_snippet_init(content_type,
+			BODY_SNIPPET_MAX_CHARS, snippet_part->snippet);
+		return;
+	}
+
+	if (ctx->snippet_ctx == NULL ||
+	    !message_decoder_decode_next_block(ctx->decoder, block, &decoded) ||
+	    decoded.size == 0)
+		return;
+	if (!message_snippet_more(ctx->snippet_ctx, decoded.data, decoded.size))
+		message_snippet_deinit(&ctx->snippet_ctx);
+}
+
+static void
+index_mail_snippet_content_type(struct message_part *part, void *context,
+				const char **type_r, const char **subtype_r)
+{
+	struct index_mail_snippet_consumer *ctx = context;
+	const char *content_type, *p;
+
+	content_type = hash_table_lookup(ctx->content_types, part);
+	if (content_type == NULL) {
+		*type_r = "text";
+		*subtype_r = "plain";
+	} else if ((p = strchr(content_type, '/')) == NULL) {
+		*type_r = content_type;
+		*subtype_r = "";
+	} else {
+		*type_r = t_strdup_until(content_type, p);
+		*subtype_r = p + 1;
+	}
+}
+
+static void
+index_mail_snippet_finish(struct index_mail_parse_consumer *consumer,
+			  struct index_mail *mail, bool success)
+{
+	struct index_mail_snippet_consumer *ctx =
+		(struct index_mail_snippet_consumer *)consumer;
+	const struct index_mail_snippet_part *snippet_part;
+	struct message_part *part;
+
+	if (ctx->snippet_ctx != NULL)
+		message_snippet_deinit(&ctx->snippet_ctx);
+	message_decoder_deinit(&ctx->decoder);
+
+	if (!success || mail->data.parts == NULL ||
+	    mail->data.body_snippet != NULL) {
+		hash_table_destroy(&ctx->content_types);
+		return;
+	}
+
+	T_BEGIN {
+		part = index_mail_find_first_text_mime_part(mail->data.parts,
+			index_mail_snippet_content_type, ctx);
+	} T_END;
+	hash_table_destroy(&ctx->content_types);
+	if (part == NULL) {
+		mail->data.body_snippet = BODY_SNIPPET_ALGO_V1;
+		return;
+	}
+	array_foreach(&ctx->parts, snippet_part) {
+		if (snippet_part->part == part) {
+			mail->data.body_snippet = str_c(snippet_part->snippet);
+			return;
+		}
+	}
+	/* the text part wasn't seen - index_mail_write_body_snippet()
+	   reads it separately */
+	mail->data.body_snippet_part = part;
+}
+
+static void index_mail_snippet_consumer_add(struct index_mail *mail)
+{
+	struct index_mail_snippet_consumer *ctx;
+
+	ctx = p_new(mail->mail.data_pool, struct index_mail_snippet_consumer, 1);
+	ctx->consumer.block = index_mail_snippet_block;
+	ctx->consumer.finish = index_mail_snippet_finish;
+	ctx->pool = mail->mail.data_pool;
+	ctx->decoder = message_decoder_init(NULL, 0);
+	p_array_init(&ctx->parts, ctx->pool, 4);
+	hash_table_create_direct(&ctx->content_types, ctx->pool, 0);
+	index_mail_parse_consumer_add(mail, &ctx->consumer);
+}
+
+void index_mail_parse_consumers_init(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+
+	/* generate the snippet while parsing if it's going to be fetched or
+	   cached anyway */
+	if (mail->data.save_body_snippet ||
+	    (_mail->saving && mail->data.body_snippet == NULL &&
+	     index_mail_want_cache(mail, MAIL_CACHE_BODY_SNIPPET)))
+		index_mail_snippet_consumer_add(mail);
+}
+
 static int
 index_mail_parse_body_finish(struct index_mail *mail,
 			     enum index_cache_field field, bool success)
@@ -999,6 +1302,7 @@ index_mail_parse_body_finish(struct index_mail *mail,
 		i_stream_unref(&parser_input);
 	}
 	if (ret <= 0) {
+		index_mail_parse_consumers_finish(mail, FALSE);
 		if (ret == 0) {
 			i_assert(error != NULL);
 			index_mail_set_message_parts_corrupted(&mail->mail.mail, error);
@@ -1015,11 +1319,16 @@ index_mail_parse_body_finish(struct index_mail *mail,
 		mail->data.save_bodystructure_body = FALSE;
 		i_assert(mail->data.parts != NULL);
 	}
+	index_mail_parse_consumers_finish(mail, success);
 	if (mail->data.save_body_snippet) {
-		if (index_mail_write_body_snippet(mail) < 0)
+		if (mail->data.body_snippet == NULL &&
+		    index_mail_write_body_snippet(mail) < 0) {
+			mail->data.body_snippet_part = NULL;
 			return -1;
+		}
 		mail->data.save_body_snippet = FALSE;
 	}
+	mail->data.body_snippet_part = NULL;
 
 	if (mail->data.no_caching) {
 		/* if we're here because we aborted parsing, don't get any
@@ -1084,6 +1393,7 @@ static int index_mail_parse_body(struct index_mail *mail,
 				 enum index_cache_field field)
 {
 	struct index_mail_data *data = &mail->data;
+	struct message_block block;
 	uoff_t old_offset;
 	int ret;
 
@@ -1096,12 +1406,13 @@ static int index_mail_parse_body(struct index_mail *mail,
 		/* bodystructure header is parsed, we want the body's mime
 		   headers too */
 		i_assert(!data->save_bodystructure_header);
-		message_parser_parse_body(data->parser_ctx,
-					  parse_bodystructure_part_header,
-					  mail->mail.data_pool);
-	} else {
-		message_parser_parse_body(data->parser_ctx,
-			*null_message_part_header_callback, (void *)NULL);
+	}
+	while (message_parser_parse_next_block(data->parser_ctx, &block) > 0) {
+		index_mail_parse_consumers_block(mail, &block);
+		if (block.size == 0 && data->save_bodystructure_body) {
+			parse_bodystructure_part_header(block.part, block.hdr,
+							mail->mail.data_pool);
+		}
 	}
 	ret = index_mail_stream_check_failure(mail);
 	if (index_mail_parse_body_finish(mail, field, TRUE) < 0)
@@ -1118,14 +1429,26 @@ static void index_mail_stream_destroy_callback(struct index_mail *mail)
 	mail->data.destroying_stream = FALSE;
 }
 
-void index_mail_set_read_buffer_size(struct mail *_mail, struct istream *input)
+void index_mail_set_read_buffer_size(struct mail *_mail, struct istream *input,
+				     bool exclusive)
 {
 	struct index_mail *mail = (struct index_mail *)_mail;
 	unsigned int block_size;
 
 	i_stream_set_max_buffer_size(input, MAIL_READ_FULL_BLOCK_SIZE);
-	block_size = (mail->data.access_part & (READ_BODY | PARSE_BODY)) != 0 ?
-		MAIL_READ_FULL_BLOCK_SIZE : MAIL_READ_HDR_BLOCK_SIZE;
+	if ((mail->data.access_part & (READ_BODY | PARSE_BODY)) != 0) {
+		block_size = MAIL_READ_FULL_BLOCK_SIZE;
+		/* The whole mail is going to be read. The access pattern is
+		   passed down to the parent file stream, so don't set it for
+		   streams shared by multiple mails. Each mail's seek would
+		   restart the prefetching of the whole file. */
+		if (exclusive) {
+			i_stream_set_access_pattern(input,
+				I_STREAM_ACCESS_SEQUENTIAL);
+		}
+	} else {
+		block_size = MAIL_READ_HDR_BLOCK_SIZE;
+	}
 	i_stream_set_init_buffer_size(input, block_size);
 }
 
@@ -1369,7 +1692,9 @@ int index_mail_get_special(struct mail *_mail,
 			} else {
 				data->body = str_c(str);
 			}
-		}
+		} else if (index_mail_get_cached_packed_bodystructure(mail,
+								FALSE, str))
+			data->body = str_c(str);
 
 		if (data->body == NULL) {
 			str_free(&str);
@@ -1399,6 +1724,9 @@ int index_mail_get_special(struct mail *_mail,
 		} else if (index_mail_cache_lookup_field(mail, str,
 					bodystructure_cache_field) > 0) {
 			data->bodystructure = str_c(str);
+		} else if (index_mail_get_cached_packed_bodystructure(mail,
+								TRUE, str)) {
+			data->bodystructure = str_c(str);
 		} else {
 			str_free(&str);
 			if (index_mail_parse_bodystructure(mail,
@@ -1492,6 +1820,7 @@ static void index_mail_close_streams_full(struct index_mail *mail, bool closing)
 	if (data->parser_ctx != NULL) {
 		if (message_parser_deinit_from_parts(&data->parser_ctx, &parts, &error) < 0)
 			index_mail_set_message_parts_corrupted(&mail->mail.mail, error);
+		index_mail_parse_consumers_finish(mail, FALSE);
 		mail->data.parser_input = NULL;
 		if (mail->data.save_bodystructure_body)
 			mail->data.save_bodystructure_header = TRUE;
@@ -1654,15 +1983,12 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 	    (data->cache_flags & MAIL_CACHE_FLAG_TEXT_PLAIN_7BIT_ASCII) == 0 &&
 	    data->body == NULL) {
 		/* we need either imap.body or imap.bodystructure */
-		const unsigned int cache_field1 =
+		const unsigned int cache_field =
 			cache_fields[MAIL_CACHE_IMAP_BODY].idx;
-		const unsigned int cache_field2 =
-			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
 
 		if (mail_cache_field_exists(cache_view, _mail->seq,
-					    cache_field1) <= 0 &&
-		    mail_cache_field_exists(cache_view, _mail->seq,
-					    cache_field2) <= 0) {
+					    cache_field) <= 0 &&
+		    !index_mail_bodystructure_is_cached(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
@@ -1672,11 +1998,7 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 	if ((data->wanted_fields & MAIL_FETCH_IMAP_BODYSTRUCTURE) != 0 &&
 	    (data->cache_flags & MAIL_CACHE_FLAG_TEXT_PLAIN_7BIT_ASCII) == 0 &&
 	    data->bodystructure == NULL) {
-		const unsigned int cache_field =
-			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
-
-                if (mail_cache_field_exists(cache_view, _mail->seq,
-                                            cache_field) <= 0) {
+		if (!index_mail_bodystructure_is_cached(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
@@ -1914,6 +2236,7 @@ void index_mail_cache_parse_continue(struct mail *_mail)
 
 	while (message_parser_parse_next_block(mail->data.parser_ctx,
 					       &block) > 0) {
+		index_mail_parse_consumers_block(mail, &block);
 		if (block.size != 0)
 			continue;
 
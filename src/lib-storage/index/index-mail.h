@@ -24,6 +24,7 @@ enum index_cache_field {
 	MAIL_CACHE_MESSAGE_PARTS,
 	MAIL_CACHE_BINARY_PARTS,
 	MAIL_CACHE_BODY_SNIPPET,
+	MAIL_CACHE_IMAP_BODYSTRUCTURE_PACKED,
 
 	MAIL_INDEX_CACHE_FIELD_COUNT
 };
@@ -72,6 +73,25 @@ struct index_mail_line {
 };
 
 struct message_header_line;
+struct message_block;
+struct index_mail;
+
+/* Consumer for the blocks of a message_parser run. All the consumers see the
+   same single parsing pass, so everything that wants to look at the message
+   body while it's being parsed anyway (e.g. while saving) can do it without
+   reading and parsing the message again. */
+struct index_mail_parse_consumer {
+	/* Called for each block returned by the message parser, including
+	   the body blocks. */
+	void (*block)(struct index_mail_parse_consumer *consumer,
+		      struct message_block *block);
+	/* Called once after the parsing has finished. If success is FALSE,
+	   the parsing was aborted and only a part of the message was seen.
+	   The consumer is no longer used afterwards. */
+	void (*finish)(struct index_mail_parse_consumer *consumer,
+		       struct index_mail *mail, bool success);
+};
+ARRAY_DEFINE_TYPE(index_mail_parse_consumer, struct index_mail_parse_consumer *);
 
 struct index_mail_data {
 	time_t date, received_date, save_date;
@@ -85,6 +105,8 @@ struct index_mail_data {
 	struct message_binary_part *bin_parts;
 	const char *envelope, *body, *bodystructure, *guid, *filename;
 	const char *from_envelope, *body_snippet;
+	/* text part whose snippet wasn't generated while parsing */
+	struct message_part *body_snippet_part;
 	struct message_part_envelope_data *envelope_data;
 
 	uint32_t seq;
@@ -104,6 +126,7 @@ struct index_mail_data {
 	struct message_size hdr_size, body_size;
 	struct istream *parser_input;
 	struct message_parser_ctx *parser_ctx;
+	ARRAY_TYPE(index_mail_parse_consumer) parse_consumers;
 	int parsing_count;
 	ARRAY_TYPE(keywords) keywords;
 	ARRAY_TYPE(keyword_indexes) keyword_indexes;
@@ -199,7 +222,11 @@ int index_mail_get_headers(struct mail *_mail, const char *field,
 int index_mail_get_header_stream(struct mail *_mail,
 				 struct mailbox_header_lookup_ctx *headers,
 				 struct istream **stream_r);
-void index_mail_set_read_buffer_size(struct mail *mail, struct istream *input);
+/* Set the buffer sizes for reading the mail's input. If the input isn't
+   shared with other mails (exclusive=TRUE) and the whole mail is going to be
+   read, the input is also set to be read sequentially. */
+void index_mail_set_read_buffer_size(struct mail *mail, struct istream *input,
+				     bool exclusive);
 
 enum mail_flags index_mail_get_flags(struct mail *_mail);
 uint64_t index_mail_get_modseq(struct mail *_mail);
@@ -262,6 +289,24 @@ void index_mail_cache_parse_continue(struct mail *mail);
 void index_mail_cache_parse_deinit(struct mail *mail, time_t received_date,
 				   bool success);
 
+/* Add a consumer for the blocks of the next message parsing. This must be
+   called before the parser is initialized. */
+void index_mail_parse_consumer_add(struct index_mail *mail,
+				   struct index_mail_parse_consumer *consumer);
+/* Add the built-in consumers that are wanted for the mail. Only the body
+   snippet needs to be one:
+    - BODYSTRUCTURE and ENVELOPE need only the headers. They're already
+      parsed in the same pass by index_mail_parse_header(), which also
+      handles reading only the header without a message_parser.
+    - There are no attachment flags to store in the index or cache.
+    - The header MD5 is used only by mbox, which calculates it with its own
+      rules while syncing the mbox file, not while parsing mails. */
+void index_mail_parse_consumers_init(struct index_mail *mail);
+bool index_mail_have_parse_consumers(struct index_mail *mail);
+void index_mail_parse_consumers_block(struct index_mail *mail,
+				      struct message_block *block);
+void index_mail_parse_consumers_finish(struct index_mail *mail, bool success);
+
 int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 				  unsigned int field_idx);
 void index_mail_save_finish(struct mail_save_context *ctx);
@@ -942,6 +942,33 @@ static void search_limit_lowwater(struct index_search_context *ctx,
 		*first_seq = seq1;
 }
 
+static bool search_limit_by_flags(struct index_search_context *ctx,
+				  struct mail_search_arg *arg,
+				  enum mail_flags pvt_flags_mask,
+				  uint32_t *first_seq)
+{
+	enum mail_flags flags = arg->value.flags;
+	uint32_t seq;
+
+	if ((flags & (MAIL_RECENT | pvt_flags_mask)) != 0)
+		return TRUE;
+	if (arg->match_not && (flags & (flags - 1)) != 0) {
+		/* NOT with multiple flags can't be looked up */
+		return TRUE;
+	}
+
+	/* skip directly to the first message that can match. this scans
+	   the flags in the index instead of checking each message
+	   separately. */
+	mail_index_lookup_first(ctx->view, arg->match_not ? 0 : flags,
+				flags, &seq);
+	if (seq == 0)
+		return FALSE;
+	if (*first_seq < seq)
+		*first_seq = seq;
+	return TRUE;
+}
+
 static bool search_limit_by_hdr(struct index_search_context *ctx,
 				struct mail_search_arg *args,
 				uint32_t *seq1, uint32_t *seq2)
@@ -1008,6 +1035,8 @@ static bool search_limit_by_hdr(struct index_search_context *ctx,
                                 	hdr->first_deleted_uid_lowwater, seq1);
 			}
 		}
+		if (!search_limit_by_flags(ctx, args, pvt_flags_mask, seq1))
+			return FALSE;
 	}
 
 	return *seq1 <= *seq2;
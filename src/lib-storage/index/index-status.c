@@ -50,50 +50,60 @@ int index_storage_get_status(struct mailbox *box,
 
 static unsigned int index_storage_count_pvt_unseen(struct mailbox *box)
 {
-	const struct mail_index_record *pvt_rec;
-	uint32_t shared_seq, pvt_seq, shared_count, pvt_count;
-	uint32_t shared_uid;
+	const uint32_t *shared_uids, *pvt_uids;
+	const uint8_t *shared_flags, *pvt_flags;
+	uint32_t shared_idx, pvt_idx, shared_count, pvt_count;
 	unsigned int unseen_count = 0;
 
+	shared_count = mail_index_view_get_messages_count(box->view);
+	pvt_count = mail_index_view_get_messages_count(box->view_pvt);
+	mail_index_view_get_columns(box->view, &shared_uids, &shared_flags);
+	mail_index_view_get_columns(box->view_pvt, &pvt_uids, &pvt_flags);
+
+	if (shared_count == pvt_count &&
+	    (shared_count == 0 ||
+	     memcmp(shared_uids, pvt_uids,
+		    shared_count * sizeof(uint32_t)) == 0)) {
+		/* private index is up to date. just count its flags. */
+		return mail_index_view_count_flags(box->view_pvt, 0, MAIL_SEEN);
+	}
+
 	/* we can't trust private index to be up to date. we'll need to go
 	   through the shared index and for each existing mail lookup its
 	   private flags. if a mail doesn't exist in private index then its
 	   flags are 0. */
-	shared_count = mail_index_view_get_messages_count(box->view);
-	pvt_count = mail_index_view_get_messages_count(box->view_pvt);
-	shared_seq = pvt_seq = 1;
-	while (shared_seq <= shared_count && pvt_seq <= pvt_count) {
-		mail_index_lookup_uid(box->view, shared_seq, &shared_uid);
-		pvt_rec = mail_index_lookup(box->view_pvt, pvt_seq);
-
-		if (shared_uid == pvt_rec->uid) {
-			if ((pvt_rec->flags & MAIL_SEEN) == 0)
+	shared_idx = pvt_idx = 0;
+	while (shared_idx < shared_count && pvt_idx < pvt_count) {
+		if (shared_uids[shared_idx] == pvt_uids[pvt_idx]) {
+			if ((pvt_flags[pvt_idx] & MAIL_SEEN) == 0)
 				unseen_count++;
-			shared_seq++; pvt_seq++;
-		} else if (shared_uid < pvt_rec->uid) {
-			shared_seq++;
+			shared_idx++; pvt_idx++;
+		} else if (shared_uids[shared_idx] < pvt_uids[pvt_idx]) {
+			shared_idx++;
 		} else {
-			pvt_seq++;
+			pvt_idx++;
 		}
 	}
-	unseen_count += (shared_count+1) - shared_seq;
+	unseen_count += shared_count - shared_idx;
 	return unseen_count;
 }
 
 static uint32_t index_storage_find_first_pvt_unseen_seq(struct mailbox *box)
 {
 	const struct mail_index_header *pvt_hdr;
-	const struct mail_index_record *pvt_rec;
+	const uint32_t *pvt_uids;
+	const uint8_t *pvt_flags;
 	uint32_t pvt_seq, pvt_count, shared_seq, seq2;
 
 	pvt_count = mail_index_view_get_messages_count(box->view_pvt);
+	mail_index_view_get_columns(box->view_pvt, &pvt_uids, &pvt_flags);
 	mail_index_lookup_first(box->view_pvt, 0, MAIL_SEEN, &pvt_seq);
 	if (pvt_seq == 0)
 		pvt_seq = pvt_count+1;
 	for (; pvt_seq <= pvt_count; pvt_seq++) {
-		pvt_rec = mail_index_lookup(box->view_pvt, pvt_seq);
-		if ((pvt_rec->flags & MAIL_SEEN) == 0 &&
-		    mail_index_lookup_seq(box->view, pvt_rec->uid, &shared_seq))
+		if ((pvt_flags[pvt_seq-1] & MAIL_SEEN) == 0 &&
+		    mail_index_lookup_seq(box->view, pvt_uids[pvt_seq-1],
+					  &shared_seq))
 			return shared_seq;
 	}
 	/* if shared index has any messages that don't exist in private index,
@@ -232,6 +242,11 @@ static void get_metadata_precache_fields(struct mailbox *box,
 	for (i = 0; i < count; i++) {
 		const char *name = fields[i].name;
 
+		if ((fields[i].decision & ~MAIL_CACHE_DECISION_FORCED) ==
+		    MAIL_CACHE_DECISION_NO) {
+			/* not cached, so there's no point in reading it */
+			continue;
+		}
 		if (strncmp(name, "hdr.", 4) == 0 ||
 		    strcmp(name, "date.sent") == 0 ||
 		    strcmp(name, "imap.envelope") == 0)
@@ -240,6 +255,7 @@ static void get_metadata_precache_fields(struct mailbox *box,
 			 strcmp(name, "binary.parts") == 0 ||
 			 strcmp(name, "imap.body") == 0 ||
 			 strcmp(name, "imap.bodystructure") == 0 ||
+			 strcmp(name, "imap.bodystructure.packed") == 0 ||
 			 strcmp(name, "body.snippet") == 0)
 			cache |= MAIL_FETCH_STREAM_BODY;
 		else if (strcmp(name, "date.received") == 0)
@@ -264,6 +280,18 @@ static void get_metadata_precache_fields(struct mailbox *box,
 	metadata_r->precache_fields = cache;
 }
 
+static void
+get_metadata_cache_compress(struct mailbox *box,
+			    struct mailbox_metadata *metadata_r)
+{
+	if (!mail_cache_compress_get_progress(box->cache,
+					      &metadata_r->cache_compress_copied,
+					      &metadata_r->cache_compress_total)) {
+		metadata_r->cache_compress_copied = 0;
+		metadata_r->cache_compress_total = 0;
+	}
+}
+
 int index_mailbox_get_metadata(struct mailbox *box,
 			       enum mailbox_metadata_items items,
 			       struct mailbox_metadata *metadata_r)
@@ -300,5 +328,7 @@ int index_mailbox_get_metadata(struct mailbox *box,
 		get_metadata_cache_fields(box, metadata_r);
 	if ((items & MAILBOX_METADATA_PRECACHE_FIELDS) != 0)
 		get_metadata_precache_fields(box, metadata_r);
+	if ((items & MAILBOX_METADATA_CACHE_COMPRESS) != 0)
+		get_metadata_cache_compress(box, metadata_r);
 	return 0;
 }
@@ -72,6 +72,9 @@ static void index_cache_register_defaults(struct mailbox *box)
 	       sizeof(global_cache_fields));
 	mail_cache_register_fields(cache, ibox->cache_fields,
 				   MAIL_INDEX_CACHE_FIELD_COUNT);
+	mail_cache_set_columns(cache, set->mail_cache_columns);
+	mail_cache_set_compress_batch_size(cache,
+					   set->mail_cache_compress_batch_size);
 
 	if (strcmp(set->mail_never_cache_fields, "*") == 0) {
 		/* all caching disabled for now */
@@ -331,6 +334,12 @@ void index_storage_mailbox_alloc(struct mailbox *box, const char *vname,
 		mail_storage_settings_to_index_flags(box->storage->set);
 	if ((box->flags & MAILBOX_FLAG_SAVEONLY) != 0)
 		ibox->index_flags |= MAIL_INDEX_OPEN_FLAG_SAVEONLY;
+	if (box->storage->set->mail_index_shared_maps &&
+	    box->list->ns->type != MAIL_NAMESPACE_TYPE_PRIVATE) {
+		/* only shared and public mailboxes are normally opened by
+		   many users' processes at the same time */
+		ibox->index_flags |= MAIL_INDEX_OPEN_FLAG_SHARED_MAPS;
+	}
 	ibox->next_lock_notify = time(NULL) + LOCK_NOTIFY_INTERVAL;
 	MODULE_CONTEXT_SET(box, index_storage_module, ibox);
 
@@ -95,7 +95,7 @@ maildir_open_mail(struct maildir_mailbox *mbox, struct mail *mail,
 			*deleted_r = TRUE;
 	} else {
 		i_stream_set_name(input, ctx.path);
-		index_mail_set_read_buffer_size(mail, input);
+		index_mail_set_read_buffer_size(mail, input, TRUE);
 	}
 	i_free(ctx.path);
 	return input;
@@ -1639,11 +1639,17 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 
 	mbox_sync_restart(sync_ctx);
 	for (i = 0;;) {
+		/* a full sync reads the file from the beginning to the end.
+		   the stream is shared by all the mails, so it's switched
+		   back afterwards for the seeks between them. */
+		i_stream_set_access_pattern(sync_ctx->file_input, partial ?
+					    I_STREAM_ACCESS_NORMAL :
+					    I_STREAM_ACCESS_SEQUENTIAL);
 		ret = mbox_sync_loop(sync_ctx, &mail_ctx, partial);
 		if (ret > 0 && !sync_ctx->errors)
 			break;
 		if (ret < 0)
-			return -1;
+			break;
 
 		/* a) partial sync didn't work
 		   b) we ran out of UIDs
@@ -1661,6 +1667,10 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 		mbox_sync_restart(sync_ctx);
 		partial = FALSE;
 	}
+	i_stream_set_access_pattern(sync_ctx->file_input,
+				    I_STREAM_ACCESS_NORMAL);
+	if (ret < 0)
+		return -1;
 
 	if (mbox_sync_handle_eof_updates(sync_ctx, &mail_ctx) < 0)
 		return -1;
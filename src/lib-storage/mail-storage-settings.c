@@ -38,6 +38,8 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_STR, mail_server_comment),
 	DEF(SET_STR, mail_server_admin),
 	DEF(SET_UINT, mail_cache_min_mail_count),
+	DEF(SET_BOOL, mail_cache_columns),
+	DEF(SET_UINT, mail_cache_compress_batch_size),
 	DEF(SET_TIME, mailbox_idle_check_interval),
 	DEF(SET_UINT, mail_max_keyword_length),
 	DEF(SET_TIME, mail_max_lock_timeout),
@@ -45,6 +47,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_BOOL, mail_save_crlf),
 	DEF(SET_ENUM, mail_fsync),
 	DEF(SET_BOOL, mmap_disable),
+	DEF(SET_BOOL, mail_index_shared_maps),
 	DEF(SET_BOOL, dotlock_use_excl),
 	DEF(SET_BOOL, mail_nfs_storage),
 	DEF(SET_BOOL, mail_nfs_index),
@@ -78,6 +81,8 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_server_comment = "",
 	.mail_server_admin = "",
 	.mail_cache_min_mail_count = 0,
+	.mail_cache_columns = FALSE,
+	.mail_cache_compress_batch_size = 0,
 	.mailbox_idle_check_interval = 30,
 	.mail_max_keyword_length = 50,
 	.mail_max_lock_timeout = 0,
@@ -85,6 +90,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_save_crlf = FALSE,
 	.mail_fsync = "optimized:never:always",
 	.mmap_disable = FALSE,
+	.mail_index_shared_maps = FALSE,
 	.dotlock_use_excl = TRUE,
 	.mail_nfs_storage = FALSE,
 	.mail_nfs_index = FALSE,
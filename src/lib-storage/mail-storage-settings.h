@@ -23,6 +23,8 @@ struct mail_storage_settings {
 	const char *mail_server_comment;
 	const char *mail_server_admin;
 	unsigned int mail_cache_min_mail_count;
+	bool mail_cache_columns;
+	unsigned int mail_cache_compress_batch_size;
 	unsigned int mailbox_idle_check_interval;
 	unsigned int mail_max_keyword_length;
 	unsigned int mail_max_lock_timeout;
@@ -30,6 +32,7 @@ struct mail_storage_settings {
 	bool mail_save_crlf;
 	const char *mail_fsync;
 	bool mmap_disable;
+	bool mail_index_shared_maps;
 	bool dotlock_use_excl;
 	bool mail_nfs_storage;
 	bool mail_nfs_index;
@@ -98,7 +98,8 @@ enum mailbox_metadata_items {
 	MAILBOX_METADATA_PRECACHE_FIELDS	= 0x08,
 	MAILBOX_METADATA_BACKEND_NAMESPACE	= 0x10,
 	MAILBOX_METADATA_PHYSICAL_SIZE		= 0x20,
-	MAILBOX_METADATA_FIRST_SAVE_DATE	= 0x40
+	MAILBOX_METADATA_FIRST_SAVE_DATE	= 0x40,
+	MAILBOX_METADATA_CACHE_COMPRESS		= 0x80
 	/* metadata items that require mailbox to be synced at least once. */
 #define MAILBOX_METADATA_SYNC_ITEMS \
 	(MAILBOX_METADATA_VIRTUAL_SIZE | MAILBOX_METADATA_PHYSICAL_SIZE | \
@@ -291,6 +292,9 @@ struct mailbox_metadata {
 	const ARRAY_TYPE(mailbox_cache_field) *cache_fields;
 	/* Fields that should be precached */
 	enum mail_fetch_field precache_fields;
+	/* Progress of an incremental cache compression. Both are 0 if it's
+	   not in progress. */
+	unsigned int cache_compress_copied, cache_compress_total;
 
 	/* imapc backend returns this based on the remote NAMESPACE reply,
 	   while currently other backends return "" and type the same as the
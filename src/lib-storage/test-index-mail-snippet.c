@@ -0,0 +1,264 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "abspath.h"
+#include "istream.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "message-snippet.h"
+#include "mail-storage-service.h"
+#include "mail-storage.h"
+#include "mail-namespace.h"
+#include "test-common.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-index-mail-snippet"
+
+#define ALT_HTML_PART \
+	"Content-Type: text/html\n" \
+	"\n" \
+	"<html><body><p>html version</p></body></html>"
+#define ALT_PLAIN_PART \
+	"Content-Type: text/plain; charset=iso-8859-1\n" \
+	"Content-Transfer-Encoding: quoted-printable\n" \
+	"\n" \
+	"Hyv=E4=E4 p=E4iv=E4=E4, this is a long soft =\n" \
+	"broken line\n" \
+	"> quoted\n" \
+	"the end"
+#define HTML_QP_PART \
+	"Content-Type: text/html; charset=utf-8\n" \
+	"Content-Transfer-Encoding: quoted-printable\n" \
+	"\n" \
+	"<html><head><meta http-equiv=3D\"Content-Type\" content=3D\"text/html =\n" \
+	"charset=3Dutf-8\"></head><body>Hi,<div class=3D\"\"><br></div>How =\n" \
+	"is it going? <blockquote>quoted text is ignored</blockquote>\n" \
+	"&gt; -foo\n" \
+	"</body></html>=\n"
+#define BASE64_PART \
+	"Content-Type: text/plain; charset=utf-8\n" \
+	"Content-Transfer-Encoding: base64\n" \
+	"\n" \
+	"SHl2w6Qgc2FubmEsIGJhc2U2NCBib2R5\n"
+
+static const struct {
+	const char *message;
+	/* the text part whose snippet is used */
+	const char *part;
+} tests[] = {
+	{ "Content-Type: multipart/alternative; boundary=\"a\"\n"
+	  "\n"
+	  "--a\n"
+	  ALT_HTML_PART
+	  "\n--a\n"
+	  ALT_PLAIN_PART
+	  "\n--a--\n",
+	  ALT_PLAIN_PART },
+	{ HTML_QP_PART, HTML_QP_PART },
+	{ "Content-Type: multipart/mixed; boundary=\"m\"\n"
+	  "\n"
+	  "--m\n"
+	  "Content-Type: application/octet-stream\n"
+	  "\n"
+	  "binary\n"
+	  "--m\n"
+	  "Content-Type: multipart/alternative; boundary=\"a\"\n"
+	  "\n"
+	  "--a\n"
+	  HTML_QP_PART
+	  "\n--a--\n"
+	  "\n--m--\n",
+	  HTML_QP_PART },
+	{ "Content-Type: multipart/mixed; boundary=\"m\"\n"
+	  "\n"
+	  "--m\n"
+	  BASE64_PART
+	  "\n--m--\n",
+	  BASE64_PART },
+	{ "Content-Type: image/png\n"
+	  "\n"
+	  "not text\n",
+	  NULL },
+};
+
+static struct mail_storage_service_ctx *storage_service;
+static struct mail_storage_service_user *service_user;
+static struct mail_user *user;
+
+static void test_user_init(const char *cache_fields)
+{
+	struct mail_storage_service_input input;
+	const char *const userdb_fields[] = {
+		"mail=sdbox:~/mail",
+		t_strconcat("home=", t_abspath(TEST_DIR), NULL),
+		t_strconcat("mail_cache_fields=", cache_fields, NULL),
+		NULL
+	};
+	const char *error;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+
+	memset(&input, 0, sizeof(input));
+	input.username = "testuser";
+	input.no_userdb_lookup = TRUE;
+	input.userdb_fields = userdb_fields;
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     &service_user, &user,
+					     &error) <= 0)
+		i_fatal("User lookup failed: %s", error);
+}
+
+static void test_user_deinit(void)
+{
+	mail_user_unref(&user);
+	mail_storage_service_user_free(&service_user);
+	mail_storage_service_deinit(&storage_service);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR);
+}
+
+static void test_save_message(struct mailbox *box, const char *message)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	ssize_t ret;
+
+	input = i_stream_create_from_data(message, strlen(message));
+	trans = mailbox_transaction_begin(box,
+					  MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	save_ctx = mailbox_save_alloc(trans);
+	test_assert(mailbox_save_begin(&save_ctx, input) == 0);
+	while ((ret = i_stream_read(input)) > 0 || ret == -2)
+		test_assert(mailbox_save_continue(save_ctx) == 0);
+	test_assert(mailbox_save_finish(&save_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	i_stream_unref(&input);
+}
+
+static const char *test_expected_snippet(const char *part)
+{
+	struct istream *input;
+	string_t *str = t_str_new(128);
+
+	/* what fetching the snippet used to do: read the text part again
+	   and generate its snippet */
+	str_append_c(str, '1');
+	if (part == NULL)
+		return str_c(str);
+	input = i_stream_create_from_data(part, strlen(part));
+	test_assert(message_snippet_generate(input, 100, str) == 0);
+	i_stream_unref(&input);
+	return str_c(str);
+}
+
+static void test_index_mail_snippet_save(void)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	const char *snippet;
+	unsigned int i;
+
+	test_begin("index-mail snippet generated while saving");
+	test_user_init("body.snippet");
+
+	box = mailbox_alloc(user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	for (i = 0; i < N_ELEMENTS(tests); i++)
+		test_save_message(box, tests[i].message);
+	test_assert(mailbox_sync(box, 0) == 0);
+
+	trans = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(trans, 0, NULL);
+	/* the snippets must have been cached while saving */
+	mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		mail_set_seq(mail, i + 1);
+		if (mail_get_special(mail, MAIL_FETCH_BODY_SNIPPET,
+				     &snippet) < 0) {
+			test_assert_idx(FALSE, i);
+			continue;
+		}
+		test_assert_idx(strcmp(snippet,
+				       test_expected_snippet(tests[i].part)) == 0, i);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+
+	test_user_deinit();
+	test_end();
+}
+
+static void test_index_mail_snippet_parse_body(void)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct message_part *parts;
+	const char *snippet;
+	unsigned int i;
+
+	test_begin("index-mail snippet generated without bodystructure");
+	test_user_init("flags");
+
+	box = mailbox_alloc(user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	for (i = 0; i < N_ELEMENTS(tests); i++)
+		test_save_message(box, tests[i].message);
+	test_assert(mailbox_sync(box, 0) == 0);
+
+	trans = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(trans, MAIL_FETCH_BODY_SNIPPET, NULL);
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		mail_set_seq(mail, i + 1);
+		/* parse the message without its bodystructure */
+		mail->lookup_abort = MAIL_LOOKUP_ABORT_NEVER;
+		test_assert_idx(mail_get_parts(mail, &parts) == 0, i);
+		/* the snippet must have been generated by the same parsing */
+		mail->lookup_abort = MAIL_LOOKUP_ABORT_READ_MAIL;
+		if (mail_get_special(mail, MAIL_FETCH_BODY_SNIPPET,
+				     &snippet) < 0) {
+			test_assert_idx(FALSE, i);
+			continue;
+		}
+		test_assert_idx(strcmp(snippet,
+				       test_expected_snippet(tests[i].part)) == 0, i);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+
+	test_user_deinit();
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_index_mail_snippet_save,
+		test_index_mail_snippet_parse_body,
+		NULL
+	};
+
+	master_service = master_service_init("test-index-mail-snippet",
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT,
+		&argc, &argv, "");
+	master_service_init_finish(master_service);
+
+	/* test_run() deinitializes the lib at the end, so the master
+	   service can't be deinitialized after it anymore */
+	return test_run(test_functions);
+}
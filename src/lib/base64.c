@@ -3,6 +3,11 @@
 #include "lib.h"
 #include "base64.h"
 #include "buffer.h"
+#include "cpu-features.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
 
 static const char b64enc[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -43,38 +48,338 @@ static const unsigned char b64dec[256] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
 };
 
-void base64_encode(const void *src, size_t src_size, buffer_t *dest)
+/* Encoding and decoding is done via a temporary buffer, so that the block
+   functions don't need to care about the dest buffer's size. */
+#define BASE64_ENCODE_CHUNK_SIZE (3*1024)
+#define BASE64_DECODE_CHUNK_SIZE (4*1024)
+/* The SIMD decoders write a few bytes past the decoded data */
+#define BASE64_DECODE_OUTPUT_SLACK 8
+
+/* Encode src_size bytes, which must be a multiple of 3. */
+typedef void base64_encode_blocks_t(const unsigned char *src, size_t src_size,
+				    unsigned char *dest);
+/* Decode as many full 4 byte blocks as possible, stopping at the first block
+   that contains anything else than base64 characters (e.g. whitespace, '='
+   or invalid characters). Returns the number of bytes decoded from src. */
+typedef size_t base64_decode_blocks_t(const unsigned char *src,
+				      size_t src_size, unsigned char *dest);
+
+static base64_encode_blocks_t base64_encode_blocks_init;
+static base64_decode_blocks_t base64_decode_blocks_init;
+static base64_encode_blocks_t *base64_encode_blocks = base64_encode_blocks_init;
+static base64_decode_blocks_t *base64_decode_blocks = base64_decode_blocks_init;
+
+static void
+base64_encode_blocks_scalar(const unsigned char *src, size_t src_size,
+			    unsigned char *dest)
 {
-	const unsigned char *src_c = src;
-	unsigned char tmp[4];
-	size_t src_pos;
+	const unsigned char *end = src + src_size;
 
-	for (src_pos = 0; src_pos < src_size; ) {
-		tmp[0] = b64enc[src_c[src_pos] >> 2];
-		switch (src_size - src_pos) {
-		case 1:
-			tmp[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
-			tmp[2] = '=';
-			tmp[3] = '=';
-			src_pos++;
+	for (; src != end; src += 3, dest += 4) {
+		dest[0] = b64enc[src[0] >> 2];
+		dest[1] = b64enc[((src[0] & 0x03) << 4) | (src[1] >> 4)];
+		dest[2] = b64enc[((src[1] & 0x0f) << 2) | (src[2] >> 6)];
+		dest[3] = b64enc[src[2] & 0x3f];
+	}
+}
+
+static size_t
+base64_decode_blocks_scalar(const unsigned char *src, size_t src_size,
+			    unsigned char *dest)
+{
+	unsigned char a, b, c, d;
+	size_t pos;
+
+	for (pos = 0; pos + 4 <= src_size; pos += 4, dest += 3) {
+		a = b64dec[src[pos]];
+		b = b64dec[src[pos+1]];
+		c = b64dec[src[pos+2]];
+		d = b64dec[src[pos+3]];
+		if (((a | b | c | d) & 0x80) != 0)
 			break;
-		case 2:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
-			tmp[3] = '=';
-			src_pos += 2;
+		dest[0] = (a << 2) | (b >> 4);
+		dest[1] = (b << 4) | (c >> 2);
+		dest[2] = (c << 6) | d;
+	}
+	return pos;
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* The vectorized versions are based on Wojciech Muła's and Daniel Lemire's
+   "Faster Base64 Encoding and Decoding Using AVX2 Instructions". */
+
+__attribute__((target("ssse3")))
+static inline __m128i base64_encode_ssse3_block(__m128i in)
+{
+	__m128i t0, t1, t2, t3, indices, result, less;
+
+	/* split the 3 byte groups into 4x6 bit indices */
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+						7, 6, 8, 7, 10, 9, 11, 10));
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	indices = _mm_or_si128(t1, t3);
+
+	/* translate the indices to ASCII by adding an offset, which is
+	   looked up based on the index's range */
+	result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+	result = _mm_shuffle_epi8(_mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0), result);
+	return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("ssse3")))
+static void
+base64_encode_blocks_ssse3(const unsigned char *src, size_t src_size,
+			   unsigned char *dest)
+{
+	__m128i in;
+
+	/* each round reads 16 bytes, but encodes only 12 of them */
+	for (; src_size >= 16; src += 12, src_size -= 12, dest += 16) {
+		in = _mm_loadu_si128((const void *)src);
+		_mm_storeu_si128((void *)dest, base64_encode_ssse3_block(in));
+	}
+	base64_encode_blocks_scalar(src, src_size, dest);
+}
+
+__attribute__((target("ssse3")))
+static inline bool
+base64_decode_ssse3_block(__m128i in, __m128i *out_r)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i hi_nibbles, lo_nibbles, lo, hi, eq_2f, roll, merged;
+
+	/* validate: each nibble maps to a bitmask of character classes, and
+	   a character is valid only if its nibbles don't share any bits */
+	hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+	lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+	lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+	hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+					     _mm_setzero_si128())) != 0xffff)
+		return FALSE;
+
+	/* translate ASCII to 6 bit values */
+	eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+	in = _mm_add_epi8(in, roll);
+
+	/* pack 4x6 bits into 3 bytes */
+	merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	*out_r = _mm_shuffle_epi8(merged, _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	return TRUE;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+base64_decode_blocks_ssse3(const unsigned char *src, size_t src_size,
+			   unsigned char *dest)
+{
+	__m128i out;
+	size_t pos;
+
+	/* each round writes 16 bytes, but only 12 of them are used */
+	for (pos = 0; pos + 16 <= src_size; pos += 16, dest += 12) {
+		if (!base64_decode_ssse3_block(
+			_mm_loadu_si128((const void *)(src + pos)), &out))
 			break;
-		default:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2) |
-					((src_c[src_pos+2] & 0xc0) >> 6)];
-			tmp[3] = b64enc[src_c[src_pos+2] & 0x3f];
-			src_pos += 3;
+		_mm_storeu_si128((void *)dest, out);
+	}
+	return pos + base64_decode_blocks_scalar(src + pos, src_size - pos,
+						 dest);
+}
+
+__attribute__((target("avx2")))
+static void
+base64_encode_blocks_avx2(const unsigned char *src, size_t src_size,
+			  unsigned char *dest)
+{
+	__m256i in, t0, t1, t2, t3, indices, result, less;
+
+	/* each round reads 12 bytes into both 128bit lanes */
+	for (; src_size >= 28; src += 24, src_size -= 24, dest += 32) {
+		in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const void *)src)),
+			_mm_loadu_si128((const void *)(src + 12)), 1);
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+		t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		indices = _mm256_or_si256(t1, t3);
+
+		result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result, _mm256_and_si256(less,
+						_mm256_set1_epi8(13)));
+		result = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), result);
+		result = _mm256_add_epi8(result, indices);
+		_mm256_storeu_si256((void *)dest, result);
+	}
+	/* avoid AVX-SSE transition penalties in the non-AVX code */
+	_mm256_zeroupper();
+	base64_encode_blocks_ssse3(src, src_size, dest);
+}
+
+__attribute__((target("avx2")))
+static size_t
+base64_decode_blocks_avx2(const unsigned char *src, size_t src_size,
+			  unsigned char *dest)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i in, hi_nibbles, lo_nibbles, lo, hi, eq_2f, roll, merged;
+	size_t pos;
+
+	/* each round writes 32 bytes, but only 24 of them are used */
+	for (pos = 0; pos + 32 <= src_size; pos += 32, dest += 24) {
+		in = _mm256_loadu_si256((const void *)(src + pos));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4),
+					      _mm256_set1_epi8(0x0f));
+		lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
 			break;
+
+		eq_2f = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+		roll = _mm256_shuffle_epi8(lut_roll,
+					   _mm256_add_epi8(eq_2f, hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		/* move the 12 bytes from both lanes next to each other */
+		merged = _mm256_permutevar8x32_epi32(merged,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((void *)dest, merged);
+	}
+	_mm256_zeroupper();
+	return pos + base64_decode_blocks_ssse3(src + pos, src_size - pos,
+						dest);
+}
+#endif
+
+bool base64_set_impl(enum base64_impl impl)
+{
+	switch (impl) {
+	case BASE64_IMPL_SCALAR:
+		base64_encode_blocks = base64_encode_blocks_scalar;
+		base64_decode_blocks = base64_decode_blocks_scalar;
+		return TRUE;
+	case BASE64_IMPL_SSSE3:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSSE3)) {
+			base64_encode_blocks = base64_encode_blocks_ssse3;
+			base64_decode_blocks = base64_decode_blocks_ssse3;
+			return TRUE;
 		}
+#endif
+		return FALSE;
+	case BASE64_IMPL_AVX2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSSE3 | CPU_FEATURE_AVX2)) {
+			base64_encode_blocks = base64_encode_blocks_avx2;
+			base64_decode_blocks = base64_decode_blocks_avx2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void base64_set_best_impl(void)
+{
+	if (!base64_set_impl(BASE64_IMPL_AVX2) &&
+	    !base64_set_impl(BASE64_IMPL_SSSE3))
+		(void)base64_set_impl(BASE64_IMPL_SCALAR);
+}
+
+static void
+base64_encode_blocks_init(const unsigned char *src, size_t src_size,
+			  unsigned char *dest)
+{
+	base64_set_best_impl();
+	base64_encode_blocks(src, src_size, dest);
+}
+
+static size_t
+base64_decode_blocks_init(const unsigned char *src, size_t src_size,
+			  unsigned char *dest)
+{
+	base64_set_best_impl();
+	return base64_decode_blocks(src, src_size, dest);
+}
+
+void base64_encode(const void *src, size_t src_size, buffer_t *dest)
+{
+	const unsigned char *src_c = src;
+	unsigned char tmp[BASE64_ENCODE_CHUNK_SIZE / 3 * 4];
+	size_t src_pos, size;
+
+	for (src_pos = 0; src_size - src_pos >= 3; src_pos += size) {
+		size = I_MIN(src_size - src_pos, BASE64_ENCODE_CHUNK_SIZE);
+		size -= size % 3;
+		base64_encode_blocks(src_c + src_pos, size, tmp);
+		buffer_append(dest, tmp, size / 3 * 4);
+	}
+
+	/* the final partial block */
+	switch (src_size - src_pos) {
+	case 1:
+		tmp[0] = b64enc[src_c[src_pos] >> 2];
+		tmp[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
+		tmp[2] = '=';
+		tmp[3] = '=';
 		buffer_append(dest, tmp, 4);
+		break;
+	case 2:
+		tmp[0] = b64enc[src_c[src_pos] >> 2];
+		tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
+				(src_c[src_pos+1] >> 4)];
+		tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
+		tmp[3] = '=';
+		buffer_append(dest, tmp, 4);
+		break;
 	}
 }
 
@@ -85,18 +390,35 @@ int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
 	const unsigned char *src_c = src;
-	size_t src_pos;
+	unsigned char tmp[BASE64_DECODE_CHUNK_SIZE / 4 * 3 +
+			  BASE64_DECODE_OUTPUT_SLACK];
+	size_t src_pos, size, block_size;
 	unsigned char input[4], output[3];
 	int ret = 1;
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
+		/* decode the full blocks quickly */
+		size = I_MIN(src_size - src_pos, BASE64_DECODE_CHUNK_SIZE);
+		size -= size % 4;
+		block_size = base64_decode_blocks(src_c + src_pos, size, tmp);
+		if (block_size > 0) {
+			buffer_append(dest, tmp, block_size / 4 * 3);
+			src_pos += block_size;
+			if (block_size == size)
+				continue;
+		}
+
+		/* the next block has whitespace, padding or invalid input */
 		input[0] = b64dec[src_c[src_pos]];
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
 				ret = -1;
 				break;
 			}
-			src_pos++;
+			/* skip over all the whitespace */
+			do {
+				src_pos++;
+			} while (src_pos < src_size && IS_EMPTY(src_c[src_pos]));
 			continue;
 		}
 
@@ -23,6 +23,20 @@ buffer_t *t_base64_decode_str(const char *str);
 /* Returns TRUE if c is a valid base64 encoding character (excluding '=') */
 bool base64_is_valid_char(char c);
 
+enum base64_impl {
+	BASE64_IMPL_SCALAR,
+	BASE64_IMPL_SSSE3,
+	BASE64_IMPL_AVX2
+};
+
+/* The fastest implementation supported by the CPU is selected automatically
+   on first use. These functions are mainly for unit tests and benchmarks:
+   Force using the given implementation. Returns FALSE if it's not supported
+   by the CPU or the build. */
+bool base64_set_impl(enum base64_impl impl);
+/* Switch back to the fastest supported implementation. */
+void base64_set_best_impl(void);
+
 /* max. buffer size required for base64_encode() */
 #define MAX_BASE64_ENCODED_SIZE(size) \
 	((size) / 3 * 4 + 2+2)
@@ -0,0 +1,143 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "base64.h"
+#include "istream.h"
+#include "istream-base64.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+#define BENCH_DATA_SIZE (1024*1024)
+#define BENCH_DEFAULT_ROUNDS 100
+
+static const struct {
+	enum base64_impl impl;
+	const char *name;
+} bench_impls[] = {
+	{ BASE64_IMPL_SCALAR, "scalar" },
+	{ BASE64_IMPL_SSSE3, "ssse3" },
+	{ BASE64_IMPL_AVX2, "avx2" }
+};
+
+static struct timeval bench_start_time;
+
+static void bench_start(void)
+{
+	if (gettimeofday(&bench_start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_end(const char *impl_name, const char *name,
+		      unsigned long long bytes)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, &bench_start_time);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%-8s %-24s %8.1f MB/s\n", impl_name, name,
+	       bytes / (double)usecs);
+}
+
+static void bench_istream_decode(const buffer_t *encoded)
+{
+	struct istream *input, *b64input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_from_data(encoded->data, encoded->used);
+	b64input = i_stream_create_base64_decoder(input);
+	while (i_stream_read_more(b64input, &data, &size) > 0)
+		i_stream_skip(b64input, size);
+	if (b64input->stream_errno != 0)
+		i_fatal("base64 decoding failed: %s", i_stream_get_error(b64input));
+	i_stream_unref(&b64input);
+	i_stream_unref(&input);
+}
+
+static void bench_impl(const char *name, const unsigned char *data,
+		       unsigned int rounds)
+{
+	buffer_t *encoded, *lines, *decoded;
+	unsigned int i;
+	size_t pos;
+
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(BENCH_DATA_SIZE));
+	lines = buffer_create_dynamic(default_pool,
+				      MAX_BASE64_ENCODED_SIZE(BENCH_DATA_SIZE)*80/76);
+	decoded = buffer_create_dynamic(default_pool, BENCH_DATA_SIZE + 3);
+
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(encoded, 0);
+		base64_encode(data, BENCH_DATA_SIZE, encoded);
+	}
+	bench_end(name, "encode", (unsigned long long)rounds * BENCH_DATA_SIZE);
+
+	/* 76 characters per line, as in MIME */
+	for (pos = 0; pos < encoded->used; pos += 76) {
+		buffer_append(lines, CONST_PTR_OFFSET(encoded->data, pos),
+			      I_MIN(76, encoded->used - pos));
+		buffer_append(lines, "\r\n", 2);
+	}
+
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		if (base64_decode(encoded->data, encoded->used,
+				  NULL, decoded) < 0)
+			i_fatal("base64_decode() failed");
+	}
+	bench_end(name, "decode", (unsigned long long)rounds * BENCH_DATA_SIZE);
+
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		if (base64_decode(lines->data, lines->used, NULL, decoded) < 0)
+			i_fatal("base64_decode() failed");
+	}
+	bench_end(name, "decode 76 char lines",
+		  (unsigned long long)rounds * BENCH_DATA_SIZE);
+	i_assert(decoded->used == BENCH_DATA_SIZE &&
+		 memcmp(decoded->data, data, BENCH_DATA_SIZE) == 0);
+
+	bench_start();
+	for (i = 0; i < rounds; i++)
+		bench_istream_decode(lines);
+	bench_end(name, "istream decode lines",
+		  (unsigned long long)rounds * BENCH_DATA_SIZE);
+
+	buffer_free(&encoded);
+	buffer_free(&lines);
+	buffer_free(&decoded);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *data;
+	unsigned int i, rounds = BENCH_DEFAULT_ROUNDS;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &rounds) < 0)
+		i_fatal("Usage: bench-base64 [<rounds>]");
+
+	data = i_malloc(BENCH_DATA_SIZE);
+	for (i = 0; i < BENCH_DATA_SIZE; i++)
+		data[i] = i * 0x9d + (i >> 8);
+
+	for (i = 0; i < N_ELEMENTS(bench_impls); i++) {
+		if (!base64_set_impl(bench_impls[i].impl))
+			printf("%-8s not supported\n", bench_impls[i].name);
+		else
+			bench_impl(bench_impls[i].name, data, rounds);
+	}
+	i_free(data);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "crc32.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+#define BENCH_DEFAULT_MBYTES 256
+
+static const struct {
+	enum crc32_impl impl;
+	const char *name;
+} bench_impls[] = {
+	{ CRC32_IMPL_TABLE, "table" },
+	{ CRC32_IMPL_SLICE8, "slice8" },
+	{ CRC32_IMPL_PCLMUL, "pclmul" },
+	{ CRC32_IMPL_ARMV8, "armv8" }
+};
+
+static void bench_crc32(enum crc32_impl impl, const char *name,
+			const unsigned char *data, size_t block_size,
+			unsigned int mbytes)
+{
+	struct timeval start, end;
+	unsigned long long total = (unsigned long long)mbytes * 1024 * 1024;
+	unsigned long long done;
+	uint32_t crc = 0;
+	long long usecs;
+
+	if (!crc32_set_impl(impl)) {
+		printf("%-8s %6"PRIuSIZE_T" bytes: not supported\n",
+		       name, block_size);
+		return;
+	}
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (done = 0; done < total; done += block_size)
+		crc = crc32_data_more(crc, data, block_size);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&end, &start);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%-8s %6"PRIuSIZE_T" bytes: %8.2f GB/s (crc %08x)\n",
+	       name, block_size, done / (usecs * 1000.0), crc);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t block_sizes[] = { 16, 64, 1024, 64*1024 };
+	unsigned char *data;
+	unsigned int i, j, mbytes = BENCH_DEFAULT_MBYTES;
+	size_t max_size = block_sizes[N_ELEMENTS(block_sizes)-1];
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &mbytes) < 0)
+		i_fatal("Usage: bench-crc32 [<MB per test>]");
+
+	data = i_malloc(max_size);
+	for (i = 0; i < max_size; i++)
+		data[i] = i * 0x9d + (i >> 8);
+
+	for (i = 0; i < N_ELEMENTS(block_sizes); i++) {
+		for (j = 0; j < N_ELEMENTS(bench_impls); j++) {
+			bench_crc32(bench_impls[j].impl, bench_impls[j].name,
+				    data, block_sizes[i], mbytes);
+		}
+	}
+	i_free(data);
+	lib_deinit();
+	return 0;
+}
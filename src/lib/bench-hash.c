@@ -0,0 +1,166 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "time-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_DEFAULT_KEY_COUNT (1024*1024)
+/* odd, so i*multiplier gives unique keys for unique i */
+#define BENCH_KEY_MULTIPLIER 2654435761U
+
+static struct timeval bench_start_time;
+
+static void bench_start(void)
+{
+	if (gettimeofday(&bench_start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_end(const char *name, unsigned int count)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, &bench_start_time);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%-32s %10u ops %8lld ms %8.1f ns/op\n", name, count,
+	       usecs / 1000, usecs * 1000.0 / count);
+}
+
+static unsigned int *bench_get_random_keys(unsigned int count)
+{
+	unsigned int *keys, i, j, tmp;
+
+	/* unique keys in random order */
+	keys = i_new(unsigned int, count * 2);
+	for (i = 0; i < count * 2; i++)
+		keys[i] = (i + 1) * BENCH_KEY_MULTIPLIER;
+	for (i = count * 2 - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = keys[i]; keys[i] = keys[j]; keys[j] = tmp;
+	}
+	return keys;
+}
+
+static void bench_direct(unsigned int count)
+{
+	HASH_TABLE(void *, void *) hash;
+	unsigned int *keys, *missing_keys, *lookup_keys;
+	unsigned int i, found = 0;
+
+	/* the second half of the keys are used for failed lookups */
+	keys = bench_get_random_keys(count);
+	missing_keys = keys + count;
+	lookup_keys = i_new(unsigned int, count);
+	memcpy(lookup_keys, keys, sizeof(*keys) * count);
+	for (i = count - 1; i > 0; i--) {
+		unsigned int j = rand() % (i + 1), tmp = lookup_keys[i];
+		lookup_keys[i] = lookup_keys[j]; lookup_keys[j] = tmp;
+	}
+
+	hash_table_create_direct(&hash, default_pool, 0);
+
+	bench_start();
+	for (i = 0; i < count; i++) {
+		hash_table_insert(hash, POINTER_CAST(keys[i]),
+				  POINTER_CAST(i+1));
+	}
+	bench_end("direct insert", count);
+
+	bench_start();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, POINTER_CAST(lookup_keys[i])) != NULL)
+			found++;
+	}
+	bench_end("direct lookup hit", count);
+
+	bench_start();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, POINTER_CAST(missing_keys[i])) != NULL)
+			found++;
+	}
+	bench_end("direct lookup miss", count);
+
+	bench_start();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, POINTER_CAST(lookup_keys[i]));
+	bench_end("direct remove", count);
+
+	i_assert(found == count);
+	hash_table_destroy(&hash);
+	i_free(keys);
+	i_free(lookup_keys);
+}
+
+static void bench_strings(unsigned int count)
+{
+	HASH_TABLE(const char *, const char *) hash;
+	ARRAY_TYPE(const_string) keys_arr, missing_arr;
+	const char *const *keys, *const *missing;
+	unsigned int i, found = 0;
+	pool_t pool;
+
+	pool = pool_alloconly_create("bench hash strings", 1024*1024);
+	p_array_init(&keys_arr, pool, count);
+	p_array_init(&missing_arr, pool, count);
+	for (i = 0; i < count; i++) {
+		const char *key =
+			p_strdup_printf(pool, "<%x.%u@example.com>", i*BENCH_KEY_MULTIPLIER, i);
+		array_append(&keys_arr, &key, 1);
+		key = p_strdup_printf(pool, "<%x.%u@example.org>", i, i);
+		array_append(&missing_arr, &key, 1);
+	}
+	keys = array_idx(&keys_arr, 0);
+	missing = array_idx(&missing_arr, 0);
+
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+
+	bench_start();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, keys[i], keys[i]);
+	bench_end("string insert", count);
+
+	bench_start();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, keys[i]) != NULL)
+			found++;
+	}
+	bench_end("string lookup hit", count);
+
+	bench_start();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, missing[i]) != NULL)
+			found++;
+	}
+	bench_end("string lookup miss", count);
+
+	bench_start();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, keys[i]);
+	bench_end("string remove", count);
+
+	i_assert(found == count);
+	hash_table_destroy(&hash);
+	pool_unref(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = BENCH_DEFAULT_KEY_COUNT;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &count) < 0)
+		i_fatal("Usage: bench-hash [<key count>]");
+
+	bench_direct(count);
+	bench_strings(count);
+	lib_deinit();
+	return 0;
+}
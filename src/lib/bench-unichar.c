@@ -0,0 +1,164 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "unichar.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+#define BENCH_TEXT_SIZE (64*1024)
+#define BENCH_DEFAULT_ROUNDS 2000
+
+static const struct {
+	enum uni_utf8_impl impl;
+	const char *name;
+} bench_impls[] = {
+	{ UNI_UTF8_IMPL_SCALAR, "scalar" },
+	{ UNI_UTF8_IMPL_SSSE3, "ssse3" },
+	{ UNI_UTF8_IMPL_AVX2, "avx2" }
+};
+
+/* Text typical for different kinds of mails. The words are picked randomly
+   to build the benchmark input. */
+static const char *const bench_words_english[] = {
+	"Subject:", "Re:", "meeting", "tomorrow", "the", "of", "and",
+	"message", "attached", "please", "find", "report", "<user@example.com>",
+	"Thanks,", "regards", "2016", "\r\n"
+};
+static const char *const bench_words_german[] = {
+	"Grüße", "für", "die", "Besprechung", "morgen", "und", "Änderungen",
+	"Straße", "bitte", "Anhang", "über", "der", "\r\n"
+};
+static const char *const bench_words_russian[] = {
+	"Привет", "встреча", "завтра", "и", "в", "отчёт", "пожалуйста",
+	"спасибо", "сообщение", "\r\n"
+};
+static const char *const bench_words_japanese[] = {
+	"こんにちは", "会議", "は", "明日", "です", "添付", "ファイル",
+	"よろしく", "お願いします", "。", "\r\n"
+};
+static const char *const bench_words_emoji[] = {
+	"ok", "👍", "🎉", "party", "tonight", "😀", "at", "8pm", "\r\n"
+};
+
+static const struct {
+	const char *name;
+	const char *const *words;
+	unsigned int count;
+} bench_texts[] = {
+	{ "english", bench_words_english, N_ELEMENTS(bench_words_english) },
+	{ "german", bench_words_german, N_ELEMENTS(bench_words_german) },
+	{ "russian", bench_words_russian, N_ELEMENTS(bench_words_russian) },
+	{ "japanese", bench_words_japanese, N_ELEMENTS(bench_words_japanese) },
+	{ "emoji", bench_words_emoji, N_ELEMENTS(bench_words_emoji) }
+};
+
+static struct timeval bench_start_time;
+
+static void bench_start(void)
+{
+	if (gettimeofday(&bench_start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_end(const char *impl_name, const char *text_name,
+		      const char *name, unsigned long long bytes)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, &bench_start_time);
+	if (usecs <= 0)
+		usecs = 1;
+	printf("%-8s %-10s %-22s %8.1f MB/s\n", impl_name, text_name, name,
+	       bytes / (double)usecs);
+}
+
+static buffer_t *
+bench_text_create(const char *const *words, unsigned int count)
+{
+	buffer_t *text;
+	const char *word;
+
+	text = buffer_create_dynamic(default_pool, BENCH_TEXT_SIZE + 64);
+	while (text->used < BENCH_TEXT_SIZE) {
+		word = words[rand() % count];
+		buffer_append(text, word, strlen(word));
+		if (strcmp(word, "\r\n") != 0)
+			buffer_append_c(text, ' ');
+	}
+	return text;
+}
+
+static void bench_text(const char *impl_name, const char *text_name,
+		       const buffer_t *text, unsigned int rounds)
+{
+	buffer_t *broken, *output;
+	unsigned long long bytes = (unsigned long long)rounds * text->used;
+	unsigned int i, len = 0;
+	size_t pos;
+
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		if (!uni_utf8_data_is_valid(text->data, text->used))
+			i_unreached();
+	}
+	bench_end(impl_name, text_name, "data_is_valid", bytes);
+
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		/* vary the size so the pure function call isn't optimized
+		   out of the loop */
+		len += uni_utf8_strlen_n(text->data, text->used - i % 2);
+	}
+	bench_end(impl_name, text_name, "strlen_n", bytes);
+
+	/* invalid input every ~4 kB */
+	broken = buffer_create_dynamic(default_pool, text->used);
+	buffer_append_buf(broken, text, 0, (size_t)-1);
+	for (pos = 4000; pos < broken->used; pos += 4096)
+		buffer_write(broken, pos, "\xff", 1);
+	output = buffer_create_dynamic(default_pool, text->used + 1024);
+	bench_start();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(output, 0);
+		(void)uni_utf8_get_valid_data(broken->data, broken->used,
+					      output);
+	}
+	bench_end(impl_name, text_name, "get_valid_data broken", bytes);
+	buffer_free(&broken);
+	buffer_free(&output);
+	i_assert(len > 0);
+}
+
+int main(int argc, char *argv[])
+{
+	buffer_t *texts[N_ELEMENTS(bench_texts)];
+	unsigned int i, j, rounds = BENCH_DEFAULT_ROUNDS;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &rounds) < 0)
+		i_fatal("Usage: bench-unichar [<rounds>]");
+
+	for (i = 0; i < N_ELEMENTS(bench_texts); i++) {
+		texts[i] = bench_text_create(bench_texts[i].words,
+					     bench_texts[i].count);
+	}
+	for (i = 0; i < N_ELEMENTS(bench_impls); i++) {
+		if (!uni_utf8_set_impl(bench_impls[i].impl)) {
+			printf("%-8s not supported\n", bench_impls[i].name);
+			continue;
+		}
+		for (j = 0; j < N_ELEMENTS(bench_texts); j++) {
+			bench_text(bench_impls[i].name, bench_texts[j].name,
+				   texts[j], rounds);
+		}
+	}
+	for (i = 0; i < N_ELEMENTS(bench_texts); i++)
+		buffer_free(&texts[i]);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "cpu-features.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <cpuid.h>
+#endif
+#ifdef HAVE_ARM_CRC32_TARGET
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+#endif
+
+static bool cpu_features_initialized = FALSE;
+static enum cpu_feature cpu_features;
+
+#ifdef HAVE_X86_SIMD_TARGET
+static bool cpu_os_saves_avx_state(void)
+{
+	unsigned int eax, edx;
+
+	/* xgetbv(0) returns XCR0. bits 1 and 2: SSE and AVX state */
+	__asm__ volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return (eax & 0x06) == 0x06;
+}
+
+static enum cpu_feature cpu_features_detect(void)
+{
+	enum cpu_feature features = 0;
+	unsigned int eax, ebx, ecx, edx, max_leaf;
+
+	max_leaf = __get_cpuid_max(0, NULL);
+	if (max_leaf < 1)
+		return 0;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if ((edx & bit_SSE2) != 0)
+		features |= CPU_FEATURE_SSE2;
+	if ((ecx & bit_SSSE3) != 0)
+		features |= CPU_FEATURE_SSSE3;
+	if ((ecx & bit_SSE4_1) != 0)
+		features |= CPU_FEATURE_SSE41;
+	if ((ecx & bit_SSE4_2) != 0)
+		features |= CPU_FEATURE_SSE42;
+	if ((ecx & bit_PCLMUL) != 0)
+		features |= CPU_FEATURE_PCLMUL;
+
+	if (max_leaf >= 7 && (ecx & bit_OSXSAVE) != 0 && (ecx & bit_AVX) != 0 &&
+	    cpu_os_saves_avx_state()) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if ((ebx & bit_AVX2) != 0)
+			features |= CPU_FEATURE_AVX2;
+	}
+	return features;
+}
+#elif defined(HAVE_ARM_CRC32_TARGET)
+static enum cpu_feature cpu_features_detect(void)
+{
+	enum cpu_feature features = 0;
+
+	if ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0)
+		features |= CPU_FEATURE_ARM_CRC32;
+	return features;
+}
+#else
+static enum cpu_feature cpu_features_detect(void)
+{
+	return 0;
+}
+#endif
+
+enum cpu_feature cpu_features_get(void)
+{
+	if (!cpu_features_initialized) {
+		cpu_features = cpu_features_detect();
+		cpu_features_initialized = TRUE;
+	}
+	return cpu_features;
+}
+
+bool cpu_features_have(enum cpu_feature features)
+{
+	return (cpu_features_get() & features) == features;
+}
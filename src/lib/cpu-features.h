@@ -0,0 +1,22 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+enum cpu_feature {
+	CPU_FEATURE_SSE2	= 0x01,
+	CPU_FEATURE_SSSE3	= 0x02,
+	CPU_FEATURE_SSE41	= 0x04,
+	CPU_FEATURE_SSE42	= 0x08,
+	CPU_FEATURE_PCLMUL	= 0x10,
+	/* AVX2 is only set if the OS also saves the AVX registers */
+	CPU_FEATURE_AVX2	= 0x20,
+
+	CPU_FEATURE_ARM_CRC32	= 0x100
+};
+
+/* Returns the SIMD related features supported by both the CPU and the
+   compiler that was used to build Dovecot. The result is cached. */
+enum cpu_feature cpu_features_get(void);
+/* Returns TRUE if all the given features are supported. */
+bool cpu_features_have(enum cpu_feature features);
+
+#endif
@@ -2,8 +2,16 @@
 
 #include "lib.h"
 #include "crc32.h"
+#include "cpu-features.h"
 
-static uint32_t crc32tab[256] = {
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
+#ifdef HAVE_ARM_CRC32_TARGET
+#  include <arm_acle.h>
+#endif
+
+static const uint32_t crc32tab[256] = {
 	0x00000000,
 	0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
 	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E,
@@ -58,22 +66,242 @@ static uint32_t crc32tab[256] = {
 	0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-uint32_t crc32_data(const void *data, size_t size)
+/* The implementations below take and return the CRC in its inverted form,
+   i.e. before the final xor. */
+typedef uint32_t crc32_func_t(uint32_t crc, const uint8_t *p, size_t size);
+
+/* slicing-by-8 tables, generated from crc32tab on first use */
+static uint32_t crc32tab8[8][256];
+static bool crc32tab8_initialized = FALSE;
+
+static crc32_func_t crc32_update_init;
+static crc32_func_t *crc32_update = crc32_update_init;
+
+static void crc32tab8_init(void)
 {
-	return crc32_data_more(0, data, size);
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc32tab8[0][i] = crc32tab[i];
+		for (j = 1; j < 8; j++) {
+			crc32tab8[j][i] = (crc32tab8[j-1][i] >> 8) ^
+				crc32tab[crc32tab8[j-1][i] & 0xff];
+		}
+	}
+	crc32tab8_initialized = TRUE;
 }
 
-uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size)
+static uint32_t crc32_update_table(uint32_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p = data, *end = p + size;
+	const uint8_t *end = p + size;
 
-	crc ^= 0xffffffff;
 	for (; p != end; p++)
 		crc = (crc >> 8) ^ crc32tab[((crc ^ *p) & 0xff)];
-	crc ^= 0xffffffff;
 	return crc;
 }
 
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint32_t one, two;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		one = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+			     ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+		two = (uint32_t)p[4] | ((uint32_t)p[5] << 8) |
+			((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = crc32tab8[7][one & 0xff] ^
+			crc32tab8[6][(one >> 8) & 0xff] ^
+			crc32tab8[5][(one >> 16) & 0xff] ^
+			crc32tab8[4][one >> 24] ^
+			crc32tab8[3][two & 0xff] ^
+			crc32tab8[2][(two >> 8) & 0xff] ^
+			crc32tab8[1][(two >> 16) & 0xff] ^
+			crc32tab8[0][two >> 24];
+	}
+	return crc32_update_table(crc, p, size);
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* Fold 64 bytes at a time with carry-less multiplication and reduce the
+   result with Barrett reduction. See Intel's "Fast CRC Computation for
+   Generic Polynomials Using PCLMULQDQ Instruction". The constants are for
+   the bit-reflected CRC-32 polynomial. size must be at least 64 and
+   a multiple of 16. */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	i_assert(size >= 64 && size % 16 == 0);
+
+	x1 = _mm_loadu_si128((const void *)(p + 0x00));
+	x2 = _mm_loadu_si128((const void *)(p + 0x10));
+	x3 = _mm_loadu_si128((const void *)(p + 0x20));
+	x4 = _mm_loadu_si128((const void *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64; size -= 64;
+
+	/* fold 4x128 bits in parallel */
+	x0 = k1k2;
+	for (; size >= 64; p += 64, size -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const void *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const void *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const void *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const void *)(p + 0x30)));
+	}
+
+	/* fold into 128 bits */
+	x0 = k3k4;
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold the remaining 16 byte blocks */
+	for (; size >= 16; p += 16, size -= 16) {
+		x2 = _mm_loadu_si128((const void *)p);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x0 = k5k0;
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = poly;
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_update_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	size_t fold_size;
+
+	if (size >= 64) {
+		fold_size = size & ~(size_t)15;
+		crc = crc32_fold_pclmul(crc, p, fold_size);
+		p += fold_size;
+		size -= fold_size;
+	}
+	return crc32_update_slice8(crc, p, size);
+}
+#endif
+
+#ifdef HAVE_ARM_CRC32_TARGET
+__attribute__((target("+crc")))
+static uint32_t crc32_update_armv8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint64_t value;
+
+	for (; size > 0 && ((uintptr_t)p & 7) != 0; p++, size--)
+		crc = __crc32b(crc, *p);
+	for (; size >= 8; p += 8, size -= 8) {
+		/* the instruction expects little-endian data */
+		value = (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+			((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+			((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+			((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+		crc = __crc32d(crc, value);
+	}
+	for (; size > 0; p++, size--)
+		crc = __crc32b(crc, *p);
+	return crc;
+}
+#endif
+
+bool crc32_set_impl(enum crc32_impl impl)
+{
+	if (!crc32tab8_initialized)
+		crc32tab8_init();
+
+	switch (impl) {
+	case CRC32_IMPL_TABLE:
+		crc32_update = crc32_update_table;
+		return TRUE;
+	case CRC32_IMPL_SLICE8:
+		crc32_update = crc32_update_slice8;
+		return TRUE;
+	case CRC32_IMPL_PCLMUL:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_PCLMUL | CPU_FEATURE_SSE41)) {
+			crc32_update = crc32_update_pclmul;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	case CRC32_IMPL_ARMV8:
+#ifdef HAVE_ARM_CRC32_TARGET
+		if (cpu_features_have(CPU_FEATURE_ARM_CRC32)) {
+			crc32_update = crc32_update_armv8;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void crc32_set_best_impl(void)
+{
+	if (!crc32_set_impl(CRC32_IMPL_PCLMUL) &&
+	    !crc32_set_impl(CRC32_IMPL_ARMV8))
+		(void)crc32_set_impl(CRC32_IMPL_SLICE8);
+}
+
+static uint32_t crc32_update_init(uint32_t crc, const uint8_t *p, size_t size)
+{
+	crc32_set_best_impl();
+	return crc32_update(crc, p, size);
+}
+
+uint32_t crc32_data(const void *data, size_t size)
+{
+	return crc32_data_more(0, data, size);
+}
+
+uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size)
+{
+	return crc32_update(crc ^ 0xffffffff, data, size) ^ 0xffffffff;
+}
+
 uint32_t crc32_str(const char *str)
 {
 	return crc32_str_more(0, str);
@@ -81,11 +309,5 @@ uint32_t crc32_str(const char *str)
 
 uint32_t crc32_str_more(uint32_t crc, const char *str)
 {
-	const uint8_t *p = (const uint8_t *)str;
-
-	crc ^= 0xffffffff;
-	for (; *p != '\0'; p++)
-		crc = (crc >> 8) ^ crc32tab[((crc ^ *p) & 0xff)];
-	crc ^= 0xffffffff;
-	return crc;
+	return crc32_data_more(crc, str, strlen(str));
 }
@@ -1,10 +1,31 @@
 #ifndef CRC32_H
 #define CRC32_H
 
-uint32_t crc32_data(const void *data, size_t size) ATTR_PURE;
-uint32_t crc32_str(const char *str) ATTR_PURE;
+/* These aren't ATTR_PURE, because the first call selects the
+   implementation. */
+uint32_t crc32_data(const void *data, size_t size);
+uint32_t crc32_str(const char *str);
 
-uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size) ATTR_PURE;
-uint32_t crc32_str_more(uint32_t crc, const char *str) ATTR_PURE;
+uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size);
+uint32_t crc32_str_more(uint32_t crc, const char *str);
+
+enum crc32_impl {
+	/* byte at a time table lookups */
+	CRC32_IMPL_TABLE,
+	/* 8 bytes at a time table lookups */
+	CRC32_IMPL_SLICE8,
+	/* x86 carry-less multiplication */
+	CRC32_IMPL_PCLMUL,
+	/* ARMv8 CRC32 instructions */
+	CRC32_IMPL_ARMV8
+};
+
+/* The fastest implementation supported by the CPU is selected automatically
+   on first use. These functions are mainly for unit tests and benchmarks:
+   Force using the given implementation. Returns FALSE if it's not supported
+   by the CPU or the build. */
+bool crc32_set_impl(enum crc32_impl impl);
+/* Switch back to the fastest supported implementation. */
+void crc32_set_best_impl(void);
 
 #endif
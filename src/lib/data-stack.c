@@ -76,6 +76,13 @@ static struct stack_frame_block *unused_frame_blocks;
 static struct stack_block *current_block; /* block now used for allocation */
 static struct stack_block *unused_block; /* largest unused block is kept here */
 
+/* data_stack_frame after t_pop() has returned to the frame created by
+   data_stack_init() */
+#define DATA_STACK_OUTERMOST_FRAME 2
+/* unused_block is freed at the outermost frame if it's larger than this */
+static size_t max_unused_size = (size_t)-1;
+static struct data_stack_stats stats;
+
 static struct stack_block *last_buffer_block;
 static size_t last_buffer_size;
 #ifdef DEBUG
@@ -193,6 +200,17 @@ unsigned int t_push_named(const char *format, ...)
 	return ret;
 }
 
+static void mem_block_free(struct stack_block *block)
+{
+	if (block == NULL || block == &outofmem_area.block)
+		return;
+	i_assert(stats.allocated_bytes >= block->size);
+	stats.allocated_bytes -= block->size;
+#ifndef USE_GC
+	free(block);
+#endif
+}
+
 static void free_blocks(struct stack_block *block)
 {
 	struct stack_block *next;
@@ -207,15 +225,10 @@ static void free_blocks(struct stack_block *block)
 			memset(STACK_BLOCK_DATA(block), CLEAR_CHR, block->size);
 
 		if (unused_block == NULL || block->size > unused_block->size) {
-#ifndef USE_GC
-			free(unused_block);
-#endif
+			mem_block_free(unused_block);
 			unused_block = block;
 		} else {
-#ifndef USE_GC
-			if (block != &outofmem_area.block)
-				free(block);
-#endif
+			mem_block_free(block);
 		}
 
 		block = next;
@@ -292,6 +305,16 @@ unsigned int t_pop(void)
 		free_blocks(current_block->next);
 		current_block->next = NULL;
 	}
+	if (data_stack_frame - 1 == DATA_STACK_OUTERMOST_FRAME &&
+	    unused_block != NULL && unused_block->size > max_unused_size) {
+		/* Nothing is allocated from data stack anymore except in
+		   the outermost frame. Don't keep a large block around for
+		   the rest of the process's lifetime because of a single
+		   large request. */
+		mem_block_free(unused_block);
+		unused_block = NULL;
+		stats.shrink_count++;
+	}
 
 	if (frame_pos > 0)
 		frame_pos--;
@@ -339,6 +362,11 @@ static struct stack_block *mem_block_alloc(size_t min_size)
 		i_panic("data stack: Out of memory when allocating %"
 			PRIuSIZE_T" bytes", alloc_size + SIZEOF_MEMBLOCK);
 	}
+	if (block != &outofmem_area.block) {
+		stats.allocated_bytes += alloc_size;
+		if (stats.allocated_bytes > stats.allocated_bytes_highwater)
+			stats.allocated_bytes_highwater = stats.allocated_bytes;
+	}
 	block->size = alloc_size;
 	block->left = 0;
 	block->lowwater = block->size;
@@ -565,6 +593,16 @@ void data_stack_set_clean_after_pop(bool enable ATTR_UNUSED)
 #endif
 }
 
+void data_stack_set_max_unused_size(size_t size)
+{
+	max_unused_size = size;
+}
+
+void data_stack_get_stats(struct data_stack_stats *stats_r)
+{
+	*stats_r = stats;
+}
+
 void data_stack_init(void)
 {
 	if (data_stack_frame > 0) {
@@ -605,10 +643,9 @@ void data_stack_deinit(void)
 
 		free(frame_block);
 	}
-
-	free(current_block);
-	free(unused_block);
 #endif
+	mem_block_free(current_block);
+	mem_block_free(unused_block);
 	unused_frame_blocks = NULL;
 	current_block = NULL;
 	unused_block = NULL;
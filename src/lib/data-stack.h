@@ -117,6 +117,24 @@ void t_buffer_alloc_last_full(void);
 /* If enabled, all the used memory is cleared after t_pop(). */
 void data_stack_set_clean_after_pop(bool enable);
 
+/* When t_pop() returns to the outermost frame and the data stack has
+   an unused memory block larger than the given size, free it. This keeps
+   a single large request from permanently growing a long-running process's
+   memory usage. The default is (size_t)-1, i.e. the largest block is always
+   kept for reuse. */
+void data_stack_set_max_unused_size(size_t size);
+
+struct data_stack_stats {
+	/* Number of bytes currently allocated for data stack blocks */
+	size_t allocated_bytes;
+	/* Highest allocated_bytes value since the process started */
+	size_t allocated_bytes_highwater;
+	/* Number of times an unused block was freed because of
+	   data_stack_set_max_unused_size() */
+	unsigned int shrink_count;
+};
+void data_stack_get_stats(struct data_stack_stats *stats_r);
+
 void data_stack_init(void);
 void data_stack_deinit(void);
 
@@ -4,11 +4,32 @@
 
 #include "lib.h"
 #include "hash.h"
-#include "primes.h"
 
 #include <ctype.h>
 
-#define HASH_TABLE_MIN_SIZE 67
+/* Open addressing with linear probing. Each slot has a control byte, which
+   tells whether the slot is empty, deleted or used. Used slots' control
+   bytes also contain 7 bits of the key's hash, so most of the non-matching
+   slots can be rejected by only looking at the densely packed control bytes
+   without touching the entries or calling the key comparison function. */
+#define HASH_CTRL_EMPTY		0x00
+#define HASH_CTRL_DELETED	0x01
+#define HASH_CTRL_FULL		0x80
+#define HASH_CTRL(hash)		(HASH_CTRL_FULL | ((hash) >> 25))
+
+#ifdef __GNUC__
+#  define hash_prefetch(p) __builtin_prefetch(p)
+#else
+#  define hash_prefetch(p)
+#endif
+
+/* table size is always a power of 2 */
+#define HASH_TABLE_MIN_SIZE 64
+/* Maximum number of used (non-empty) slots. When frozen the table can't be
+   resized, so it's allowed to fill up further before new entries are
+   placed to the overflow list. */
+#define HASH_TABLE_MAX_USED(size) ((size) / 4 * 3)
+#define HASH_TABLE_FROZEN_MAX_USED(size) ((size) - (size) / 8)
 
 #undef hash_table_create
 #undef hash_table_create_direct
@@ -26,20 +47,33 @@
 #undef hash_table_thaw
 #undef hash_table_copy
 
-struct hash_node {
-	struct hash_node *next;
+/* The hash isn't stored, so that the entries stay small. The 7 bits in the
+   control byte already filter out most of the non-matching keys, and the
+   hashes are recalculated when resizing like with the old chained table. */
+struct hash_entry {
 	void *key;
 	void *value;
 };
 
+struct hash_node {
+	struct hash_node *next;
+	struct hash_entry entry;
+};
+
 struct hash_table {
 	pool_t node_pool;
 
 	int frozen;
-	unsigned int initial_size, nodes_count, removed_count;
+	unsigned int initial_size, nodes_count;
+	/* number of non-empty slots, including the deleted ones */
+	unsigned int used_count;
 
 	unsigned int size;
-	struct hash_node *nodes;
+	uint8_t *ctrl;
+	struct hash_entry *entries;
+
+	/* entries that didn't fit to the table while it was frozen */
+	struct hash_node *overflow;
 	struct hash_node *free_nodes;
 
 	hash_callback_t *hash_cb;
@@ -48,29 +82,50 @@ struct hash_table {
 
 struct hash_iterate_context {
 	struct hash_table *table;
-	struct hash_node *next;
 	unsigned int pos;
+
+	struct hash_node *next_node;
+	bool overflow_started;
 };
 
-static bool hash_table_resize(struct hash_table *table, bool grow);
+static void hash_table_resize(struct hash_table *table);
+
+static unsigned int hash_table_get_size(unsigned int min_size,
+					unsigned int nodes_count)
+{
+	unsigned int size = min_size;
+
+	/* leave the table at most half full, so there's always plenty of
+	   space for new inserts before the next resize */
+	while (size / 2 < nodes_count) {
+		i_assert(size < (1U << 31));
+		size <<= 1;
+	}
+	return size;
+}
 
 void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size, hash_callback_t *hash_cb,
 		       hash_cmp_callback_t *key_compare_cb)
 {
 	struct hash_table *table;
+	unsigned int size = HASH_TABLE_MIN_SIZE;
 
 	pool_ref(node_pool);
 	table = i_new(struct hash_table, 1);
 	table->node_pool = node_pool;
-	table->initial_size =
-		I_MAX(primes_closest(initial_size), HASH_TABLE_MIN_SIZE);
+	while (HASH_TABLE_MAX_USED(size) < initial_size) {
+		i_assert(size < (1U << 31));
+		size <<= 1;
+	}
+	table->initial_size = size;
 
 	table->hash_cb = hash_cb;
 	table->key_compare_cb = key_compare_cb;
 
 	table->size = table->initial_size;
-	table->nodes = i_new(struct hash_node, table->size);
+	table->ctrl = i_new(uint8_t, table->size);
+	table->entries = i_new(struct hash_entry, table->size);
 	*table_r = table;
 }
 
@@ -92,6 +147,35 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+static inline unsigned int hash_table_hash(const struct hash_table *table,
+					   const void *key)
+{
+	unsigned int hash = table->hash_cb(key);
+
+	/* Mix the bits, since the slot is chosen from the low bits and the
+	   control byte from the high bits. Many of the hash callbacks (e.g.
+	   pointers and short strings) don't distribute either well. */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static struct hash_node *hash_table_alloc_node(struct hash_table *table)
+{
+	struct hash_node *node;
+
+	if (table->free_nodes == NULL)
+		return p_new(table->node_pool, struct hash_node, 1);
+
+	node = table->free_nodes;
+	table->free_nodes = node->next;
+	node->next = NULL;
+	return node;
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -113,16 +197,6 @@ static void destroy_node_list(struct hash_table *table, struct hash_node *node)
 	}
 }
 
-static void hash_table_destroy_nodes(struct hash_table *table)
-{
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++) {
-		if (table->nodes[i].next != NULL)
-			destroy_node_list(table, table->nodes[i].next);
-	}
-}
-
 void hash_table_destroy(struct hash_table **_table)
 {
 	struct hash_table *table = *_table;
@@ -130,19 +204,25 @@ void hash_table_destroy(struct hash_table **_table)
 	*_table = NULL;
 
 	if (!table->node_pool->alloconly_pool) {
-		hash_table_destroy_nodes(table);
+		destroy_node_list(table, table->overflow);
 		destroy_node_list(table, table->free_nodes);
 	}
 
 	pool_unref(&table->node_pool);
-	i_free(table->nodes);
+	i_free(table->ctrl);
+	i_free(table->entries);
 	i_free(table);
 }
 
 void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
-	if (!table->node_pool->alloconly_pool)
-		hash_table_destroy_nodes(table);
+	struct hash_node *node, *next;
+
+	for (node = table->overflow; node != NULL; node = next) {
+		next = node->next;
+		free_node(table, node);
+	}
+	table->overflow = NULL;
 
 	if (free_nodes) {
 		if (!table->node_pool->alloconly_pool)
@@ -150,200 +230,213 @@ void hash_table_clear(struct hash_table *table, bool free_nodes)
                 table->free_nodes = NULL;
 	}
 
-	memset(table->nodes, 0, sizeof(struct hash_node) * table->size);
+	memset(table->ctrl, HASH_CTRL_EMPTY, table->size);
 
 	table->nodes_count = 0;
-	table->removed_count = 0;
+	table->used_count = 0;
+}
+
+static bool
+hash_table_lookup_pos(const struct hash_table *table,
+		      const void *key, unsigned int hash, unsigned int *pos_r)
+{
+	const struct hash_entry *entry;
+	unsigned int mask = table->size - 1, pos;
+	uint8_t ctrl = HASH_CTRL(hash);
+
+	pos = hash & mask;
+	/* usually the key is found from the first slot. start loading it
+	   while the control bytes are being checked. */
+	hash_prefetch(&table->entries[pos]);
+	/* there's always at least one empty slot, so this finishes */
+	for (;; pos = (pos + 1) & mask) {
+		if (table->ctrl[pos] == ctrl) {
+			entry = &table->entries[pos];
+			if (table->key_compare_cb(entry->key, key) == 0) {
+				*pos_r = pos;
+				return TRUE;
+			}
+		} else if (table->ctrl[pos] == HASH_CTRL_EMPTY) {
+			return FALSE;
+		}
+	}
 }
 
 static struct hash_node *
-hash_table_lookup_node(const struct hash_table *table,
-		       const void *key, unsigned int hash)
+hash_table_lookup_overflow(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
 
-	node = &table->nodes[hash % table->size];
-
-	do {
-		if (node->key != NULL) {
-			if (table->key_compare_cb(node->key, key) == 0)
-				return node;
-		}
-		node = node->next;
-	} while (node != NULL);
+	for (node = table->overflow; node != NULL; node = node->next) {
+		if (node->entry.key != NULL &&
+		    table->key_compare_cb(node->entry.key, key) == 0)
+			return node;
+	}
+	return NULL;
+}
 
+static struct hash_entry *
+hash_table_lookup_entry(const struct hash_table *table, const void *key)
+{
+	struct hash_node *node;
+	unsigned int hash, pos;
+
+	hash = hash_table_hash(table, key);
+	if (hash_table_lookup_pos(table, key, hash, &pos))
+		return &table->entries[pos];
+	if (unlikely(table->overflow != NULL)) {
+		node = hash_table_lookup_overflow(table, key);
+		if (node != NULL)
+			return &node->entry;
+	}
 	return NULL;
 }
 
 void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
-	struct hash_node *node;
+	struct hash_entry *entry;
 
-	node = hash_table_lookup_node(table, key, table->hash_cb(key));
-	return node != NULL ? node->value : NULL;
+	entry = hash_table_lookup_entry(table, key);
+	return entry != NULL ? entry->value : NULL;
 }
 
 bool hash_table_lookup_full(const struct hash_table *table,
 			    const void *lookup_key,
 			    void **orig_key, void **value)
 {
-	struct hash_node *node;
+	struct hash_entry *entry;
 
-	node = hash_table_lookup_node(table, lookup_key,
-				      table->hash_cb(lookup_key));
-	if (node == NULL)
+	entry = hash_table_lookup_entry(table, lookup_key);
+	if (entry == NULL)
 		return FALSE;
 
-	*orig_key = node->key;
-	*value = node->value;
+	*orig_key = entry->key;
+	*value = entry->value;
 	return TRUE;
 }
 
-static struct hash_node * ATTR_NOWARN_UNUSED_RESULT
-hash_table_insert_node(struct hash_table *table, void *key, void *value,
-		       bool check_existing)
+static struct hash_entry * ATTR_NOWARN_UNUSED_RESULT
+hash_table_insert_entry(struct hash_table *table, void *key, void *value)
 {
-	struct hash_node *node, *prev;
-	unsigned int hash;
+	struct hash_entry *entry;
+	struct hash_node *node;
+	unsigned int hash, mask, pos, free_pos = UINT_MAX;
+	uint8_t ctrl;
 
 	i_assert(key != NULL);
 
-	hash = table->hash_cb(key);
-
-	if (check_existing && table->removed_count > 0) {
-		/* there may be holes, have to check everything */
-		node = hash_table_lookup_node(table, key, hash);
-		if (node != NULL) {
-			node->value = value;
-			return node;
-		}
-
-                check_existing = FALSE;
-	}
-
-	/* a) primary node */
-	node = &table->nodes[hash % table->size];
-	if (node->key == NULL) {
-		table->nodes_count++;
-
-		node->key = key;
-		node->value = value;
-		return node;
-	}
+	if (table->frozen == 0 &&
+	    table->used_count >= HASH_TABLE_MAX_USED(table->size))
+		hash_table_resize(table);
 
-	if (check_existing) {
-		if (table->key_compare_cb(node->key, key) == 0) {
-			node->value = value;
-			return node;
-		}
-	}
+	hash = hash_table_hash(table, key);
+	ctrl = HASH_CTRL(hash);
+	mask = table->size - 1;
 
-	/* b) collisions list */
-	prev = node; node = node->next;
-	while (node != NULL) {
-		if (node->key == NULL)
+	for (pos = hash & mask;; pos = (pos + 1) & mask) {
+		if (table->ctrl[pos] == HASH_CTRL_EMPTY)
 			break;
-
-		if (check_existing) {
-			if (table->key_compare_cb(node->key, key) == 0) {
-				node->value = value;
-				return node;
+		if (table->ctrl[pos] == HASH_CTRL_DELETED) {
+			/* the key may still exist further away */
+			if (free_pos == UINT_MAX)
+				free_pos = pos;
+		} else if (table->ctrl[pos] == ctrl) {
+			entry = &table->entries[pos];
+			if (table->key_compare_cb(entry->key, key) == 0) {
+				entry->value = value;
+				return entry;
 			}
 		}
-
-		prev = node;
-		node = node->next;
 	}
-
-	if (node == NULL) {
-		if (table->frozen == 0 && hash_table_resize(table, TRUE)) {
-			/* resized table, try again */
-			return hash_table_insert_node(table, key, value, FALSE);
+	if (unlikely(table->overflow != NULL)) {
+		node = hash_table_lookup_overflow(table, key);
+		if (node != NULL) {
+			node->entry.value = value;
+			return &node->entry;
 		}
+	}
 
-		if (table->free_nodes == NULL)
-			node = p_new(table->node_pool, struct hash_node, 1);
-		else {
-			node = table->free_nodes;
-			table->free_nodes = node->next;
-			node->next = NULL;
-		}
-		prev->next = node;
+	if (free_pos != UINT_MAX) {
+		/* reuse a deleted slot */
+		entry = &table->entries[free_pos];
+		table->ctrl[free_pos] = ctrl;
+	} else if (table->used_count < HASH_TABLE_FROZEN_MAX_USED(table->size)) {
+		entry = &table->entries[pos];
+		table->ctrl[pos] = ctrl;
+		table->used_count++;
+	} else {
+		/* frozen table is getting full. we can't move the existing
+		   entries, so add to the overflow list until thawed. */
+		i_assert(table->frozen > 0);
+		node = hash_table_alloc_node(table);
+		node->next = table->overflow;
+		table->overflow = node;
+		entry = &node->entry;
 	}
 
-	node->key = key;
-	node->value = value;
+	entry->key = key;
+	entry->value = value;
 
 	table->nodes_count++;
-	return node;
+	return entry;
 }
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
-	struct hash_node *node;
+	struct hash_entry *entry;
 
-	node = hash_table_insert_node(table, key, value, TRUE);
-	node->key = key;
+	entry = hash_table_insert_entry(table, key, value);
+	entry->key = key;
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, TRUE);
+	hash_table_insert_entry(table, key, value);
 }
 
-static void
-hash_table_compress(struct hash_table *table, struct hash_node *root)
+static bool hash_table_need_resize(struct hash_table *table)
 {
-	struct hash_node *node, *next;
-
-	/* remove deleted nodes from the list */
-	for (node = root; node->next != NULL; ) {
-		next = node->next;
-
-		if (next->key == NULL) {
-			node->next = next->next;
-			free_node(table, next);
-		} else {
-			node = next;
-		}
-	}
-
-	/* update root */
-	if (root->key == NULL && root->next != NULL) {
-		next = root->next;
-		*root = *next;
-		free_node(table, next);
-	}
-}
-
-static void hash_table_compress_removed(struct hash_table *table)
-{
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++)
-		hash_table_compress(table, &table->nodes[i]);
-
-        table->removed_count = 0;
+	if (table->overflow != NULL)
+		return TRUE;
+	if (table->used_count >= HASH_TABLE_MAX_USED(table->size))
+		return TRUE;
+	/* shrink */
+	return table->size > table->initial_size &&
+		table->nodes_count < table->size / 8;
 }
 
 bool hash_table_try_remove(struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
-	unsigned int hash;
-
-	hash = table->hash_cb(key);
-
-	node = hash_table_lookup_node(table, key, hash);
-	if (unlikely(node == NULL))
-		return FALSE;
-
-	node->key = NULL;
+	unsigned int hash, pos, mask = table->size - 1;
+
+	hash = hash_table_hash(table, key);
+	if (hash_table_lookup_pos(table, key, hash, &pos)) {
+		table->entries[pos].key = NULL;
+		table->ctrl[pos] = HASH_CTRL_DELETED;
+		/* If the next slot is empty, no probe sequence continues past
+		   this slot, so it and the deleted slots preceding it can be
+		   made empty. This doesn't move any entries, so it's safe even
+		   while iterating. */
+		while (table->ctrl[pos] == HASH_CTRL_DELETED &&
+		       table->ctrl[(pos + 1) & mask] == HASH_CTRL_EMPTY) {
+			table->ctrl[pos] = HASH_CTRL_EMPTY;
+			table->used_count--;
+			pos = (pos - 1) & mask;
+		}
+	} else {
+		if (likely(table->overflow == NULL))
+			return FALSE;
+		node = hash_table_lookup_overflow(table, key);
+		if (node == NULL)
+			return FALSE;
+		/* removed from the list when thawed */
+		node->entry.key = NULL;
+	}
 	table->nodes_count--;
 
-	if (table->frozen != 0)
-		table->removed_count++;
-	else if (!hash_table_resize(table, FALSE))
-		hash_table_compress(table, &table->nodes[hash % table->size]);
+	if (table->frozen == 0 && hash_table_need_resize(table))
+		hash_table_resize(table);
 	return TRUE;
 }
 
@@ -360,45 +453,40 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
 	return ctx;
 }
 
-static struct hash_node *
-hash_table_iterate_next(struct hash_iterate_context *ctx,
-			struct hash_node *node)
-{
-	do {
-		node = node->next;
-		if (node == NULL) {
-			if (++ctx->pos == ctx->table->size) {
-				ctx->pos--;
-				return NULL;
-			}
-			node = &ctx->table->nodes[ctx->pos];
-		}
-	} while (node->key == NULL);
-
-	return node;
-}
-
 bool hash_table_iterate(struct hash_iterate_context *ctx,
 			void **key_r, void **value_r)
 {
+	struct hash_table *table = ctx->table;
+	const struct hash_entry *entry;
 	struct hash_node *node;
 
-	node = ctx->next;
-	if (node != NULL && node->key == NULL)
-		node = hash_table_iterate_next(ctx, node);
-	if (node == NULL) {
-		*key_r = *value_r = NULL;
-		return FALSE;
+	while (ctx->pos < table->size) {
+		if ((table->ctrl[ctx->pos++] & HASH_CTRL_FULL) != 0) {
+			entry = &table->entries[ctx->pos-1];
+			*key_r = entry->key;
+			*value_r = entry->value;
+			return TRUE;
+		}
 	}
-	*key_r = node->key;
-	*value_r = node->value;
 
-	ctx->next = hash_table_iterate_next(ctx, node);
-	return TRUE;
+	if (!ctx->overflow_started) {
+		ctx->next_node = table->overflow;
+		ctx->overflow_started = TRUE;
+	}
+	while (ctx->next_node != NULL) {
+		node = ctx->next_node;
+		ctx->next_node = node->next;
+		if (node->entry.key != NULL) {
+			*key_r = node->entry.key;
+			*value_r = node->entry.value;
+			return TRUE;
+		}
+	}
+	*key_r = *value_r = NULL;
+	return FALSE;
 }
 
 void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
@@ -422,65 +510,60 @@ void hash_table_thaw(struct hash_table *table)
 	if (--table->frozen > 0)
 		return;
 
-	if (table->removed_count > 0) {
-		if (!hash_table_resize(table, FALSE))
-			hash_table_compress_removed(table);
-	}
+	if (hash_table_need_resize(table))
+		hash_table_resize(table);
 }
 
-static bool hash_table_resize(struct hash_table *table, bool grow)
+static void
+hash_table_insert_rehash(struct hash_table *table,
+			 const struct hash_entry *entry)
 {
-	struct hash_node *old_nodes, *node, *next;
-	unsigned int next_size, old_size, i;
-	float nodes_per_list;
-
-        nodes_per_list = (float) table->nodes_count / (float) table->size;
-	if (nodes_per_list > 0.3 && nodes_per_list < 2.0)
-		return FALSE;
-
-	next_size = I_MAX(primes_closest(table->nodes_count+1),
-			  table->initial_size);
-	if (next_size == table->size)
-		return FALSE;
-
-	if (grow && table->size >= next_size)
-		return FALSE;
+	unsigned int mask = table->size - 1, hash, pos;
 
-	/* recreate primary table */
-	old_size = table->size;
-	old_nodes = table->nodes;
+	/* the key is known not to exist and there are no deleted slots */
+	hash = hash_table_hash(table, entry->key);
+	pos = hash & mask;
+	while (table->ctrl[pos] != HASH_CTRL_EMPTY)
+		pos = (pos + 1) & mask;
 
-	table->size = I_MAX(next_size, HASH_TABLE_MIN_SIZE);
-	table->nodes = i_new(struct hash_node, table->size);
-
-	table->nodes_count = 0;
-	table->removed_count = 0;
+	table->ctrl[pos] = HASH_CTRL(hash);
+	table->entries[pos] = *entry;
+	table->used_count++;
+}
 
-	table->frozen++;
+static void hash_table_resize(struct hash_table *table)
+{
+	struct hash_node *node, *next, *overflow = table->overflow;
+	struct hash_entry *old_entries = table->entries;
+	uint8_t *old_ctrl = table->ctrl;
+	unsigned int i, old_size = table->size;
+
+	i_assert(table->frozen == 0);
+
+	/* this may also keep the same size, which just gets rid of the
+	   deleted slots */
+	table->size = hash_table_get_size(table->initial_size,
+					  table->nodes_count);
+	table->ctrl = i_new(uint8_t, table->size);
+	table->entries = i_new(struct hash_entry, table->size);
+	table->used_count = 0;
+	table->overflow = NULL;
 
 	/* move the data */
 	for (i = 0; i < old_size; i++) {
-		node = &old_nodes[i];
-		if (node->key != NULL) {
-			hash_table_insert_node(table, node->key,
-					       node->value, FALSE);
-		}
-
-		for (node = node->next; node != NULL; node = next) {
-			next = node->next;
-
-			if (node->key != NULL) {
-				hash_table_insert_node(table, node->key,
-						       node->value, FALSE);
-			}
-			free_node(table, node);
-		}
+		if ((old_ctrl[i] & HASH_CTRL_FULL) != 0)
+			hash_table_insert_rehash(table, &old_entries[i]);
 	}
+	for (node = overflow; node != NULL; node = next) {
+		next = node->next;
+		if (node->entry.key != NULL)
+			hash_table_insert_rehash(table, &node->entry);
+		free_node(table, node);
+	}
+	i_assert(table->used_count == table->nodes_count);
 
-	table->frozen--;
-
-	i_free(old_nodes);
-	return TRUE;
+	i_free(old_ctrl);
+	i_free(old_entries);
 }
 
 void hash_table_copy(struct hash_table *dest, struct hash_table *src)
@@ -488,14 +571,10 @@ void hash_table_copy(struct hash_table *dest, struct hash_table *src)
 	struct hash_iterate_context *iter;
 	void *key, *value;
 
-	hash_table_freeze(dest);
-
 	iter = hash_table_iterate_init(src);
 	while (hash_table_iterate(iter, &key, &value))
 		hash_table_insert(dest, key, value);
 	hash_table_iterate_deinit(&iter);
-
-	hash_table_thaw(dest);
 }
 
 /* a char* hash function from ASU -- from glib */
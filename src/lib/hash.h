@@ -15,9 +15,10 @@ typedef unsigned int hash_callback_t(const void *p);
 typedef int hash_cmp_callback_t(const void *p1, const void *p2);
 
 /* Create a new hash table. If initial_size is 0, the default value is used.
-   table_pool is used to allocate/free large hash tables, node_pool is used
-   for smaller allocations and can also be alloconly pool. The pools must not
-   be free'd before hash_table_destroy() is called. */
+   The table itself is allocated from system pool. node_pool is used only for
+   the nodes that don't fit into the table while it's frozen and can also be
+   alloconly pool. The pool must not be free'd before hash_table_destroy() is
+   called. */
 void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size,
 		       hash_callback_t *hash_cb,
@@ -151,8 +152,8 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 
 void hash_table_iterate_deinit(struct hash_iterate_context **ctx);
 
-/* Hash table isn't resized, and removed nodes aren't removed from
-   the list while hash table is freezed. Supports nesting. */
+/* Hash table isn't resized and existing nodes aren't moved while hash table
+   is freezed. Supports nesting. */
 void hash_table_freeze(struct hash_table *table);
 void hash_table_thaw(struct hash_table *table);
 #define hash_table_freeze(table) \
@@ -158,7 +158,7 @@ void io_loop_handle_remove(struct io_file *io, bool closed)
 		   insteading of appending to the events array */
 		ctx->deleted_count++;
 	}
-	i_free(io);
+	io_file_free(io);
 }
 
 void io_loop_handler_run_internal(struct ioloop *ioloop)
@@ -105,7 +105,7 @@ void io_loop_handle_remove(struct io_file *io, bool closed)
 
 	i_assert(io->refcount > 0);
 	if (--io->refcount == 0)
-		i_free(io);
+		io_file_free(io);
 }
 
 void io_loop_handler_run_internal(struct ioloop *ioloop)
@@ -152,7 +152,7 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 
 		i_assert(io->refcount > 0);
 		if (--io->refcount == 0)
-			i_free(io);
+			io_file_free(io);
 	}
 }
 
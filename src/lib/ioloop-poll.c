@@ -120,7 +120,7 @@ void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
 		}
 	}
 #endif
-	i_free(io);
+	io_file_free(io);
 
 	if (condition & IO_READ) {
 		ctx->fds[index].events &= ~(POLLIN|POLLPRI);
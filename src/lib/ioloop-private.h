@@ -9,6 +9,15 @@
 #  define IOLOOP_INITIAL_FD_COUNT 128
 #endif
 
+/* Repeating timeouts of at least this many milliseconds are kept in the
+   timing wheel instead of the priority queue. */
+#define IOLOOP_WHEEL_MIN_MSECS 1000
+/* The timing wheel has IOLOOP_WHEEL_LEVELS levels, each with
+   2^IOLOOP_WHEEL_LEVEL_BITS slots. Level 0 slots are one second wide. */
+#define IOLOOP_WHEEL_LEVEL_BITS 6
+#define IOLOOP_WHEEL_LEVEL_SLOTS (1 << IOLOOP_WHEEL_LEVEL_BITS)
+#define IOLOOP_WHEEL_LEVELS 4
+
 struct ioloop {
         struct ioloop *prev;
 
@@ -19,6 +28,17 @@ struct ioloop {
 	struct priorityq *timeouts;
 	ARRAY(struct timeout *) timeouts_new;
 
+	/* Hierarchical timing wheel for long repeating timeouts. Resetting
+	   them only moves them between slots. When a level 0 slot's second
+	   is reached, its timeouts are moved to the priority queue, which
+	   then runs them at their exact time. */
+	struct timeout *wheel[IOLOOP_WHEEL_LEVELS][IOLOOP_WHEEL_LEVEL_SLOTS];
+	/* bitmask of non-empty slots in each level */
+	uint64_t wheel_slots_used[IOLOOP_WHEEL_LEVELS];
+	/* the next second whose level 0 slot hasn't been processed yet */
+	time_t wheel_cur_sec;
+	unsigned int wheel_count;
+
         struct ioloop_handler_context *handler_context;
         struct ioloop_notify_handler_context *notify_handler_context;
 	unsigned int max_fd_count;
@@ -62,6 +82,8 @@ struct io_file {
 
 struct timeout {
 	struct priorityq_item item;
+	/* linked list in a timing wheel slot */
+	struct timeout *wheel_prev, *wheel_next;
 	unsigned int source_linenum;
 
         unsigned int msecs;
@@ -73,7 +95,9 @@ struct timeout {
 	struct ioloop *ioloop;
 	struct ioloop_context *ctx;
 
+	unsigned char wheel_level, wheel_slot;
 	unsigned int one_shot:1;
+	unsigned int in_wheel:1;
 };
 
 struct ioloop_context_callback {
@@ -98,6 +122,8 @@ void io_loop_handler_run_internal(struct ioloop *ioloop);
 /* I/O handler calls */
 void io_loop_handle_add(struct io_file *io);
 void io_loop_handle_remove(struct io_file *io, bool closed);
+/* Free io after the I/O handler no longer references it */
+void io_file_free(struct io_file *io);
 
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
@@ -95,7 +95,7 @@ void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
 		if (io->fd == ctx->highest_fd)
 			update_highest_fd(io->io.ioloop);
 	}
-	i_free(io);
+	io_file_free(io);
 }
 
 #define io_check_condition(ctx, fd, cond) \
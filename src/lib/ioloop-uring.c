@@ -0,0 +1,689 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "llist.h"
+#include "fd-close-on-exec.h"
+#include "istream.h"
+#include "istream-file-private.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Size of the completion queue. The kernel buffers overflowing completions
+   internally (IORING_FEAT_NODROP), so this only needs to be large enough
+   to usually hold a single ioloop run's worth of events. */
+#define IOLOOP_URING_CQ_ENTRIES 4096
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT (POLLOUT | IO_URING_ERROR)
+
+enum io_uring_request_type {
+	/* one-shot IORING_OP_POLL_ADD. Multishot polls would save rearming
+	   them, but they are edge-triggered (IORING_POLL_ADD_LEVEL can't be
+	   combined with them), while the io callbacks rely on being called
+	   again for input they left unread. */
+	IO_URING_REQUEST_POLL,
+	/* IORING_OP_READ for the input io's istream. The data is handed over
+	   to the istream, so the callback doesn't need to read() it. */
+	IO_URING_REQUEST_READ
+};
+
+/* A request submitted to the kernel. The kernel always produces exactly one
+   completion for it, either with its result or with -ECANCELED after it
+   was cancelled. The request is freed only once that completion has been
+   seen, since until then the kernel may still return its pointer as
+   user_data. */
+struct io_uring_request {
+	struct io_uring_request *prev, *next;
+	enum io_uring_request_type type;
+
+	/* NULL after the request has been cancelled */
+	struct io_uring_fd *ufd;
+	/* IO_URING_REQUEST_READ: the stream that is read */
+	struct istream *input;
+};
+
+struct io_uring_fd {
+	struct io_list list;
+	int fd;
+
+	/* currently armed poll request and its event mask */
+	struct io_uring_request *poll;
+	unsigned int poll_events;
+	/* read request done for the input io */
+	struct io_uring_request *read;
+
+	/* requests need to be (re)armed before the next wait */
+	bool dirty;
+	/* the fd can't be read via io_uring, poll it instead */
+	bool no_async_read;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries, sq_local_tail;
+
+	struct io_uring_request *requests;
+	/* completions moved out of the completion queue, but not handled yet */
+	ARRAY(struct io_uring_cqe) pending_cqes;
+	ARRAY(struct io_uring_fd *) fd_index;
+	ARRAY(struct io_uring_fd *) dirty_fds;
+	/* number of poll and read requests in flight */
+	unsigned int armed_count;
+
+	/* the kernel waits for input itself for reads (IORING_FEAT_FAST_POLL) */
+	bool async_reads;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+		   unsigned int min_complete, unsigned int flags,
+		   struct io_uring_getevents_arg *arg)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, arg, arg == NULL ? 0 : sizeof(*arg));
+}
+
+static void *
+io_uring_mmap(struct ioloop_handler_context *ctx, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ctx->ring_fd, offset);
+	if (ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring, %"PRIuSIZE_T") failed: %m", size);
+	return ptr;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+	struct io_uring_params params;
+	unsigned char *sq_ring, *cq_ring;
+
+	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->dirty_fds, initial_fd_count);
+	i_array_init(&ctx->pending_cqes, 64);
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = IOLOOP_URING_CQ_ENTRIES;
+	ctx->ring_fd = sys_io_uring_setup(initial_fd_count, &params);
+	if (ctx->ring_fd < 0) {
+		if (errno == ENOMEM) {
+			i_fatal("io_uring_setup(): %m (you may need to "
+				"increase RLIMIT_MEMLOCK)");
+		} else if (errno == EPERM) {
+			i_fatal("io_uring_setup(): %m (io_uring may be "
+				"disabled by kernel.io_uring_disabled)");
+		}
+		i_fatal("io_uring_setup(): %m");
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	if ((params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		i_fatal("io_uring: Kernel is too old (v5.11+ required), "
+			"rebuild with --with-ioloop=epoll");
+	}
+	ctx->async_reads = (params.features & IORING_FEAT_FAST_POLL) != 0;
+
+	ctx->sq_entries = params.sq_entries;
+	ctx->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ctx->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ctx->sq_ring = io_uring_mmap(ctx, ctx->sq_ring_size, IORING_OFF_SQ_RING);
+	ctx->cq_ring = io_uring_mmap(ctx, ctx->cq_ring_size, IORING_OFF_CQ_RING);
+	ctx->sqes = io_uring_mmap(ctx, ctx->sqes_size, IORING_OFF_SQES);
+
+	sq_ring = ctx->sq_ring;
+	ctx->sq_head = (void *)(sq_ring + params.sq_off.head);
+	ctx->sq_tail = (void *)(sq_ring + params.sq_off.tail);
+	ctx->sq_mask = (void *)(sq_ring + params.sq_off.ring_mask);
+	ctx->sq_array = (void *)(sq_ring + params.sq_off.array);
+	ctx->sq_local_tail = *ctx->sq_tail;
+
+	cq_ring = ctx->cq_ring;
+	ctx->cq_head = (void *)(cq_ring + params.cq_off.head);
+	ctx->cq_tail = (void *)(cq_ring + params.cq_off.tail);
+	ctx->cq_mask = (void *)(cq_ring + params.cq_off.ring_mask);
+	ctx->cqes = (void *)(cq_ring + params.cq_off.cqes);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **ufds;
+	struct io_uring_request *req;
+	unsigned int i, count;
+
+	/* closing the ring cancels all the requests still in flight. reads
+	   were already finished when their ios were removed, so the kernel
+	   isn't writing to any buffers anymore. */
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	while (ctx->requests != NULL) {
+		req = ctx->requests;
+		i_assert(req->type == IO_URING_REQUEST_POLL);
+		DLLIST_REMOVE(&ctx->requests, req);
+		i_free(req);
+	}
+
+	ufds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(ufds[i]);
+
+	if (munmap(ctx->sqes, ctx->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (munmap(ctx->cq_ring, ctx->cq_ring_size) < 0)
+		i_error("munmap(io_uring cq) failed: %m");
+	if (munmap(ctx->sq_ring, ctx->sq_ring_size) < 0)
+		i_error("munmap(io_uring sq) failed: %m");
+	array_free(&ctx->fd_index);
+	array_free(&ctx->dirty_fds);
+	array_free(&ctx->pending_cqes);
+	i_free(ioloop->handler_context);
+}
+
+static unsigned int
+io_uring_submit_pending(struct ioloop_handler_context *ctx)
+{
+	return ctx->sq_local_tail - __atomic_load_n(ctx->sq_head,
+						    __ATOMIC_ACQUIRE);
+}
+
+static int io_uring_submit(struct ioloop_handler_context *ctx)
+{
+	unsigned int to_submit = io_uring_submit_pending(ctx);
+
+	if (to_submit == 0)
+		return 0;
+	if (sys_io_uring_enter(ctx->ring_fd, to_submit, 0, 0, NULL) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(submit) failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+static void io_uring_reap_cqes(struct ioloop_handler_context *ctx)
+{
+	unsigned int head, tail;
+
+	/* Move the completions to pending_cqes, so their slots are released.
+	   They are handled later by io_loop_handler_run_internal(), since
+	   the callbacks can't be called from here. */
+	head = *ctx->cq_head;
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe =
+			&ctx->cqes[head & *ctx->cq_mask];
+
+		if (cqe->user_data != 0)
+			array_append(&ctx->pending_cqes, cqe, 1);
+	}
+	__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *io_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while (io_uring_submit_pending(ctx) >= ctx->sq_entries) {
+		/* submission queue is full - flush it. normally all the
+		   requests are submitted with a single io_uring_enter() call
+		   while waiting for events. the completions are always
+		   drained, so that the kernel can accept the requests once
+		   the completion queue has room again. */
+		if (io_uring_submit(ctx) < 0)
+			io_uring_reap_cqes(ctx);
+	}
+	idx = ctx->sq_local_tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ctx->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void io_uring_sqe_ready(struct ioloop_handler_context *ctx)
+{
+	ctx->sq_local_tail++;
+	__atomic_store_n(ctx->sq_tail, ctx->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static void
+io_uring_fd_set_dirty(struct ioloop_handler_context *ctx,
+		      struct io_uring_fd *ufd)
+{
+	if (!ufd->dirty) {
+		ufd->dirty = TRUE;
+		array_append(&ctx->dirty_fds, &ufd, 1);
+	}
+}
+
+static struct io_uring_request *
+io_uring_request_new(struct ioloop_handler_context *ctx,
+		     struct io_uring_fd *ufd, enum io_uring_request_type type)
+{
+	struct io_uring_request *req;
+
+	req = i_new(struct io_uring_request, 1);
+	req->type = type;
+	req->ufd = ufd;
+	DLLIST_PREPEND(&ctx->requests, req);
+	ctx->armed_count++;
+	return req;
+}
+
+static void
+io_uring_request_cancel(struct ioloop_handler_context *ctx,
+			struct io_uring_request *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ctx);
+	if (req->type == IO_URING_REQUEST_POLL) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+	} else {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	}
+	sqe->addr = POINTER_CAST_TO(req, uintptr_t);
+	/* the cancellation's own completion is ignored */
+	sqe->user_data = 0;
+	io_uring_sqe_ready(ctx);
+
+	/* the request is freed once its -ECANCELED completion (or its
+	   already queued result) is received */
+	req->ufd = NULL;
+	i_assert(ctx->armed_count > 0);
+	ctx->armed_count--;
+}
+
+static void
+io_uring_poll_add(struct ioloop_handler_context *ctx, struct io_uring_fd *ufd,
+		  unsigned int events)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_request *poll;
+
+	i_assert(ufd->poll == NULL);
+
+	poll = io_uring_request_new(ctx, ufd, IO_URING_REQUEST_POLL);
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ufd->fd;
+	sqe->poll32_events = events;
+	sqe->user_data = POINTER_CAST_TO(poll, uintptr_t);
+	io_uring_sqe_ready(ctx);
+
+	ufd->poll = poll;
+	ufd->poll_events = events;
+}
+
+static void
+io_uring_poll_cancel(struct ioloop_handler_context *ctx, struct io_uring_fd *ufd)
+{
+	i_assert(ufd->poll != NULL);
+
+	io_uring_request_cancel(ctx, ufd->poll);
+	ufd->poll = NULL;
+	ufd->poll_events = 0;
+}
+
+static void
+io_uring_read_start(struct ioloop_handler_context *ctx,
+		    struct io_uring_fd *ufd, struct io_file *io)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_request *req;
+	void *buf;
+	size_t size;
+	int ret;
+
+	i_assert(ufd->read == NULL);
+
+	if (!ctx->async_reads || ufd->no_async_read || io->istream == NULL ||
+	    io->io.condition != IO_READ)
+		return;
+
+	ret = i_stream_file_async_read_begin(io->istream, &buf, &size);
+	if (ret == 0) {
+		/* the previous read's data hasn't been read from the stream
+		   yet. keep calling the io like for any unread input. */
+		io_set_pending(&io->io);
+		return;
+	}
+	if (ret < 0)
+		return;
+
+	req = io_uring_request_new(ctx, ufd, IO_URING_REQUEST_READ);
+	req->input = io->istream;
+	i_stream_ref(req->input);
+
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ufd->fd;
+	sqe->addr = POINTER_CAST_TO(buf, uintptr_t);
+	sqe->len = size;
+	/* read from the current file position */
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = POINTER_CAST_TO(req, uintptr_t);
+	io_uring_sqe_ready(ctx);
+
+	ufd->read = req;
+}
+
+static void
+io_uring_handle_read(struct ioloop_handler_context *ctx,
+		     struct io_uring_request *req, int res)
+{
+	struct io_uring_fd *ufd = req->ufd;
+
+	i_stream_file_async_read_end(req->input, res < 0 ? -1 : res,
+				     res < 0 ? -res : 0);
+	/* the io still references the stream if it wasn't removed */
+	i_stream_unref(&req->input);
+	DLLIST_REMOVE(&ctx->requests, req);
+	i_free(req);
+
+	if (ufd == NULL) {
+		/* cancelled - anything that was read is returned by the
+		   stream once it's read the next time */
+		return;
+	}
+	ufd->read = NULL;
+	i_assert(ctx->armed_count > 0);
+	ctx->armed_count--;
+	io_uring_fd_set_dirty(ctx, ufd);
+
+	if (res == -EAGAIN) {
+		/* the kernel doesn't wait for input on this fd */
+		ufd->no_async_read = TRUE;
+		return;
+	}
+	io_loop_call_io(&ufd->list.ios[IOLOOP_IOLIST_INPUT]->io);
+}
+
+static bool
+io_uring_handle_reaped_read(struct ioloop_handler_context *ctx,
+			    struct io_uring_request *req)
+{
+	struct io_uring_cqe *cqe;
+
+	io_uring_reap_cqes(ctx);
+	array_foreach_modifiable(&ctx->pending_cqes, cqe) {
+		if (cqe->user_data == POINTER_CAST_TO(req, uintptr_t)) {
+			/* handled now - skip it later */
+			cqe->user_data = 0;
+			io_uring_handle_read(ctx, req, cqe->res);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void
+io_uring_read_cancel(struct ioloop_handler_context *ctx,
+		     struct io_uring_fd *ufd)
+{
+	struct io_uring_request *req = ufd->read;
+
+	i_assert(req != NULL);
+
+	io_uring_request_cancel(ctx, req);
+	ufd->read = NULL;
+
+	/* Wait for the read to finish. The istream can't be read until then,
+	   and the io may be added back to another ioloop, which can't see
+	   this ioloop's completions. A read that is only waiting for input
+	   is cancelled immediately. */
+	while (!io_uring_handle_reaped_read(ctx, req)) {
+		if (sys_io_uring_enter(ctx->ring_fd,
+				       io_uring_submit_pending(ctx), 1,
+				       IORING_ENTER_GETEVENTS, NULL) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(cancel) failed: %m");
+	}
+}
+
+static unsigned int
+io_uring_event_mask(struct io_list *list, struct io_file *skip_io)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL || io == skip_io)
+			continue;
+
+		if (io->io.condition & IO_READ)
+			events |= IO_URING_INPUT;
+		if (io->io.condition & IO_WRITE)
+			events |= IO_URING_OUTPUT;
+		if (io->io.condition & IO_ERROR)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void io_uring_flush_dirty(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_fd *const *ufdp, *ufd;
+	struct io_file *input_io;
+	unsigned int events;
+
+	/* queue all the changes made since the previous wait, so they get
+	   submitted with the same io_uring_enter() call */
+	array_foreach(&ctx->dirty_fds, ufdp) {
+		ufd = *ufdp;
+		ufd->dirty = FALSE;
+
+		/* read the input io's istream directly if possible and poll
+		   only for the rest */
+		input_io = ufd->list.ios[IOLOOP_IOLIST_INPUT];
+		if (input_io != NULL && ufd->read == NULL)
+			io_uring_read_start(ctx, ufd, input_io);
+		events = io_uring_event_mask(&ufd->list, ufd->read == NULL ?
+					     NULL : input_io);
+		if (ufd->poll != NULL && ufd->poll_events == events)
+			continue;
+		if (ufd->poll != NULL)
+			io_uring_poll_cancel(ctx, ufd);
+		if (events != 0)
+			io_uring_poll_add(ctx, ufd, events);
+	}
+	array_clear(&ctx->dirty_fds);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+
+	ufdp = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL) {
+		*ufdp = i_new(struct io_uring_fd, 1);
+		(*ufdp)->fd = io->fd;
+	}
+
+	(void)ioloop_iolist_add(&(*ufdp)->list, io);
+	io_uring_fd_set_dirty(ctx, *ufdp);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+	bool last;
+
+	ufdp = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if ((*ufdp)->read != NULL &&
+	    (*ufdp)->list.ios[IOLOOP_IOLIST_INPUT] == io)
+		io_uring_read_cancel(ctx, *ufdp);
+
+	last = ioloop_iolist_del(&(*ufdp)->list, io);
+	if (last) {
+		/* the fd may be reused for something else */
+		(*ufdp)->no_async_read = FALSE;
+	}
+	if (last && (*ufdp)->poll != NULL) {
+		/* The poll request keeps a reference to the file even if the
+		   fd was already closed, so it always needs to be removed.
+		   Do it immediately so the fd number can be reused. */
+		io_uring_poll_cancel(ctx, *ufdp);
+	} else {
+		io_uring_fd_set_dirty(ctx, *ufdp);
+	}
+	io_file_free(io);
+}
+
+static void
+io_uring_handle_poll(struct ioloop_handler_context *ctx,
+		     struct io_uring_request *poll, int res)
+{
+	struct io_uring_fd *ufd;
+	struct io_file *io;
+	unsigned int events;
+	bool call;
+	int i;
+
+	ufd = poll->ufd;
+	i_assert(ufd == NULL || ufd->poll == poll);
+	DLLIST_REMOVE(&ctx->requests, poll);
+	i_free(poll);
+
+	if (ufd == NULL) {
+		/* cancelled */
+		return;
+	}
+	ufd->poll = NULL;
+	ufd->poll_events = 0;
+	i_assert(ctx->armed_count > 0);
+	ctx->armed_count--;
+
+	/* poll requests are one-shot, rearm before the next wait */
+	io_uring_fd_set_dirty(ctx, ufd);
+
+	events = res < 0 ? POLLERR : (unsigned int)res;
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = ufd->list.ios[i];
+		if (io == NULL)
+			continue;
+		if (i == IOLOOP_IOLIST_INPUT && ufd->read != NULL) {
+			/* the read's completion calls the io */
+			continue;
+		}
+
+		call = FALSE;
+		if ((events & (POLLHUP | POLLERR)) != 0)
+			call = TRUE;
+		else if ((io->io.condition & IO_READ) != 0)
+			call = (events & (POLLIN | POLLPRI)) != 0;
+		else if ((io->io.condition & IO_WRITE) != 0)
+			call = (events & POLLOUT) != 0;
+		else if ((io->io.condition & IO_ERROR) != 0)
+			call = (events & IO_URING_ERROR) != 0;
+
+		if (call)
+			io_loop_call_io(&io->io);
+	}
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_request *req;
+	struct io_uring_cqe cqe;
+	struct timeval tv;
+	unsigned int i, min_complete;
+	int msecs, ret;
+
+	io_uring_flush_dirty(ctx);
+
+        /* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+	if (msecs < 0 && ctx->armed_count == 0)
+		i_panic("BUG: No IOs or timeouts set. Not waiting for infinity.");
+
+	memset(&arg, 0, sizeof(arg));
+	if (msecs >= 0) {
+		/* wait for the rounded up msecs like the other backends.
+		   timeouts have only msec precision, so waiting for the exact
+		   tv could wake up just before the timeout is due. */
+		ts.tv_sec = msecs / 1000;
+		ts.tv_nsec = (msecs % 1000) * 1000000LL;
+		arg.ts = POINTER_CAST_TO(&ts, uintptr_t);
+	}
+	/* don't wait if there are already completions or pending ios to
+	   handle */
+	min_complete = array_count(&ctx->pending_cqes) > 0 ||
+		ioloop->io_pending_count > 0 ? 0 : 1;
+	/* submit all the queued poll changes and wait for events with a
+	   single syscall */
+	ret = sys_io_uring_enter(ctx->ring_fd, io_uring_submit_pending(ctx),
+				 min_complete,
+				 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				 &arg);
+	if (ret < 0 && errno != EINTR && errno != ETIME &&
+	    errno != EAGAIN && errno != EBUSY)
+		i_fatal("io_uring_enter(): %m");
+
+	/* execute timeout handlers */
+        io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	io_uring_reap_cqes(ctx);
+	/* the callbacks may reap more completions, so don't keep pointers
+	   to the array */
+	for (i = 0; i < array_count(&ctx->pending_cqes); i++) {
+		cqe = *array_idx(&ctx->pending_cqes, i);
+		req = POINTER_CAST(cqe.user_data);
+		if (req == NULL) {
+			/* already handled while cancelling the read */
+		} else if (req->type == IO_URING_REQUEST_POLL)
+			io_uring_handle_poll(ctx, req, cqe.res);
+		else
+			io_uring_handle_read(ctx, req, cqe.res);
+	}
+	array_clear(&ctx->pending_cqes);
+}
+
+#endif	/* IOLOOP_URING */
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "time-util.h"
 #include "istream-private.h"
+#include "llist.h"
 #include "ioloop-private.h"
 
 #include <unistd.h>
@@ -18,6 +19,19 @@ struct timeval ioloop_timeval;
 
 struct ioloop *current_ioloop = NULL;
 static ARRAY(io_switch_callback_t *) io_switch_callbacks = ARRAY_INIT;
+/* io_files and timeouts are allocated and freed all the time, so keep them
+   in a slab pool shared by all ioloops. It's freed when the last ioloop is
+   destroyed, since ios and timeouts can't exist without an ioloop. */
+static pool_t ioloop_slab_pool = NULL;
+/* Number of ioloops that haven't been destroyed yet. current_ioloop can be
+   NULL while some of them still exist. */
+static unsigned int ioloop_count = 0;
+
+static void io_loop_gettimeofday(struct timeval *tv_r)
+{
+	if (gettimeofday(tv_r, NULL) < 0)
+		i_fatal("gettimeofday(): %m");
+}
 
 static void io_loop_initialize_handler(struct ioloop *ioloop)
 {
@@ -39,7 +53,7 @@ io_add_file(int fd, enum io_condition condition,
 	i_assert(callback != NULL);
 	i_assert((condition & IO_NOTIFY) == 0);
 
-	io = i_new(struct io_file, 1);
+	io = p_new(ioloop_slab_pool, struct io_file, 1);
         io->io.condition = condition;
 	io->io.callback = callback;
         io->io.context = context;
@@ -96,6 +110,11 @@ struct io *io_add_istream(struct istream *input, unsigned int source_linenum,
 	return &io->io;
 }
 
+void io_file_free(struct io_file *io)
+{
+	p_free(ioloop_slab_pool, io);
+}
+
 static void io_file_unlink(struct io_file *io)
 {
 	if (io->prev != NULL)
@@ -147,7 +166,7 @@ static void io_remove_full(struct io **_io, bool closed)
 		if (io_file->fd != -1)
 			io_loop_handle_remove(io_file, closed);
 		else
-			i_free(io);
+			io_file_free(io_file);
 
 		/* remove io from the ioloop before unreferencing the istream,
 		   because a destroyed istream may automatically close the
@@ -182,8 +201,7 @@ void io_set_pending(struct io *io)
 static void timeout_update_next(struct timeout *timeout, struct timeval *tv_now)
 {
 	if (tv_now == NULL) {
-		if (gettimeofday(&timeout->next_run, NULL) < 0)
-			i_fatal("gettimeofday(): %m");
+		io_loop_gettimeofday(&timeout->next_run);
 	} else {
                 timeout->next_run.tv_sec = tv_now->tv_sec;
                 timeout->next_run.tv_usec = tv_now->tv_usec;
@@ -202,13 +220,175 @@ static void timeout_update_next(struct timeout *timeout, struct timeval *tv_now)
 	}
 }
 
+static bool timeout_is_queued(const struct timeout *timeout)
+{
+	return timeout->item.idx != UINT_MAX || timeout->in_wheel;
+}
+
+static bool io_loop_wheel_link(struct ioloop *ioloop, struct timeout *timeout)
+{
+	time_t sec = timeout->next_run.tv_sec;
+	unsigned int level, slot, shift;
+
+	if (sec < ioloop->wheel_cur_sec)
+		return FALSE;
+
+	/* Each level covers IOLOOP_WHEEL_LEVEL_SLOTS times the previous
+	   level's range. The slot is the one that gets processed (level 0)
+	   or cascaded to lower levels (others) when the timeout's second is
+	   reached. */
+	for (level = 0;; level++) {
+		if (level == IOLOOP_WHEEL_LEVELS)
+			return FALSE;
+		shift = level * IOLOOP_WHEEL_LEVEL_BITS;
+		if (((sec - ioloop->wheel_cur_sec) >>
+		     (shift + IOLOOP_WHEEL_LEVEL_BITS)) == 0)
+			break;
+	}
+	slot = (sec >> shift) & (IOLOOP_WHEEL_LEVEL_SLOTS-1);
+
+	timeout->wheel_level = level;
+	timeout->wheel_slot = slot;
+	timeout->in_wheel = TRUE;
+	DLLIST_PREPEND_FULL(&ioloop->wheel[level][slot], timeout,
+			    wheel_prev, wheel_next);
+	ioloop->wheel_slots_used[level] |= 1ULL << slot;
+	ioloop->wheel_count++;
+	return TRUE;
+}
+
+static void
+io_loop_wheel_unlink(struct ioloop *ioloop, struct timeout *timeout)
+{
+	unsigned int level = timeout->wheel_level, slot = timeout->wheel_slot;
+
+	i_assert(timeout->in_wheel);
+	i_assert(ioloop->wheel_count > 0);
+
+	DLLIST_REMOVE_FULL(&ioloop->wheel[level][slot], timeout,
+			   wheel_prev, wheel_next);
+	if (ioloop->wheel[level][slot] == NULL)
+		ioloop->wheel_slots_used[level] &= ~(1ULL << slot);
+	timeout->in_wheel = FALSE;
+	ioloop->wheel_count--;
+}
+
+static void timeout_queue(struct ioloop *ioloop, struct timeout *timeout)
+{
+	if (!timeout->one_shot && timeout->msecs >= IOLOOP_WHEEL_MIN_MSECS) {
+		if (ioloop->wheel_count == 0) {
+			ioloop->wheel_cur_sec =
+				I_MIN(ioloop_time, timeout->next_run.tv_sec);
+		}
+		if (io_loop_wheel_link(ioloop, timeout))
+			return;
+	}
+	priorityq_add(ioloop->timeouts, &timeout->item);
+}
+
+static void timeout_dequeue(struct ioloop *ioloop, struct timeout *timeout)
+{
+	if (timeout->in_wheel)
+		io_loop_wheel_unlink(ioloop, timeout);
+	else
+		priorityq_remove(ioloop->timeouts, &timeout->item);
+}
+
+static void
+io_loop_wheel_slot_move(struct ioloop *ioloop, unsigned int level,
+			unsigned int slot, bool to_priorityq)
+{
+	struct timeout *timeout;
+
+	while ((timeout = ioloop->wheel[level][slot]) != NULL) {
+		io_loop_wheel_unlink(ioloop, timeout);
+		if (to_priorityq || !io_loop_wheel_link(ioloop, timeout))
+			priorityq_add(ioloop->timeouts, &timeout->item);
+	}
+}
+
+static void io_loop_wheel_flush(struct ioloop *ioloop)
+{
+	unsigned int level, slot;
+
+	for (level = 0; level < IOLOOP_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < IOLOOP_WHEEL_LEVEL_SLOTS; slot++)
+			io_loop_wheel_slot_move(ioloop, level, slot, TRUE);
+	}
+	i_assert(ioloop->wheel_count == 0);
+}
+
+static void io_loop_wheel_advance(struct ioloop *ioloop, time_t now)
+{
+	unsigned int level, shift, slot;
+	time_t cur;
+
+	if (ioloop->wheel_count == 0)
+		return;
+	if (now - ioloop->wheel_cur_sec >= IOLOOP_WHEEL_LEVEL_SLOTS *
+	    IOLOOP_WHEEL_LEVEL_SLOTS) {
+		/* we haven't been called for a long time. it's faster to just
+		   let the priority queue sort it out. */
+		io_loop_wheel_flush(ioloop);
+		return;
+	}
+
+	while (ioloop->wheel_cur_sec <= now && ioloop->wheel_count > 0) {
+		cur = ioloop->wheel_cur_sec;
+		/* at the beginning of each higher level slot, cascade its
+		   timeouts to the lower levels */
+		for (level = 1; level < IOLOOP_WHEEL_LEVELS; level++) {
+			shift = level * IOLOOP_WHEEL_LEVEL_BITS;
+			if ((cur & ((1 << shift) - 1)) != 0)
+				break;
+			slot = (cur >> shift) & (IOLOOP_WHEEL_LEVEL_SLOTS-1);
+			io_loop_wheel_slot_move(ioloop, level, slot, FALSE);
+		}
+		io_loop_wheel_slot_move(ioloop, 0,
+			cur & (IOLOOP_WHEEL_LEVEL_SLOTS-1), TRUE);
+		ioloop->wheel_cur_sec++;
+	}
+}
+
+static time_t io_loop_wheel_get_next_sec(struct ioloop *ioloop)
+{
+	unsigned int level, idx;
+	uint64_t used;
+	time_t next_sec = (time_t)-1;
+
+	i_assert(ioloop->wheel_count > 0);
+
+	/* next used level 0 slot */
+	used = ioloop->wheel_slots_used[0];
+	if (used != 0) {
+		idx = ioloop->wheel_cur_sec & (IOLOOP_WHEEL_LEVEL_SLOTS-1);
+		if (idx != 0)
+			used = (used >> idx) | (used << (64 - idx));
+		next_sec = ioloop->wheel_cur_sec +
+			bits_required64(used & -used) - 1;
+	}
+	/* higher levels are cascaded at the beginning of a level 0 round */
+	for (level = 1; level < IOLOOP_WHEEL_LEVELS; level++) {
+		if (ioloop->wheel_slots_used[level] != 0) {
+			time_t round_sec = (ioloop->wheel_cur_sec +
+					    IOLOOP_WHEEL_LEVEL_SLOTS-1) &
+				~(time_t)(IOLOOP_WHEEL_LEVEL_SLOTS-1);
+			if (next_sec == (time_t)-1 || round_sec < next_sec)
+				next_sec = round_sec;
+			break;
+		}
+	}
+	i_assert(next_sec != (time_t)-1);
+	return next_sec;
+}
+
 static struct timeout *
 timeout_add_common(unsigned int source_linenum,
 			    timeout_callback_t *callback, void *context)
 {
 	struct timeout *timeout;
 
-	timeout = i_new(struct timeout, 1);
+	timeout = p_new(ioloop_slab_pool, struct timeout, 1);
 	timeout->item.idx = UINT_MAX;
 	timeout->source_linenum = source_linenum;
 	timeout->ioloop = current_ioloop;
@@ -240,7 +420,7 @@ struct timeout *timeout_add(unsigned int msecs, unsigned int source_linenum,
 		/* trigger zero timeouts as soon as possible */
 		timeout_update_next(timeout, timeout->ioloop->running ?
 			    NULL : &ioloop_timeval);
-		priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+		timeout_queue(timeout->ioloop, timeout);
 	}
 	return timeout;
 }
@@ -280,8 +460,8 @@ timeout_copy(const struct timeout *old_to)
 	new_to->msecs = old_to->msecs;
 	new_to->next_run = old_to->next_run;
 
-	if (old_to->item.idx != UINT_MAX)
-		priorityq_add(new_to->ioloop->timeouts, &new_to->item);
+	if (timeout_is_queued(old_to))
+		timeout_queue(new_to->ioloop, new_to);
 	else if (!new_to->one_shot) {
 		i_assert(new_to->msecs > 0);
 		array_append(&new_to->ioloop->timeouts_new, &new_to, 1);
@@ -294,7 +474,7 @@ static void timeout_free(struct timeout *timeout)
 {
 	if (timeout->ctx != NULL)
 		io_loop_context_unref(&timeout->ctx);
-	i_free(timeout);
+	p_free(ioloop_slab_pool, timeout);
 }
 
 void timeout_remove(struct timeout **_timeout)
@@ -303,8 +483,8 @@ void timeout_remove(struct timeout **_timeout)
 	struct ioloop *ioloop = timeout->ioloop;
 
 	*_timeout = NULL;
-	if (timeout->item.idx != UINT_MAX)
-		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	if (timeout_is_queued(timeout))
+		timeout_dequeue(ioloop, timeout);
 	else if (!timeout->one_shot && timeout->msecs > 0) {
 		struct timeout *const *to_idx;
 		array_foreach(&ioloop->timeouts_new, to_idx) {
@@ -321,7 +501,7 @@ void timeout_remove(struct timeout **_timeout)
 static void ATTR_NULL(2)
 timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 {
-	if (timeout->item.idx == UINT_MAX)
+	if (!timeout_is_queued(timeout))
 		return;
 
 	timeout_update_next(timeout, tv_now);
@@ -340,8 +520,8 @@ timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 		 timeout->next_run.tv_sec > tv_now->tv_sec ||
 		 (timeout->next_run.tv_sec == tv_now->tv_sec &&
 		  timeout->next_run.tv_usec > tv_now->tv_usec));
-	priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	timeout_dequeue(timeout->ioloop, timeout);
+	timeout_queue(timeout->ioloop, timeout);
 }
 
 void timeout_reset(struct timeout *timeout)
@@ -350,23 +530,22 @@ void timeout_reset(struct timeout *timeout)
 	timeout_reset_timeval(timeout, NULL);
 }
 
-static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
-				 struct timeval *tv_now)
+static int timeval_get_wait_time(const struct timeval *next_run,
+				 struct timeval *tv_r, struct timeval *tv_now)
 {
 	int ret;
 
 	if (tv_now->tv_sec == 0) {
-		if (gettimeofday(tv_now, NULL) < 0)
-			i_fatal("gettimeofday(): %m");
+		io_loop_gettimeofday(tv_now);
 	} 
 	tv_r->tv_sec = tv_now->tv_sec;
 	tv_r->tv_usec = tv_now->tv_usec;
 
 	i_assert(tv_r->tv_sec > 0);
-	i_assert(timeout->next_run.tv_sec > 0);
+	i_assert(next_run->tv_sec > 0);
 
-	tv_r->tv_sec = timeout->next_run.tv_sec - tv_r->tv_sec;
-	tv_r->tv_usec = timeout->next_run.tv_usec - tv_r->tv_usec;
+	tv_r->tv_sec = next_run->tv_sec - tv_r->tv_sec;
+	tv_r->tv_usec = next_run->tv_usec - tv_r->tv_usec;
 	if (tv_r->tv_usec < 0) {
 		tv_r->tv_sec--;
 		tv_r->tv_usec += 1000000;
@@ -386,16 +565,22 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 	return ret;
 }
 
+static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
+				 struct timeval *tv_now)
+{
+	return timeval_get_wait_time(&timeout->next_run, tv_r, tv_now);
+}
+
 int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 {
-	struct timeval tv_now;
+	struct timeval tv_now, tv_wheel, wheel_next_run;
 	struct priorityq_item *item;
 	struct timeout *timeout;
-	int msecs;
+	int msecs, wheel_msecs;
 
 	item = priorityq_peek(ioloop->timeouts);
 	timeout = (struct timeout *)item;
-	if (timeout == NULL) {
+	if (timeout == NULL && ioloop->wheel_count == 0) {
 		/* no timeouts. use INT_MAX msecs for timeval and
 		   return -1 for poll/epoll infinity. */
 		tv_r->tv_sec = INT_MAX / 1000;
@@ -405,7 +590,21 @@ int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 	}
 
 	tv_now.tv_sec = 0;
-	msecs = timeout_get_wait_time(timeout, tv_r, &tv_now);
+	if (timeout != NULL)
+		msecs = timeout_get_wait_time(timeout, tv_r, &tv_now);
+	else
+		msecs = -1;
+	if (ioloop->wheel_count > 0) {
+		/* wake up when the next wheel slot needs to be processed */
+		wheel_next_run.tv_sec = io_loop_wheel_get_next_sec(ioloop);
+		wheel_next_run.tv_usec = 0;
+		wheel_msecs = timeval_get_wait_time(&wheel_next_run,
+						    &tv_wheel, &tv_now);
+		if (msecs < 0 || wheel_msecs < msecs) {
+			msecs = wheel_msecs;
+			*tv_r = tv_wheel;
+		}
+	}
 	ioloop->next_max_time = (tv_now.tv_sec + msecs/1000) + 1;
 
 	/* update ioloop_timeval - this is meant for io_loop_handle_timeouts()'s
@@ -447,7 +646,7 @@ static void io_loop_timeouts_start_new(struct ioloop *ioloop)
 		i_assert(!timeout->one_shot);
 		i_assert(timeout->msecs > 0);
 		timeout_update_next(timeout, &ioloop_timeval);
-		priorityq_add(ioloop->timeouts, &timeout->item);
+		timeout_queue(ioloop, timeout);
 	}
 	array_clear(&ioloop->timeouts_new);
 }
@@ -457,6 +656,10 @@ static void io_loop_timeouts_update(struct ioloop *ioloop, long diff_secs)
 	struct priorityq_item *const *items;
 	unsigned int i, count;
 
+	/* the wheel slots would all be wrong now. timeouts get back to the
+	   wheel when they're reset. */
+	io_loop_wheel_flush(ioloop);
+
 	count = priorityq_count(ioloop->timeouts);
 	items = priorityq_items(ioloop->timeouts);
 	for (i = 0; i < count; i++) {
@@ -480,8 +683,7 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 	struct timeval tv, tv_call, prev_ioloop_timeval = ioloop_timeval;
 	unsigned int t_id;
 
-	if (gettimeofday(&ioloop_timeval, NULL) < 0)
-		i_fatal("gettimeofday(): %m");
+	io_loop_gettimeofday(&ioloop_timeval);
 
 	/* Don't bother comparing usecs. */
 	if (unlikely(ioloop_time > ioloop_timeval.tv_sec)) {
@@ -491,8 +693,7 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 		ioloop->time_moved_callback(ioloop_time,
 					    ioloop_timeval.tv_sec);
 		/* the callback may have slept, so check the time again. */
-		if (gettimeofday(&ioloop_timeval, NULL) < 0)
-			i_fatal("gettimeofday(): %m");
+		io_loop_gettimeofday(&ioloop_timeval);
 	} else {
 		if (unlikely(ioloop_timeval.tv_sec >
 			     ioloop->next_max_time)) {
@@ -509,6 +710,7 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 	ioloop_time = ioloop_timeval.tv_sec;
 	tv_call = ioloop_timeval;
 
+	io_loop_wheel_advance(ioloop, ioloop_time);
 	while ((item = priorityq_peek(ioloop->timeouts)) != NULL) {
 		struct timeout *timeout = (struct timeout *)item;
 
@@ -635,8 +837,7 @@ bool io_loop_is_running(struct ioloop *ioloop)
 
 void io_loop_time_refresh(void)
 {
-	if (gettimeofday(&ioloop_timeval, NULL) < 0)
-		i_fatal("gettimeofday(): %m");
+	io_loop_gettimeofday(&ioloop_timeval);
 	ioloop_time = ioloop_timeval.tv_sec;
 }
 
@@ -645,10 +846,12 @@ struct ioloop *io_loop_create(void)
 	struct ioloop *ioloop;
 
 	/* initialize time */
-	if (gettimeofday(&ioloop_timeval, NULL) < 0)
-		i_fatal("gettimeofday(): %m");
+	io_loop_gettimeofday(&ioloop_timeval);
 	ioloop_time = ioloop_timeval.tv_sec;
 
+	if (ioloop_count++ == 0)
+		ioloop_slab_pool = pool_slab_create("ioloop", FALSE);
+
         ioloop = i_new(struct ioloop, 1);
 	ioloop->timeouts = priorityq_init(timeout_cmp, 32);
 	i_array_init(&ioloop->timeouts_new, 8);
@@ -697,6 +900,7 @@ void io_loop_destroy(struct ioloop **_ioloop)
 	}
 	array_free(&ioloop->timeouts_new);
 
+	io_loop_wheel_flush(ioloop);
 	while ((item = priorityq_pop(ioloop->timeouts)) != NULL) {
 		struct timeout *to = (struct timeout *)item;
 
@@ -713,6 +917,9 @@ void io_loop_destroy(struct ioloop **_ioloop)
 		io_loop_context_deactivate(ioloop->cur_ctx);
 
 	i_free(ioloop);
+	i_assert(ioloop_count > 0);
+	if (--ioloop_count == 0)
+		pool_unref(&ioloop_slab_pool);
 }
 
 void io_loop_set_time_moved_callback(struct ioloop *ioloop,
@@ -8,9 +8,25 @@ struct file_istream {
 
 	uoff_t skip_left;
 
+	enum istream_access_pattern access_pattern;
+	/* With I_STREAM_ACCESS_SEQUENTIAL: the current read size, which grows
+	   while the stream is being read sequentially, and the offset up to
+	   which the kernel has been asked to prefetch the file. */
+	size_t seq_read_size;
+	uoff_t prefetch_offset;
+
+	/* Data read from the fd by the ioloop on the stream's behalf. It's
+	   returned by the next read() before the fd is read again. */
+	unsigned char *async_buf;
+	size_t async_buf_size, async_pos, async_size;
+	int async_errno;
+
 	unsigned int file:1;
 	unsigned int autoclose_fd:1;
 	unsigned int seen_eof:1;
+	/* the ioloop is reading the fd into async_buf */
+	unsigned int async_reading:1;
+	unsigned int async_eof:1;
 };
 
 struct istream *
@@ -20,4 +36,21 @@ i_stream_create_file_common(struct file_istream *fstream,
 ssize_t i_stream_file_read(struct istream_private *stream);
 void i_stream_file_close(struct iostream_private *stream, bool close_parent);
 
+/* Start reading the stream's fd outside the stream, so that the ioloop can
+   read it asynchronously. The stream may be any stream whose root is a
+   nonblocking file istream. Returns 1 and the buffer to read into if the
+   read can be started, 0 if the stream already has such data waiting to be
+   read, -1 if the stream can't be read this way. While the read is in
+   progress, read() returns 0 without touching the fd. */
+int i_stream_file_async_read_begin(struct istream *input,
+				   void **buf_r, size_t *size_r);
+/* Finish the read started by i_stream_file_async_read_begin(). ret and
+   error are the read() result and errno. A cancelled read finishes with
+   ECANCELED. */
+void i_stream_file_async_read_end(struct istream *input, ssize_t ret,
+				  int error);
+/* Returns TRUE if the ioloop is reading the stream or the stream has data
+   read by the ioloop still waiting. The fd can't be read directly then. */
+bool i_stream_file_async_read_pending(struct file_istream *fstream);
+
 #endif
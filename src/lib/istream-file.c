@@ -12,6 +12,12 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+/* How much to ask the kernel to prefetch at a time with
+   I_STREAM_ACCESS_SEQUENTIAL */
+#define ISTREAM_FILE_PREFETCH_SIZE (1024*1024)
+/* Maximum size of a single read done by the ioloop on the stream's behalf */
+#define ISTREAM_FILE_ASYNC_READ_MAX_SIZE IO_BLOCK_SIZE
+
 void i_stream_file_close(struct iostream_private *stream,
 			 bool close_parent ATTR_UNUSED)
 {
@@ -27,8 +33,199 @@ void i_stream_file_close(struct iostream_private *stream,
 	_stream->fd = -1;
 }
 
+static void i_stream_file_destroy(struct iostream_private *stream)
+{
+	struct file_istream *fstream = (struct file_istream *)stream;
+
+	/* the ioloop references the stream while reading it */
+	i_assert(!fstream->async_reading);
+
+	i_free(fstream->async_buf);
+	i_free(fstream->istream.w_buffer);
+}
+
+static struct file_istream *i_stream_file_async_get(struct istream *input)
+{
+	while (input->real_stream->parent != NULL)
+		input = input->real_stream->parent;
+	if (input->real_stream->read != i_stream_file_read)
+		return NULL;
+	return (struct file_istream *)input->real_stream;
+}
+
+bool i_stream_file_async_read_pending(struct file_istream *fstream)
+{
+	return fstream->async_reading ||
+		fstream->async_pos < fstream->async_size ||
+		fstream->async_eof || fstream->async_errno != 0;
+}
+
+int i_stream_file_async_read_begin(struct istream *input,
+				   void **buf_r, size_t *size_r)
+{
+	struct file_istream *fstream = i_stream_file_async_get(input);
+	struct istream_private *stream;
+	size_t used, limit;
+
+	if (fstream == NULL || fstream->async_reading)
+		return -1;
+	if (i_stream_file_async_read_pending(fstream))
+		return 0;
+
+	stream = &fstream->istream;
+	if (fstream->file || stream->istream.blocking ||
+	    stream->istream.closed || stream->fd == -1 ||
+	    fstream->seen_eof || fstream->skip_left > 0)
+		return -1;
+
+	/* read only as much as read() could, so the data always fits into
+	   the stream's buffer once it's returned */
+	used = stream->pos - stream->skip;
+	limit = I_MAX(stream->buffer_size, stream->max_buffer_size);
+	if (used >= limit)
+		return -1;
+	*size_r = I_MIN(limit - used, ISTREAM_FILE_ASYNC_READ_MAX_SIZE);
+	if (stream->try_alloc_limit > 0 && *size_r > stream->try_alloc_limit)
+		*size_r = stream->try_alloc_limit;
+
+	if (fstream->async_buf == NULL) {
+		fstream->async_buf_size = ISTREAM_FILE_ASYNC_READ_MAX_SIZE;
+		fstream->async_buf = i_malloc(fstream->async_buf_size);
+	}
+	fstream->async_reading = TRUE;
+	fstream->async_pos = fstream->async_size = 0;
+	*buf_r = fstream->async_buf;
+	return 1;
+}
+
+void i_stream_file_async_read_end(struct istream *input, ssize_t ret,
+				  int error)
+{
+	struct file_istream *fstream = i_stream_file_async_get(input);
+
+	i_assert(fstream != NULL && fstream->async_reading);
+	i_assert(ret <= (ssize_t)fstream->async_buf_size);
+
+	fstream->async_reading = FALSE;
+	if (fstream->istream.istream.closed) {
+		/* nobody is going to read the data anymore */
+	} else if (ret > 0) {
+		fstream->async_size = ret;
+	} else if (ret == 0) {
+		fstream->async_eof = TRUE;
+	} else if (error != ECANCELED && error != EAGAIN && error != EINTR) {
+		i_assert(error != 0);
+		fstream->async_errno = error;
+	}
+}
+
+static ssize_t
+i_stream_file_async_read(struct file_istream *fstream, void *buf, size_t size)
+{
+	if (fstream->async_reading) {
+		/* the ioloop is still reading the fd */
+		errno = EAGAIN;
+		return -1;
+	}
+	if (fstream->async_pos < fstream->async_size) {
+		size = I_MIN(size, fstream->async_size - fstream->async_pos);
+		memcpy(buf, fstream->async_buf + fstream->async_pos, size);
+		fstream->async_pos += size;
+		return size;
+	}
+	if (fstream->async_errno != 0) {
+		errno = fstream->async_errno;
+		fstream->async_errno = 0;
+		return -1;
+	}
+	i_assert(fstream->async_eof);
+	fstream->async_eof = FALSE;
+	return 0;
+}
+
+static void i_stream_file_fadvise(struct file_istream *fstream)
+{
+#ifdef HAVE_POSIX_FADVISE
+	struct istream_private *stream = &fstream->istream;
+	int advice;
+
+	switch (fstream->access_pattern) {
+	case I_STREAM_ACCESS_NORMAL:
+		advice = POSIX_FADV_NORMAL;
+		break;
+	case I_STREAM_ACCESS_SEQUENTIAL:
+		advice = POSIX_FADV_SEQUENTIAL;
+		break;
+	case I_STREAM_ACCESS_RANDOM:
+		advice = POSIX_FADV_RANDOM;
+		break;
+	default:
+		i_unreached();
+	}
+	/* this is only a hint, so don't bother logging errors */
+	(void)posix_fadvise(stream->fd, 0, 0, advice);
+#endif
+}
+
+static void i_stream_file_prefetch(struct file_istream *fstream, uoff_t offset)
+{
+#ifdef HAVE_POSIX_FADVISE
+	struct istream_private *stream = &fstream->istream;
+
+	/* keep the kernel reading ahead asynchronously, so the reads don't
+	   have to wait for it. start the next prefetch when half of the
+	   previous prefetch has been read. */
+	if (offset + ISTREAM_FILE_PREFETCH_SIZE/2 < fstream->prefetch_offset)
+		return;
+	if (offset < fstream->prefetch_offset)
+		offset = fstream->prefetch_offset;
+	(void)posix_fadvise(stream->fd, offset, ISTREAM_FILE_PREFETCH_SIZE,
+			    POSIX_FADV_WILLNEED);
+	fstream->prefetch_offset = offset + ISTREAM_FILE_PREFETCH_SIZE;
+#endif
+}
+
+static void i_stream_file_grow_seq_read_size(struct istream_private *stream)
+{
+	struct file_istream *fstream = (struct file_istream *)stream;
+
+	if (stream->skip != stream->pos) {
+		/* the caller is still using the buffered data */
+		return;
+	}
+	/* everything read so far was used - read more at once next time */
+	if (fstream->seq_read_size < I_STREAM_SEQUENTIAL_MAX_READ_SIZE) {
+		fstream->seq_read_size = I_MIN(fstream->seq_read_size * 2,
+					       I_STREAM_SEQUENTIAL_MAX_READ_SIZE);
+	}
+	stream->skip = stream->pos = 0;
+	if (stream->buffer_size < fstream->seq_read_size) {
+		/* no need to preserve the old data */
+		i_free(stream->w_buffer);
+		stream->w_buffer = i_malloc(fstream->seq_read_size);
+		stream->buffer = stream->w_buffer;
+		stream->buffer_size = fstream->seq_read_size;
+	}
+}
+
+static void
+i_stream_file_set_access_pattern(struct istream_private *stream,
+				 enum istream_access_pattern pattern)
+{
+	struct file_istream *fstream = (struct file_istream *)stream;
+
+	if (fstream->access_pattern == pattern)
+		return;
+	fstream->access_pattern = pattern;
+	fstream->seq_read_size = stream->init_buffer_size;
+	fstream->prefetch_offset = 0;
+	if (stream->fd != -1 && fstream->file)
+		i_stream_file_fadvise(fstream);
+}
+
 static int i_stream_file_open(struct istream_private *stream)
 {
+	struct file_istream *fstream = (struct file_istream *) stream;
 	const char *path = i_stream_get_name(&stream->istream);
 
 	stream->fd = open(path, O_RDONLY);
@@ -38,6 +235,8 @@ static int i_stream_file_open(struct istream_private *stream)
 		stream->istream.stream_errno = errno;
 		return -1;
 	}
+	if (fstream->access_pattern != I_STREAM_ACCESS_NORMAL)
+		i_stream_file_fadvise(fstream);
 	return 0;
 }
 
@@ -48,6 +247,9 @@ ssize_t i_stream_file_read(struct istream_private *stream)
 	size_t size;
 	ssize_t ret;
 
+	if (fstream->access_pattern == I_STREAM_ACCESS_SEQUENTIAL &&
+	    stream->w_buffer != NULL)
+		i_stream_file_grow_seq_read_size(stream);
 	if (!i_stream_try_alloc(stream, 1, &size))
 		return -2;
 
@@ -57,6 +259,21 @@ ssize_t i_stream_file_read(struct istream_private *stream)
 	}
 
 	offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (fstream->access_pattern == I_STREAM_ACCESS_SEQUENTIAL) {
+		/* the buffer may be larger than max_buffer_size, but keep
+		   the buffered data within it unless the read size has
+		   grown larger */
+		size_t used = stream->pos - stream->skip;
+		size_t limit = I_MAX(stream->max_buffer_size,
+				     fstream->seq_read_size);
+
+		if (used >= limit)
+			return -2;
+		if (size > limit - used)
+			size = limit - used;
+		if (fstream->file)
+			i_stream_file_prefetch(fstream, offset);
+	}
 	do {
 		if (fstream->file) {
 			ret = pread(stream->fd, stream->w_buffer + stream->pos,
@@ -65,6 +282,9 @@ ssize_t i_stream_file_read(struct istream_private *stream)
 			/* don't try to read() again. EOF from keyboard (^D)
 			   requires this to work right. */
 			ret = 0;
+		} else if (i_stream_file_async_read_pending(fstream)) {
+			ret = i_stream_file_async_read(fstream,
+				stream->w_buffer + stream->pos, size);
 		} else {
 			ret = read(stream->fd, stream->w_buffer + stream->pos,
 				   size);
@@ -134,6 +354,13 @@ static void i_stream_file_seek(struct istream_private *stream, uoff_t v_offset,
 			i_panic("stream doesn't support seeking backwards");
 		fstream->skip_left += v_offset - stream->istream.v_offset;
 	}
+	if (fstream->access_pattern == I_STREAM_ACCESS_SEQUENTIAL &&
+	    v_offset != stream->istream.v_offset +
+	    (stream->pos - stream->skip)) {
+		/* not sequential anymore - start again with small reads */
+		fstream->seq_read_size = stream->init_buffer_size;
+		fstream->prefetch_offset = 0;
+	}
 
 	stream->istream.v_offset = v_offset;
 	stream->skip = stream->pos = 0;
@@ -191,11 +418,13 @@ i_stream_create_file_common(struct file_istream *fstream,
 	fstream->autoclose_fd = autoclose_fd;
 
 	fstream->istream.iostream.close = i_stream_file_close;
+	fstream->istream.iostream.destroy = i_stream_file_destroy;
 	fstream->istream.max_buffer_size = max_buffer_size;
 	fstream->istream.read = i_stream_file_read;
 	fstream->istream.seek = i_stream_file_seek;
 	fstream->istream.sync = i_stream_file_sync;
 	fstream->istream.stat = i_stream_file_stat;
+	fstream->istream.set_access_pattern = i_stream_file_set_access_pattern;
 
 	/* if it's a file, set the flags properly */
 	if (fd == -1)
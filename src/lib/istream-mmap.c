@@ -16,6 +16,7 @@ struct mmap_istream {
 	void *mmap_base;
 	off_t mmap_offset;
 	uoff_t v_size;
+	enum istream_access_pattern access_pattern;
 
 	unsigned int autoclose_fd:1;
 };
@@ -65,6 +66,53 @@ static size_t mstream_get_mmap_block_size(struct istream_private *stream)
 		(mmap_get_page_size() - 1);
 }
 
+static void i_stream_mmap_madvise(struct mmap_istream *mstream)
+{
+	struct istream_private *stream = &mstream->istream;
+
+	if (stream->buffer_size <= mmap_get_page_size())
+		return;
+
+	switch (mstream->access_pattern) {
+	case I_STREAM_ACCESS_NORMAL:
+		/* the whole mapping is usually read through */
+		if (madvise(mstream->mmap_base, stream->buffer_size,
+			    MADV_SEQUENTIAL) < 0) {
+			i_error("mmap_istream.madvise(%s): %m",
+				i_stream_get_name(&stream->istream));
+		}
+		break;
+	case I_STREAM_ACCESS_SEQUENTIAL:
+		/* start reading the whole mapping in the background */
+		if (madvise(mstream->mmap_base, stream->buffer_size,
+			    MADV_SEQUENTIAL) < 0 ||
+		    madvise(mstream->mmap_base, stream->buffer_size,
+			    MADV_WILLNEED) < 0) {
+			i_error("mmap_istream.madvise(%s): %m",
+				i_stream_get_name(&stream->istream));
+		}
+		break;
+	case I_STREAM_ACCESS_RANDOM:
+		if (madvise(mstream->mmap_base, stream->buffer_size,
+			    MADV_RANDOM) < 0) {
+			i_error("mmap_istream.madvise(%s): %m",
+				i_stream_get_name(&stream->istream));
+		}
+		break;
+	}
+}
+
+static void
+i_stream_mmap_set_access_pattern(struct istream_private *stream,
+				 enum istream_access_pattern pattern)
+{
+	struct mmap_istream *mstream = (struct mmap_istream *) stream;
+
+	mstream->access_pattern = pattern;
+	if (mstream->mmap_base != NULL)
+		i_stream_mmap_madvise(mstream);
+}
+
 static ssize_t i_stream_mmap_read(struct istream_private *stream)
 {
 	struct mmap_istream *mstream = (struct mmap_istream *) stream;
@@ -128,13 +176,8 @@ static ssize_t i_stream_mmap_read(struct istream_private *stream)
 		stream->buffer = mstream->mmap_base;
 	}
 
-	if (stream->buffer_size > mmap_get_page_size()) {
-		if (madvise(mstream->mmap_base, stream->buffer_size,
-			    MADV_SEQUENTIAL) < 0) {
-			i_error("mmap_istream.madvise(%s): %m",
-				i_stream_get_name(&stream->istream));
-		}
-	}
+	if (mstream->mmap_base != NULL)
+		i_stream_mmap_madvise(mstream);
 
 	stream->pos = stream->buffer_size;
 	i_assert(stream->pos - stream->skip > 0);
@@ -228,6 +271,7 @@ struct istream *i_stream_create_mmap(int fd, size_t block_size,
 	mstream->istream.seek = i_stream_mmap_seek;
 	mstream->istream.sync = i_stream_mmap_sync;
 	mstream->istream.stat = i_stream_mmap_stat;
+	mstream->istream.set_access_pattern = i_stream_mmap_set_access_pattern;
 
 	mstream->istream.istream.readable_fd = TRUE;
 	mstream->istream.start_offset = start_offset;
@@ -20,6 +20,8 @@ struct istream_private {
 	int (*stat)(struct istream_private *stream, bool exact);
 	int (*get_size)(struct istream_private *stream, bool exact, uoff_t *size_r);
 	void (*switch_ioloop)(struct istream_private *stream);
+	void (*set_access_pattern)(struct istream_private *stream,
+				   enum istream_access_pattern pattern);
 
 /* data: */
 	struct istream istream;
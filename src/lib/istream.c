@@ -126,6 +126,14 @@ size_t i_stream_get_max_buffer_size(struct istream *stream)
 	return stream->real_stream->max_buffer_size;
 }
 
+void i_stream_set_access_pattern(struct istream *stream,
+				 enum istream_access_pattern pattern)
+{
+	struct istream_private *_stream = stream->real_stream;
+
+	_stream->set_access_pattern(_stream, pattern);
+}
+
 void i_stream_set_return_partial_line(struct istream *stream, bool set)
 {
 	stream->real_stream->return_nolf_line = set;
@@ -731,6 +739,14 @@ i_stream_default_set_max_buffer_size(struct iostream_private *stream,
 		i_stream_set_max_buffer_size(_stream->parent, max_size);
 }
 
+static void
+i_stream_default_set_access_pattern(struct istream_private *stream,
+				    enum istream_access_pattern pattern)
+{
+	if (stream->parent != NULL)
+		i_stream_set_access_pattern(stream->parent, pattern);
+}
+
 static void i_stream_default_close(struct iostream_private *stream,
 				   bool close_parent)
 {
@@ -864,6 +880,8 @@ i_stream_create(struct istream_private *_stream, struct istream *parent, int fd)
 		_stream->iostream.set_max_buffer_size =
 			i_stream_default_set_max_buffer_size;
 	}
+	if (_stream->set_access_pattern == NULL)
+		_stream->set_access_pattern = i_stream_default_set_access_pattern;
 	if (_stream->init_buffer_size == 0)
 		_stream->init_buffer_size = I_STREAM_MIN_SIZE;
 
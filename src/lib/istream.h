@@ -4,6 +4,18 @@
 /* Note that some systems (Solaris) may use a macro to redefine struct stat */
 #include <sys/stat.h>
 
+/* Maximum read size that I_STREAM_ACCESS_SEQUENTIAL grows to */
+#define I_STREAM_SEQUENTIAL_MAX_READ_SIZE (128*1024)
+
+enum istream_access_pattern {
+	/* No specific access pattern (default) */
+	I_STREAM_ACCESS_NORMAL = 0,
+	/* The stream is read sequentially, usually until the end */
+	I_STREAM_ACCESS_SEQUENTIAL,
+	/* The stream is read in a random order, don't read ahead */
+	I_STREAM_ACCESS_RANDOM
+};
+
 struct istream {
 	uoff_t v_offset;
 
@@ -106,6 +118,15 @@ void i_stream_set_return_partial_line(struct istream *stream, bool set);
    become empty. */
 void i_stream_set_persistent_buffers(struct istream *stream, bool set);
 
+/* Tell how the stream is going to be accessed. File and mmap istreams pass
+   this to the kernel with posix_fadvise() or madvise(), filter streams pass it
+   to their parents. With I_STREAM_ACCESS_SEQUENTIAL file istreams also
+   prefetch the data ahead of the reads and grow their read size while the
+   stream keeps being read sequentially. The read buffer may then grow up to
+   I_STREAM_SEQUENTIAL_MAX_READ_SIZE even if the max buffer size is smaller. */
+void i_stream_set_access_pattern(struct istream *stream,
+				 enum istream_access_pattern pattern);
+
 /* Returns number of bytes read if read was ok, -1 if EOF or error, -2 if the
    input buffer is full. */
 ssize_t i_stream_read(struct istream *stream);
@@ -0,0 +1,387 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "safe-memset.h"
+#include "llist.h"
+#include "mempool.h"
+
+/* Chunk sizes are multiples of this */
+#define SLAB_CLASS_ALIGN 16
+#define SLAB_MAX_CHUNK_SIZE 4096
+/* Chunks are carved from blocks of this size. Large enough to fit at least
+   a few of the largest chunks. */
+#define SLAB_BLOCK_SIZE (64*1024)
+#define SLAB_CLASS_LARGE N_ELEMENTS(slab_class_sizes)
+#define SLAB_CHUNK_FLAG_FREE 0x80000000U
+
+#ifdef DEBUG
+#  define CLEAR_CHR 0xde
+#endif
+
+static const size_t slab_class_sizes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256,
+	384, 512, 768, 1024, 1536, 2048, 3072, SLAB_MAX_CHUNK_SIZE
+};
+#define SLAB_CLASS_COUNT N_ELEMENTS(slab_class_sizes)
+
+struct slab_chunk {
+	/* index to slab_class_sizes or SLAB_CLASS_LARGE,
+	   with SLAB_CHUNK_FLAG_FREE set while it's in a free list */
+	unsigned int class_idx;
+	/* unsigned char data[]; */
+};
+#define SIZEOF_SLAB_CHUNK (MEM_ALIGN(sizeof(struct slab_chunk)))
+#define SLAB_CHUNK_DATA(chunk) \
+	((unsigned char *)(chunk) + SIZEOF_SLAB_CHUNK)
+#define SLAB_DATA_CHUNK(mem) \
+	((struct slab_chunk *)((unsigned char *)(mem) - SIZEOF_SLAB_CHUNK))
+
+/* Allocations larger than SLAB_MAX_CHUNK_SIZE are malloc()ed separately,
+   but they're still tracked so they can be freed with the pool. */
+struct slab_large {
+	struct slab_large *prev, *next;
+	size_t size;
+	/* struct slab_chunk chunk; */
+};
+#define SIZEOF_SLAB_LARGE (MEM_ALIGN(sizeof(struct slab_large)))
+#define SLAB_CHUNK_LARGE(chunk) \
+	((struct slab_large *)((unsigned char *)(chunk) - SIZEOF_SLAB_LARGE))
+
+struct slab_block {
+	struct slab_block *prev;
+	/* unsigned char data[]; */
+};
+#define SIZEOF_SLAB_BLOCK (MEM_ALIGN(sizeof(struct slab_block)))
+
+struct slab_free_chunk {
+	struct slab_free_chunk *next;
+};
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+	char *name;
+
+	struct slab_block *block;
+	unsigned char *block_pos;
+	size_t block_left;
+
+	struct slab_free_chunk *free_lists[SLAB_CLASS_COUNT];
+	struct slab_large *large_chunks;
+
+	/* SLAB_CLASS_COUNT+1 items if statistics are enabled */
+	struct pool_slab_class_stats *stats;
+};
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+/* (size-1) / SLAB_CLASS_ALIGN -> class index */
+static uint8_t slab_size_classes[SLAB_MAX_CHUNK_SIZE / SLAB_CLASS_ALIGN];
+static bool slab_size_classes_initialized = FALSE;
+
+static void slab_size_classes_init(void)
+{
+	unsigned int i, class_idx = 0;
+
+	for (i = 0; i < N_ELEMENTS(slab_size_classes); i++) {
+		if ((i + 1) * SLAB_CLASS_ALIGN > slab_class_sizes[class_idx])
+			class_idx++;
+		slab_size_classes[i] = class_idx;
+	}
+	slab_size_classes_initialized = TRUE;
+}
+
+static inline unsigned int slab_size_get_class(size_t size)
+{
+	if (size > SLAB_MAX_CHUNK_SIZE)
+		return SLAB_CLASS_LARGE;
+	return slab_size_classes[(size - 1) / SLAB_CLASS_ALIGN];
+}
+
+pool_t pool_slab_create(const char *name, bool stats)
+{
+	struct slab_pool *spool;
+	unsigned int i;
+
+	if (!slab_size_classes_initialized)
+		slab_size_classes_init();
+
+	spool = i_new(struct slab_pool, 1);
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+	spool->name = i_strdup(name);
+	if (stats) {
+		spool->stats = i_new(struct pool_slab_class_stats,
+				     SLAB_CLASS_COUNT + 1);
+		for (i = 0; i < SLAB_CLASS_COUNT; i++)
+			spool->stats[i].chunk_size = slab_class_sizes[i];
+		spool->stats[SLAB_CLASS_LARGE].chunk_size = (size_t)-1;
+	}
+	return &spool->pool;
+}
+
+static const char *pool_slab_get_name(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	return spool->name;
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	i_assert(spool->refcount > 0);
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *_pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)*_pool;
+
+	i_assert(spool->refcount > 0);
+
+	/* erase the pointer before freeing anything, as the pointer may
+	   exist inside the pool's memory area */
+	*_pool = NULL;
+
+	if (--spool->refcount > 0)
+		return;
+
+	pool_slab_clear(&spool->pool);
+	i_free(spool->stats);
+	i_free(spool->name);
+	i_free(spool);
+}
+
+static void *slab_chunk_alloc(struct slab_pool *spool, unsigned int class_idx)
+{
+	struct slab_block *block;
+	struct slab_chunk *chunk;
+	size_t chunk_size = SIZEOF_SLAB_CHUNK + slab_class_sizes[class_idx];
+
+	if (spool->block_left < chunk_size) {
+		/* the rest of the current block is wasted */
+		block = i_malloc(SLAB_BLOCK_SIZE);
+		block->prev = spool->block;
+		spool->block = block;
+		spool->block_pos = (unsigned char *)block + SIZEOF_SLAB_BLOCK;
+		spool->block_left = SLAB_BLOCK_SIZE - SIZEOF_SLAB_BLOCK;
+	}
+	chunk = (struct slab_chunk *)spool->block_pos;
+	spool->block_pos += chunk_size;
+	spool->block_left -= chunk_size;
+
+	chunk->class_idx = class_idx;
+	return SLAB_CHUNK_DATA(chunk);
+}
+
+static void *slab_large_alloc(struct slab_pool *spool, size_t size)
+{
+	struct slab_large *large;
+	struct slab_chunk *chunk;
+
+	if (unlikely(size > SSIZE_T_MAX - SIZEOF_SLAB_LARGE - SIZEOF_SLAB_CHUNK))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", size);
+
+	large = i_malloc(SIZEOF_SLAB_LARGE + SIZEOF_SLAB_CHUNK + size);
+	large->size = size;
+	DLLIST_PREPEND(&spool->large_chunks, large);
+
+	chunk = (struct slab_chunk *)((unsigned char *)large +
+				      SIZEOF_SLAB_LARGE);
+	chunk->class_idx = SLAB_CLASS_LARGE;
+	return SLAB_CHUNK_DATA(chunk);
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_free_chunk *free_chunk;
+	unsigned int class_idx;
+	void *mem;
+
+	if (unlikely(size == 0 || size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", size);
+
+	class_idx = slab_size_get_class(size);
+	if (class_idx == SLAB_CLASS_LARGE)
+		mem = slab_large_alloc(spool, size);
+	else if ((free_chunk = spool->free_lists[class_idx]) != NULL) {
+		spool->free_lists[class_idx] = free_chunk->next;
+		SLAB_DATA_CHUNK(free_chunk)->class_idx = class_idx;
+		memset(free_chunk, 0, size);
+		mem = free_chunk;
+		if (spool->stats != NULL)
+			spool->stats[class_idx].free_count--;
+	} else {
+		/* blocks are allocated zero-filled */
+		mem = slab_chunk_alloc(spool, class_idx);
+	}
+
+	if (spool->stats != NULL) {
+		struct pool_slab_class_stats *stats =
+			&spool->stats[class_idx];
+
+		stats->alloc_count++;
+		if (++stats->used_count > stats->peak_used_count)
+			stats->peak_used_count = stats->used_count;
+	}
+	return mem;
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_chunk *chunk;
+	struct slab_large *large;
+	struct slab_free_chunk *free_chunk;
+	unsigned int class_idx;
+
+	if (mem == NULL)
+		return;
+
+	chunk = SLAB_DATA_CHUNK(mem);
+	class_idx = chunk->class_idx;
+	if (unlikely((class_idx & SLAB_CHUNK_FLAG_FREE) != 0))
+		i_panic("pool_slab_free(%s): Chunk freed twice", spool->name);
+	i_assert(class_idx <= SLAB_CLASS_LARGE);
+
+	if (spool->stats != NULL) {
+		i_assert(spool->stats[class_idx].used_count > 0);
+		spool->stats[class_idx].used_count--;
+	}
+
+	if (class_idx == SLAB_CLASS_LARGE) {
+		large = SLAB_CHUNK_LARGE(chunk);
+		DLLIST_REMOVE(&spool->large_chunks, large);
+		i_free(large);
+		return;
+	}
+
+#ifdef DEBUG
+	safe_memset(mem, CLEAR_CHR, slab_class_sizes[class_idx]);
+#endif
+	chunk->class_idx |= SLAB_CHUNK_FLAG_FREE;
+	free_chunk = mem;
+	free_chunk->next = spool->free_lists[class_idx];
+	spool->free_lists[class_idx] = free_chunk;
+	if (spool->stats != NULL)
+		spool->stats[class_idx].free_count++;
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	struct slab_chunk *chunk;
+	size_t alloc_size;
+	void *new_mem;
+
+	if (unlikely(new_size == 0 || new_size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", new_size);
+
+	if (mem == NULL)
+		return pool_slab_malloc(pool, new_size);
+
+	chunk = SLAB_DATA_CHUNK(mem);
+	i_assert(chunk->class_idx <= SLAB_CLASS_LARGE);
+	alloc_size = chunk->class_idx == SLAB_CLASS_LARGE ?
+		SLAB_CHUNK_LARGE(chunk)->size :
+		slab_class_sizes[chunk->class_idx];
+	if (old_size > alloc_size)
+		old_size = alloc_size;
+
+	if (new_size <= alloc_size) {
+		/* fits into the existing chunk */
+		if (old_size < new_size) {
+			memset((unsigned char *)mem + old_size, 0,
+			       new_size - old_size);
+		}
+		return mem;
+	}
+
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, old_size);
+	pool_slab_free(pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_block *block;
+	struct slab_large *large;
+	unsigned int i;
+
+	while (spool->large_chunks != NULL) {
+		large = spool->large_chunks;
+		spool->large_chunks = large->next;
+		i_free(large);
+	}
+	while (spool->block != NULL) {
+		block = spool->block;
+		spool->block = block->prev;
+#ifdef DEBUG
+		safe_memset(block, CLEAR_CHR, SLAB_BLOCK_SIZE);
+#endif
+		i_free(block);
+	}
+	spool->block_pos = NULL;
+	spool->block_left = 0;
+	memset(spool->free_lists, 0, sizeof(spool->free_lists));
+
+	if (spool->stats != NULL) {
+		for (i = 0; i <= SLAB_CLASS_LARGE; i++) {
+			spool->stats[i].used_count = 0;
+			spool->stats[i].free_count = 0;
+		}
+	}
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+const struct pool_slab_class_stats *
+pool_slab_get_stats(pool_t pool, unsigned int *count_r)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	i_assert(pool->v == &static_slab_pool_vfuncs);
+	i_assert(spool->stats != NULL);
+
+	*count_r = SLAB_CLASS_COUNT + 1;
+	return spool->stats;
+}
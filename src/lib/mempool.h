@@ -63,6 +63,13 @@ pool_t pool_alloconly_create(const char *name, size_t size);
    that the stack frame is the same. This should make it quite safe to use. */
 pool_t pool_datastack_create(void);
 
+/* Create a new pool for many small allocations that are freed individually.
+   Allocations are rounded up to size classes and p_free()d memory is kept in
+   per-class free lists for reuse. The memory is returned to the system only
+   when the pool is cleared or freed. If stats is TRUE, per-class statistics
+   are kept and can be read with pool_slab_get_stats(). */
+pool_t pool_slab_create(const char *name, bool stats);
+
 /* Similar to nearest_power(), but try not to exceed buffer's easy
    allocation size. If you don't have any explicit minimum size, use
    old_size + 1. */
@@ -132,4 +139,24 @@ size_t pool_alloconly_get_total_used_size(pool_t pool);
 /* Returns how much system memory has been allocated for this pool. */
 size_t pool_alloconly_get_total_alloc_size(pool_t pool);
 
+/* These functions are only for pools created with pool_slab_create(): */
+
+struct pool_slab_class_stats {
+	/* Size of chunks in this size class. The last class contains the
+	   allocations that were too large for any size class and it has
+	   chunk_size=(size_t)-1. */
+	size_t chunk_size;
+	/* Number of currently allocated chunks and the highest it has been */
+	unsigned int used_count, peak_used_count;
+	/* Number of chunks in the free list */
+	unsigned int free_count;
+	/* Total number of allocations */
+	uint64_t alloc_count;
+};
+
+/* Returns per-class statistics. The pool must have been created with
+   stats=TRUE. */
+const struct pool_slab_class_stats *
+pool_slab_get_stats(pool_t pool, unsigned int *count_r);
+
 #endif
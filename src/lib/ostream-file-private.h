@@ -12,6 +12,8 @@ struct file_ostream {
 
 	int fd;
 	struct io *io;
+	/* pipe for moving data from an istream's fd with splice() */
+	int splice_pipe[2];
 	uoff_t buffer_offset;
 	uoff_t real_offset;
 
@@ -25,6 +27,8 @@ struct file_ostream {
 	unsigned int socket_cork_set:1;
 	unsigned int no_socket_cork:1;
 	unsigned int no_sendfile:1;
+	unsigned int no_splice:1;
+	unsigned int splice_pipe_created:1;
 	unsigned int autoclose_fd:1;
 };
 
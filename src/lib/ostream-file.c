@@ -2,16 +2,20 @@
 
 /* @UNSAFE: whole file */
 
+#define _GNU_SOURCE /* for splice() */
 #include "lib.h"
 #include "ioloop.h"
 #include "write-full.h"
 #include "net.h"
 #include "sendfile-util.h"
+#include "fd-set-nonblock.h"
+#include "fd-close-on-exec.h"
 #include "istream.h"
-#include "istream-private.h"
+#include "istream-file-private.h"
 #include "ostream-file-private.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #ifdef HAVE_SYS_UIO_H
 #  include <sys/uio.h>
@@ -28,6 +32,9 @@
 #define MAX_SSIZE_T(size) \
 	((size) < SSIZE_T_MAX ? (size_t)(size) : SSIZE_T_MAX)
 
+/* Maximum number of bytes to move through the splice() pipe at once. */
+#define SPLICE_MAX_CHUNK_SIZE (64*1024)
+
 static void stream_send_io(struct file_ostream *fstream);
 
 static void stream_closed(struct file_ostream *fstream)
@@ -61,6 +68,10 @@ static void o_stream_file_destroy(struct iostream_private *stream)
 {
 	struct file_ostream *fstream = (struct file_ostream *)stream;
 
+	if (fstream->splice_pipe_created) {
+		i_close_fd(&fstream->splice_pipe[0]);
+		i_close_fd(&fstream->splice_pipe[1]);
+	}
 	i_free(fstream->buffer);
 }
 
@@ -779,6 +790,176 @@ io_stream_sendfile(struct ostream_private *outstream,
 	return TRUE;
 }
 
+#ifdef HAVE_SPLICE
+static int o_stream_file_splice_pipe_init(struct file_ostream *fstream)
+{
+	if (fstream->splice_pipe_created)
+		return 0;
+
+	if (pipe(fstream->splice_pipe) < 0) {
+		i_error("pipe() failed: %m");
+		return -1;
+	}
+	fd_set_nonblock(fstream->splice_pipe[0], TRUE);
+	fd_set_nonblock(fstream->splice_pipe[1], TRUE);
+	fd_close_on_exec(fstream->splice_pipe[0], TRUE);
+	fd_close_on_exec(fstream->splice_pipe[1], TRUE);
+	fstream->splice_pipe_created = TRUE;
+	return 0;
+}
+
+static int
+o_stream_file_splice_pipe_to_buffer(struct file_ostream *fstream, size_t size)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	ssize_t ret;
+	size_t added;
+
+	/* The output didn't accept all the data that was already moved
+	   from the istream to the pipe. Move the rest to our buffer. The
+	   buffer is empty at this point, and the chunks are never larger
+	   than max_buffer_size, so all of it fits. */
+	while (size > 0) {
+		ret = read(fstream->splice_pipe[0], buf, I_MIN(sizeof(buf), size));
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			i_error("read(splice pipe) failed: %s",
+				ret == 0 ? "EOF" : strerror(errno));
+			return -1;
+		}
+		added = o_stream_add(fstream, buf, ret);
+		i_assert(added == (size_t)ret);
+		size -= ret;
+	}
+	return 0;
+}
+
+static bool
+io_stream_splice(struct ostream_private *outstream,
+		 struct istream *instream, int in_fd,
+		 enum ostream_send_istream_result *res_r)
+{
+	struct file_ostream *foutstream = (struct file_ostream *)outstream;
+	struct file_istream *finstream =
+		(struct file_istream *)instream->real_stream;
+	const unsigned char *data;
+	size_t size, chunk_size, pipe_size;
+	ssize_t ret;
+
+	if (finstream->skip_left > 0) {
+		/* istream still needs to skip over some data */
+		return FALSE;
+	}
+	if (i_stream_file_async_read_pending(finstream)) {
+		/* the ioloop is reading the fd, splicing it now would
+		   reorder the data */
+		return FALSE;
+	}
+
+	/* send the data that is already buffered in the istream */
+	data = i_stream_get_data(instream, &size);
+	if (size > 0) {
+		if ((ret = o_stream_send(&outstream->ostream, data, size)) < 0) {
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			return TRUE;
+		}
+		i_stream_skip(instream, ret);
+		if ((size_t)ret < size) {
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+			return TRUE;
+		}
+	}
+
+	/* flush out any data in buffer */
+	if ((ret = buffer_flush(foutstream)) < 0) {
+		*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+		return TRUE;
+	} else if (ret == 0) {
+		*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+		return TRUE;
+	}
+
+	if (o_stream_file_splice_pipe_init(foutstream) < 0) {
+		foutstream->no_splice = TRUE;
+		return FALSE;
+	}
+
+	chunk_size = I_MIN(SPLICE_MAX_CHUNK_SIZE, outstream->max_buffer_size);
+	for (;;) {
+		ret = splice(in_fd, NULL, foutstream->splice_pipe[1], NULL,
+			     chunk_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret == 0) {
+			instream->eof = TRUE;
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_FINISHED;
+			return TRUE;
+		}
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT;
+				return TRUE;
+			}
+			if (errno == EINVAL) {
+				/* not supported with this fd */
+				foutstream->no_splice = TRUE;
+				return FALSE;
+			}
+			io_stream_set_error(&instream->real_stream->iostream,
+					    "splice() failed: %m");
+			instream->stream_errno = errno;
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT;
+			return TRUE;
+		}
+		/* the istream's buffer is empty, so its offset can be
+		   simply moved forward */
+		instream->v_offset += ret;
+		outstream->ostream.offset += ret;
+
+		pipe_size = ret;
+		while (pipe_size > 0) {
+			ret = splice(foutstream->splice_pipe[0], NULL,
+				     foutstream->fd, NULL, pipe_size,
+				     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (ret <= 0) {
+				if (ret < 0 && errno == EINTR)
+					continue;
+				break;
+			}
+			pipe_size -= ret;
+			foutstream->real_offset += ret;
+			foutstream->buffer_offset += ret;
+		}
+		if (pipe_size == 0)
+			continue;
+
+		if (ret < 0 && errno != EAGAIN && errno != EINVAL) {
+			io_stream_set_error(&outstream->iostream,
+					    "splice() failed: %m");
+			outstream->ostream.stream_errno = errno;
+			stream_closed(foutstream);
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			return TRUE;
+		}
+		if (o_stream_file_splice_pipe_to_buffer(foutstream,
+							pipe_size) < 0) {
+			outstream->ostream.stream_errno = EIO;
+			stream_closed(foutstream);
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			return TRUE;
+		}
+		if (ret < 0 && errno == EINVAL) {
+			/* output fd doesn't support splice() */
+			foutstream->no_splice = TRUE;
+			return FALSE;
+		}
+		*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+		return TRUE;
+	}
+}
+#endif
+
 static enum ostream_send_istream_result
 io_stream_copy_backwards(struct ostream_private *outstream,
 			 struct istream *instream, uoff_t in_size)
@@ -918,6 +1099,17 @@ o_stream_file_send_istream(struct ostream_private *outstream,
 		   regular sending. */
 		foutstream->no_sendfile = TRUE;
 	}
+#ifdef HAVE_SPLICE
+	/* splice() data between pipes and sockets, but only directly from
+	   a file istream. Any layered istreams (e.g. SSL or compression)
+	   need to see the data. */
+	if (!foutstream->no_splice && !foutstream->file && in_fd != -1 &&
+	    in_fd != foutstream->fd && !instream->seekable &&
+	    instream->real_stream->read == i_stream_file_read) {
+		if (io_stream_splice(outstream, instream, in_fd, &res))
+			return res;
+	}
+#endif
 
 	same_stream = i_stream_get_fd(instream) == foutstream->fd &&
 		foutstream->fd != -1;
@@ -101,9 +101,91 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static const struct {
+	enum base64_impl impl;
+	const char *name;
+} base64_impls[] = {
+	{ BASE64_IMPL_SCALAR, "scalar" },
+	{ BASE64_IMPL_SSSE3, "ssse3" },
+	{ BASE64_IMPL_AVX2, "avx2" }
+};
+
+static void test_base64_impl_random_input(string_t *input)
+{
+	unsigned char buf[300];
+	unsigned int i, len, line_len;
+
+	len = rand() % sizeof(buf);
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+	str_truncate(input, 0);
+	base64_encode(buf, len, input);
+
+	if (rand() % 2 == 0) {
+		/* add line breaks */
+		line_len = 4 * (1 + rand() % 20);
+		for (i = line_len; i < str_len(input); i += line_len + 2)
+			str_insert(input, i, "\r\n");
+	}
+	if (str_len(input) > 0 && rand() % 4 == 0) {
+		/* corrupt it */
+		i = rand() % str_len(input);
+		buffer_write(input, i, "!= \t\x80"+rand()%5, 1);
+	}
+}
+
+static void test_base64_impls(void)
+{
+	string_t *input, *expected, *output;
+	size_t expected_pos, pos;
+	int expected_ret, ret;
+	unsigned int i, j;
+
+	input = t_str_new(512);
+	expected = t_str_new(512);
+	output = t_str_new(512);
+	for (i = 0; i < N_ELEMENTS(base64_impls); i++) {
+		if (!base64_set_impl(base64_impls[i].impl))
+			continue;
+
+		test_begin(t_strdup_printf("base64 %s", base64_impls[i].name));
+		for (j = 0; j < 1000; j++) {
+			/* the scalar implementation gives the expected
+			   results */
+			test_assert(base64_set_impl(BASE64_IMPL_SCALAR));
+			test_base64_impl_random_input(input);
+			str_truncate(expected, 0);
+			expected_ret = base64_decode(str_data(input),
+						     str_len(input),
+						     &expected_pos, expected);
+
+			test_assert(base64_set_impl(base64_impls[i].impl));
+			str_truncate(output, 0);
+			ret = base64_decode(str_data(input), str_len(input),
+					    &pos, output);
+			test_assert_idx(ret == expected_ret, j);
+			test_assert_idx(pos == expected_pos, j);
+			test_assert_idx(str_equals(output, expected), j);
+
+			/* encode the decoded data */
+			str_truncate(output, 0);
+			base64_encode(str_data(expected), str_len(expected),
+				      output);
+			str_truncate(input, 0);
+			test_assert(base64_set_impl(BASE64_IMPL_SCALAR));
+			base64_encode(str_data(expected), str_len(expected),
+				      input);
+			test_assert_idx(str_equals(output, input), j);
+		}
+		test_end();
+	}
+	base64_set_best_impl();
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
 	test_base64_decode();
 	test_base64_random();
+	test_base64_impls();
 }
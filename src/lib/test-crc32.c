@@ -3,12 +3,56 @@
 #include "test-lib.h"
 #include "crc32.h"
 
-void test_crc32(void)
+static const struct {
+	enum crc32_impl impl;
+	const char *name;
+} crc32_impls[] = {
+	{ CRC32_IMPL_TABLE, "table" },
+	{ CRC32_IMPL_SLICE8, "slice8" },
+	{ CRC32_IMPL_PCLMUL, "pclmul" },
+	{ CRC32_IMPL_ARMV8, "armv8" }
+};
+
+static void test_crc32_impl(enum crc32_impl impl, const char *name)
 {
 	const char str[] = "foo\0bar";
+	unsigned char buf[1024+16];
+	uint32_t crc, expected[64];
+	unsigned int i, j, offsets[N_ELEMENTS(expected)];
+	size_t sizes[N_ELEMENTS(expected)];
 
-	test_begin("crc32");
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 0x9d + (i >> 8);
+	/* calculate the expected values with the plain table version */
+	i_assert(crc32_set_impl(CRC32_IMPL_TABLE));
+	for (i = 0; i < N_ELEMENTS(expected); i++) {
+		offsets[i] = i % 16;
+		sizes[i] = i < 32 ? i * 3 : (sizeof(buf) - 16) - i * 7;
+		expected[i] = crc32_data(buf + offsets[i], sizes[i]);
+	}
+	if (!crc32_set_impl(impl))
+		return;
+
+	test_begin(t_strdup_printf("crc32 %s", name));
 	test_assert(crc32_str(str) == 0x8c736521);
 	test_assert(crc32_data(str, sizeof(str)) == 0x32c9723d);
+	for (i = 0; i < N_ELEMENTS(expected); i++) {
+		test_assert_idx(crc32_data(buf + offsets[i], sizes[i]) ==
+				expected[i], i);
+		/* the same in two parts */
+		j = sizes[i] / 3;
+		crc = crc32_data(buf + offsets[i], j);
+		crc = crc32_data_more(crc, buf + offsets[i] + j, sizes[i] - j);
+		test_assert_idx(crc == expected[i], i);
+	}
 	test_end();
 }
+
+void test_crc32(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(crc32_impls); i++)
+		test_crc32_impl(crc32_impls[i].impl, crc32_impls[i].name);
+	crc32_set_best_impl();
+}
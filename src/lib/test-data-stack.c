@@ -138,11 +138,42 @@ static void test_ds_recursive(int count, int depth)
 	test_end();
 }
 
+static void test_ds_shrink(void)
+{
+	struct data_stack_stats stats1, stats2, stats3;
+	unsigned int id;
+
+	test_begin("data-stack shrink");
+	data_stack_set_max_unused_size(1024*1024);
+	data_stack_get_stats(&stats1);
+	T_BEGIN {
+		(void)t_malloc_no0(4*1024*1024);
+	} T_END;
+	data_stack_get_stats(&stats2);
+	test_assert(stats2.allocated_bytes_highwater >= 4*1024*1024);
+	/* not back in the outermost frame yet, so the block is kept */
+	test_assert(stats2.allocated_bytes >= 4*1024*1024);
+	test_assert(stats2.shrink_count == stats1.shrink_count);
+
+	/* the tests are run inside a frame - temporarily return to the
+	   outermost one */
+	id = t_pop();
+	test_assert(t_push(NULL) == id);
+	data_stack_get_stats(&stats3);
+	test_assert(stats3.allocated_bytes < 4*1024*1024);
+	test_assert(stats3.allocated_bytes_highwater ==
+		    stats2.allocated_bytes_highwater);
+	test_assert(stats3.shrink_count == stats1.shrink_count + 1);
+	data_stack_set_max_unused_size((size_t)-1);
+	test_end();
+}
+
 void test_data_stack(void)
 {
 	test_ds_buffers();
 	test_ds_realloc();
 	test_ds_recursive(20, 80);
+	test_ds_shrink();
 }
 
 enum fatal_test_state fatal_data_stack(int stage)
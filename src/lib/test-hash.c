@@ -35,6 +35,99 @@ static void test_hash_random_pool(pool_t pool)
 	i_free(keys);
 }
 
+static void test_hash_iterate_modify_pool(pool_t pool)
+{
+#define ITER_KEYMAX 1000
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	unsigned char seen[ITER_KEYMAX*3+1];
+	void *key, *value;
+	unsigned int i, k;
+
+	test_begin("hash iterate and modify");
+	hash_table_create_direct(&hash, pool, 0);
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		hash_table_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+
+	/* remove odd keys and add lots of new ones while iterating. the
+	   new keys don't fit into the frozen table, but every original key
+	   must still be seen exactly once. */
+	memset(seen, 0, sizeof(seen));
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		k = POINTER_CAST_TO(key, unsigned int);
+		test_assert(key == value);
+		test_assert(k >= 1 && k <= ITER_KEYMAX*3);
+		seen[k]++;
+		if (k <= ITER_KEYMAX) {
+			if (k % 2 == 1)
+				hash_table_remove(hash, key);
+			hash_table_insert(hash, POINTER_CAST(k + ITER_KEYMAX),
+					  POINTER_CAST(k + ITER_KEYMAX));
+			hash_table_insert(hash, POINTER_CAST(k + ITER_KEYMAX*2),
+					  POINTER_CAST(k + ITER_KEYMAX*2));
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		test_assert_idx(seen[i] == 1, i);
+	for (i = ITER_KEYMAX+1; i <= ITER_KEYMAX*3; i++)
+		test_assert_idx(seen[i] <= 1, i);
+
+	test_assert(hash_table_count(hash) == ITER_KEYMAX*2 + ITER_KEYMAX/2);
+	for (i = 1; i <= ITER_KEYMAX*3; i++) {
+		value = hash_table_lookup(hash, POINTER_CAST(i));
+		if (i <= ITER_KEYMAX && i % 2 == 1)
+			test_assert_idx(value == NULL, i);
+		else
+			test_assert_idx(value == POINTER_CAST(i), i);
+	}
+
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_count(hash) == 0);
+	test_assert(hash_table_lookup(hash, POINTER_CAST(2)) == NULL);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_strings(void)
+{
+	HASH_TABLE(const char *, const char *) hash, hash2;
+	const char *key, *orig_key, *value;
+	unsigned int i;
+
+	test_begin("hash strings");
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < 1000; i++) {
+		hash_table_insert(hash, t_strdup_printf("key%u", i),
+				  t_strdup_printf("value%u", i));
+	}
+	/* update keeps the original key, insert replaces it */
+	value = "updated";
+	hash_table_update(hash, t_strdup("key5"), value);
+	key = "key5";
+	test_assert(hash_table_lookup_full(hash, key, &orig_key, &value));
+	test_assert(strcmp(value, "updated") == 0);
+	test_assert(strcmp(orig_key, "key5") == 0 && orig_key != key);
+
+	hash_table_create(&hash2, default_pool, 0, str_hash, strcmp);
+	hash_table_copy(hash2, hash);
+	test_assert(hash_table_count(hash2) == 1000);
+	for (i = 0; i < 1000; i += 2)
+		hash_table_remove(hash, t_strdup_printf("key%u", i));
+	test_assert(hash_table_count(hash) == 500);
+	for (i = 0; i < 1000; i++) {
+		key = t_strdup_printf("key%u", i);
+		test_assert_idx((hash_table_lookup(hash, key) != NULL) == (i % 2 == 1), i);
+		test_assert_idx(hash_table_lookup(hash2, key) != NULL, i);
+	}
+	key = "nonexistent";
+	test_assert(!hash_table_try_remove(hash, key));
+	hash_table_destroy(&hash);
+	hash_table_destroy(&hash2);
+	test_end();
+}
+
 void test_hash(void)
 {
 	pool_t pool;
@@ -44,4 +137,11 @@ void test_hash(void)
 	pool = pool_alloconly_create("test hash", 1024);
 	test_hash_random_pool(pool);
 	pool_unref(&pool);
+
+	test_hash_iterate_modify_pool(default_pool);
+	pool = pool_alloconly_create("test hash iterate", 1024);
+	test_hash_iterate_modify_pool(pool);
+	pool_unref(&pool);
+
+	test_hash_strings();
 }
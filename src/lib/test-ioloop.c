@@ -2,11 +2,34 @@
 
 #include "test-lib.h"
 #include "net.h"
+#include "str.h"
 #include "time-util.h"
-#include "ioloop.h"
+#include "fd-set-nonblock.h"
+#include "istream.h"
+#include "ioloop-private.h"
 
 #include <unistd.h>
 
+#ifdef __GLIBC__
+/* Added to the time returned by gettimeofday(). This gettimeofday() replaces
+   libc's within the test binary, so the tests can move the ioloop's clock
+   forward without sleeping. */
+static unsigned int test_clock_offset_msecs = 0;
+
+int gettimeofday(struct timeval *tv, void *tz ATTR_UNUSED)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		return -1;
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	if (test_clock_offset_msecs != 0)
+		timeval_add_msecs(tv, test_clock_offset_msecs);
+	return 0;
+}
+#endif
+
 static void timeout_callback(struct timeval *tv)
 {
 	if (gettimeofday(tv, NULL) < 0)
@@ -51,6 +74,132 @@ static void test_ioloop_timeout(void)
 	test_end();
 }
 
+static void long_timeout_callback(bool *fired)
+{
+	*fired = TRUE;
+}
+
+static void test_ioloop_timeout_wheel(void)
+{
+	struct ioloop *ioloop;
+	struct timeout *to, *long_to[1000];
+	struct timeval tv_start, tv_callback, tv;
+	unsigned int i;
+	bool long_fired = FALSE;
+
+	test_begin("ioloop timeout wheel");
+	ioloop = io_loop_create();
+
+	/* timeouts spread over all the wheel levels */
+	for (i = 0; i < N_ELEMENTS(long_to); i++) {
+		long_to[i] = timeout_add(2000 + i * 3000017U,
+					 long_timeout_callback, &long_fired);
+	}
+	to = timeout_add(1500, timeout_callback, &tv_callback);
+	if (gettimeofday(&tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	/* timeouts have millisecond precision */
+	tv_start.tv_usec -= tv_start.tv_usec % 1000;
+	io_loop_run(ioloop);
+	/* the timeout still runs at its exact time, not at a second
+	   boundary */
+	test_assert(timeval_diff_msecs(&tv_callback, &tv_start) >= 1500);
+	test_assert(timeval_diff_msecs(&tv_callback, &tv_start) < 2000);
+	test_assert(!long_fired);
+
+	for (i = 0; i < N_ELEMENTS(long_to); i++)
+		timeout_reset(long_to[i]);
+	timeout_remove(&to);
+	test_assert(io_loop_get_wait_time(ioloop, &tv) > 0);
+	test_assert(io_loop_get_wait_time(ioloop, &tv) <= 64*1000);
+	for (i = 0; i < N_ELEMENTS(long_to); i++)
+		timeout_remove(&long_to[i]);
+	test_assert(io_loop_get_wait_time(ioloop, &tv) == -1);
+	test_assert(!long_fired);
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+#ifdef __GLIBC__
+struct wheel_cascade_context {
+	unsigned int count;
+	struct timeval tv_callback;
+};
+
+static void wheel_cascade_callback(struct wheel_cascade_context *ctx)
+{
+	ctx->count++;
+	ctx->tv_callback = ioloop_timeval;
+}
+
+static void test_ioloop_run_once(struct ioloop *ioloop)
+{
+	struct timeout *to;
+
+	/* handle the timeouts that are due without waiting */
+	to = timeout_add(0, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+}
+
+static void test_ioloop_timeout_wheel_cascade(void)
+{
+	/* longer than what level 0 of the wheel covers */
+	const unsigned int long_msecs =
+		(IOLOOP_WHEEL_LEVEL_SLOTS + 36) * 1000;
+	struct wheel_cascade_context ctx;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	struct timeval tv, tv_expected;
+	unsigned int steps = 0;
+	bool seen_level0 = FALSE;
+	int msecs;
+
+	test_begin("ioloop timeout wheel cascade");
+	memset(&ctx, 0, sizeof(ctx));
+	ioloop = io_loop_create();
+
+	to = timeout_add(long_msecs, wheel_cascade_callback, &ctx);
+	test_ioloop_run_once(ioloop);
+	test_assert(to->in_wheel && to->wheel_level > 0);
+	tv_expected = to->next_run;
+
+	/* move the clock forward to each wakeup time without sleeping */
+	while (ctx.count == 0 && steps++ < 100) {
+		msecs = io_loop_get_wait_time(ioloop, &tv);
+		test_assert(msecs >= 0);
+		if (msecs < 0)
+			break;
+		test_clock_offset_msecs += msecs;
+		test_ioloop_run_once(ioloop);
+		if (to->in_wheel && to->wheel_level == 0)
+			seen_level0 = TRUE;
+		if (ctx.count == 0) {
+			/* not fired early */
+			test_assert(timeval_cmp(&ioloop_timeval,
+						&tv_expected) < 0);
+		}
+	}
+	test_assert(seen_level0);
+	test_assert(ctx.count == 1);
+	test_assert(timeval_cmp(&ctx.tv_callback, &tv_expected) >= 0);
+	test_assert(timeval_diff_msecs(&ctx.tv_callback, &tv_expected) < 1000);
+
+	/* the timeout was reset to run again after another interval, so
+	   moving the clock forward less than that doesn't trigger it */
+	test_clock_offset_msecs += long_msecs / 2;
+	test_ioloop_run_once(ioloop);
+	test_assert(ctx.count == 1);
+
+	test_clock_offset_msecs = 0;
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+#endif
+
 static void io_callback(void *context ATTR_UNUSED)
 {
 }
@@ -98,8 +247,270 @@ static void test_ioloop_find_fd_conditions(void)
 	test_end();
 }
 
+struct test_io_ctx {
+	int fd;
+	unsigned int read_count;
+};
+
+static void test_io_read_callback(struct test_io_ctx *ctx)
+{
+	char buf[16];
+
+	if (read(ctx->fd, buf, sizeof(buf)) > 0)
+		ctx->read_count++;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_io_stop_callback(void *context ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_io_add_remove(void)
+{
+	struct test_io_ctx ctx;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	struct io *io;
+	int fd[2];
+
+	test_begin("ioloop io add/remove");
+	ioloop = io_loop_create();
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fd = fd[0];
+
+	/* the io is called for the pending input */
+	io = io_add(fd[0], IO_READ, test_io_read_callback, &ctx);
+	if (write(fd[1], "x", 1) != 1)
+		i_fatal("write() failed: %m");
+	io_loop_run(ioloop);
+	test_assert(ctx.read_count == 1);
+
+	/* a removed io isn't called anymore */
+	io_remove(&io);
+	if (write(fd[1], "x", 1) != 1)
+		i_fatal("write() failed: %m");
+	to = timeout_add_short(100, test_io_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_assert(ctx.read_count == 1);
+
+	/* adding it back sees the input that arrived meanwhile */
+	io = io_add(fd[0], IO_READ, test_io_read_callback, &ctx);
+	io_loop_run(ioloop);
+	test_assert(ctx.read_count == 2);
+
+	/* the io is rearmed after each event */
+	if (write(fd[1], "x", 1) != 1)
+		i_fatal("write() failed: %m");
+	io_loop_run(ioloop);
+	test_assert(ctx.read_count == 3);
+
+	/* idle ios don't prevent timeouts from running */
+	to = timeout_add_short(10, test_io_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_assert(ctx.read_count == 3);
+
+	io_remove(&io);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+#define TEST_IO_MANY_COUNT 300
+
+static void test_io_many_callback(unsigned int *count)
+{
+	if (++(*count) == TEST_IO_MANY_COUNT)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_io_many(void)
+{
+	struct ioloop *ioloop;
+	struct io *ios[TEST_IO_MANY_COUNT];
+	int fds[TEST_IO_MANY_COUNT][2];
+	unsigned int i, count = 0;
+
+	test_begin("ioloop many ios");
+	ioloop = io_loop_create();
+	/* more poll changes than fit into a single submission */
+	for (i = 0; i < TEST_IO_MANY_COUNT; i++) {
+		if (pipe(fds[i]) < 0)
+			i_fatal("pipe() failed: %m");
+		ios[i] = io_add(fds[i][1], IO_WRITE,
+				test_io_many_callback, &count);
+	}
+	io_loop_run(ioloop);
+	test_assert(count == TEST_IO_MANY_COUNT);
+
+	for (i = 0; i < TEST_IO_MANY_COUNT; i++) {
+		io_remove(&ios[i]);
+		i_close_fd(&fds[i][0]);
+		i_close_fd(&fds[i][1]);
+	}
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+struct test_io_istream_ctx {
+	struct istream *input;
+	string_t *data;
+	/* number of calls to return from without reading */
+	unsigned int ignore_count;
+	bool eof;
+};
+
+static void test_io_istream_read(struct test_io_istream_ctx *ctx)
+{
+	const unsigned char *data;
+	size_t size;
+	ssize_t ret;
+
+	while ((ret = i_stream_read(ctx->input)) > 0) {
+		data = i_stream_get_data(ctx->input, &size);
+		str_append_n(ctx->data, data, size);
+		i_stream_skip(ctx->input, size);
+	}
+	if (ret == -1)
+		ctx->eof = TRUE;
+}
+
+static void test_io_istream_callback(struct test_io_istream_ctx *ctx)
+{
+	if (ctx->ignore_count > 0) {
+		ctx->ignore_count--;
+		return;
+	}
+	test_io_istream_read(ctx);
+	io_loop_stop(current_ioloop);
+}
+
+static void test_io_istream_write(int fd, const char *data)
+{
+	if (write(fd, data, strlen(data)) != (ssize_t)strlen(data))
+		i_fatal("write() failed: %m");
+}
+
+static void test_ioloop_io_istream(void)
+{
+	struct test_io_istream_ctx ctx;
+	struct ioloop *ioloop, *ioloop2;
+	struct timeout *to;
+	struct io *io;
+	int fd[2];
+
+	test_begin("ioloop io istream");
+	ioloop = io_loop_create();
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	fd_set_nonblock(fd[0], TRUE);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.input = i_stream_create_fd(fd[0], 1024, FALSE);
+	ctx.data = str_new(default_pool, 64);
+
+	/* the io is called for the pending input */
+	io = io_add_istream(ctx.input, test_io_istream_callback, &ctx);
+	test_io_istream_write(fd[1], "hello");
+	io_loop_run(ioloop);
+	test_assert(strcmp(str_c(ctx.data), "hello") == 0);
+
+	/* input that arrives while the io is idle is read in order with
+	   the input that arrives after the io is removed */
+	str_truncate(ctx.data, 0);
+	to = timeout_add_short(10, test_io_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_io_istream_write(fd[1], "ab");
+	io_remove(&io);
+	test_io_istream_write(fd[1], "cd");
+	test_io_istream_read(&ctx);
+	test_assert(strcmp(str_c(ctx.data), "abcd") == 0);
+
+	/* the io can be moved to another ioloop while it's idle */
+	str_truncate(ctx.data, 0);
+	io = io_add_istream(ctx.input, test_io_istream_callback, &ctx);
+	to = timeout_add_short(10, test_io_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	ioloop2 = io_loop_create();
+	io = io_loop_move_io(&io);
+	test_io_istream_write(fd[1], "moved");
+	io_loop_run(ioloop2);
+	test_assert(strcmp(str_c(ctx.data), "moved") == 0);
+	io_loop_set_current(ioloop);
+	io = io_loop_move_io(&io);
+	io_loop_set_current(ioloop2);
+	io_loop_destroy(&ioloop2);
+
+	/* input that is left unread keeps the io called */
+	str_truncate(ctx.data, 0);
+	ctx.ignore_count = 1;
+	test_io_istream_write(fd[1], "left");
+	io_loop_run(ioloop);
+	test_assert(strcmp(str_c(ctx.data), "left") == 0);
+
+	/* EOF */
+	i_close_fd(&fd[1]);
+	io_loop_run(ioloop);
+	test_assert(ctx.eof);
+
+	io_remove(&io);
+	i_stream_unref(&ctx.input);
+	str_free(&ctx.data);
+	i_close_fd(&fd[0]);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_ioloop_destroy_order(void)
+{
+	struct ioloop *ioloop, *ioloop2;
+	struct timeout *to;
+	struct io *io;
+	int fd[2];
+
+	test_begin("ioloop destroy order");
+	ioloop = io_loop_create();
+	ioloop2 = io_loop_create();
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	io = io_add(fd[1], IO_WRITE, test_io_stop_callback, (void *)NULL);
+
+	/* destroying the first ioloop while the second one still exists
+	   leaves no current ioloop */
+	io_loop_set_current(ioloop);
+	io_loop_destroy(&ioloop);
+	test_assert(current_ioloop == NULL);
+
+	/* the second ioloop's io and timeouts are still usable */
+	io_loop_set_current(ioloop2);
+	io_loop_run(ioloop2);
+	io_remove(&io);
+	to = timeout_add_short(1, test_io_stop_callback, (void *)NULL);
+	io_loop_run(ioloop2);
+	timeout_remove(&to);
+
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	io_loop_destroy(&ioloop2);
+	test_end();
+}
+
 void test_ioloop(void)
 {
 	test_ioloop_timeout();
+	test_ioloop_timeout_wheel();
+#ifdef __GLIBC__
+	test_ioloop_timeout_wheel_cascade();
+#endif
 	test_ioloop_find_fd_conditions();
+	test_ioloop_io_add_remove();
+	test_ioloop_io_many();
+	test_ioloop_io_istream();
+	test_ioloop_destroy_order();
 }
@@ -3,6 +3,9 @@
 #include "test-lib.h"
 #include "istream.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 static void test_istream_children(void)
 {
 	struct istream *parent, *child1, *child2;
@@ -56,7 +59,74 @@ static void test_istream_children(void)
 	test_end();
 }
 
+static void test_istream_access_pattern(void)
+{
+	const char *path = ".temp.istream.access";
+	struct istream *input, *child;
+	const unsigned char *data;
+	unsigned char buf[1024];
+	size_t size, max_size = 0;
+	uoff_t offset;
+	unsigned int i;
+	bool data_ok = TRUE;
+	ssize_t ret;
+	int fd;
+
+	test_begin("istream access pattern");
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	i_unlink(path);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i % 251;
+	for (i = 0; i < 1024; i++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			i_fatal("write(%s) failed: %m", path);
+	}
+
+	input = i_stream_create_fd(fd, 1024, TRUE);
+	i_stream_set_init_buffer_size(input, 1024);
+	child = i_stream_create_limit(input, (uoff_t)-1);
+	/* passed through to the parent */
+	i_stream_set_access_pattern(child, I_STREAM_ACCESS_SEQUENTIAL);
+
+	/* the read size grows while everything read is consumed */
+	offset = 0;
+	while ((ret = i_stream_read(child)) > 0) {
+		data = i_stream_get_data(child, &size);
+		if (size > max_size)
+			max_size = size;
+		for (i = 0; i < size; i++) {
+			if (data[i] != (offset + i) % 1024 % 251)
+				data_ok = FALSE;
+		}
+		offset += size;
+		i_stream_skip(child, size);
+	}
+	test_assert(ret == -1 && child->stream_errno == 0);
+	test_assert(offset == 1024*1024);
+	test_assert(data_ok);
+	test_assert(max_size == I_STREAM_SEQUENTIAL_MAX_READ_SIZE);
+
+	/* seeking elsewhere goes back to small reads */
+	i_stream_seek(child, 1000);
+	test_assert(i_stream_read(child) > 0);
+	data = i_stream_get_data(child, &size);
+	test_assert(size <= 2048 && data[0] == 1000 % 251);
+
+	/* keeping the data buffered doesn't grow the buffer beyond the max
+	   buffer size */
+	while ((ret = i_stream_read(child)) > 0) ;
+	test_assert(ret == -2);
+	test_assert(i_stream_get_data_size(child) <= 2048);
+
+	i_stream_unref(&child);
+	i_stream_unref(&input);
+	test_end();
+}
+
 void test_istream(void)
 {
 	test_istream_children();
+	test_istream_access_pattern();
 }
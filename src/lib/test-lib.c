@@ -37,6 +37,7 @@ int main(void)
 		test_json_tree,
 		test_llist,
 		test_mempool_alloconly,
+		test_mempool_slab,
 		test_net,
 		test_numpack,
 		test_pkcs5_pbkdf2,
@@ -0,0 +1,117 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+#define TEST_SLAB_ALLOC_COUNT 256
+
+static bool mem_has_bytes(const void *mem, size_t size, uint8_t b)
+{
+	const uint8_t *bytes = mem;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != b)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void test_mempool_slab_alloc(void)
+{
+	static const size_t sizes[] = { 1, 15, 16, 17, 100, 4096, 4097, 10000 };
+	void *mem[TEST_SLAB_ALLOC_COUNT];
+	size_t size;
+	unsigned int i, j;
+	pool_t pool;
+
+	test_begin("mempool_slab alloc");
+	pool = pool_slab_create("test", FALSE);
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i++) {
+			size = sizes[i % N_ELEMENTS(sizes)];
+			mem[i] = p_malloc(pool, size);
+			test_assert(mem_has_bytes(mem[i], size, 0));
+			memset(mem[i], i, size);
+		}
+		for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i++) {
+			size = sizes[i % N_ELEMENTS(sizes)];
+			test_assert(mem_has_bytes(mem[i], size, i & 0xff));
+		}
+		/* free every other allocation, so the second round reuses
+		   them from the free lists */
+		for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i += 2)
+			p_free(pool, mem[i]);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_realloc(void)
+{
+	unsigned char *mem;
+	size_t size;
+	pool_t pool;
+
+	test_begin("mempool_slab realloc");
+	pool = pool_slab_create("test", FALSE);
+	mem = p_malloc(pool, 10);
+	memset(mem, 'x', 10);
+	for (size = 10; size < 20000; size = size * 3 / 2) {
+		mem = p_realloc(pool, mem, size, size * 3 / 2);
+		test_assert(mem_has_bytes(mem, 10, 'x'));
+		test_assert(mem_has_bytes(mem + 10, size * 3 / 2 - 10, 0));
+	}
+	p_free(pool, mem);
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_stats(void)
+{
+	const struct pool_slab_class_stats *stats;
+	void *mem[3], *freed_mem;
+	unsigned int i, count;
+	pool_t pool;
+
+	test_begin("mempool_slab stats");
+	pool = pool_slab_create("test", TRUE);
+	mem[0] = p_malloc(pool, 20);
+	mem[1] = p_malloc(pool, 30);
+	mem[2] = p_malloc(pool, 100000);
+	freed_mem = mem[0];
+	p_free(pool, mem[0]);
+
+	stats = pool_slab_get_stats(pool, &count);
+	for (i = 0; i < count; i++) {
+		if (stats[i].chunk_size == 32) {
+			test_assert(stats[i].used_count == 1);
+			test_assert(stats[i].peak_used_count == 2);
+			test_assert(stats[i].free_count == 1);
+			test_assert(stats[i].alloc_count == 2);
+		} else if (stats[i].chunk_size == (size_t)-1) {
+			test_assert(i == count-1);
+			test_assert(stats[i].used_count == 1);
+			test_assert(stats[i].alloc_count == 1);
+		} else {
+			test_assert(stats[i].alloc_count == 0);
+		}
+	}
+	/* reusing the freed chunk doesn't create a new one */
+	test_assert(p_malloc(pool, 17) == freed_mem);
+	stats = pool_slab_get_stats(pool, &count);
+	test_assert(stats[1].chunk_size == 32 && stats[1].free_count == 0);
+
+	p_clear(pool);
+	stats = pool_slab_get_stats(pool, &count);
+	for (i = 0; i < count; i++)
+		test_assert(stats[i].used_count == 0);
+	pool_unref(&pool);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_alloc();
+	test_mempool_slab_realloc();
+	test_mempool_slab_stats();
+}
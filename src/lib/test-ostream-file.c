@@ -172,9 +172,58 @@ static void test_ostream_file_send_istream_sendfile(void)
 	test_end();
 }
 
+static void test_ostream_file_send_istream_splice(void)
+{
+	struct istream *input;
+	struct ostream *output;
+	unsigned char *data, *buf;
+	const size_t data_size = 60000;
+	int in_fd[2], sock_fd[2];
+	ssize_t ret;
+	size_t i, pos;
+
+	test_begin("ostream file send istream splice()");
+	data = i_malloc(data_size);
+	buf = i_malloc(data_size);
+	for (i = 0; i < data_size; i++)
+		data[i] = i % 251;
+
+	/* pipe istream with some of the data already buffered */
+	i_assert(pipe(in_fd) == 0);
+	test_assert(write(in_fd[1], data, data_size) == (ssize_t)data_size);
+	i_close_fd(&in_fd[1]);
+	input = i_stream_create_fd(in_fd[0], 16, TRUE);
+	test_assert(i_stream_read(input) > 0);
+	i_stream_skip(input, 3);
+
+	/* temp socket ostream */
+	i_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fd) == 0);
+	output = o_stream_create_fd(sock_fd[0], 0, TRUE);
+
+	test_assert(o_stream_send_istream(output, input) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
+	test_assert(output->offset == data_size - 3);
+	test_assert(input->v_offset == data_size);
+	test_assert(o_stream_flush(output) > 0);
+	o_stream_destroy(&output);
+
+	for (pos = 0; pos < data_size - 3; pos += ret) {
+		ret = read(sock_fd[1], buf + pos, data_size - 3 - pos);
+		if (ret <= 0)
+			break;
+	}
+	test_assert(pos == data_size - 3 && memcmp(buf, data + 3, pos) == 0);
+
+	i_stream_unref(&input);
+	i_close_fd(&sock_fd[1]);
+	i_free(data);
+	i_free(buf);
+	test_end();
+}
+
 void test_ostream_file(void)
 {
 	test_ostream_file_random();
 	test_ostream_file_send_istream_file();
 	test_ostream_file_send_istream_sendfile();
+	test_ostream_file_send_istream_splice();
 }
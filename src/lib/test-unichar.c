@@ -36,6 +36,80 @@ static void test_unichar_uni_utf8_partial_strlen_n(void)
 	test_end();
 }
 
+static void test_unichar_random_input(buffer_t *input)
+{
+	static const char *pieces[] = {
+		"a", "hello world ", "\r\n", "\xc3\xa4", "\xe2\x82\xac",
+		"\xf0\x9f\x98\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+		"\xf8\x88\x80\x80\x80", "\xfc\x84\x80\x80\x80\x80",
+		"\xc0\xaf", "\xe0\x80\xaf", "\x80", "\xbf", "\xc3",
+		"\xe2\x82", "\xf0\x9f\x98", "\xfe", "\xff"
+	};
+	unsigned int i, count, idx;
+
+	buffer_set_used_size(input, 0);
+	count = rand() % 80;
+	for (i = 0; i < count; i++) {
+		/* mostly valid input */
+		idx = rand() % 100 < 95 ? rand() % 6 : rand() % N_ELEMENTS(pieces);
+		buffer_append(input, pieces[idx], strlen(pieces[idx]));
+	}
+}
+
+static void test_unichar_impls(void)
+{
+	static const struct {
+		enum uni_utf8_impl impl;
+		const char *name;
+	} impls[] = {
+		{ UNI_UTF8_IMPL_SCALAR, "scalar" },
+		{ UNI_UTF8_IMPL_SSSE3, "ssse3" },
+		{ UNI_UTF8_IMPL_AVX2, "avx2" }
+	};
+	buffer_t *input, *expected, *output;
+	unsigned int i, j, expected_len, len;
+	size_t expected_pos, pos, size;
+	bool expected_valid, valid;
+
+	input = buffer_create_dynamic(pool_datastack_create(), 1024);
+	expected = buffer_create_dynamic(pool_datastack_create(), 1024);
+	output = buffer_create_dynamic(pool_datastack_create(), 1024);
+	for (i = 0; i < N_ELEMENTS(impls); i++) {
+		if (!uni_utf8_set_impl(impls[i].impl))
+			continue;
+		test_begin(t_strdup_printf("unichar utf8 %s", impls[i].name));
+		for (j = 0; j < 2000; j++) {
+			test_unichar_random_input(input);
+			size = input->used;
+			if (size > 0 && rand() % 2 == 0)
+				size -= rand() % I_MIN(size, 4);
+
+			/* the scalar implementation gives the expected
+			   results */
+			test_assert(uni_utf8_set_impl(UNI_UTF8_IMPL_SCALAR));
+			buffer_set_used_size(expected, 0);
+			expected_valid = uni_utf8_get_valid_data(input->data,
+								 size, expected);
+			expected_len = uni_utf8_partial_strlen_n(input->data,
+								 size, &expected_pos);
+
+			test_assert(uni_utf8_set_impl(impls[i].impl));
+			buffer_set_used_size(output, 0);
+			valid = uni_utf8_get_valid_data(input->data, size,
+							output);
+			test_assert_idx(valid == expected_valid, j);
+			test_assert_idx(buffer_cmp(output, expected), j);
+			test_assert_idx(uni_utf8_data_is_valid(input->data, size) ==
+					expected_valid, j);
+			len = uni_utf8_partial_strlen_n(input->data, size, &pos);
+			test_assert_idx(len == expected_len, j);
+			test_assert_idx(pos == expected_pos, j);
+		}
+		test_end();
+	}
+	uni_utf8_set_best_impl();
+}
+
 void test_unichar(void)
 {
 	static const char overlong_utf8[] = "\xf8\x80\x95\x81\xa1";
@@ -92,4 +166,5 @@ void test_unichar(void)
 
 	test_unichar_uni_utf8_strlen();
 	test_unichar_uni_utf8_partial_strlen_n();
+	test_unichar_impls();
 }
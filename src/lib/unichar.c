@@ -4,6 +4,11 @@
 #include "array.h"
 #include "bsearch-insert-pos.h"
 #include "unichar.h"
+#include "cpu-features.h"
+
+#ifdef HAVE_X86_SIMD_TARGET
+#  include <immintrin.h>
+#endif
 
 #include "unicodemap.c"
 
@@ -184,6 +189,307 @@ void uni_ucs4_to_utf8_c(unichar_t chr, buffer_t *output)
 	} while (bitpos > 0);
 }
 
+/* The block functions below return the length of the longest prefix of input
+   that they could verify to be valid UTF-8. The prefix always ends at
+   a character boundary. The number of characters in the prefix is added to
+   char_count_r. The checks are stricter than uni_utf8_get_char_n(), e.g.
+   surrogates and 5-6 byte sequences aren't accepted, so the caller must
+   check the data after the prefix with the per-character code. */
+typedef size_t uni_utf8_valid_prefix_t(const unsigned char *input, size_t size,
+				       unsigned int *char_count_r);
+
+/* How many bytes to check with the per-character code before retrying
+   the block function after it stopped. */
+#define UNI_UTF8_SLOW_PATH_BYTES 64
+
+static uni_utf8_valid_prefix_t uni_utf8_valid_prefix_init;
+static uni_utf8_valid_prefix_t *uni_utf8_valid_prefix =
+	uni_utf8_valid_prefix_init;
+
+static size_t
+uni_utf8_valid_prefix_scalar(const unsigned char *input, size_t size,
+			     unsigned int *char_count_r)
+{
+	uint64_t value;
+	size_t pos;
+
+	/* only 7bit ASCII is handled here */
+	for (pos = 0; pos + sizeof(value) <= size; pos += sizeof(value)) {
+		memcpy(&value, input + pos, sizeof(value));
+		if ((value & 0x8080808080808080ULL) != 0)
+			break;
+	}
+	*char_count_r += pos;
+	return pos;
+}
+
+#ifdef HAVE_X86_SIMD_TARGET
+/* The vectorized validation is the "lookup" algorithm from John Keiser and
+   Daniel Lemire's "Validating UTF-8 In Less Than One Instruction Per Byte".
+   The high and low nibbles of each byte and the high nibble of the next byte
+   are used to look up bitmasks of the possible errors. The error exists
+   only if the bit is set in all three. */
+#define UTF8_TOO_SHORT		(1 << 0)
+#define UTF8_TOO_LONG		(1 << 1)
+#define UTF8_OVERLONG_3		(1 << 2)
+#define UTF8_TOO_LARGE		(1 << 3)
+#define UTF8_SURROGATE		(1 << 4)
+#define UTF8_OVERLONG_2		(1 << 5)
+#define UTF8_TOO_LARGE_1000	(1 << 6)
+#define UTF8_OVERLONG_4		(1 << 6)
+#define UTF8_TWO_CONTS		(1 << 7)
+#define UTF8_CARRY		(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH_LUT \
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+	UTF8_TOO_SHORT, \
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+#define UTF8_BYTE_1_LOW_LUT \
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+	UTF8_CARRY | UTF8_OVERLONG_2, \
+	UTF8_CARRY, \
+	UTF8_CARRY, \
+	UTF8_CARRY | UTF8_TOO_LARGE, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+#define UTF8_BYTE_2_HIGH_LUT \
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | \
+		UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | \
+		UTF8_TOO_LARGE, \
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | \
+		UTF8_TOO_LARGE, \
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | \
+		UTF8_TOO_LARGE, \
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+/* Any of the last 3 bytes starting a character that doesn't fit into
+   the block */
+#define UTF8_INCOMPLETE_MAX \
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, \
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+
+/* The block at pos failed the check, or it's the final partial block.
+   Return the beginning of the character that contains the byte at pos. */
+static size_t
+uni_utf8_valid_prefix_end(const unsigned char *input, size_t pos,
+			  unsigned int *char_count_r)
+{
+	unsigned int len;
+	size_t start;
+
+	if (pos == 0)
+		return 0;
+	/* the data before pos passed the checks, so the character starts at
+	   most 3 bytes earlier */
+	start = pos - 1;
+	while (start > 0 && pos - start < 3 && (input[start] & 0xc0) == 0x80)
+		start--;
+	if ((input[start] & 0xc0) == 0x80) {
+		/* 4 byte character ending at pos */
+		return pos;
+	}
+	len = uni_utf8_char_bytes(input[start]);
+	if (start + len <= pos && (input[start] < 0x80 || len > 1))
+		return pos;
+	/* The character continues past pos, or it's an invalid lead byte,
+	   which is detected only by checking it together with the next byte.
+	   The lead byte was already counted. */
+	*char_count_r -= 1;
+	return start;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+uni_utf8_valid_prefix_ssse3(const unsigned char *input, size_t size,
+			    unsigned int *char_count_r)
+{
+	const __m128i byte_1_high_lut = _mm_setr_epi8(UTF8_BYTE_1_HIGH_LUT);
+	const __m128i byte_1_low_lut = _mm_setr_epi8(UTF8_BYTE_1_LOW_LUT);
+	const __m128i byte_2_high_lut = _mm_setr_epi8(UTF8_BYTE_2_HIGH_LUT);
+	const __m128i incomplete_max = _mm_setr_epi8(UTF8_INCOMPLETE_MAX);
+	const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+	__m128i in, prev_input, prev_incomplete, prev1, prev2, prev3;
+	__m128i byte_1_high, byte_1_low, byte_2_high, special, must23;
+	unsigned int count = 0;
+	size_t pos;
+
+	prev_input = prev_incomplete = _mm_setzero_si128();
+	for (pos = 0; pos + 16 <= size; pos += 16) {
+		in = _mm_loadu_si128((const void *)(input + pos));
+		if (_mm_movemask_epi8(in) == 0) {
+			/* ASCII - valid unless the previous block ended
+			   with an incomplete character */
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(prev_incomplete,
+					_mm_setzero_si128())) != 0xffff)
+				break;
+			count += 16;
+			prev_input = in;
+			continue;
+		}
+
+		prev1 = _mm_alignr_epi8(in, prev_input, 16 - 1);
+		byte_1_high = _mm_shuffle_epi8(byte_1_high_lut,
+			_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble_mask));
+		byte_1_low = _mm_shuffle_epi8(byte_1_low_lut,
+			_mm_and_si128(prev1, nibble_mask));
+		byte_2_high = _mm_shuffle_epi8(byte_2_high_lut,
+			_mm_and_si128(_mm_srli_epi16(in, 4), nibble_mask));
+		special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low),
+					byte_2_high);
+
+		/* 3rd and 4th bytes of a character must be continuations */
+		prev2 = _mm_alignr_epi8(in, prev_input, 16 - 2);
+		prev3 = _mm_alignr_epi8(in, prev_input, 16 - 3);
+		must23 = _mm_or_si128(
+			_mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+			_mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+		must23 = _mm_and_si128(must23, _mm_set1_epi8(0x80));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_xor_si128(must23, special),
+				_mm_setzero_si128())) != 0xffff)
+			break;
+
+		/* count the bytes that aren't continuation bytes */
+		count += __builtin_popcount(_mm_movemask_epi8(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8(-65))));
+		prev_incomplete = _mm_subs_epu8(in, incomplete_max);
+		prev_input = in;
+	}
+	*char_count_r += count;
+	return uni_utf8_valid_prefix_end(input, pos, char_count_r);
+}
+
+__attribute__((target("avx2")))
+static size_t
+uni_utf8_valid_prefix_avx2(const unsigned char *input, size_t size,
+			   unsigned int *char_count_r)
+{
+	const __m256i byte_1_high_lut = _mm256_setr_epi8(
+		UTF8_BYTE_1_HIGH_LUT, UTF8_BYTE_1_HIGH_LUT);
+	const __m256i byte_1_low_lut = _mm256_setr_epi8(
+		UTF8_BYTE_1_LOW_LUT, UTF8_BYTE_1_LOW_LUT);
+	const __m256i byte_2_high_lut = _mm256_setr_epi8(
+		UTF8_BYTE_2_HIGH_LUT, UTF8_BYTE_2_HIGH_LUT);
+	const __m256i incomplete_max = _mm256_setr_epi8(
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		UTF8_INCOMPLETE_MAX);
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+	__m256i in, prev_input, prev_incomplete, prev, prev1, prev2, prev3;
+	__m256i byte_1_high, byte_1_low, byte_2_high, special, must23;
+	unsigned int count = 0;
+	size_t pos, end;
+
+	prev_input = prev_incomplete = _mm256_setzero_si256();
+	for (pos = 0; pos + 32 <= size; pos += 32) {
+		in = _mm256_loadu_si256((const void *)(input + pos));
+		if (_mm256_movemask_epi8(in) == 0) {
+			if (!_mm256_testz_si256(prev_incomplete,
+						prev_incomplete))
+				break;
+			count += 32;
+			prev_input = in;
+			continue;
+		}
+
+		/* the previous block's high lane + this block's low lane */
+		prev = _mm256_permute2x128_si256(prev_input, in, 0x21);
+		prev1 = _mm256_alignr_epi8(in, prev, 16 - 1);
+		byte_1_high = _mm256_shuffle_epi8(byte_1_high_lut,
+			_mm256_and_si256(_mm256_srli_epi16(prev1, 4),
+					 nibble_mask));
+		byte_1_low = _mm256_shuffle_epi8(byte_1_low_lut,
+			_mm256_and_si256(prev1, nibble_mask));
+		byte_2_high = _mm256_shuffle_epi8(byte_2_high_lut,
+			_mm256_and_si256(_mm256_srli_epi16(in, 4),
+					 nibble_mask));
+		special = _mm256_and_si256(_mm256_and_si256(byte_1_high,
+							    byte_1_low),
+					   byte_2_high);
+
+		prev2 = _mm256_alignr_epi8(in, prev, 16 - 2);
+		prev3 = _mm256_alignr_epi8(in, prev, 16 - 3);
+		must23 = _mm256_or_si256(
+			_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+			_mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+		must23 = _mm256_and_si256(must23, _mm256_set1_epi8(0x80));
+		special = _mm256_xor_si256(must23, special);
+		if (!_mm256_testz_si256(special, special))
+			break;
+
+		count += __builtin_popcount(_mm256_movemask_epi8(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8(-65))));
+		prev_incomplete = _mm256_subs_epu8(in, incomplete_max);
+		prev_input = in;
+	}
+	/* avoid AVX-SSE transition penalties in the non-AVX code */
+	_mm256_zeroupper();
+	*char_count_r += count;
+	end = uni_utf8_valid_prefix_end(input, pos, char_count_r);
+	if (pos + 32 <= size) {
+		/* the block at pos failed the check */
+		return end;
+	}
+	return end + uni_utf8_valid_prefix_ssse3(input + end, size - end,
+						 char_count_r);
+}
+#endif
+
+bool uni_utf8_set_impl(enum uni_utf8_impl impl)
+{
+	switch (impl) {
+	case UNI_UTF8_IMPL_SCALAR:
+		uni_utf8_valid_prefix = uni_utf8_valid_prefix_scalar;
+		return TRUE;
+	case UNI_UTF8_IMPL_SSSE3:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSSE3)) {
+			uni_utf8_valid_prefix = uni_utf8_valid_prefix_ssse3;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	case UNI_UTF8_IMPL_AVX2:
+#ifdef HAVE_X86_SIMD_TARGET
+		if (cpu_features_have(CPU_FEATURE_SSSE3 | CPU_FEATURE_AVX2)) {
+			uni_utf8_valid_prefix = uni_utf8_valid_prefix_avx2;
+			return TRUE;
+		}
+#endif
+		return FALSE;
+	}
+	i_unreached();
+}
+
+void uni_utf8_set_best_impl(void)
+{
+	if (!uni_utf8_set_impl(UNI_UTF8_IMPL_AVX2) &&
+	    !uni_utf8_set_impl(UNI_UTF8_IMPL_SSSE3))
+		(void)uni_utf8_set_impl(UNI_UTF8_IMPL_SCALAR);
+}
+
+static size_t
+uni_utf8_valid_prefix_init(const unsigned char *input, size_t size,
+			   unsigned int *char_count_r)
+{
+	uni_utf8_set_best_impl();
+	return uni_utf8_valid_prefix(input, size, char_count_r);
+}
+
 unsigned int uni_utf8_strlen(const char *input)
 {
 	return uni_utf8_strlen_n(input, strlen(input));
@@ -201,14 +507,20 @@ unsigned int uni_utf8_partial_strlen_n(const void *_input, size_t size,
 {
 	const unsigned char *input = _input;
 	unsigned int count, len = 0;
-	size_t i;
+	size_t i, slow_end;
 
 	for (i = 0; i < size; ) {
-		count = uni_utf8_char_bytes(input[i]);
-		if (i + count > size)
-			break;
-		i += count;
-		len++;
+		i += uni_utf8_valid_prefix(input + i, size - i, &len);
+		slow_end = I_MIN(size, i + UNI_UTF8_SLOW_PATH_BYTES);
+		while (i < slow_end) {
+			count = uni_utf8_char_bytes(input[i]);
+			if (i + count > size) {
+				*partial_pos_r = i;
+				return len;
+			}
+			i += count;
+			len++;
+		}
 	}
 	*partial_pos_r = i;
 	return len;
@@ -362,19 +674,24 @@ is_valid_utf8_seq(const unsigned char *input, unsigned int size)
 static int uni_utf8_find_invalid_pos(const unsigned char *input, size_t size,
 				     size_t *pos_r)
 {
-	size_t i, len;
+	unsigned int char_count = 0;
+	size_t i, len, slow_end;
 
 	/* find the first invalid utf8 sequence */
 	for (i = 0; i < size;) {
-		if (input[i] < 0x80)
-			i++;
-		else {
-			len = is_valid_utf8_seq(input + i, size-i);
-			if (unlikely(len == 0)) {
-				*pos_r = i;
-				return -1;
+		i += uni_utf8_valid_prefix(input + i, size - i, &char_count);
+		slow_end = I_MIN(size, i + UNI_UTF8_SLOW_PATH_BYTES);
+		while (i < slow_end) {
+			if (input[i] < 0x80)
+				i++;
+			else {
+				len = is_valid_utf8_seq(input + i, size-i);
+				if (unlikely(len == 0)) {
+					*pos_r = i;
+					return -1;
+				}
+				i += len;
 			}
-			i += len;
 		}
 	}
 	return 0;
@@ -393,19 +710,13 @@ bool uni_utf8_get_valid_data(const unsigned char *input, size_t size,
 
 	output_add_replacement_char(buf);
 	while (i < size) {
-		if (input[i] < 0x80) {
-			buffer_append_c(buf, input[i++]);
-			continue;
-		}
-
-		len = is_valid_utf8_seq(input + i, size-i);
-		if (len == 0) {
-			i++;
-			output_add_replacement_char(buf);
-			continue;
+		if (uni_utf8_find_invalid_pos(input + i, size - i, &len) == 0) {
+			buffer_append(buf, input + i, size - i);
+			break;
 		}
 		buffer_append(buf, input + i, len);
-		i += len;
+		i += len + 1;
+		output_add_replacement_char(buf);
 	}
 	return FALSE;
 }
@@ -100,4 +100,18 @@ bool uni_utf8_str_is_valid(const char *str);
 /* Returns TRUE if data contains only valid UTF-8 input. */
 bool uni_utf8_data_is_valid(const unsigned char *data, size_t size);
 
+enum uni_utf8_impl {
+	UNI_UTF8_IMPL_SCALAR,
+	UNI_UTF8_IMPL_SSSE3,
+	UNI_UTF8_IMPL_AVX2
+};
+
+/* UTF-8 validation and uni_utf8_*strlen*() use the fastest implementation
+   supported by the CPU. These functions are mainly for unit tests and
+   benchmarks: Force using the given implementation. Returns FALSE if it's not
+   supported by the CPU or the build. */
+bool uni_utf8_set_impl(enum uni_utf8_impl impl);
+/* Switch back to the fastest supported implementation. */
+void uni_utf8_set_best_impl(void);
+
 #endif
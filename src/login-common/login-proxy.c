@@ -19,6 +19,9 @@
 
 #define MAX_PROXY_INPUT_SIZE 4096
 #define OUTBUF_THRESHOLD 1024
+/* o_stream_send_istream() copies the data through the output buffer when
+   it can't splice() it, so the buffer must stay bounded for slow readers */
+#define MAX_PROXY_OUTPUT_SIZE IO_BLOCK_SIZE
 #define LOGIN_PROXY_DIE_IDLE_SECS 2
 #define LOGIN_PROXY_IPC_PATH "ipc-proxy"
 #define LOGIN_PROXY_IPC_NAME "proxy"
@@ -107,15 +110,6 @@ static void login_proxy_free_errstr(struct login_proxy **_proxy,
 		login_proxy_free_reason(_proxy, str_c(reason));
 }
 
-static void login_proxy_free_errno(struct login_proxy **_proxy,
-				   int err, bool server)
-{
-	const char *errstr;
-
-	errstr = err == 0 || err == EPIPE ? "" : strerror(err);
-	login_proxy_free_errstr(_proxy, errstr, server);
-}
-
 static void login_proxy_free_ostream(struct login_proxy **_proxy,
 				     struct ostream *output, bool server)
 {
@@ -127,59 +121,59 @@ static void login_proxy_free_ostream(struct login_proxy **_proxy,
 	login_proxy_free_errstr(_proxy, errstr, server);
 }
 
-static void server_input(struct login_proxy *proxy)
+static void
+login_proxy_send_istream(struct login_proxy *proxy, bool server)
 {
-	unsigned char buf[OUTBUF_THRESHOLD];
-	ssize_t ret, ret2;
+	struct istream *input =
+		server ? proxy->server_input : proxy->client_input;
+	struct ostream *output =
+		server ? proxy->client_output : proxy->server_output;
+	struct io **io = server ? &proxy->server_io : &proxy->client_io;
+	enum ostream_send_istream_result res;
 
 	proxy->last_io = ioloop_time;
-	if (o_stream_get_buffer_used_size(proxy->client_output) >
-	    OUTBUF_THRESHOLD) {
-		/* client's output buffer is already quite full.
+	if (o_stream_get_buffer_used_size(output) > OUTBUF_THRESHOLD) {
+		/* output buffer is already quite full.
 		   don't send more until we're below threshold. */
-		io_remove(&proxy->server_io);
+		io_remove(io);
 		return;
 	}
 
-	ret = net_receive(proxy->server_fd, buf, sizeof(buf));
-	if (ret < 0) {
-		login_proxy_free_errno(&proxy, errno, TRUE);
-		return;
+	/* this uses splice() when possible, so the data doesn't need to be
+	   copied through userspace */
+	o_stream_cork(output);
+	res = o_stream_send_istream(output, input);
+	o_stream_uncork(output);
+
+	switch (res) {
+	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
+		login_proxy_free_errstr(&proxy, server ? "" :
+					i_stream_get_error(input), server);
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT:
+		/* output's flush callback continues */
+		io_remove(io);
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT:
+		login_proxy_free_errstr(&proxy, i_stream_get_error(input),
+					server);
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT:
+		login_proxy_free_ostream(&proxy, output, !server);
+		break;
 	}
-	o_stream_cork(proxy->client_output);
-	ret2 = o_stream_send(proxy->client_output, buf, ret);
-	o_stream_uncork(proxy->client_output);
-	if (ret2 != ret)
-		login_proxy_free_ostream(&proxy, proxy->client_output, FALSE);
 }
 
-static void proxy_client_input(struct login_proxy *proxy)
+static void server_input(struct login_proxy *proxy)
 {
-	const unsigned char *data;
-	size_t size;
-	ssize_t ret;
-
-	proxy->last_io = ioloop_time;
-	if (o_stream_get_buffer_used_size(proxy->server_output) >
-	    OUTBUF_THRESHOLD) {
-		/* proxy's output buffer is already quite full.
-		   don't send more until we're below threshold. */
-		io_remove(&proxy->client_io);
-		return;
-	}
+	login_proxy_send_istream(proxy, TRUE);
+}
 
-	if (i_stream_read_more(proxy->client_input, &data, &size) < 0) {
-		const char *errstr = i_stream_get_error(proxy->client_input);
-		login_proxy_free_errstr(&proxy, errstr, FALSE);
-		return;
-	}
-	o_stream_cork(proxy->server_output);
-	ret = o_stream_send(proxy->server_output, data, size);
-	o_stream_uncork(proxy->server_output);
-	if (ret != (ssize_t)size)
-		login_proxy_free_ostream(&proxy, proxy->server_output, TRUE);
-	else
-		i_stream_skip(proxy->client_input, ret);
+static void proxy_client_input(struct login_proxy *proxy)
+{
+	login_proxy_send_istream(proxy, FALSE);
 }
 
 static void proxy_client_disconnected_input(struct login_proxy *proxy)
@@ -209,6 +203,7 @@ static int server_output(struct login_proxy *proxy)
 		   read more from client. */
 		proxy->client_io = io_add_istream(proxy->client_input,
 						  proxy_client_input, proxy);
+		i_stream_set_input_pending(proxy->client_input, TRUE);
 	}
 	return 1;
 }
@@ -226,8 +221,9 @@ static int proxy_client_output(struct login_proxy *proxy)
 	    OUTBUF_THRESHOLD) {
 		/* there's again space in client's output buffer, so we can
 		   read more from proxy. */
-		proxy->server_io =
-			io_add(proxy->server_fd, IO_READ, server_input, proxy);
+		proxy->server_io = io_add_istream(proxy->server_input,
+						  server_input, proxy);
+		i_stream_set_input_pending(proxy->server_input, TRUE);
 	}
 	return 1;
 }
@@ -657,7 +653,14 @@ bool login_proxy_is_ourself(const struct client *client, const char *host,
 
 struct istream *login_proxy_get_istream(struct login_proxy *proxy)
 {
-	return proxy->disconnecting ? NULL : proxy->server_input;
+	if (proxy->disconnecting)
+		return NULL;
+	if (proxy->client_fd != -1) {
+		/* detached - the server_input is now used only internally
+		   for proxying */
+		return NULL;
+	}
+	return proxy->server_input;
 }
 
 struct ostream *login_proxy_get_ostream(struct login_proxy *proxy)
@@ -704,7 +707,7 @@ void login_proxy_detach(struct login_proxy *proxy)
 	proxy->client_output = client->output;
 
 	i_stream_set_persistent_buffers(client->input, FALSE);
-	o_stream_set_max_buffer_size(client->output, (size_t)-1);
+	o_stream_set_max_buffer_size(client->output, MAX_PROXY_OUTPUT_SIZE);
 	o_stream_set_flush_callback(client->output, proxy_client_output, proxy);
 	client->input = NULL;
 	client->output = NULL;
@@ -713,15 +716,19 @@ void login_proxy_detach(struct login_proxy *proxy)
 	data = i_stream_get_data(proxy->client_input, &size);
 	if (size != 0)
 		o_stream_nsend(proxy->server_output, data, size);
+	o_stream_set_max_buffer_size(proxy->server_output,
+				     MAX_PROXY_OUTPUT_SIZE);
 
 	/* from now on, just do dummy proxying */
 	io_remove(&proxy->server_io);
 	proxy->server_io =
-		io_add(proxy->server_fd, IO_READ, server_input, proxy);
+		io_add_istream(proxy->server_input, server_input, proxy);
 	proxy->client_io =
 		io_add_istream(proxy->client_input, proxy_client_input, proxy);
 	o_stream_set_flush_callback(proxy->server_output, server_output, proxy);
-	i_stream_destroy(&proxy->server_input);
+	/* send any server input that is already buffered */
+	if (i_stream_get_data_size(proxy->server_input) > 0)
+		i_stream_set_input_pending(proxy->server_input, TRUE);
 
 	if (proxy->notify_refresh_secs != 0) {
 		proxy->to_notify =
@@ -56,6 +56,8 @@ void login_proxy_detach(struct login_proxy *proxy);
 /* STARTTLS command was issued. */
 int login_proxy_starttls(struct login_proxy *proxy);
 
+/* Returns the server's istream, or NULL if the proxy is disconnecting or
+   already detached. */
 struct istream *login_proxy_get_istream(struct login_proxy *proxy);
 struct ostream *login_proxy_get_ostream(struct login_proxy *proxy);
 
@@ -113,6 +113,7 @@ void mail_stats_fill(struct stats_user *suser, struct mail_stats *stats_r)
 {
 	static bool getrusage_broken = FALSE;
 	static struct rusage prev_usage;
+	struct data_stack_stats data_stack_stats;
 	struct rusage usage;
 
 	memset(stats_r, 0, sizeof(*stats_r));
@@ -138,6 +139,11 @@ void mail_stats_fill(struct stats_user *suser, struct mail_stats *stats_r)
 	stats_r->disk_input = (unsigned long long)usage.ru_inblock * 512ULL;
 	stats_r->disk_output = (unsigned long long)usage.ru_oublock * 512ULL;
 	(void)gettimeofday(&stats_r->clock_time, NULL);
+	data_stack_get_stats(&data_stack_stats);
+	stats_r->data_stack_peak_bytes =
+		data_stack_stats.allocated_bytes_highwater;
 	process_read_io_stats(stats_r);
 	user_trans_stats_get(suser, stats_r);
+	memcpy(stats_r->index_latencies, mail_index_latencies,
+	       sizeof(stats_r->index_latencies));
 }
@@ -9,6 +9,19 @@
 static struct stats_parser_field mail_stats_fields[] = {
 #define E(parsename, name, type) { parsename, offsetof(struct mail_stats, name), sizeof(((struct mail_stats *)0)->name), type }
 #define EN(parsename, name) E(parsename, name, STATS_PARSER_TYPE_UINT)
+#define EL(parsename, type) \
+	EN(parsename"_count", index_latencies[type].count), \
+	EN(parsename"_usecs", index_latencies[type].usecs), \
+	EN(parsename"_4us", index_latencies[type].buckets[0]), \
+	EN(parsename"_16us", index_latencies[type].buckets[1]), \
+	EN(parsename"_64us", index_latencies[type].buckets[2]), \
+	EN(parsename"_256us", index_latencies[type].buckets[3]), \
+	EN(parsename"_1ms", index_latencies[type].buckets[4]), \
+	EN(parsename"_4ms", index_latencies[type].buckets[5]), \
+	EN(parsename"_16ms", index_latencies[type].buckets[6]), \
+	EN(parsename"_65ms", index_latencies[type].buckets[7]), \
+	EN(parsename"_262ms", index_latencies[type].buckets[8]), \
+	EN(parsename"_slow", index_latencies[type].buckets[9])
 	E("user_cpu", user_cpu, STATS_PARSER_TYPE_TIMEVAL),
 	E("sys_cpu", sys_cpu, STATS_PARSER_TYPE_TIMEVAL),
 	E("clock_time", clock_time, STATS_PARSER_TYPE_TIMEVAL),
@@ -23,6 +36,7 @@ static struct stats_parser_field mail_stats_fields[] = {
 	EN("read_bytes", read_bytes),
 	EN("write_count", write_count),
 	EN("write_bytes", write_bytes),
+	E("data_stack_peak_bytes", data_stack_peak_bytes, STATS_PARSER_TYPE_UINT_PEAK),
 
 	/*EN("mopen", trans_stats.open_lookup_count),
 	EN("mstat", trans_stats.stat_lookup_count),
@@ -31,7 +45,13 @@ static struct stats_parser_field mail_stats_fields[] = {
 	EN("mail_lookup_attr", trans_lookup_attr),
 	EN("mail_read_count", trans_files_read_count),
 	EN("mail_read_bytes", trans_files_read_bytes),
-	EN("mail_cache_hits", trans_cache_hit_count)
+	EN("mail_cache_hits", trans_cache_hit_count),
+
+	EL("idx_sync", MAIL_INDEX_LATENCY_INDEX_SYNC),
+	EL("idx_view_sync", MAIL_INDEX_LATENCY_VIEW_SYNC),
+	EL("idx_cache_lookup", MAIL_INDEX_LATENCY_CACHE_LOOKUP),
+	EL("idx_log_append", MAIL_INDEX_LATENCY_LOG_APPEND),
+	EL("idx_log_lock", MAIL_INDEX_LATENCY_LOG_LOCK)
 };
 
 static size_t mail_stats_alloc_size(void)
@@ -88,6 +108,8 @@ mail_stats_have_changed(const struct stats *_prev, const struct stats *_cur)
 	    cur->trans_files_read_bytes != prev->trans_files_read_bytes ||
 	    cur->trans_cache_hit_count != prev->trans_cache_hit_count)
 		return TRUE;
+	/* don't check for index latency changes. nearly every command syncs
+	   the index, so they're sent along with the other changes. */
 
 	/* allow a tiny bit of changes that are caused by this
 	   timeout handling */
@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 #include "mail-storage-private.h"
+#include "mail-index-latency.h"
 
 struct stats_user;
 
@@ -20,6 +21,8 @@ struct mail_stats {
 	/* read()/write() syscall count and number of bytes */
 	uint32_t read_count, write_count;
 	uint64_t read_bytes, write_bytes;
+	/* highest memory usage of the process's data stack */
+	uint64_t data_stack_peak_bytes;
 
 	/* based on struct mailbox_transaction_stats: */
 	uint32_t trans_lookup_path;
@@ -27,6 +30,10 @@ struct mail_stats {
 	uint32_t trans_files_read_count;
 	uint64_t trans_files_read_bytes;
 	uint64_t trans_cache_hit_count;
+
+	/* lib-index operation latencies */
+	struct mail_index_latency_histogram
+		index_latencies[MAIL_INDEX_LATENCY_TYPE_COUNT];
 };
 
 extern const struct stats_vfuncs mail_stats_vfuncs;